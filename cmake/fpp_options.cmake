@@ -1,4 +1,7 @@
 option(OPTION_BUILD_CLI "Build program with CLI" ON)
+option(OPTION_BUILD_TESTS "Build the known-answer tests and register them with CTest" ON)
+option(OPTION_BUILD_PERF "Build the fpp_perf regression suite and register it with CTest" OFF)
+option(OPTION_USDT "Compile in USDT probes for bpftrace, needs sys/sdt.h" OFF)
 # 
 # TODO: add CMAKE_DEPENDENT_OPTION
 # 
@@ -16,7 +16,7 @@ extern "C" {
 #endif
 
 #define FPP_IVSIZE_AES128   16
-#define FPP_KEYSIZE_AES128  32
+#define FPP_KEYSIZE_AES128  16
 #define FPP_AES_BLOCK_SIZE  AES_BLOCK_SIZE
 
 
@@ -0,0 +1,51 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef AES_MB_H
+#define AES_MB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "errcodes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Multi-buffer AES-CBC encryption. A CBC stream is a chain of
+ * dependent blocks, so one stream leaves the AES unit idle for most
+ * of every round; up to FPP_AES_MB_LANES independent streams are
+ * interleaved round by round to keep it busy.
+ */
+#define FPP_AES_MB_LANES  8
+
+typedef struct {
+    /* 16 or 32 bytes */
+    const uint8_t *key;
+    /* Replaced by the last ciphertext block, to continue the stream */
+    uint8_t iv[16];
+    const uint8_t *in;
+    uint8_t *out;
+    /* A multiple of the block size, no padding is added */
+    size_t len;
+} fpp_aes_cbc_stream_t;
+
+
+/* The CPU has AES instructions and this build uses them */
+bool fpp_aes_mb_is_accelerated(void);
+
+/* n streams of any lengths, all with keys of key_bits 128 or 256 */
+fpp_err_t fpp_aes_cbc_encrypt_mb(fpp_aes_cbc_stream_t *streams, size_t n,
+    int key_bits);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AES_MB_H */
@@ -0,0 +1,37 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef ARGS_H
+#define ARGS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "errcodes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Option arguments shared by the command line tools. FPP_ERR_IO_ARGV
+ * unless the whole string is valid, *value is left alone then.
+ */
+
+/* A decimal number in [min, max] and nothing after it */
+fpp_err_t fpp_parse_int(const char *str, long long min, long long max,
+    long long *value);
+/* "64M", "1G", bytes without a suffix */
+fpp_err_t fpp_parse_size(const char *str, uint64_t *size);
+/* Up to max non-zero sizes separated by commas, as in "4K,1M,1G" */
+fpp_err_t fpp_parse_size_list(const char *str, size_t *list, size_t max,
+    size_t *n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ARGS_H */
@@ -0,0 +1,84 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <stddef.h>
+
+#include "errcodes.h"
+#include "context.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Completion handlers are either queued and run from
+ * fpp_async_process_completions() on the event loop thread after
+ * the notification descriptor becomes readable, or called directly
+ * on the worker thread that finished the job.
+ */
+#define FPP_ASYNC_NOTIFY_FD        0
+#define FPP_ASYNC_NOTIFY_CALLBACK  1
+
+typedef struct fpp_async_s fpp_async_t;
+typedef struct fpp_async_job_s fpp_async_job_t;
+
+/*
+ * status is FPP_OK, FPP_ERR_JOB_CANCELED or an error code, see
+ * fpp_ctx_verify_file(). The job handle is released when the handler
+ * returns.
+ */
+typedef void (*fpp_async_handler_pt)(fpp_async_job_t *job,
+    fpp_err_t status, void *data);
+
+typedef struct {
+    /* Worker threads, 0 - one per online CPU */
+    size_t nworkers;
+    /* Submitted but not yet completed jobs, 0 - unlimited */
+    size_t max_jobs;
+    int notify;
+} fpp_async_config_t;
+
+
+void fpp_async_config_init(fpp_async_config_t *config);
+
+fpp_async_t *fpp_async_create(fpp_ctx_t *ctx,
+    const fpp_async_config_t *config);
+/* Cancels outstanding jobs and delivers their completions */
+void fpp_async_destroy(fpp_async_t *async);
+
+/*
+ * Readable while completions are waiting, -1 for FPP_ASYNC_NOTIFY_CALLBACK.
+ * Suitable for epoll, poll and select.
+ */
+int fpp_async_get_fd(const fpp_async_t *async);
+size_t fpp_async_process_completions(fpp_async_t *async);
+
+/*
+ * params are copied, so the caller may release them right after the
+ * call. Returns FPP_ERR_JOB_BUSY when max_jobs are already in flight.
+ */
+fpp_err_t fpp_async_encrypt_file(fpp_async_t *async,
+    const fpp_crypto_params_t *params, fpp_async_handler_pt handler,
+    void *data, fpp_async_job_t **job);
+fpp_err_t fpp_async_decrypt_file(fpp_async_t *async,
+    const fpp_crypto_params_t *params, fpp_async_handler_pt handler,
+    void *data, fpp_async_job_t **job);
+
+/*
+ * A queued job completes without touching any file, a running one
+ * stops at the next chunk and removes its output. The handler still
+ * runs, so the job must not be canceled after its handler returned.
+ */
+void fpp_async_cancel(fpp_async_job_t *job);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ASYNC_H */
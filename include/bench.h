@@ -0,0 +1,24 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * "fpp bench [options...]". Measures the cipher, key derivation and
+ * file code paths of this build on this host. argv[0] is "bench".
+ */
+int fpp_bench_main(int argc, const char *const *argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BENCH_H */
@@ -15,7 +15,7 @@
 extern "C" {
 #endif
 
-#define FPP_IVSIZE_BLOWFISH      16
+#define FPP_IVSIZE_BLOWFISH      8
 #define FPP_KEYSIZE_BLOWFISH     16
 #define FPP_BLOWFISH_BLOCK_SIZE  BF_BLOCK
 
@@ -0,0 +1,53 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "context.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Enough for SIMD loads and for O_DIRECT on any block device */
+#define FPP_BUFPOOL_ALIGNMENT  4096
+
+#define FPP_BUFPOOL_HUGE_PAGES  0x01
+/* Backed by an fpp_secmem_t arena, huge pages are ignored */
+#define FPP_BUFPOOL_LOCKED      0x02
+
+/*
+ * Recycles equally sized, aligned buffers. A region for nbufs buffers
+ * is reserved at creation but only faulted in as buffers are first
+ * used, so an idle pool costs address space only. When the region is
+ * exhausted buffers come from the heap and are recycled as well.
+ *
+ * Released buffers are not wiped, that is up to the caller.
+ */
+typedef struct fpp_bufpool_s fpp_bufpool_t;
+
+
+/* The region is placed on node, see fpp_cpu_bind_memory() */
+fpp_bufpool_t *fpp_bufpool_create(size_t buf_size, size_t nbufs, int flags,
+    int node);
+void fpp_bufpool_destroy(fpp_bufpool_t *pool);
+
+void *fpp_bufpool_alloc(fpp_bufpool_t *pool);
+void fpp_bufpool_free(fpp_bufpool_t *pool, void *buf);
+/* buf lies in the region, heap buffers belong to no pool */
+bool fpp_bufpool_owns(const fpp_bufpool_t *pool, const void *buf);
+
+void fpp_bufpool_get_stats(fpp_bufpool_t *pool, fpp_buffer_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BUFPOOL_H */
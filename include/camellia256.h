@@ -16,7 +16,7 @@ extern "C" {
 #endif
 
 #define FPP_IVSIZE_CAMELLIA256      16
-#define FPP_KEYSIZE_CAMELLIA256     16
+#define FPP_KEYSIZE_CAMELLIA256     32
 #define FPP_CAMELLIA256_BLOCK_SIZE  CAMELLIA_BLOCK_SIZE
 
 
@@ -15,7 +15,7 @@
 extern "C" {
 #endif
 
-#define FPP_IVSIZE_CAST5      16
+#define FPP_IVSIZE_CAST5      8
 #define FPP_KEYSIZE_CAST5     16
 #define FPP_CAST5_BLOCK_SIZE  CAST_BLOCK
 
@@ -0,0 +1,58 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef CIPHER_H
+#define CIPHER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <openssl/evp.h>
+
+#include "errcodes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef fpp_err_t (*fpp_cipher_handler_pt)(const uint8_t *in_data,
+    uint32_t in_len, uint8_t *out_data, uint32_t *out_len,
+    const uint8_t *key, const uint8_t *iv);
+
+typedef struct {
+    const char *name;
+    uint32_t algo;
+    /* Name used to fetch the implementation from an OpenSSL provider */
+    const char *evp_name;
+    const EVP_CIPHER *(*evp_cipher)(void);
+    size_t key_size;
+    size_t iv_size;
+    size_t block_size;
+    fpp_cipher_handler_pt encrypt;
+    fpp_cipher_handler_pt decrypt;
+} fpp_cipher_t;
+
+
+/*
+ * AES-256, or Camellia-256 where a short throughput probe on the first
+ * call finds it clearly faster on a CPU without AES instructions. Keys
+ * are never shorter than those of the default; Blowfish and CAST5 are
+ * never picked, their 64-bit blocks repeat too soon in large files.
+ * fpp_cipher_by_name() returns it for FPP_CIPHER_AUTO.
+ */
+#define FPP_CIPHER_AUTO  "auto"
+
+const fpp_cipher_t *fpp_cipher_select(void);
+
+const fpp_cipher_t *fpp_cipher_by_name(const char *name);
+const fpp_cipher_t *fpp_cipher_by_algo(uint32_t algo);
+const fpp_cipher_t *fpp_cipher_at(size_t index);
+size_t fpp_cipher_count(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CIPHER_H */
@@ -0,0 +1,197 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <openssl/evp.h>
+
+#include "errcodes.h"
+#include "kdf.h"
+#include "encrypt_file.h"
+#include "cipher.h"
+#include "stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FPP_DEFAULT_ALGO        "aes256"
+#define FPP_DEFAULT_ITER        50180
+#define FPP_DEFAULT_CHUNK_SIZE  (1024 * 1024)
+
+/* I/O scheduling class of the threads running jobs, as in ionice(1) */
+typedef enum {
+    FPP_IO_CLASS_DEFAULT,
+    FPP_IO_CLASS_BEST_EFFORT,
+    FPP_IO_CLASS_IDLE
+} fpp_io_class_t;
+
+/*
+ * Configuration is copied into the context on creation and stays
+ * immutable for the context lifetime. Per-call values in
+ * fpp_crypto_params_t (algo_name, iter) override the defaults here
+ * when they are set.
+ */
+typedef struct {
+    const char *algo_name;
+    uint32_t iter;
+    /*
+     * Key derivation of new files, FPP_KDF_* from kdf.h. scrypt and
+     * Argon2id take kdf_memory KiB in each of kdf_lanes lanes, 0 - one
+     * lane per CPU; iter is the number of Argon2id passes and unused
+     * by scrypt.
+     */
+    uint32_t kdf;
+    uint32_t kdf_memory;
+    uint32_t kdf_lanes;
+    /*
+     * KiB of all lanes together that a file may ask for, in the header
+     * of a file to decrypt or through kdf_memory and kdf_lanes. The
+     * default lane count is lowered to stay within it.
+     */
+    uint32_t kdf_max_memory;
+    /* Number of worker threads for batch calls, 0 - one per CPU */
+    size_t nthreads;
+    /*
+     * CPUs the workers run on, as "0-3,8", NULL - all the process may
+     * use. Workers are spread over the NUMA nodes of these CPUs and
+     * pinned to their node, their chunk buffers come from its memory.
+     * Pinning is on by default, but it only takes effect with cpus set
+     * or with CPUs on more than one node.
+     */
+    const char *cpus;
+    bool numa_pinning;
+    /* Size of the read/cipher/write unit of the file pipeline */
+    size_t chunk_size;
+    /*
+     * Keep chunk buffers, not only keys, in memory that is locked
+     * against swapping. One buffer per worker thread is reserved.
+     */
+    bool secure_memory;
+    /*
+     * Back chunk buffers with huge pages: explicit ones if the system
+     * has them reserved, transparent ones otherwise. Ignored together
+     * with secure_memory, which needs per-buffer guard pages.
+     */
+    bool huge_pages;
+    /*
+     * Count cycles, instructions, cache misses and context switches
+     * per phase of every file, see fpp_ctx_get_stats(). Counters the
+     * kernel doesn't allow are skipped.
+     */
+    bool perf_counters;
+    /*
+     * Time the phases of every file and keep a histogram of per-file
+     * latencies, see fpp_ctx_get_stats(). Implied by perf_counters.
+     */
+    bool stats;
+    /*
+     * Store a keyed SHA3-256 of the plaintext in the header of new
+     * files, hashed chunk by chunk in the encryption pass. Decryption
+     * checks it whenever a file has one. On by default.
+     */
+    bool plaintext_digest;
+    /*
+     * Append a "sha256sum -c" line for every encrypted file, and its
+     * header file if it has one, to this file, "-" for stdout. The
+     * checksum is taken from the data as it is written, one manifest
+     * collects a whole batch. NULL - off.
+     */
+    const char *manifest_fname;
+    /*
+     * Bandwidth budget of all jobs together: bytes read plus bytes
+     * written per second, 0 - unlimited. After a pause up to io_burst
+     * bytes go through at full speed, 0 - one chunk.
+     */
+    uint64_t io_rate;
+    uint64_t io_burst;
+    /*
+     * Applied to the worker threads of the context and of its async
+     * objects: nice is added to the niceness of the thread creating
+     * the context, io_level (0-7) is used with FPP_IO_CLASS_BEST_EFFORT.
+     * Synchronous calls keep the priority of the caller's thread.
+     * Linux has both per thread; Windows maps positive nice to a lower
+     * thread priority and the idle class to background mode.
+     */
+    int nice;
+    fpp_io_class_t io_class;
+    int io_level;
+} fpp_ctx_config_t;
+
+/*
+ * Chunk buffer reuse. A steady-state workload shows allocs growing
+ * with reuses while fresh and heap_allocs stay put, i.e. no page
+ * faults and no allocator calls per file.
+ */
+typedef struct {
+    size_t buffer_size;
+    /* Buffers in the preallocated region */
+    size_t reserved;
+    size_t allocs;
+    /* Served from a released buffer */
+    size_t reuses;
+    /* First use of a region buffer, its pages are faulted in */
+    size_t fresh;
+    /* Region exhausted, allocated from the heap */
+    size_t heap_allocs;
+    size_t in_use;
+    size_t peak_in_use;
+    bool huge_pages;
+    bool locked;
+} fpp_buffer_stats_t;
+
+typedef struct fpp_ctx_s fpp_ctx_t;
+
+
+void fpp_ctx_config_init(fpp_ctx_config_t *config);
+
+fpp_ctx_t *fpp_ctx_create(const fpp_ctx_config_t *config);
+void fpp_ctx_destroy(fpp_ctx_t *ctx);
+const fpp_ctx_config_t *fpp_ctx_get_config(const fpp_ctx_t *ctx);
+void fpp_ctx_get_buffer_stats(fpp_ctx_t *ctx, fpp_buffer_stats_t *stats);
+
+/* Totals over the files processed since creation or the last reset */
+void fpp_ctx_get_stats(fpp_ctx_t *ctx, fpp_stats_t *stats);
+void fpp_ctx_reset_stats(fpp_ctx_t *ctx);
+
+/* Returns NULL if the cipher isn't provided by the linked OpenSSL */
+const EVP_CIPHER *fpp_ctx_get_evp_cipher(fpp_ctx_t *ctx,
+    const fpp_cipher_t *cipher);
+
+fpp_err_t fpp_ctx_encrypt_file(fpp_ctx_t *ctx,
+    const fpp_crypto_params_t *params);
+fpp_err_t fpp_ctx_decrypt_file(fpp_ctx_t *ctx,
+    const fpp_crypto_params_t *params);
+/*
+ * Decrypt into nothing, out_fname is ignored: the padding and the
+ * plaintext digest, if the file has one, are checked. Returns
+ * FPP_ERR_IO_DIGEST, FPP_ERR_IO_PADDING or FPP_ERR_IO_FORMAT for a
+ * damaged file or a wrong password, FPP_FAILURE for other errors.
+ */
+fpp_err_t fpp_ctx_verify_file(fpp_ctx_t *ctx,
+    const fpp_crypto_params_t *params);
+
+/*
+ * Process n independent files on the context thread pool. The status
+ * of every file is stored in results (may be NULL), the return value
+ * is FPP_OK only if all files succeeded.
+ */
+fpp_err_t fpp_ctx_encrypt_files(fpp_ctx_t *ctx,
+    const fpp_crypto_params_t *params, size_t n, fpp_err_t *results);
+fpp_err_t fpp_ctx_decrypt_files(fpp_ctx_t *ctx,
+    const fpp_crypto_params_t *params, size_t n, fpp_err_t *results);
+fpp_err_t fpp_ctx_verify_files(fpp_ctx_t *ctx,
+    const fpp_crypto_params_t *params, size_t n, fpp_err_t *results);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONTEXT_H */
@@ -0,0 +1,215 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef CONTEXT_INTERNAL_H
+#define CONTEXT_INTERNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+#include <openssl/provider.h>
+#endif
+
+#include "context.h"
+#include "cipher.h"
+#include "thread_pool.h"
+#include "secmem.h"
+#include "bufpool.h"
+#include "perfctr.h"
+#include "stats.h"
+#include "throttle.h"
+#include "cpu.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FPP_ALGO_MAX  FPP_ALGO_CAMELLIA256
+
+#define FPP_MAGIC_WORD         "FPPv2"
+#define FPP_MAGIC_WORD_V1      "FPPv1"
+
+#define FPP_CTX_KEY_SLOT_SIZE  64
+#define FPP_CTX_KEY_SLOTS      64
+
+/* stdio buffers of the input, output and header files, cipher state */
+#define FPP_JOB_MEMORY_OVERHEAD  (3 * BUFSIZ + 4096)
+
+/*
+ * One PBKDF2 run fills a key slot, the cipher key comes first and
+ * the key of the plaintext digest follows it
+ */
+#define FPP_DIGEST_KEY_OFFSET  32
+#define FPP_DIGEST_KEY_SIZE    32
+
+typedef enum {
+    FPP_MODE_ENCRYPT,
+    FPP_MODE_DECRYPT
+} fpp_mode_t;
+
+/* No phase is being measured */
+#define FPP_PHASE_NONE  FPP_PHASE_MAX
+
+/*
+ * Per-file accounting. Phases are contiguous, entering one closes the
+ * previous, so every boundary costs a single counter read.
+ */
+typedef struct {
+    fpp_perfctr_t *counters;
+    fpp_phase_t phase;
+    uint64_t mark[FPP_PERFCTR_MAX];
+    /* Clock when the job and the current phase began */
+    uint64_t start;
+    uint64_t mark_ns;
+    /* The latency histogram stays empty, see fpp_ctx_add_stats() */
+    fpp_stats_t stats;
+} fpp_job_stats_t;
+
+/*
+ * One file operation. The pipeline checks canceled between chunks,
+ * it may be set from any thread.
+ */
+typedef struct {
+    const fpp_crypto_params_t *params;
+    fpp_mode_t mode;
+    /* Decrypt only to check the file, the plaintext isn't written */
+    bool discard;
+    volatile int canceled;
+    /* Largest chunk read, the part of the buffer to wipe */
+    size_t buf_used;
+    /* NULL unless the context collects statistics */
+    fpp_job_stats_t *stats;
+    /* Plaintext digest, NULL if the file has none */
+    EVP_MD_CTX *digest;
+    /* SHA-256 of what goes to the output file, for the manifest */
+    EVP_MD_CTX *checksum;
+} fpp_job_t;
+
+struct fpp_ctx_s {
+    fpp_ctx_config_t config;
+    pthread_mutex_t lock;
+    /* Held by the one scrypt or Argon2id derivation that runs */
+    pthread_mutex_t kdf_lock;
+
+    /* Ciphers are resolved once, indexed by algorithm magic word */
+    const EVP_CIPHER *evp_ciphers[FPP_ALGO_MAX + 1];
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+    OSSL_LIB_CTX *libctx;
+    OSSL_PROVIDER *default_provider;
+    OSSL_PROVIDER *legacy_provider;
+#endif
+
+    /* Created on the first batch call */
+    fpp_thread_pool_t *pool;
+    fpp_cpu_topology_t topology;
+    bool pin_threads;
+
+    /*
+     * Chunk buffers hold the input chunk followed by the output chunk,
+     * both start on a FPP_BUFPOOL_ALIGNMENT boundary.
+     */
+    fpp_bufpool_t *buffer_pools[FPP_NODE_MAX];
+    /* One pool per node of topology if workers are pinned, else one */
+    size_t nbuffer_pools;
+    size_t buffer_size;
+    size_t buffer_out_offset;
+    /* Reserved from the memory budget for every job */
+    size_t job_memory;
+    /*
+     * Most files a worker encrypts in one group, the pools reserve a
+     * buffer for each. 1 - no groups.
+     */
+    size_t group_size;
+
+    fpp_secmem_t *key_arena;
+
+    /* Totals of finished jobs, under lock */
+    fpp_stats_t stats;
+
+    /* Open for the context lifetime if manifest_fname is set */
+    FILE *manifest;
+
+    fpp_throttle_t throttle;
+    /*
+     * Niceness of the thread that created the context, workers are set
+     * to it plus config.nice whatever they inherited.
+     */
+    int base_nice;
+};
+
+
+fpp_thread_pool_t *fpp_ctx_get_thread_pool(fpp_ctx_t *ctx);
+/* Private library context of the KDFs, NULL before OpenSSL 3.0 */
+OSSL_LIB_CTX *fpp_ctx_get_libctx(fpp_ctx_t *ctx);
+/* Priorities of config.nice and config.io_class, for worker threads */
+void fpp_ctx_lower_priority(fpp_ctx_t *ctx);
+
+uint8_t *fpp_ctx_alloc_key(fpp_ctx_t *ctx);
+void fpp_ctx_free_key(fpp_ctx_t *ctx, uint8_t *key);
+
+uint8_t *fpp_ctx_alloc_buffer(fpp_ctx_t *ctx);
+void fpp_ctx_free_buffer(fpp_ctx_t *ctx, uint8_t *buf, size_t used);
+
+/* Adds a finished job, which took latency ns */
+void fpp_ctx_add_stats(fpp_ctx_t *ctx, const fpp_stats_t *stats,
+    uint64_t latency);
+
+/* Append a line with the SHA-256 of fname to the manifest */
+fpp_err_t fpp_ctx_add_manifest(fpp_ctx_t *ctx, const char *fname,
+    const uint8_t *checksum);
+
+/*
+ * Read an "FPPv1" or "FPPv2" header at the current position, fields
+ * an "FPPv1" header lacks are left zero. FPP_ERR_IO_FORMAT if it is
+ * neither. Headers are always written in "FPPv2" at offset 0.
+ */
+fpp_err_t fpp_read_header(fpp_crypto_header_t *header, FILE *fd);
+fpp_err_t fpp_write_header(const fpp_crypto_header_t *header, FILE *fd);
+
+void fpp_job_init(fpp_job_t *job, const fpp_crypto_params_t *params,
+    fpp_mode_t mode);
+void fpp_job_stats_init(fpp_job_stats_t *js, bool counters);
+void fpp_job_stats_enter(fpp_job_stats_t *js, fpp_phase_t phase);
+fpp_err_t fpp_ctx_run_job(fpp_ctx_t *ctx, fpp_job_t *job);
+/* n small AES files of one algorithm, n up to FPP_AES_MB_LANES */
+void fpp_ctx_encrypt_group(fpp_ctx_t *ctx, const fpp_crypto_params_t **params,
+    size_t n, fpp_err_t *results);
+
+static inline void
+fpp_job_enter_phase(fpp_job_t *job, fpp_phase_t phase)
+{
+    if (job->stats) {
+        fpp_job_stats_enter(job->stats, phase);
+    }
+}
+
+/* Charge n bytes of I/O to the context budget */
+static inline void
+fpp_job_throttle(fpp_ctx_t *ctx, fpp_job_t *job, size_t n)
+{
+    if (ctx->throttle.rate) {
+        fpp_job_enter_phase(job, FPP_PHASE_THROTTLE);
+        fpp_throttle_acquire(&ctx->throttle, n);
+    }
+}
+
+static inline void
+fpp_job_add_bytes(fpp_job_t *job, fpp_phase_t phase, size_t n)
+{
+    if (job->stats) {
+        job->stats->stats.phases[phase].bytes += n;
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONTEXT_INTERNAL_H */
@@ -0,0 +1,90 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "errcodes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Instruction set extensions the ciphers and the KDFs can use */
+#define FPP_CPU_AESNI        0x0001
+#define FPP_CPU_VAES         0x0002
+#define FPP_CPU_PCLMUL       0x0004
+#define FPP_CPU_AVX2         0x0008
+#define FPP_CPU_AVX512F      0x0010
+#define FPP_CPU_SHANI        0x0020
+/* ARMv8 Cryptography Extensions */
+#define FPP_CPU_ARMV8_AES    0x0100
+#define FPP_CPU_ARMV8_PMULL  0x0200
+#define FPP_CPU_ARMV8_SHA2   0x0400
+
+/* CPUs and NUMA nodes beyond these are not used */
+#define FPP_CPU_MAX          1024
+#define FPP_NODE_MAX         64
+#define FPP_NODE_ANY         (-1)
+
+/*
+ * CPUs fpp may run on and their NUMA nodes. Nodes are referred to by
+ * their index in nodes. Without NUMA information all CPUs are on one
+ * node.
+ */
+typedef struct {
+    size_t ncpus;
+    uint16_t cpus[FPP_CPU_MAX];
+    uint8_t cpu_node[FPP_CPU_MAX];
+    size_t nnodes;
+    /* System node numbers */
+    uint16_t nodes[FPP_NODE_MAX];
+    size_t node_ncpus[FPP_NODE_MAX];
+    /* Node of worker i % ncpus, nodes take turns by their CPU counts */
+    uint8_t worker_node[FPP_CPU_MAX];
+} fpp_cpu_topology_t;
+
+
+/*
+ * FPP_CPU_* bits of what the CPU and the OS support, detected on the
+ * first call. Zero where the build has no way to tell.
+ */
+uint32_t fpp_cpu_features(void);
+/* Space separated names of the bits set in features, "none" if none */
+const char *fpp_cpu_features_str(uint32_t features, char *buf,
+    size_t size);
+
+/*
+ * The CPUs in the affinity mask of the process, only those in cpus
+ * ("0-3,8") if it isn't NULL. FPP_ERR_IO_ARGV if cpus is malformed or
+ * leaves no CPU.
+ */
+fpp_err_t fpp_cpu_topology_init(fpp_cpu_topology_t *topo, const char *cpus);
+size_t fpp_cpu_topology_worker_node(const fpp_cpu_topology_t *topo,
+    size_t index);
+/* Node of the CPU the calling thread runs on, 0 if unknown */
+size_t fpp_cpu_topology_current_node(const fpp_cpu_topology_t *topo);
+
+/* Run the calling thread only on the CPUs of topo on node */
+fpp_err_t fpp_cpu_pin_thread(const fpp_cpu_topology_t *topo, size_t node);
+/* Run the calling thread, and the threads it creates, on topo only */
+fpp_err_t fpp_cpu_restrict(const fpp_cpu_topology_t *topo);
+/*
+ * Pages of the mapping at addr that are faulted in later come from the
+ * NUMA node with the system number node while it has free memory,
+ * FPP_NODE_ANY - no preference. The policy of the calling thread is
+ * left alone.
+ */
+void fpp_cpu_bind_memory(void *addr, size_t len, int node);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CPU_H */
@@ -7,6 +7,8 @@
 #ifndef ENCRYPT_FILE_H
 #define ENCRYPT_FILE_H
 
+#include <stdint.h>
+
 #include "errcodes.h"
 
 #ifdef __cplusplus
@@ -31,18 +33,43 @@ typedef struct {
     uint32_t iter;
 } fpp_crypto_params_t;
 
+/* Bits of fpp_crypto_header_t.flags */
+#define FPP_HEADER_DIGEST        0x00000001
+#define FPP_HEADER_MERKLE        0x00000002
+
 typedef struct {
     char magic_word[8];
     uint8_t iv[16];
     uint8_t salt[44]; // TODO: Which salt size need to use?
     uint32_t iter;
     uint32_t algo;
+    /* An "FPPv1" header ends here, the rest is "FPPv2" */
+    uint32_t flags;
+    /* Keyed SHA3-256 of the plaintext if FPP_HEADER_DIGEST is set */
+    uint8_t digest[32];
+    /* Root of the integrity index if FPP_HEADER_MERKLE is set */
+    uint8_t merkle_root[32];
+    /* FPP_KDF_*, see kdf.h, KiB per lane and lanes of memory-hard ones */
+    uint32_t kdf;
+    uint32_t kdf_memory;
+    uint32_t kdf_lanes;
+    /* Zero, for later format extensions */
+    uint8_t reserved[4];
 } fpp_crypto_header_t;
 
+#define FPP_HEADER_V1_SIZE       76
+
 
 fpp_err_t fpp_encrypt_file(fpp_crypto_params_t *params);
 fpp_err_t fpp_decrypt_file(fpp_crypto_params_t *params);
 
+/*
+ * Number of iterations for which deriving a file key takes about msec
+ * milliseconds on this host. It is stored in the header, so unlocking
+ * the file elsewhere takes as long as that host needs for it.
+ */
+fpp_err_t fpp_kdf_calibrate_iter(uint32_t msec, uint32_t *iter);
+
 #ifdef __cplusplus
 }
 #endif
@@ -34,6 +34,12 @@ extern "C" {
 #define FPP_ERR_IO_ARGV              (FPP_ERR_IO + 1)
 #define FPP_ERR_IO_EXIST             (FPP_ERR_IO + 2)
 #define FPP_ERR_IO_FORMAT            (FPP_ERR_IO + 3)
+#define FPP_ERR_IO_DIGEST            (FPP_ERR_IO + 4)
+#define FPP_ERR_IO_PADDING           (FPP_ERR_IO + 5)
+
+#define FPP_ERR_JOB                  (FPP_APPLICATION_START_ERROR + 100)
+#define FPP_ERR_JOB_CANCELED         (FPP_ERR_JOB + 1)
+#define FPP_ERR_JOB_BUSY             (FPP_ERR_JOB + 2)
 
 #define FPP_OK                       0
 #define FPP_FAILURE                 -1
@@ -0,0 +1,27 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+/*
+ * Public interface of libfpp. Applications include this header only
+ * and link with -lfpp.
+ */
+
+#ifndef FPP_H
+#define FPP_H
+
+#include "version.h"
+#include "errcodes.h"
+#include "log.h"
+#include "memory.h"
+#include "profile.h"
+#include "encrypt_file.h"
+#include "context.h"
+#if !(_WIN32)
+#include "async.h"
+#include "merkle.h"
+#endif
+
+#endif /* FPP_H */
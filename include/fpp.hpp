@@ -0,0 +1,530 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+/*
+ * Header-only C++ interface over libfpp. Objects own their native
+ * handles and are move-only, memory is passed in as spans so nothing
+ * is copied on the way to OpenSSL, and per-algorithm sizes are known
+ * at compile time through cipher_traits. Errors are reported the same
+ * way as in the C API, as fpp_err_t return values.
+ */
+
+#ifndef FPP_HPP
+#define FPP_HPP
+
+#include <array>
+#include <limits>
+#include <memory>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <openssl/evp.h>
+
+#include "fpp.h"
+#include "cipher.h"
+#include "memory.h"
+#include "aes128.h"
+#include "aes256.h"
+#include "blowfish.h"
+#include "cast5.h"
+#include "camellia128.h"
+#include "camellia256.h"
+
+namespace fpp {
+
+/*
+ * Non-owning view over contiguous memory, a C++14 stand-in for
+ * std::span.
+ */
+template <typename T>
+class span {
+public:
+    using element_type = T;
+    using value_type = typename std::remove_cv<T>::type;
+    using size_type = std::size_t;
+    using pointer = T *;
+    using reference = T &;
+    using iterator = T *;
+
+    static constexpr size_type npos = static_cast<size_type>(-1);
+
+    constexpr span() noexcept : data_(nullptr), size_(0) {}
+
+    constexpr span(pointer data, size_type size) noexcept
+        : data_(data), size_(size) {}
+
+    template <std::size_t N>
+    constexpr span(T (&arr)[N]) noexcept : data_(arr), size_(N) {}
+
+    /* Anything with contiguous data() and size(): std::array, std::vector */
+    template <typename Container, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<Container>::type, span>::value &&
+        std::is_convertible<
+            decltype(std::declval<Container &>().data()), pointer>::value
+        >::type>
+    span(Container &c) noexcept : data_(c.data()), size_(c.size()) {}
+
+    template <typename U, typename = typename std::enable_if<
+        std::is_convertible<U *, pointer>::value>::type>
+    constexpr span(const span<U> &other) noexcept
+        : data_(other.data()), size_(other.size()) {}
+
+    constexpr pointer data() const noexcept { return data_; }
+    constexpr size_type size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+
+    constexpr reference operator[](size_type i) const noexcept
+    {
+        return data_[i];
+    }
+
+    constexpr iterator begin() const noexcept { return data_; }
+    constexpr iterator end() const noexcept { return data_ + size_; }
+
+    constexpr span first(size_type n) const noexcept
+    {
+        return span(data_, n);
+    }
+
+    constexpr span subspan(size_type offset,
+        size_type n = npos) const noexcept
+    {
+        return span(data_ + offset, n == npos ? size_ - offset : n);
+    }
+
+private:
+    pointer data_;
+    size_type size_;
+};
+
+template <typename T>
+constexpr typename span<T>::size_type span<T>::npos;
+
+using byte_span = span<std::uint8_t>;
+using const_byte_span = span<const std::uint8_t>;
+
+
+/* Algorithm tags */
+struct aes128 {};
+struct aes256 {};
+struct blowfish {};
+struct cast5 {};
+struct camellia128 {};
+struct camellia256 {};
+
+template <std::uint32_t Algo, std::size_t KeySize, std::size_t IvSize,
+    std::size_t BlockSize>
+struct cipher_traits_base {
+    static constexpr std::uint32_t algo = Algo;
+    static constexpr std::size_t key_size = KeySize;
+    static constexpr std::size_t iv_size = IvSize;
+    static constexpr std::size_t block_size = BlockSize;
+
+    /* CBC with PKCS#7 padding always adds 1..block_size bytes */
+    static constexpr std::size_t padded_size(std::size_t n) noexcept
+    {
+        return (n / block_size + 1) * block_size;
+    }
+
+    static constexpr bool is_block_aligned(std::size_t n) noexcept
+    {
+        return n % block_size == 0;
+    }
+};
+
+template <std::uint32_t Algo, std::size_t KeySize, std::size_t IvSize,
+    std::size_t BlockSize>
+constexpr std::uint32_t
+    cipher_traits_base<Algo, KeySize, IvSize, BlockSize>::algo;
+template <std::uint32_t Algo, std::size_t KeySize, std::size_t IvSize,
+    std::size_t BlockSize>
+constexpr std::size_t
+    cipher_traits_base<Algo, KeySize, IvSize, BlockSize>::key_size;
+template <std::uint32_t Algo, std::size_t KeySize, std::size_t IvSize,
+    std::size_t BlockSize>
+constexpr std::size_t
+    cipher_traits_base<Algo, KeySize, IvSize, BlockSize>::iv_size;
+template <std::uint32_t Algo, std::size_t KeySize, std::size_t IvSize,
+    std::size_t BlockSize>
+constexpr std::size_t
+    cipher_traits_base<Algo, KeySize, IvSize, BlockSize>::block_size;
+
+template <typename Algo>
+struct cipher_traits;
+
+template <>
+struct cipher_traits<aes128> : cipher_traits_base<FPP_ALGO_AES128,
+    FPP_KEYSIZE_AES128, FPP_IVSIZE_AES128, FPP_AES_BLOCK_SIZE>
+{
+    static constexpr const char *name() noexcept { return "aes128"; }
+};
+
+template <>
+struct cipher_traits<aes256> : cipher_traits_base<FPP_ALGO_AES256,
+    FPP_KEYSIZE_AES256, FPP_IVSIZE_AES256, FPP_AES_BLOCK_SIZE>
+{
+    static constexpr const char *name() noexcept { return "aes256"; }
+};
+
+template <>
+struct cipher_traits<blowfish> : cipher_traits_base<FPP_ALGO_BLOWFISH,
+    FPP_KEYSIZE_BLOWFISH, FPP_IVSIZE_BLOWFISH, FPP_BLOWFISH_BLOCK_SIZE>
+{
+    static constexpr const char *name() noexcept { return "blowfish"; }
+};
+
+template <>
+struct cipher_traits<cast5> : cipher_traits_base<FPP_ALGO_CAST5,
+    FPP_KEYSIZE_CAST5, FPP_IVSIZE_CAST5, FPP_CAST5_BLOCK_SIZE>
+{
+    static constexpr const char *name() noexcept { return "cast5"; }
+};
+
+template <>
+struct cipher_traits<camellia128> : cipher_traits_base<FPP_ALGO_CAMELLIA128,
+    FPP_KEYSIZE_CAMELLIA128, FPP_IVSIZE_CAMELLIA128,
+    FPP_CAMELLIA128_BLOCK_SIZE>
+{
+    static constexpr const char *name() noexcept { return "camellia128"; }
+};
+
+template <>
+struct cipher_traits<camellia256> : cipher_traits_base<FPP_ALGO_CAMELLIA256,
+    FPP_KEYSIZE_CAMELLIA256, FPP_IVSIZE_CAMELLIA256,
+    FPP_CAMELLIA256_BLOCK_SIZE>
+{
+    static constexpr const char *name() noexcept { return "camellia256"; }
+};
+
+template <typename Algo>
+using key_type = std::array<std::uint8_t, cipher_traits<Algo>::key_size>;
+
+template <typename Algo>
+using iv_type = std::array<std::uint8_t, cipher_traits<Algo>::iv_size>;
+
+/* Exact ciphertext storage for an N byte plaintext */
+template <typename Algo, std::size_t N>
+using ciphertext_array = std::array<std::uint8_t,
+    cipher_traits<Algo>::padded_size(N)>;
+
+
+/*
+ * Owning heap buffer, wiped before it's released. Move-only, so key
+ * material and plaintext never get duplicated by accident.
+ */
+class buffer {
+public:
+    buffer() noexcept : size_(0) {}
+
+    explicit buffer(std::size_t size)
+        : data_(size ? new (std::nothrow) std::uint8_t[size] : nullptr),
+          size_(data_ ? size : 0) {}
+
+    buffer(buffer &&other) noexcept
+        : data_(std::move(other.data_)), size_(other.size_)
+    {
+        other.size_ = 0;
+    }
+
+    buffer &operator=(buffer &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            data_ = std::move(other.data_);
+            size_ = other.size_;
+            other.size_ = 0;
+        }
+        return *this;
+    }
+
+    buffer(const buffer &) = delete;
+    buffer &operator=(const buffer &) = delete;
+
+    ~buffer() { reset(); }
+
+    void reset() noexcept
+    {
+        if (data_) {
+            fpp_explicit_memzero(data_.get(), size_);
+        }
+        data_.reset();
+        size_ = 0;
+    }
+
+    std::uint8_t *data() noexcept { return data_.get(); }
+    const std::uint8_t *data() const noexcept { return data_.get(); }
+    std::size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+    explicit operator bool() const noexcept { return data_ != nullptr; }
+
+    byte_span view() noexcept { return byte_span(data_.get(), size_); }
+
+    const_byte_span view() const noexcept
+    {
+        return const_byte_span(data_.get(), size_);
+    }
+
+private:
+    std::unique_ptr<std::uint8_t[]> data_;
+    std::size_t size_;
+};
+
+
+class context {
+public:
+    context() : ctx_(fpp_ctx_create(nullptr)) {}
+
+    explicit context(const fpp_ctx_config_t &config)
+        : ctx_(fpp_ctx_create(&config)) {}
+
+    bool valid() const noexcept { return ctx_ != nullptr; }
+    explicit operator bool() const noexcept { return valid(); }
+
+    fpp_ctx_t *native_handle() const noexcept { return ctx_.get(); }
+
+    const fpp_ctx_config_t &config() const noexcept
+    {
+        return *fpp_ctx_get_config(ctx_.get());
+    }
+
+    fpp_err_t encrypt_file(const fpp_crypto_params_t &params) noexcept
+    {
+        return fpp_ctx_encrypt_file(ctx_.get(), &params);
+    }
+
+    fpp_err_t decrypt_file(const fpp_crypto_params_t &params) noexcept
+    {
+        return fpp_ctx_decrypt_file(ctx_.get(), &params);
+    }
+
+    fpp_err_t verify_file(const fpp_crypto_params_t &params) noexcept
+    {
+        return fpp_ctx_verify_file(ctx_.get(), &params);
+    }
+
+    /* results must be empty or hold one entry per params entry */
+    fpp_err_t encrypt_files(span<const fpp_crypto_params_t> params,
+        span<fpp_err_t> results = span<fpp_err_t>()) noexcept
+    {
+        if (!results.empty() && results.size() < params.size()) {
+            return FPP_ERR_IO_ARGV;
+        }
+        return fpp_ctx_encrypt_files(ctx_.get(), params.data(),
+            params.size(), results.empty() ? nullptr : results.data());
+    }
+
+    fpp_err_t decrypt_files(span<const fpp_crypto_params_t> params,
+        span<fpp_err_t> results = span<fpp_err_t>()) noexcept
+    {
+        if (!results.empty() && results.size() < params.size()) {
+            return FPP_ERR_IO_ARGV;
+        }
+        return fpp_ctx_decrypt_files(ctx_.get(), params.data(),
+            params.size(), results.empty() ? nullptr : results.data());
+    }
+
+    fpp_err_t verify_files(span<const fpp_crypto_params_t> params,
+        span<fpp_err_t> results = span<fpp_err_t>()) noexcept
+    {
+        if (!results.empty() && results.size() < params.size()) {
+            return FPP_ERR_IO_ARGV;
+        }
+        return fpp_ctx_verify_files(ctx_.get(), params.data(),
+            params.size(), results.empty() ? nullptr : results.data());
+    }
+
+private:
+    struct deleter {
+        void operator()(fpp_ctx_t *ctx) const noexcept
+        {
+            fpp_ctx_destroy(ctx);
+        }
+    };
+
+    std::unique_ptr<fpp_ctx_t, deleter> ctx_;
+};
+
+
+/*
+ * Streaming CBC cipher for one algorithm. The EVP implementation
+ * comes from the context, so it is resolved once per context rather
+ * than once per message.
+ */
+template <typename Algo>
+class cipher {
+public:
+    using traits = cipher_traits<Algo>;
+
+    cipher() : ctx_(EVP_CIPHER_CTX_new()) {}
+
+    bool valid() const noexcept { return ctx_ != nullptr; }
+    explicit operator bool() const noexcept { return valid(); }
+
+    EVP_CIPHER_CTX *native_handle() const noexcept { return ctx_.get(); }
+
+    fpp_err_t init_encrypt(context &ctx, const key_type<Algo> &key,
+        const iv_type<Algo> &iv) noexcept
+    {
+        return init(ctx, key, iv, 1);
+    }
+
+    fpp_err_t init_decrypt(context &ctx, const key_type<Algo> &key,
+        const iv_type<Algo> &iv) noexcept
+    {
+        return init(ctx, key, iv, 0);
+    }
+
+    /*
+     * out must have room for in.size() + block_size bytes, written
+     * receives the number of bytes actually produced.
+     */
+    fpp_err_t update(const_byte_span in, byte_span out,
+        std::size_t &written) noexcept
+    {
+        const std::size_t max_step = std::numeric_limits<int>::max()
+            - traits::block_size;
+        std::size_t offset, step;
+        int out_len;
+
+        written = 0;
+        if (out.size() < in.size() + traits::block_size) {
+            return FPP_ERR_IO_ARGV;
+        }
+
+        for (offset = 0; offset < in.size(); offset += step) {
+            step = in.size() - offset;
+            if (step > max_step) {
+                step = max_step;
+            }
+            if (EVP_CipherUpdate(ctx_.get(), out.data() + written, &out_len,
+                in.data() + offset, static_cast<int>(step)) != 1)
+            {
+                return FPP_FAILURE;
+            }
+            written += static_cast<std::size_t>(out_len);
+        }
+        return FPP_OK;
+    }
+
+    /* out must have room for block_size bytes */
+    fpp_err_t final(byte_span out, std::size_t &written) noexcept
+    {
+        int out_len;
+
+        written = 0;
+        if (out.size() < traits::block_size) {
+            return FPP_ERR_IO_ARGV;
+        }
+        if (EVP_CipherFinal_ex(ctx_.get(), out.data(), &out_len) != 1) {
+            return FPP_FAILURE;
+        }
+        written = static_cast<std::size_t>(out_len);
+        return FPP_OK;
+    }
+
+    /* One-shot encryption, out must hold traits::padded_size(in.size()) */
+    fpp_err_t encrypt(const_byte_span in, byte_span out,
+        std::size_t &written) noexcept
+    {
+        if (out.size() < traits::padded_size(in.size())) {
+            written = 0;
+            return FPP_ERR_IO_ARGV;
+        }
+        return process(in, out, written);
+    }
+
+    /* One-shot decryption, out must hold in.size() bytes */
+    fpp_err_t decrypt(const_byte_span in, byte_span out,
+        std::size_t &written) noexcept
+    {
+        if (out.size() < in.size() || !traits::is_block_aligned(in.size())) {
+            written = 0;
+            return FPP_ERR_IO_ARGV;
+        }
+        return process(in, out, written);
+    }
+
+    /*
+     * Fixed-size path: the output size is computed at compile time and
+     * the buffer type guarantees it fits, so no runtime checks remain.
+     */
+    template <std::size_t N>
+    fpp_err_t encrypt(const std::array<std::uint8_t, N> &in,
+        ciphertext_array<Algo, N> &out) noexcept
+    {
+        std::size_t written;
+
+        return process(const_byte_span(in.data(), N),
+            byte_span(out.data(), out.size()), written);
+    }
+
+private:
+    struct deleter {
+        void operator()(EVP_CIPHER_CTX *ctx) const noexcept
+        {
+            EVP_CIPHER_CTX_free(ctx);
+        }
+    };
+
+    fpp_err_t init(context &ctx, const key_type<Algo> &key,
+        const iv_type<Algo> &iv, int enc) noexcept
+    {
+        const EVP_CIPHER *evp_cipher;
+
+        if (!ctx_ || !ctx) {
+            return FPP_FAILURE;
+        }
+        evp_cipher = fpp_ctx_get_evp_cipher(ctx.native_handle(),
+            fpp_cipher_by_algo(traits::algo));
+        if (!evp_cipher) {
+            return FPP_FAILURE;
+        }
+        if (EVP_CipherInit_ex(ctx_.get(), evp_cipher, nullptr,
+            key.data(), iv.data(), enc) != 1)
+        {
+            return FPP_FAILURE;
+        }
+        return FPP_OK;
+    }
+
+    /*
+     * One-shot update and final. The caller has checked that out holds
+     * the whole result, which for CBC never exceeds padded_size() when
+     * encrypting or in.size() when decrypting.
+     */
+    fpp_err_t process(const_byte_span in, byte_span out,
+        std::size_t &written) noexcept
+    {
+        int out_len, tail_len;
+
+        written = 0;
+        if (in.size() > static_cast<std::size_t>(
+            std::numeric_limits<int>::max() - traits::block_size))
+        {
+            return FPP_ERR_IO_ARGV;
+        }
+        if (EVP_CipherUpdate(ctx_.get(), out.data(), &out_len, in.data(),
+            static_cast<int>(in.size())) != 1)
+        {
+            return FPP_FAILURE;
+        }
+        if (EVP_CipherFinal_ex(ctx_.get(), out.data() + out_len,
+            &tail_len) != 1)
+        {
+            return FPP_FAILURE;
+        }
+        written = static_cast<std::size_t>(out_len + tail_len);
+        return FPP_OK;
+    }
+
+    std::unique_ptr<EVP_CIPHER_CTX, deleter> ctx_;
+};
+
+} /* namespace fpp */
+
+#endif /* FPP_HPP */
@@ -0,0 +1,80 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef KDF_H
+#define KDF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <openssl/opensslv.h>
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+#include <openssl/types.h>
+#else
+typedef struct ossl_lib_ctx_st OSSL_LIB_CTX;
+#endif
+
+#include "errcodes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Key derivation functions, recorded in the header. Files without the
+ * field have zero there and use PBKDF2-HMAC-SHA512 with iter.
+ *
+ * scrypt and Argon2id are memory-hard: every lane fills memory KiB and
+ * the lanes run on their own threads, so a key costs lanes times the
+ * memory and work within the time of one lane. scrypt uses r = 8 and
+ * N = memory (a power of two), Argon2id makes iter passes.
+ */
+#define FPP_KDF_PBKDF2              0
+#define FPP_KDF_SCRYPT              1
+#define FPP_KDF_ARGON2ID            2
+
+#define FPP_KDF_DEFAULT_MEMORY      (64 * 1024)
+#define FPP_KDF_MAX_LANES           64
+/* KiB of all lanes together, larger headers are rejected */
+#define FPP_KDF_MAX_MEMORY          (16 * 1024 * 1024)
+/* Limit of a context unless configured, see kdf_max_memory */
+#define FPP_KDF_DEFAULT_MAX_MEMORY  (1024 * 1024)
+#define FPP_SCRYPT_R                8
+#define FPP_ARGON2_DEFAULT_PASSES   3
+
+typedef struct {
+    uint32_t id;
+    uint32_t iter;
+    /* KiB per lane */
+    uint32_t memory;
+    uint32_t lanes;
+} fpp_kdf_params_t;
+
+
+const char *fpp_kdf_name(uint32_t id);
+/* Returns FPP_ERR_IO_ARGV for an unknown name */
+fpp_err_t fpp_kdf_by_name(const char *name, uint32_t *id);
+/*
+ * Argon2id needs OpenSSL 3.2 or later. It is fetched from libctx and
+ * runs its lanes on the threads libctx allows, NULL is the default
+ * library context, which allows none unless the application set it.
+ */
+bool fpp_kdf_is_available(OSSL_LIB_CTX *libctx, uint32_t id);
+
+/*
+ * Returns FPP_ERR_IO_FORMAT if the parameters are out of range, as
+ * they may be in a damaged or hostile header.
+ */
+fpp_err_t fpp_kdf_check(const fpp_kdf_params_t *kdf);
+fpp_err_t fpp_kdf_derive(OSSL_LIB_CTX *libctx, const fpp_kdf_params_t *kdf,
+    const char *pass, size_t passlen, const uint8_t *salt, size_t saltlen,
+    uint8_t *out, size_t outlen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KDF_H */
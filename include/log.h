@@ -1,4 +1,4 @@
-/* 
+/*
  * This file is part of FPP (File Protection Program).
  *
  * See LICENSE for licensing information.
@@ -11,17 +11,93 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 
 #include "errcodes.h"
 
+/* One JSON line, longer records are cut and marked "truncated" */
+#define FPP_LOG_RECORD_SIZE     1024
+#define FPP_LOG_DEFAULT_RECORDS 1024
+
+typedef enum {
+    FPP_LOG_DEBUG,
+    FPP_LOG_INFO,
+    FPP_LOG_WARN,
+    FPP_LOG_ERROR
+} fpp_log_level_t;
+
+typedef enum {
+    FPP_LOG_FIELD_STR,
+    FPP_LOG_FIELD_INT,
+    FPP_LOG_FIELD_UINT
+} fpp_log_field_type_t;
+
+typedef struct {
+    const char *key;
+    fpp_log_field_type_t type;
+    union {
+        const char *s;
+        int64_t i;
+        uint64_t u;
+    } value;
+} fpp_log_field_t;
+
+#define FPP_LOG_STR(k, v)                                                  \
+    { (k), FPP_LOG_FIELD_STR, { .s = (v) } }
+#define FPP_LOG_INT(k, v)                                                  \
+    { (k), FPP_LOG_FIELD_INT, { .i = (int64_t) (v) } }
+#define FPP_LOG_UINT(k, v)                                                 \
+    { (k), FPP_LOG_FIELD_UINT, { .u = (uint64_t) (v) } }
+
+typedef struct {
+    /* Records below it are discarded by the caller */
+    fpp_log_level_t level;
+    /* JSON lines are appended to it, NULL or "-" for stderr */
+    const char *fname;
+    /* Records the ring holds, rounded up to a power of two */
+    size_t nrecords;
+} fpp_log_config_t;
+
+typedef struct {
+    uint64_t written;
+    /* The ring was full, the record was discarded */
+    uint64_t dropped;
+} fpp_log_stats_t;
+
+
 void fpp_enable_quite_mode(void);
 void fpp_disable_quite_mode(void);
 bool fpp_is_quite_mode(void);
 
+/*
+ * Without fpp_log_start() messages are printed to stdout as they come.
+ * With it they go to the log as "info" and "error" records.
+ */
 void fpp_log_message(const char *fmt, ...);
 void fpp_log_error(fpp_err_t errcode, const char *fmt, ...);
 
+void fpp_log_config_init(fpp_log_config_t *config);
+
+/*
+ * Start the background thread that writes the log. Callers format
+ * their record into a slot of a lock-free ring and return, they never
+ * wait for I/O or for each other; if the ring is full the record is
+ * dropped and counted instead.
+ */
+fpp_err_t fpp_log_start(const fpp_log_config_t *config);
+/*
+ * Write what is queued and the number of dropped records, and stop.
+ * No other thread may be logging by then.
+ */
+void fpp_log_stop(void);
+/* Records are only kept while the log is started */
+bool fpp_log_enabled(fpp_log_level_t level);
+void fpp_log_write(fpp_log_level_t level, const char *msg,
+    const fpp_log_field_t *fields, size_t nfields);
+void fpp_log_get_stats(fpp_log_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
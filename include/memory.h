@@ -7,6 +7,9 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -17,8 +20,33 @@ extern "C" {
 #define fpp_memory_barrier()
 #endif
 
+/* a must be a power of two */
+#define fpp_align_up(n, a)  (((n) + (a) - 1) & ~((size_t) (a) - 1))
+
+typedef struct {
+    /* 0 - unlimited */
+    size_t limit;
+    size_t in_use;
+    size_t peak_in_use;
+    /* Reservations that had to wait for memory to be released */
+    uint64_t waits;
+} fpp_memory_budget_stats_t;
+
+
 void fpp_explicit_memzero(uint8_t *buf, size_t n);
 
+/*
+ * Process-wide budget for the buffers of file jobs, shared by all
+ * contexts. A job reserves its buffers before it opens any file; while
+ * the budget is exhausted jobs wait in arrival order rather than fail.
+ * A job larger than the whole budget runs when it is the only one.
+ * 0 - unlimited, the default.
+ */
+void fpp_memory_set_budget(size_t limit);
+void fpp_memory_get_budget_stats(fpp_memory_budget_stats_t *stats);
+void fpp_memory_reserve(size_t n);
+void fpp_memory_release(size_t n);
+
 #ifdef __cplusplus
 }
 #endif
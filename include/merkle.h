@@ -0,0 +1,83 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "errcodes.h"
+#include "context.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Integrity index of an encrypted file. The ciphertext after the
+ * header is split into leaf_size chunks, every chunk is hashed with
+ * SHA3-256 and the hashes are combined pairwise up to a root. The
+ * leaf hashes are kept in an index file next to the encrypted one,
+ * the root in its header, so that any range can be checked without
+ * the password and without reading the rest of the file.
+ */
+#define FPP_MERKLE_DEFAULT_LEAF_SIZE  (1024 * 1024)
+#define FPP_MERKLE_HASH_SIZE          32
+#define FPP_MERKLE_INDEX_SUFFIX       ".fppm"
+
+typedef struct {
+    char magic_word[8];
+    uint32_t leaf_size;
+    uint32_t reserved;
+    /* Where the ciphertext starts in the encrypted file */
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint64_t nleaves;
+    /* Followed by nleaves leaf hashes */
+} fpp_merkle_index_t;
+
+typedef struct {
+    uint64_t index;
+    /* Position in the encrypted file */
+    uint64_t offset;
+    uint64_t length;
+} fpp_merkle_chunk_t;
+
+typedef struct {
+    uint64_t nchecked;
+    size_t nbad;
+    fpp_merkle_chunk_t *bad;
+    /* The file was truncated or extended since the index was built */
+    bool size_mismatch;
+} fpp_merkle_report_t;
+
+
+/*
+ * Hash the ciphertext of fname on the context thread pool, write the
+ * leaf hashes to index_fname and the root to the header, which is in
+ * header_fname if that isn't NULL.
+ */
+fpp_err_t fpp_ctx_merkle_build(fpp_ctx_t *ctx, const char *fname,
+    const char *header_fname, const char *index_fname, size_t leaf_size);
+
+/*
+ * Check the chunks that overlap [offset, offset + length) of the
+ * ciphertext, length 0 - up to its end. Returns FPP_ERR_IO_DIGEST if
+ * some chunks don't match, they are listed in report, and
+ * FPP_ERR_IO_FORMAT if the index doesn't match the header.
+ */
+fpp_err_t fpp_ctx_merkle_verify(fpp_ctx_t *ctx, const char *fname,
+    const char *header_fname, const char *index_fname, uint64_t offset,
+    uint64_t length, fpp_merkle_report_t *report);
+void fpp_merkle_report_free(fpp_merkle_report_t *report);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MERKLE_H */
@@ -7,6 +7,9 @@
 #ifndef PBKDF2_H
 #define PBKDF2_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 #include "errcodes.h"
 
 #ifdef __cplusplus
@@ -25,6 +28,40 @@ fpp_err_t fpp_pkcs5_pbkdf2_hmac_sha512(const char *pass, size_t passlen,
     const uint8_t *salt, size_t saltlen, uint32_t iter, uint8_t *out,
     size_t outlen);
 
+/*
+ * Independent derivations with the same iteration count and output
+ * length, e.g. one key per file of a batch with a salt per file.
+ */
+typedef struct {
+    const char *pass;
+    size_t passlen;
+    const uint8_t *salt;
+    size_t saltlen;
+    uint8_t *out;
+} fpp_pbkdf2_params_t;
+
+/*
+ * Same result as fpp_pkcs5_pbkdf2_hmac_sha512() for every entry. The
+ * iterations of up to FPP_PBKDF2_LANES output blocks run in lockstep,
+ * one per SIMD lane, so a batch costs about as much as its largest
+ * group of single derivations would.
+ */
+#define FPP_PBKDF2_LANES  8
+
+fpp_err_t fpp_pkcs5_pbkdf2_hmac_sha512_batch(
+    const fpp_pbkdf2_params_t *params, size_t n, uint32_t iter,
+    size_t outlen);
+
+/*
+ * Iterations of fpp_pkcs5_pbkdf2_hmac_sha512() deriving outlen bytes
+ * that take about msec milliseconds on this host, measured on a short
+ * run. Never less than FPP_PBKDF2_MIN_ITER.
+ */
+#define FPP_PBKDF2_MIN_ITER  1000
+
+fpp_err_t fpp_pkcs5_pbkdf2_hmac_sha512_calibrate(uint32_t msec,
+    size_t outlen, uint32_t *iter);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,46 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include <stdint.h>
+
+#include "errcodes.h"
+#include "stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Indexes into the values of fpp_perfctr_read() */
+#define FPP_PERFCTR_CYCLES            0
+#define FPP_PERFCTR_INSTRUCTIONS      1
+#define FPP_PERFCTR_CACHE_MISSES      2
+#define FPP_PERFCTR_CONTEXT_SWITCHES  3
+#define FPP_PERFCTR_MAX               4
+
+/*
+ * Counters of the calling thread, opened as one perf_event group on
+ * first use and kept until the thread exits, so that all of them are
+ * read with a single system call.
+ */
+typedef struct fpp_perfctr_s fpp_perfctr_t;
+
+
+/* NULL when no counter could be opened, e.g. in a container */
+fpp_perfctr_t *fpp_perfctr_get(void);
+/* FPP_COUNTER_* bits of the counters that are open */
+unsigned int fpp_perfctr_available(const fpp_perfctr_t *pc);
+/* Running totals, 0 for counters that aren't open */
+fpp_err_t fpp_perfctr_read(fpp_perfctr_t *pc,
+    uint64_t values[FPP_PERFCTR_MAX]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PERFCTR_H */
@@ -0,0 +1,58 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * USDT probes of provider "fpp", compiled in with OPTION_USDT. A probe
+ * is a nop plus an ELF note that tells the tracer where its arguments
+ * live, there is no branch or call until a tracer attaches. Names and
+ * arguments are kept stable for the scripts in tools/bpftrace:
+ *
+ *   file__start(job, in_fname, mode)
+ *   file__done(job, in_fname, mode, err)
+ *   kdf__start(job, iter)
+ *   kdf__done(job, iter)
+ *   chunk__start(job, len)
+ *   chunk__done(job, len, out_len)
+ *   write__done(job, len)
+ *   cipher__start(algo_name, mode, len)
+ *   cipher__done(algo_name, mode, out_len)
+ *   error(err, message)
+ *
+ * mode is 0 for encryption and 1 for decryption, as in fpp_mode_t,
+ * algo_name, in_fname and message are C strings.
+ * Chunk probes fire for every chunk of the file pipeline, the cipher
+ * ones for every call of the one-shot fpp_*_cbc() wrappers.
+ */
+
+#if (FPP_HAVE_USDT)
+
+#include <sys/sdt.h>
+
+#define FPP_PROBE0(name)                                                  \
+    DTRACE_PROBE(fpp, name)
+#define FPP_PROBE1(name, a1)                                              \
+    DTRACE_PROBE1(fpp, name, a1)
+#define FPP_PROBE2(name, a1, a2)                                          \
+    DTRACE_PROBE2(fpp, name, a1, a2)
+#define FPP_PROBE3(name, a1, a2, a3)                                      \
+    DTRACE_PROBE3(fpp, name, a1, a2, a3)
+#define FPP_PROBE4(name, a1, a2, a3, a4)                                  \
+    DTRACE_PROBE4(fpp, name, a1, a2, a3, a4)
+
+#else
+
+#define FPP_PROBE0(name)
+#define FPP_PROBE1(name, a1)
+#define FPP_PROBE2(name, a1, a2)
+#define FPP_PROBE3(name, a1, a2, a3)
+#define FPP_PROBE4(name, a1, a2, a3, a4)
+
+#endif
+
+#endif /* PROBES_H */
@@ -0,0 +1,58 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "errcodes.h"
+#include "encrypt_file.h"
+#include "context.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FPP_PROFILE_VERSION  1
+#define FPP_PROFILE_NALGOS   (FPP_ALGO_CAMELLIA256 + 1)
+
+/*
+ * What "fpp tune" measured on this host. Saved as "key = value" lines,
+ * unknown keys are skipped so that older builds can read newer files.
+ * Zero means not measured.
+ */
+typedef struct {
+    size_t chunk_size;
+    /* Files in flight for batch work */
+    size_t nthreads;
+    /* Sequential throughput of the calibrated filesystem, bytes/s */
+    uint64_t read_rate;
+    uint64_t write_rate;
+    /* Single-thread encryption throughput by FPP_ALGO_*, bytes/s */
+    uint64_t cipher_rate[FPP_PROFILE_NALGOS];
+} fpp_profile_t;
+
+
+void fpp_profile_init(fpp_profile_t *profile);
+/* FPP_ERR_IO_FORMAT if the file isn't a profile of a known version */
+fpp_err_t fpp_profile_load(fpp_profile_t *profile, const char *fname);
+fpp_err_t fpp_profile_save(const fpp_profile_t *profile, const char *fname);
+/* Copy the measured values into config, what wasn't measured stays */
+void fpp_profile_apply(const fpp_profile_t *profile,
+    fpp_ctx_config_t *config);
+/*
+ * $FPP_PROFILE, or ".fpp-profile" in the home directory. NULL if
+ * there is no home directory or buf is too small.
+ */
+const char *fpp_profile_default_path(char *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROFILE_H */
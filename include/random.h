@@ -7,12 +7,25 @@
 #ifndef RANDOM_H
 #define RANDOM_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 #include "errcodes.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Per-thread pool of random bytes */
+#define FPP_RANDOM_POOL_SIZE        4096
+/* Bytes a thread generates before pulling a fresh seed from OpenSSL */
+#define FPP_RANDOM_RESEED_INTERVAL  (1024 * 1024)
+
+/*
+ * Thread-safe and lock-free. Output comes from a thread-local
+ * generator that is seeded once, reseeded every
+ * FPP_RANDOM_RESEED_INTERVAL bytes and after fork().
+ */
 fpp_err_t fpp_random_bytes(uint8_t *buf, size_t in_len);
 
 #ifdef __cplusplus
@@ -0,0 +1,49 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef SECMEM_H
+#define SECMEM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "errcodes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Fixed-size slots carved out of one mapping that is reserved, locked
+ * against swapping and excluded from core dumps once, at creation.
+ * Slots of a page or more are separated by inaccessible guard pages,
+ * smaller ones are packed between the guards at both ends. Released
+ * slots are wiped and go back to a free list, so steady-state use
+ * makes no system calls and no allocator calls.
+ */
+typedef struct fpp_secmem_s fpp_secmem_t;
+
+
+/* node as in fpp_cpu_bind_memory(), placed before the pages are locked */
+fpp_secmem_t *fpp_secmem_create(size_t slot_size, size_t nslots, int node);
+void fpp_secmem_destroy(fpp_secmem_t *arena);
+
+/* Returns NULL when all slots are in use */
+void *fpp_secmem_alloc(fpp_secmem_t *arena);
+/* Only the first used bytes are wiped, the rest was never written */
+void fpp_secmem_free(fpp_secmem_t *arena, void *ptr, size_t used);
+
+bool fpp_secmem_owns(const fpp_secmem_t *arena, const void *ptr);
+/* false if the system refused to lock the arena (RLIMIT_MEMLOCK) */
+bool fpp_secmem_is_locked(const fpp_secmem_t *arena);
+size_t fpp_secmem_slot_size(const fpp_secmem_t *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SECMEM_H */
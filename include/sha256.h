@@ -0,0 +1,36 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <openssl/evp.h>
+
+#include "errcodes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FPP_SHA256_BUFSIZE  32
+
+/*
+ * Incremental SHA-256, the checksum of "sha256sum".
+ * fpp_sha256_final() frees the context.
+ */
+EVP_MD_CTX *fpp_sha256_init(void);
+fpp_err_t fpp_sha256_update(EVP_MD_CTX *mdctx, const uint8_t *in_data,
+    size_t in_size);
+fpp_err_t fpp_sha256_final(EVP_MD_CTX *mdctx, uint8_t *buf);
+void fpp_sha256_free(EVP_MD_CTX *mdctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SHA256_H */
@@ -7,6 +7,12 @@
 #ifndef SHA3_256_H
 #define SHA3_256_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include <openssl/evp.h>
+
+#include "errcodes.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -16,6 +22,17 @@ extern "C" {
 uint8_t *fpp_hash_sha3_256_ex(const uint8_t *in_data, size_t in_size,
     uint8_t *buf);
 
+/*
+ * Incremental hashing. A key, if given, is absorbed first; SHA-3 has
+ * no length extension, so this makes a MAC without HMAC's second pass.
+ * fpp_sha3_256_final() frees the context.
+ */
+EVP_MD_CTX *fpp_sha3_256_init(const uint8_t *key, size_t key_len);
+fpp_err_t fpp_sha3_256_update(EVP_MD_CTX *mdctx, const uint8_t *in_data,
+    size_t in_size);
+fpp_err_t fpp_sha3_256_final(EVP_MD_CTX *mdctx, uint8_t *buf);
+void fpp_sha3_256_free(EVP_MD_CTX *mdctx);
+
 #ifdef __cplusplus
 }
 #endif
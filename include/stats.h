@@ -0,0 +1,122 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "errcodes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Where a file operation spends its time. Opening and closing files
+ * and the header counts as FPP_PHASE_OPEN, except for the buffered
+ * output flushed by fclose(), which is FPP_PHASE_WRITE. Cipher setup
+ * belongs to FPP_PHASE_KDF. FPP_PHASE_THROTTLE is time spent waiting
+ * for the I/O budget.
+ */
+typedef enum {
+    FPP_PHASE_OPEN,
+    FPP_PHASE_KDF,
+    FPP_PHASE_READ,
+    FPP_PHASE_CIPHER,
+    FPP_PHASE_WRITE,
+    FPP_PHASE_THROTTLE,
+    FPP_PHASE_MAX
+} fpp_phase_t;
+
+/* Bits of fpp_stats_t.counters */
+#define FPP_COUNTER_CYCLES            0x01
+#define FPP_COUNTER_INSTRUCTIONS      0x02
+#define FPP_COUNTER_CACHE_MISSES      0x04
+#define FPP_COUNTER_CONTEXT_SWITCHES  0x08
+
+/*
+ * Log-linear histogram after HdrHistogram. Values below
+ * FPP_HISTOGRAM_SUB_BUCKETS are exact, every larger power of two is
+ * split into FPP_HISTOGRAM_SUB_BUCKETS buckets, so a value is known to
+ * within 1/16. Nanoseconds up to 2^FPP_HISTOGRAM_MAX_BITS (~78 hours)
+ * fit, longer ones are counted in the last bucket.
+ */
+#define FPP_HISTOGRAM_SUB_BITS     4
+#define FPP_HISTOGRAM_SUB_BUCKETS  (1 << FPP_HISTOGRAM_SUB_BITS)
+#define FPP_HISTOGRAM_MAX_BITS     48
+#define FPP_HISTOGRAM_BUCKETS  \
+    ((FPP_HISTOGRAM_MAX_BITS - FPP_HISTOGRAM_SUB_BITS + 1)  \
+        * FPP_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint64_t buckets[FPP_HISTOGRAM_BUCKETS];
+} fpp_histogram_t;
+
+typedef struct {
+    /* Wall-clock time */
+    uint64_t ns;
+    uint64_t bytes;
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t cache_misses;
+    uint64_t context_switches;
+} fpp_phase_stats_t;
+
+typedef struct {
+    /* Successfully processed files */
+    size_t files;
+    /* Plaintext bytes of those files */
+    uint64_t bytes;
+    /*
+     * Counters the kernel let us open, containers and virtual machines
+     * often have no hardware counters at all. The fields of missing
+     * counters stay 0.
+     */
+    unsigned int counters;
+    fpp_phase_stats_t phases[FPP_PHASE_MAX];
+    /* Nanoseconds from opening to closing each file */
+    fpp_histogram_t latency;
+    /*
+     * Peak resident set size of the process in bytes when the stats
+     * were taken, 0 if the system doesn't tell
+     */
+    uint64_t peak_rss;
+} fpp_stats_t;
+
+
+const char *fpp_phase_name(fpp_phase_t phase);
+
+void fpp_histogram_record(fpp_histogram_t *h, uint64_t value);
+/* Largest value of the bucket that holds the given percentile */
+uint64_t fpp_histogram_percentile(const fpp_histogram_t *h,
+    double percentile);
+/* Range of values counted in bucket i */
+uint64_t fpp_histogram_bucket_lowest(size_t i);
+uint64_t fpp_histogram_bucket_highest(size_t i);
+
+/* Monotonic clock */
+uint64_t fpp_time_ns(void);
+uint64_t fpp_peak_rss(void);
+
+/*
+ * One JSON object with totals, per-phase time, throughput and counters
+ * and the latency percentiles and non-empty buckets. The object isn't
+ * followed by a newline so that it can be nested in another one.
+ */
+fpp_err_t fpp_stats_write_json(FILE *fd, const fpp_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STATS_H */
@@ -0,0 +1,58 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "errcodes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*fpp_task_handler_pt)(void *arg);
+/* Runs in every worker before its first task, index counts from 0 */
+typedef void (*fpp_thread_init_pt)(void *arg, size_t index);
+
+typedef struct fpp_thread_pool_s fpp_thread_pool_t;
+
+/*
+ * Counts outstanding tasks so that a caller can wait for its own
+ * tasks without draining the whole pool.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t count;
+} fpp_wait_group_t;
+
+
+fpp_thread_pool_t *fpp_thread_pool_create(size_t nthreads);
+fpp_thread_pool_t *fpp_thread_pool_create_ex(size_t nthreads,
+    fpp_thread_init_pt init, void *init_arg);
+void fpp_thread_pool_destroy(fpp_thread_pool_t *pool);
+size_t fpp_thread_pool_size(const fpp_thread_pool_t *pool);
+
+fpp_err_t fpp_thread_pool_post(fpp_thread_pool_t *pool,
+    fpp_task_handler_pt handler, void *arg);
+
+fpp_err_t fpp_wait_group_init(fpp_wait_group_t *wg);
+void fpp_wait_group_destroy(fpp_wait_group_t *wg);
+void fpp_wait_group_add(fpp_wait_group_t *wg, size_t n);
+void fpp_wait_group_done(fpp_wait_group_t *wg);
+void fpp_wait_group_wait(fpp_wait_group_t *wg);
+
+/* CPUs the process may run on */
+size_t fpp_get_ncpu(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* THREAD_POOL_H */
@@ -0,0 +1,54 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "errcodes.h"
+#include "context.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Token bucket shared by all jobs of a context. It is kept as the time
+ * when the tokens taken so far are paid off (GCRA), so taking tokens
+ * is a single compare-and-swap and callers sleep outside of any lock.
+ */
+typedef struct {
+    /* Bytes per second, 0 - unlimited */
+    uint64_t rate;
+    /* Credit the bucket holds, in nanoseconds at rate */
+    uint64_t burst_ns;
+    uint64_t tat;
+} fpp_throttle_t;
+
+
+void fpp_throttle_init(fpp_throttle_t *throttle, uint64_t rate,
+    uint64_t burst);
+/* Take n bytes worth of tokens, sleeping until the budget allows it */
+void fpp_throttle_acquire(fpp_throttle_t *throttle, uint64_t n);
+
+/* Niceness of the calling thread, 0 where threads have none */
+int fpp_throttle_get_nice(void);
+/*
+ * Lower the CPU and I/O priority of the calling thread as the config
+ * asks, to base_nice plus config->nice. Meant for threads the library
+ * owns or a caller that wants its own thread lowered: an unprivileged
+ * thread can't raise its priority again.
+ */
+fpp_err_t fpp_throttle_thread(const fpp_ctx_config_t *config,
+    int base_nice);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* THROTTLE_H */
@@ -0,0 +1,25 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#ifndef TUNE_H
+#define TUNE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * "fpp tune [options...]". Calibrates chunk size and worker count on
+ * the target filesystem and saves them as the host profile that later
+ * runs load. argv[0] is "tune".
+ */
+int fpp_tune_main(int argc, const char *const *argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TUNE_H */
@@ -0,0 +1,718 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+/*
+ * Performance regression suite. Every case runs in a child process so
+ * that its peak RSS can be read with wait4(), the fastest of the timed
+ * runs is compared against a baseline JSON file. A missing baseline is
+ * recorded by the first run.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "context.h"
+#include "cipher.h"
+#include "pbkdf2.h"
+#include "random.h"
+#include "errcodes.h"
+#include "log.h"
+#include "args.h"
+
+#define FPP_PERF_NAME_SIZE      128
+#define FPP_PERF_MAX_CASES      128
+#define FPP_PERF_MAX_SIZES      8
+/* Every timed run processes at least this much data */
+#define FPP_PERF_MIN_BYTES      (16 * 1024 * 1024)
+#define FPP_PERF_WRAPPER_MAX    (1024 * 1024)
+#define FPP_PERF_SALT_SIZE      44
+#define FPP_PERF_PASSWD         "fpp perf pass phrase"
+/* Upper bounds of --repeat and --rss-tolerance */
+#define FPP_PERF_MAX_RUNS       10000
+#define FPP_PERF_MAX_RSS_TOLERANCE 1000
+
+typedef enum {
+    FPP_PERF_WRAPPER,
+    FPP_PERF_KDF,
+    FPP_PERF_FILE
+} fpp_perf_kind_t;
+
+typedef struct {
+    char name[FPP_PERF_NAME_SIZE];
+    fpp_perf_kind_t kind;
+    const fpp_cipher_t *cipher;
+    bool encrypt;
+    size_t size;
+} fpp_perf_case_t;
+
+typedef struct {
+    char name[FPP_PERF_NAME_SIZE];
+    char unit[16];
+    /* Units per second, negative if the case can't run on this build */
+    double rate;
+    long peak_rss_kb;
+} fpp_perf_result_t;
+
+typedef struct {
+    const char *baseline_fname;
+    const char *output_fname;
+    bool update;
+    double tolerance;
+    double rss_tolerance;
+    size_t wrapper_sizes[FPP_PERF_MAX_SIZES];
+    size_t nwrapper_sizes;
+    size_t file_sizes[FPP_PERF_MAX_SIZES];
+    size_t nfile_sizes;
+    uint32_t iter;
+    size_t warmup;
+    size_t repeat;
+} fpp_perf_config_t;
+
+static fpp_perf_config_t fpp_perf_config;
+
+
+static double
+fpp_perf_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/*
+ * Other load on the host only ever slows a run down, so the fastest
+ * run is the most stable figure to compare between runs.
+ */
+static double
+fpp_perf_fastest(const double *samples, size_t n)
+{
+    double min = samples[0];
+    size_t i;
+
+    for (i = 1; i < n; ++i) {
+        if (samples[i] < min) {
+            min = samples[i];
+        }
+    }
+    return min;
+}
+
+static double
+fpp_perf_wrapper(const fpp_perf_case_t *pc)
+{
+    const fpp_cipher_t *cipher = pc->cipher;
+    uint8_t key[EVP_MAX_KEY_LENGTH];
+    uint8_t iv[EVP_MAX_IV_LENGTH];
+    uint8_t *plain, *encrypted, *out;
+    uint32_t enc_len, out_len;
+    double *samples, start, rate;
+    size_t rounds, round, run;
+    fpp_err_t err;
+
+    plain = malloc(pc->size);
+    encrypted = malloc(pc->size + EVP_MAX_BLOCK_LENGTH);
+    out = malloc(pc->size + EVP_MAX_BLOCK_LENGTH);
+    samples = calloc(fpp_perf_config.repeat, sizeof(double));
+    if (!plain || !encrypted || !out || !samples) {
+        return 0;
+    }
+
+    if (fpp_random_bytes(plain, pc->size) != FPP_OK ||
+        fpp_random_bytes(key, sizeof(key)) != FPP_OK ||
+        fpp_random_bytes(iv, sizeof(iv)) != FPP_OK)
+    {
+        return 0;
+    }
+
+    /* Legacy ciphers need a provider the wrappers don't load */
+    if (cipher->encrypt(plain, pc->size, encrypted, &enc_len, key, iv)
+        != FPP_OK)
+    {
+        return -1;
+    }
+
+    rounds = (FPP_PERF_MIN_BYTES + pc->size - 1) / pc->size;
+
+    for (run = 0; run < fpp_perf_config.warmup + fpp_perf_config.repeat;
+        ++run)
+    {
+        start = fpp_perf_now();
+        for (round = 0; round < rounds; ++round) {
+            if (pc->encrypt) {
+                err = cipher->encrypt(plain, pc->size, out, &out_len, key,
+                    iv);
+            }
+            else {
+                err = cipher->decrypt(encrypted, enc_len, out, &out_len, key,
+                    iv);
+            }
+            if (err != FPP_OK) {
+                return 0;
+            }
+        }
+        if (run >= fpp_perf_config.warmup) {
+            samples[run - fpp_perf_config.warmup] = fpp_perf_now() - start;
+        }
+    }
+
+    rate = (double) pc->size * rounds
+        / fpp_perf_fastest(samples, fpp_perf_config.repeat);
+
+    free(plain);
+    free(encrypted);
+    free(out);
+    free(samples);
+    return rate;
+}
+
+static double
+fpp_perf_kdf(const fpp_perf_case_t *pc)
+{
+    uint8_t salt[FPP_PERF_SALT_SIZE];
+    uint8_t key[EVP_MAX_KEY_LENGTH];
+    double *samples, start, rate;
+    size_t run;
+
+    (void) pc;
+
+    samples = calloc(fpp_perf_config.repeat, sizeof(double));
+    if (!samples || fpp_random_bytes(salt, sizeof(salt)) != FPP_OK) {
+        return 0;
+    }
+
+    for (run = 0; run < fpp_perf_config.warmup + fpp_perf_config.repeat;
+        ++run)
+    {
+        start = fpp_perf_now();
+        if (fpp_pkcs5_pbkdf2_hmac_sha512(FPP_PERF_PASSWD,
+            sizeof(FPP_PERF_PASSWD) - 1, salt, sizeof(salt),
+            fpp_perf_config.iter, key, sizeof(key)) != FPP_OK)
+        {
+            return 0;
+        }
+        if (run >= fpp_perf_config.warmup) {
+            samples[run - fpp_perf_config.warmup] = fpp_perf_now() - start;
+        }
+    }
+
+    rate = fpp_perf_config.iter
+        / fpp_perf_fastest(samples, fpp_perf_config.repeat);
+
+    free(samples);
+    return rate;
+}
+
+static fpp_err_t
+fpp_perf_write_input(const char *fname, size_t size)
+{
+    static uint8_t data[FPP_DEFAULT_CHUNK_SIZE];
+    size_t pos, n;
+    FILE *fd;
+
+    fd = fopen(fname, "wb");
+    if (!fd) {
+        return FPP_FAILURE;
+    }
+
+    for (pos = 0; pos < size; pos += n) {
+        n = size - pos < sizeof(data) ? size - pos : sizeof(data);
+        if (fpp_random_bytes(data, n) != FPP_OK ||
+            fwrite(data, 1, n, fd) != n)
+        {
+            fclose(fd);
+            return FPP_FAILURE;
+        }
+    }
+
+    return fclose(fd) == 0 ? FPP_OK : FPP_FAILURE;
+}
+
+/* The key derivation runs a single iteration, it has its own case */
+static double
+fpp_perf_file(const fpp_perf_case_t *pc)
+{
+    char in_fname[32], enc_fname[48], dec_fname[48];
+    fpp_crypto_params_t params;
+    fpp_ctx_config_t config;
+    fpp_ctx_t *ctx;
+    double *samples, start, rate = 0;
+    size_t run;
+    fpp_err_t err;
+
+    snprintf(in_fname, sizeof(in_fname), "fpp-perf-%ld.bin", (long) getpid());
+    snprintf(enc_fname, sizeof(enc_fname), "%s.fpp", in_fname);
+    snprintf(dec_fname, sizeof(dec_fname), "%s.out", in_fname);
+
+    fpp_ctx_config_init(&config);
+    config.algo_name = pc->cipher->name;
+    config.iter = 1;
+    config.nthreads = 1;
+
+    ctx = fpp_ctx_create(&config);
+    samples = calloc(fpp_perf_config.repeat, sizeof(double));
+    if (!ctx || !samples) {
+        return 0;
+    }
+
+    memset(&params, 0, sizeof(params));
+    params.text_passwd = FPP_PERF_PASSWD;
+    params.iter = 1;
+
+    if (fpp_perf_write_input(in_fname, pc->size) != FPP_OK) {
+        goto failed;
+    }
+
+    if (!pc->encrypt) {
+        params.in_fname = in_fname;
+        params.out_fname = enc_fname;
+        params.algo_name = pc->cipher->name;
+        if (fpp_ctx_encrypt_file(ctx, &params) != FPP_OK) {
+            goto failed;
+        }
+        params.in_fname = enc_fname;
+        params.out_fname = dec_fname;
+        params.algo_name = NULL;
+    }
+    else {
+        params.in_fname = in_fname;
+        params.out_fname = enc_fname;
+        params.algo_name = pc->cipher->name;
+    }
+
+    for (run = 0; run < fpp_perf_config.warmup + fpp_perf_config.repeat;
+        ++run)
+    {
+        remove(params.out_fname);
+
+        start = fpp_perf_now();
+        if (pc->encrypt) {
+            err = fpp_ctx_encrypt_file(ctx, &params);
+        }
+        else {
+            err = fpp_ctx_decrypt_file(ctx, &params);
+        }
+        if (err != FPP_OK) {
+            goto failed;
+        }
+        if (run >= fpp_perf_config.warmup) {
+            samples[run - fpp_perf_config.warmup] = fpp_perf_now() - start;
+        }
+    }
+
+    rate = (double) pc->size / fpp_perf_fastest(samples,
+        fpp_perf_config.repeat);
+
+failed:
+    remove(in_fname);
+    remove(enc_fname);
+    remove(dec_fname);
+    fpp_ctx_destroy(ctx);
+    free(samples);
+    return rate;
+}
+
+static fpp_err_t
+fpp_perf_run_case(const fpp_perf_case_t *pc, fpp_perf_result_t *result)
+{
+    struct rusage usage;
+    double rate = 0;
+    ssize_t n;
+    pid_t pid;
+    int fds[2];
+    int status;
+
+    strcpy(result->name, pc->name);
+    strcpy(result->unit, pc->kind == FPP_PERF_KDF ? "iter/s" : "B/s");
+
+    if (pipe(fds) != 0) {
+        return FPP_FAILURE;
+    }
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return FPP_FAILURE;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        switch (pc->kind) {
+        case FPP_PERF_WRAPPER:
+            rate = fpp_perf_wrapper(pc);
+            break;
+        case FPP_PERF_KDF:
+            rate = fpp_perf_kdf(pc);
+            break;
+        case FPP_PERF_FILE:
+            rate = fpp_perf_file(pc);
+            break;
+        }
+        n = write(fds[1], &rate, sizeof(rate));
+        _exit(n == sizeof(rate) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    n = read(fds[0], &rate, sizeof(rate));
+    close(fds[0]);
+
+    if (wait4(pid, &status, 0, &usage) == -1 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0 || n != sizeof(rate) || rate == 0)
+    {
+        return FPP_FAILURE;
+    }
+
+    result->rate = rate;
+    result->peak_rss_kb = usage.ru_maxrss;
+    return FPP_OK;
+}
+
+static size_t
+fpp_perf_build_cases(fpp_perf_case_t *cases)
+{
+    const fpp_perf_config_t *config = &fpp_perf_config;
+    const fpp_cipher_t *cipher;
+    fpp_perf_case_t *pc;
+    size_t n = 0, i, j;
+    int enc;
+
+    for (i = 0; i < fpp_cipher_count(); ++i) {
+        cipher = fpp_cipher_at(i);
+        for (j = 0; j < config->nwrapper_sizes; ++j) {
+            for (enc = 1; enc >= 0; --enc) {
+                pc = &cases[n++];
+                pc->kind = FPP_PERF_WRAPPER;
+                pc->cipher = cipher;
+                pc->encrypt = enc;
+                pc->size = config->wrapper_sizes[j];
+                snprintf(pc->name, sizeof(pc->name), "wrapper/%s/%s/%zu",
+                    cipher->name, enc ? "encrypt" : "decrypt", pc->size);
+            }
+        }
+    }
+
+    pc = &cases[n++];
+    pc->kind = FPP_PERF_KDF;
+    snprintf(pc->name, sizeof(pc->name), "kdf/pbkdf2-hmac-sha512/%u",
+        (unsigned int) config->iter);
+
+    /* The default cipher stands for the file pipeline */
+    for (j = 0; j < config->nfile_sizes; ++j) {
+        for (enc = 1; enc >= 0; --enc) {
+            pc = &cases[n++];
+            pc->kind = FPP_PERF_FILE;
+            pc->cipher = fpp_cipher_by_name(FPP_DEFAULT_ALGO);
+            pc->encrypt = enc;
+            pc->size = config->file_sizes[j];
+            snprintf(pc->name, sizeof(pc->name), "file/%s/%s/%zu",
+                pc->cipher->name, enc ? "encrypt" : "decrypt", pc->size);
+        }
+    }
+
+    return n;
+}
+
+static fpp_err_t
+fpp_perf_write_results(const char *fname, const fpp_perf_result_t *results,
+    size_t n)
+{
+    const fpp_perf_result_t *r;
+    FILE *fd;
+    size_t i;
+
+    fd = fopen(fname, "w");
+    if (!fd) {
+        fpp_log_error(fpp_get_os_errno(), "Failed to open \"%s\"", fname);
+        return FPP_FAILURE;
+    }
+
+    fprintf(fd, "{\n  \"results\": [\n");
+    for (i = 0; i < n; ++i) {
+        r = &results[i];
+        fprintf(fd, "    {\"name\": \"%s\", \"unit\": \"%s\", \"rate\": %.6e, "
+            "\"peak_rss_kb\": %ld}%s\n", r->name, r->unit, r->rate,
+            r->peak_rss_kb, i + 1 < n ? "," : "");
+    }
+    fprintf(fd, "  ]\n}\n");
+
+    if (fclose(fd) != 0) {
+        fpp_log_error(fpp_get_os_errno(), "Failed to write \"%s\"", fname);
+        return FPP_FAILURE;
+    }
+    return FPP_OK;
+}
+
+/* Reads back what fpp_perf_write_results() wrote, one result per line */
+static size_t
+fpp_perf_read_results(const char *fname, fpp_perf_result_t *results,
+    size_t max)
+{
+    fpp_perf_result_t *r;
+    char line[512];
+    FILE *fd;
+    size_t n = 0;
+
+    fd = fopen(fname, "r");
+    if (!fd) {
+        return 0;
+    }
+
+    while (n < max && fgets(line, sizeof(line), fd)) {
+        r = &results[n];
+        if (sscanf(line, " {\"name\": \"%127[^\"]\", \"unit\": \"%15[^\"]\", "
+            "\"rate\": %lf, \"peak_rss_kb\": %ld", r->name, r->unit,
+            &r->rate, &r->peak_rss_kb) == 4)
+        {
+            n++;
+        }
+    }
+
+    fclose(fd);
+    return n;
+}
+
+static const fpp_perf_result_t *
+fpp_perf_find(const fpp_perf_result_t *results, size_t n, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        if (strcmp(results[i].name, name) == 0) {
+            return &results[i];
+        }
+    }
+    return NULL;
+}
+
+static void
+fpp_perf_show_help(void)
+{
+    fprintf(stdout,
+        "Usage: fpp_perf [options...]\n\n"
+        "Options:\n"
+        "  -h, --help                     Displays this message.\n"
+        "  --baseline <file>              Baseline results (perf-baseline.json).\n"
+        "  --update                       Replace the baseline with this run.\n"
+        "  --output <file>                Also write this run's results.\n"
+        "  --tolerance <pct>              Allowed throughput drop (10).\n"
+        "  --rss-tolerance <pct>          Allowed peak RSS growth (10).\n"
+        "  --wrapper-sizes <list>         Cipher wrapper sizes (4K,1M).\n"
+        "  --file-sizes <list>            File sizes (4K,1M,1G).\n"
+        "  --iter <n>                     KDF iterations (%d).\n"
+        "  --repeat <n>                   Timed runs per case (5).\n",
+        FPP_DEFAULT_ITER);
+}
+
+static fpp_err_t
+fpp_perf_parse_argv(int argc, const char *const *argv)
+{
+    fpp_perf_config_t *config = &fpp_perf_config;
+    const char *opt, *arg;
+    long long n;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        opt = argv[i];
+
+        if (strcmp(opt, "-h") == 0 || strcmp(opt, "--help") == 0) {
+            fpp_perf_show_help();
+            exit(0);
+        }
+        if (strcmp(opt, "--update") == 0) {
+            config->update = true;
+            continue;
+        }
+
+        arg = argv[++i];
+        if (!arg) {
+            fprintf(stderr, "fpp_perf: missing argment for option -- \"%s\"\n",
+                opt);
+            return FPP_FAILURE;
+        }
+
+        if (strcmp(opt, "--baseline") == 0) {
+            config->baseline_fname = arg;
+        }
+        else if (strcmp(opt, "--output") == 0) {
+            config->output_fname = arg;
+        }
+        else if (strcmp(opt, "--tolerance") == 0) {
+            if (fpp_parse_int(arg, 0, 100, &n) != FPP_OK) {
+                goto invalid_argment;
+            }
+            config->tolerance = (double) n / 100;
+        }
+        else if (strcmp(opt, "--rss-tolerance") == 0) {
+            if (fpp_parse_int(arg, 0, FPP_PERF_MAX_RSS_TOLERANCE, &n)
+                != FPP_OK)
+            {
+                goto invalid_argment;
+            }
+            config->rss_tolerance = (double) n / 100;
+        }
+        else if (strcmp(opt, "--wrapper-sizes") == 0) {
+            if (fpp_parse_size_list(arg, config->wrapper_sizes,
+                FPP_PERF_MAX_SIZES, &config->nwrapper_sizes) != FPP_OK ||
+                config->wrapper_sizes[config->nwrapper_sizes - 1]
+                > FPP_PERF_WRAPPER_MAX)
+            {
+                goto invalid_argment;
+            }
+        }
+        else if (strcmp(opt, "--file-sizes") == 0) {
+            if (fpp_parse_size_list(arg, config->file_sizes,
+                FPP_PERF_MAX_SIZES, &config->nfile_sizes) != FPP_OK)
+            {
+                goto invalid_argment;
+            }
+        }
+        else if (strcmp(opt, "--iter") == 0) {
+            if (fpp_parse_int(arg, 1, UINT32_MAX, &n) != FPP_OK) {
+                goto invalid_argment;
+            }
+            config->iter = (uint32_t) n;
+        }
+        else if (strcmp(opt, "--repeat") == 0) {
+            if (fpp_parse_int(arg, 1, FPP_PERF_MAX_RUNS, &n) != FPP_OK) {
+                goto invalid_argment;
+            }
+            config->repeat = (size_t) n;
+        }
+        else {
+            fprintf(stderr, "fpp_perf: invalid option -- \"%s\"\n", opt);
+            return FPP_FAILURE;
+        }
+    }
+
+    if (config->iter == 0 || config->repeat == 0) {
+        fprintf(stderr, "fpp_perf: iterations and repetitions must be "
+            "positive\n");
+        return FPP_FAILURE;
+    }
+
+    return FPP_OK;
+
+invalid_argment:
+    fprintf(stderr, "fpp_perf: invalid argment for option -- \"%s\"\n",
+        argv[i - 1]);
+    return FPP_FAILURE;
+}
+
+int
+main(int argc, const char *const *argv)
+{
+    static fpp_perf_case_t cases[FPP_PERF_MAX_CASES];
+    static fpp_perf_result_t results[FPP_PERF_MAX_CASES];
+    static fpp_perf_result_t baseline[FPP_PERF_MAX_CASES];
+    fpp_perf_config_t *config = &fpp_perf_config;
+    const fpp_perf_result_t *base;
+    fpp_perf_result_t *r;
+    size_t ncases, nbaseline, i;
+    double rate_delta, rss_delta;
+    const char *status;
+    bool failed = false;
+
+    config->baseline_fname = "perf-baseline.json";
+    config->tolerance = 0.10;
+    config->rss_tolerance = 0.10;
+    config->wrapper_sizes[0] = 4 * 1024;
+    config->wrapper_sizes[1] = 1024 * 1024;
+    config->nwrapper_sizes = 2;
+    config->file_sizes[0] = 4 * 1024;
+    config->file_sizes[1] = 1024 * 1024;
+    config->file_sizes[2] = 1024 * 1024 * 1024;
+    config->nfile_sizes = 3;
+    config->iter = FPP_DEFAULT_ITER;
+    config->warmup = 1;
+    config->repeat = 5;
+
+    if (fpp_perf_parse_argv(argc, argv) != FPP_OK) {
+        fpp_perf_show_help();
+        return 1;
+    }
+
+    ncases = fpp_perf_build_cases(cases);
+
+    nbaseline = 0;
+    if (!config->update) {
+        nbaseline = fpp_perf_read_results(config->baseline_fname, baseline,
+            FPP_PERF_MAX_CASES);
+    }
+
+    fprintf(stdout, "%-36s %14s %14s %8s %10s %10s  %s\n", "case", "rate",
+        "baseline", "delta", "rss KB", "baseline", "status");
+
+    for (i = 0; i < ncases; ++i) {
+        r = &results[i];
+        if (fpp_perf_run_case(&cases[i], r) != FPP_OK) {
+            fprintf(stdout, "%-36s %14s %14s %8s %10s %10s  FAILED\n",
+                cases[i].name, "-", "-", "-", "-", "-");
+            failed = true;
+            continue;
+        }
+
+        if (r->rate < 0) {
+            fprintf(stdout, "%-36s %14s %14s %8s %10s %10s  unavailable\n",
+                r->name, "-", "-", "-", "-", "-");
+            continue;
+        }
+
+        base = fpp_perf_find(baseline, nbaseline, r->name);
+        if (!base || base->rate <= 0) {
+            fprintf(stdout, "%-36s %14.4g %14s %8s %10ld %10s  new\n",
+                r->name, r->rate, "-", "-", r->peak_rss_kb, "-");
+            continue;
+        }
+
+        rate_delta = r->rate / base->rate - 1;
+        rss_delta = (double) r->peak_rss_kb / base->peak_rss_kb - 1;
+
+        status = "ok";
+        if (rate_delta < -config->tolerance) {
+            status = "SLOWER";
+            failed = true;
+        }
+        else if (rss_delta > config->rss_tolerance) {
+            status = "LARGER";
+            failed = true;
+        }
+
+        fprintf(stdout, "%-36s %14.4g %14.4g %+7.1f%% %10ld %10ld  %s\n",
+            r->name, r->rate, base->rate, rate_delta * 100, r->peak_rss_kb,
+            base->peak_rss_kb, status);
+    }
+
+    if (config->output_fname) {
+        if (fpp_perf_write_results(config->output_fname, results, ncases)
+            != FPP_OK)
+        {
+            return 1;
+        }
+    }
+
+    if (nbaseline == 0) {
+        if (failed) {
+            return 1;
+        }
+        fprintf(stdout, "\nRecording baseline \"%s\"\n",
+            config->baseline_fname);
+        return fpp_perf_write_results(config->baseline_fname, results,
+            ncases) == FPP_OK ? 0 : 1;
+    }
+
+    return failed ? 1 : 0;
+}
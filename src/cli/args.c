@@ -0,0 +1,113 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "args.h"
+
+fpp_err_t
+fpp_parse_int(const char *str, long long min, long long max,
+    long long *value)
+{
+    char *end;
+    long long n;
+
+    errno = 0;
+    n = strtoll(str, &end, 10);
+    if (end == str || *end != '\0' || errno == ERANGE
+        || n < min || n > max)
+    {
+        return FPP_ERR_IO_ARGV;
+    }
+
+    *value = n;
+    return FPP_OK;
+}
+
+/* A size and its K/M/G suffix, *end is what follows them */
+static fpp_err_t
+fpp_parse_size_prefix(const char *str, uint64_t *size, const char **end)
+{
+    char *p;
+    unsigned long long n;
+    int shift = 0;
+
+    /* strtoull() would take "-1" as 2^64 - 1 */
+    if (*str < '0' || *str > '9') {
+        return FPP_ERR_IO_ARGV;
+    }
+    errno = 0;
+    n = strtoull(str, &p, 10);
+    if (errno == ERANGE) {
+        return FPP_ERR_IO_ARGV;
+    }
+
+    switch (*p) {
+    case 'G': case 'g':
+        shift++;
+        /* fall through */
+    case 'M': case 'm':
+        shift++;
+        /* fall through */
+    case 'K': case 'k':
+        shift++;
+        p++;
+        break;
+    default:
+        break;
+    }
+
+    while (shift--) {
+        if (n > UINT64_MAX / 1024) {
+            return FPP_ERR_IO_ARGV;
+        }
+        n *= 1024;
+    }
+
+    *size = (uint64_t) n;
+    *end = p;
+    return FPP_OK;
+}
+
+fpp_err_t
+fpp_parse_size(const char *str, uint64_t *size)
+{
+    const char *end;
+    uint64_t n;
+
+    if (fpp_parse_size_prefix(str, &n, &end) != FPP_OK || *end != '\0') {
+        return FPP_ERR_IO_ARGV;
+    }
+
+    *size = n;
+    return FPP_OK;
+}
+
+fpp_err_t
+fpp_parse_size_list(const char *str, size_t *list, size_t max, size_t *n)
+{
+    const char *end;
+    uint64_t size;
+
+    *n = 0;
+    while (*str) {
+        if (*n == max
+            || fpp_parse_size_prefix(str, &size, &end) != FPP_OK
+            || (*end != '\0' && *end != ',')
+            || size == 0 || size > SIZE_MAX)
+        {
+            return FPP_ERR_IO_ARGV;
+        }
+
+        list[(*n)++] = (size_t) size;
+        str = (*end == ',') ? end + 1 : end;
+    }
+
+    return *n ? FPP_OK : FPP_ERR_IO_ARGV;
+}
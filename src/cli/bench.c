@@ -0,0 +1,942 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "bench.h"
+#include "context.h"
+#include "cipher.h"
+#include "aes256.h"
+#include "thread_pool.h"
+#include "pbkdf2.h"
+#include "random.h"
+#include "memory.h"
+#include "errcodes.h"
+#include "log.h"
+#include "version.h"
+#include "args.h"
+
+#define FPP_BENCH_MAX_LIST      16
+#define FPP_BENCH_MAX_PATHLEN   4096
+/* Input file name with an output suffix */
+#define FPP_BENCH_NAME_SIZE     (FPP_BENCH_MAX_PATHLEN + 32)
+/* Every measured run processes at least this much data */
+#define FPP_BENCH_MIN_BYTES     (16 * 1024 * 1024)
+#define FPP_BENCH_KDF_SALT_SIZE 44
+/* Upper bound of --repeat and --warmup */
+#define FPP_BENCH_MAX_RUNS      10000
+
+typedef struct {
+    const char *algo_name;
+    uint32_t iter;
+    size_t sizes[FPP_BENCH_MAX_LIST];
+    size_t nsizes;
+    size_t threads[FPP_BENCH_MAX_LIST];
+    size_t nthreads;
+    size_t repeat;
+    size_t warmup;
+    const char *json_fname;
+    const char *dir;
+} fpp_bench_config_t;
+
+typedef struct {
+    /* "cipher" or "file" */
+    const char *kind;
+    const char *algo_name;
+    const char *op;
+    size_t size;
+    size_t threads;
+    double seconds;
+    double gbps;
+    /* Reference cycles of the time stamp counter, 0 if unavailable */
+    double cpb;
+    /* Per-phase counters of the measured file runs */
+    bool has_stats;
+    fpp_stats_t stats;
+} fpp_bench_result_t;
+
+typedef struct {
+    double seconds;
+    uint64_t cycles;
+} fpp_bench_sample_t;
+
+typedef struct {
+    fpp_bench_config_t config;
+    fpp_bench_result_t *results;
+    size_t nresults;
+    size_t results_cap;
+    double kdf_ms;
+    /* Per key, FPP_PBKDF2_LANES keys derived in one batch */
+    double kdf_batch_ms;
+} fpp_bench_t;
+
+
+static double
+fpp_bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static uint64_t
+fpp_bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static int
+fpp_bench_sample_cmp(const void *a, const void *b)
+{
+    const fpp_bench_sample_t *x = a;
+    const fpp_bench_sample_t *y = b;
+
+    return (x->seconds > y->seconds) - (x->seconds < y->seconds);
+}
+
+/* Sorts the samples, the median is the robust choice for noisy hosts */
+static fpp_bench_sample_t
+fpp_bench_median(fpp_bench_sample_t *samples, size_t n)
+{
+    qsort(samples, n, sizeof(fpp_bench_sample_t), fpp_bench_sample_cmp);
+    return samples[n / 2];
+}
+
+static fpp_err_t
+fpp_bench_add_result(fpp_bench_t *bench, const fpp_bench_result_t *result)
+{
+    fpp_bench_result_t *results;
+    size_t cap;
+
+    if (bench->nresults == bench->results_cap) {
+        cap = bench->results_cap ? bench->results_cap * 2 : 32;
+        results = realloc(bench->results, cap * sizeof(fpp_bench_result_t));
+        if (!results) {
+            return FPP_FAILURE;
+        }
+        bench->results = results;
+        bench->results_cap = cap;
+    }
+
+    bench->results[bench->nresults++] = *result;
+    return FPP_OK;
+}
+
+static void
+fpp_bench_show_help(void)
+{
+    fprintf(stdout,
+        "Usage: fpp bench [options...]\n\n"
+        "Options:\n"
+        "  -h, --help                     Displays this message.\n"
+        "  -a, --algorithm <name>         Only measure one algorithm.\n"
+        "  -i, --iter <n>                 Iterations for the KDF (%d).\n"
+        "      --sizes <list>             Data sizes (4K,1M,64M).\n"
+        "      --threads <list>           Files in flight (1,<ncpu>).\n"
+        "      --repeat <n>               Measured runs (5).\n"
+        "      --warmup <n>               Discarded runs (1).\n"
+        "      --json <file>              Write results as JSON, - for\n"
+        "                                 stdout.\n"
+        "      --dir <dir>                Directory for temporary files.\n",
+        FPP_DEFAULT_ITER);
+}
+
+static bool
+fpp_bench_is_option(const char *opt)
+{
+    static const char *const options[] = {
+        "-a", "--algorithm", "-i", "--iter", "--sizes", "--threads",
+        "--repeat", "--warmup", "--json", "--dir"
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(options) / sizeof(options[0]); ++i) {
+        if (strcmp(opt, options[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static fpp_err_t
+fpp_bench_parse_argv(fpp_bench_config_t *config, int argc,
+    const char *const *argv)
+{
+    const fpp_cipher_t *cipher;
+    const char *opt, *arg;
+    long long n;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        opt = argv[i];
+
+        if (strcmp(opt, "-h") == 0 || strcmp(opt, "--help") == 0) {
+            fpp_bench_show_help();
+            exit(0);
+        }
+
+        if (!fpp_bench_is_option(opt)) {
+            fprintf(stderr, "fpp: invalid option -- \"%s\"\n", opt);
+            return FPP_FAILURE;
+        }
+
+        arg = argv[i + 1];
+        if (!arg) {
+            fprintf(stderr, "fpp: missing argment for option -- \"%s\"\n",
+                opt);
+            return FPP_FAILURE;
+        }
+        ++i;
+
+        if (strcmp(opt, "-a") == 0 || strcmp(opt, "--algorithm") == 0) {
+            cipher = fpp_cipher_by_name(arg);
+            if (!cipher) {
+                fprintf(stderr, "fpp: unknown algorithm -- \"%s\"\n", arg);
+                return FPP_FAILURE;
+            }
+            /* "auto" is resolved here, the results name the cipher */
+            config->algo_name = cipher->name;
+        }
+        else if (strcmp(opt, "-i") == 0 || strcmp(opt, "--iter") == 0) {
+            if (fpp_parse_int(arg, 1, UINT32_MAX, &n) != FPP_OK) {
+                goto invalid_argment;
+            }
+            config->iter = (uint32_t) n;
+        }
+        else if (strcmp(opt, "--sizes") == 0) {
+            if (fpp_parse_size_list(arg, config->sizes, FPP_BENCH_MAX_LIST,
+                &config->nsizes) != FPP_OK)
+            {
+                goto invalid_argment;
+            }
+        }
+        else if (strcmp(opt, "--threads") == 0) {
+            if (fpp_parse_size_list(arg, config->threads, FPP_BENCH_MAX_LIST,
+                &config->nthreads) != FPP_OK)
+            {
+                goto invalid_argment;
+            }
+        }
+        else if (strcmp(opt, "--repeat") == 0) {
+            if (fpp_parse_int(arg, 1, FPP_BENCH_MAX_RUNS, &n) != FPP_OK) {
+                goto invalid_argment;
+            }
+            config->repeat = (size_t) n;
+        }
+        else if (strcmp(opt, "--warmup") == 0) {
+            if (fpp_parse_int(arg, 0, FPP_BENCH_MAX_RUNS, &n) != FPP_OK) {
+                goto invalid_argment;
+            }
+            config->warmup = (size_t) n;
+        }
+        else if (strcmp(opt, "--json") == 0) {
+            config->json_fname = arg;
+        }
+        else {
+            config->dir = arg;
+        }
+    }
+
+    if (config->iter == 0 || config->repeat == 0) {
+        fprintf(stderr, "fpp: iterations and repetitions must be positive\n");
+        return FPP_FAILURE;
+    }
+
+    return FPP_OK;
+
+invalid_argment:
+    fprintf(stderr, "fpp: invalid argment for option -- \"%s\"\n",
+        argv[i - 1]);
+    return FPP_FAILURE;
+}
+
+/*
+ * One pass over the data the way the file pipeline does it: the same
+ * EVP cipher object and chunk size, padding included.
+ */
+static fpp_err_t
+fpp_bench_cipher_pass(EVP_CIPHER_CTX *cipher_ctx, const EVP_CIPHER *evp_cipher,
+    int enc, const uint8_t *key, const uint8_t *iv, const uint8_t *in,
+    size_t size, uint8_t *out, size_t *out_size)
+{
+    size_t pos, n;
+    int len;
+
+    if (EVP_CipherInit_ex(cipher_ctx, evp_cipher, NULL, key, iv, enc) != 1) {
+        return FPP_FAILURE;
+    }
+
+    *out_size = 0;
+    for (pos = 0; pos < size; pos += n) {
+        n = size - pos;
+        if (n > FPP_DEFAULT_CHUNK_SIZE) {
+            n = FPP_DEFAULT_CHUNK_SIZE;
+        }
+        if (EVP_CipherUpdate(cipher_ctx, out + *out_size, &len, in + pos,
+            (int) n) != 1)
+        {
+            return FPP_FAILURE;
+        }
+        *out_size += len;
+    }
+
+    if (EVP_CipherFinal_ex(cipher_ctx, out + *out_size, &len) != 1) {
+        return FPP_FAILURE;
+    }
+    *out_size += len;
+
+    return FPP_OK;
+}
+
+static fpp_err_t
+fpp_bench_cipher(fpp_bench_t *bench, fpp_ctx_t *ctx,
+    const fpp_cipher_t *cipher, size_t size)
+{
+    const fpp_bench_config_t *config = &bench->config;
+    const EVP_CIPHER *evp_cipher;
+    EVP_CIPHER_CTX *cipher_ctx = NULL;
+    uint8_t key[EVP_MAX_KEY_LENGTH];
+    uint8_t iv[EVP_MAX_IV_LENGTH];
+    uint8_t *plain = NULL, *encrypted = NULL, *decrypted = NULL;
+    fpp_bench_sample_t *samples = NULL, median;
+    fpp_bench_result_t result;
+    size_t rounds, round, run, out_size, enc_size;
+    uint64_t cycles;
+    double start;
+    int enc;
+    fpp_err_t err = FPP_FAILURE;
+
+    memset(&result, 0, sizeof(result));
+
+    evp_cipher = fpp_ctx_get_evp_cipher(ctx, cipher);
+    if (!evp_cipher) {
+        fpp_log_message("Skipping %s, not provided by %s", cipher->name,
+            OpenSSL_version(OPENSSL_VERSION));
+        return FPP_OK;
+    }
+
+    cipher_ctx = EVP_CIPHER_CTX_new();
+    plain = malloc(size);
+    encrypted = malloc(size + EVP_MAX_BLOCK_LENGTH);
+    decrypted = malloc(size + EVP_MAX_BLOCK_LENGTH);
+    samples = calloc(config->repeat, sizeof(fpp_bench_sample_t));
+    if (!cipher_ctx || !plain || !encrypted || !decrypted || !samples) {
+        fpp_log_error(fpp_get_os_errno(), "Failed to allocate memory");
+        goto failed;
+    }
+
+    if (fpp_random_bytes(plain, size) != FPP_OK ||
+        fpp_random_bytes(key, sizeof(key)) != FPP_OK ||
+        fpp_random_bytes(iv, sizeof(iv)) != FPP_OK)
+    {
+        fpp_log_error(FPP_FAILURE, "Failed to generate test data");
+        goto failed;
+    }
+
+    /* Small sizes are repeated so that a run outlasts timer resolution */
+    rounds = (FPP_BENCH_MIN_BYTES + size - 1) / size;
+
+    if (fpp_bench_cipher_pass(cipher_ctx, evp_cipher, 1, key, iv, plain,
+        size, encrypted, &enc_size) != FPP_OK)
+    {
+        fpp_log_error(fpp_get_openssl_errno(), "%s failed", cipher->name);
+        goto failed;
+    }
+
+    for (enc = 1; enc >= 0; --enc) {
+        for (run = 0; run < config->warmup + config->repeat; ++run) {
+            start = fpp_bench_now();
+            cycles = fpp_bench_cycles();
+
+            for (round = 0; round < rounds; ++round) {
+                if (enc) {
+                    err = fpp_bench_cipher_pass(cipher_ctx, evp_cipher, 1,
+                        key, iv, plain, size, encrypted, &out_size);
+                }
+                else {
+                    err = fpp_bench_cipher_pass(cipher_ctx, evp_cipher, 0,
+                        key, iv, encrypted, enc_size, decrypted, &out_size);
+                }
+                if (err != FPP_OK) {
+                    fpp_log_error(fpp_get_openssl_errno(), "%s failed",
+                        cipher->name);
+                    goto failed;
+                }
+            }
+
+            if (run >= config->warmup) {
+                samples[run - config->warmup].cycles =
+                    fpp_bench_cycles() - cycles;
+                samples[run - config->warmup].seconds =
+                    fpp_bench_now() - start;
+            }
+        }
+
+        if (!enc && (out_size != size || memcmp(plain, decrypted, size))) {
+            fpp_log_error(FPP_FAILURE, "%s round trip mismatch",
+                cipher->name);
+            err = FPP_FAILURE;
+            goto failed;
+        }
+
+        median = fpp_bench_median(samples, config->repeat);
+
+        result.kind = "cipher";
+        result.algo_name = cipher->name;
+        result.op = enc ? "encrypt" : "decrypt";
+        result.size = size;
+        result.threads = 1;
+        result.seconds = median.seconds / rounds;
+        result.gbps = (double) size * rounds / median.seconds / 1e9;
+        result.cpb = (double) median.cycles / ((double) size * rounds);
+
+        if (fpp_bench_add_result(bench, &result) != FPP_OK) {
+            err = FPP_FAILURE;
+            goto failed;
+        }
+    }
+
+    err = FPP_OK;
+
+failed:
+    fpp_explicit_memzero(key, sizeof(key));
+    EVP_CIPHER_CTX_free(cipher_ctx);
+    free(plain);
+    free(encrypted);
+    free(decrypted);
+    free(samples);
+    return err;
+}
+
+static fpp_err_t
+fpp_bench_kdf(fpp_bench_t *bench)
+{
+    const fpp_bench_config_t *config = &bench->config;
+    static const char passwd[] = "fpp bench pass phrase";
+    uint8_t salt[FPP_BENCH_KDF_SALT_SIZE];
+    uint8_t key[FPP_KEYSIZE_AES256];
+    uint8_t keys[FPP_PBKDF2_LANES][FPP_KEYSIZE_AES256];
+    fpp_pbkdf2_params_t batch[FPP_PBKDF2_LANES];
+    fpp_bench_sample_t *samples;
+    fpp_bench_sample_t median;
+    size_t i, run;
+    double start;
+
+    samples = calloc(config->repeat, sizeof(fpp_bench_sample_t));
+    if (!samples) {
+        fpp_log_error(fpp_get_os_errno(), "Failed to allocate memory");
+        return FPP_FAILURE;
+    }
+
+    if (fpp_random_bytes(salt, sizeof(salt)) != FPP_OK) {
+        free(samples);
+        return FPP_FAILURE;
+    }
+
+    for (run = 0; run < config->warmup + config->repeat; ++run) {
+        start = fpp_bench_now();
+        if (fpp_pkcs5_pbkdf2_hmac_sha512(passwd, sizeof(passwd) - 1, salt,
+            sizeof(salt), config->iter, key, sizeof(key)) != FPP_OK)
+        {
+            fpp_log_error(FPP_FAILURE, "fpp_pkcs5_pbkdf2_hmac_sha512() failed");
+            free(samples);
+            return FPP_FAILURE;
+        }
+        if (run >= config->warmup) {
+            samples[run - config->warmup].seconds = fpp_bench_now() - start;
+        }
+    }
+
+    median = fpp_bench_median(samples, config->repeat);
+    bench->kdf_ms = median.seconds * 1e3;
+
+    /* Same password and salt in every lane, the work is the same */
+    for (i = 0; i < FPP_PBKDF2_LANES; ++i) {
+        batch[i].pass = passwd;
+        batch[i].passlen = sizeof(passwd) - 1;
+        batch[i].salt = salt;
+        batch[i].saltlen = sizeof(salt);
+        batch[i].out = keys[i];
+    }
+
+    for (run = 0; run < config->warmup + config->repeat; ++run) {
+        start = fpp_bench_now();
+        if (fpp_pkcs5_pbkdf2_hmac_sha512_batch(batch, FPP_PBKDF2_LANES,
+            config->iter, sizeof(key)) != FPP_OK)
+        {
+            fpp_log_error(FPP_FAILURE,
+                "fpp_pkcs5_pbkdf2_hmac_sha512_batch() failed");
+            free(samples);
+            return FPP_FAILURE;
+        }
+        if (run >= config->warmup) {
+            samples[run - config->warmup].seconds = fpp_bench_now() - start;
+        }
+    }
+
+    median = fpp_bench_median(samples, config->repeat);
+    bench->kdf_batch_ms = median.seconds * 1e3 / FPP_PBKDF2_LANES;
+
+    fpp_explicit_memzero(key, sizeof(key));
+    fpp_explicit_memzero(keys[0], sizeof(keys));
+    free(samples);
+    return FPP_OK;
+}
+
+static fpp_err_t
+fpp_bench_write_file(const char *fname, size_t size)
+{
+    uint8_t *data;
+    size_t pos, n;
+    FILE *fd;
+
+    data = malloc(FPP_DEFAULT_CHUNK_SIZE);
+    if (!data) {
+        return FPP_FAILURE;
+    }
+
+    fd = fopen(fname, "wb");
+    if (!fd) {
+        free(data);
+        return FPP_FAILURE;
+    }
+
+    for (pos = 0; pos < size; pos += n) {
+        n = size - pos;
+        if (n > FPP_DEFAULT_CHUNK_SIZE) {
+            n = FPP_DEFAULT_CHUNK_SIZE;
+        }
+        if (fpp_random_bytes(data, n) != FPP_OK ||
+            fwrite(data, 1, n, fd) != n)
+        {
+            fclose(fd);
+            free(data);
+            return FPP_FAILURE;
+        }
+    }
+
+    free(data);
+    return fclose(fd) == 0 ? FPP_OK : FPP_FAILURE;
+}
+
+/*
+ * nthreads files are processed at once through the batch API, every
+ * one of them reads the same input. The KDF runs a single iteration
+ * here, it is measured on its own.
+ */
+static fpp_err_t
+fpp_bench_file(fpp_bench_t *bench, const fpp_cipher_t *cipher, size_t size,
+    size_t nthreads, const char *in_fname)
+{
+    const fpp_bench_config_t *config = &bench->config;
+    fpp_ctx_config_t ctx_config;
+    fpp_ctx_t *ctx = NULL;
+    fpp_crypto_params_t *params = NULL;
+    fpp_bench_sample_t *samples = NULL, median;
+    fpp_bench_result_t result;
+    char *names = NULL;
+    char *enc_fname, *dec_fname;
+    size_t i, run;
+    double start, total;
+    int enc;
+    fpp_err_t err = FPP_FAILURE;
+
+    fpp_ctx_config_init(&ctx_config);
+    ctx_config.algo_name = cipher->name;
+    ctx_config.iter = 1;
+    ctx_config.nthreads = nthreads;
+    ctx_config.perf_counters = true;
+
+    memset(&result, 0, sizeof(result));
+
+    ctx = fpp_ctx_create(&ctx_config);
+    params = calloc(nthreads, sizeof(fpp_crypto_params_t));
+    names = calloc(nthreads, 2 * FPP_BENCH_NAME_SIZE);
+    samples = calloc(config->repeat, sizeof(fpp_bench_sample_t));
+    if (!ctx || !params || !names || !samples) {
+        fpp_log_error(FPP_FAILURE, "Failed to set up file benchmark");
+        goto failed;
+    }
+
+    for (enc = 1; enc >= 0; --enc) {
+        for (i = 0; i < nthreads; ++i) {
+            enc_fname = names + 2 * i * FPP_BENCH_NAME_SIZE;
+            dec_fname = enc_fname + FPP_BENCH_NAME_SIZE;
+            snprintf(enc_fname, FPP_BENCH_NAME_SIZE, "%s.%zu.fpp",
+                in_fname, i);
+            snprintf(dec_fname, FPP_BENCH_NAME_SIZE, "%s.%zu.out",
+                in_fname, i);
+
+            params[i].in_fname = enc ? in_fname : enc_fname;
+            params[i].out_fname = enc ? enc_fname : dec_fname;
+            params[i].header_fname = NULL;
+            params[i].text_passwd = "fpp bench pass phrase";
+            params[i].iter = 1;
+            params[i].algo_name = enc ? cipher->name : NULL;
+        }
+
+        for (run = 0; run < config->warmup + config->repeat; ++run) {
+            /* The last encryption run leaves its output for decryption */
+            for (i = 0; i < nthreads; ++i) {
+                remove(params[i].out_fname);
+            }
+            if (run == config->warmup) {
+                fpp_ctx_reset_stats(ctx);
+            }
+
+            start = fpp_bench_now();
+            if (enc) {
+                err = fpp_ctx_encrypt_files(ctx, params, nthreads, NULL);
+            }
+            else {
+                err = fpp_ctx_decrypt_files(ctx, params, nthreads, NULL);
+            }
+            if (err != FPP_OK) {
+                goto failed;
+            }
+            if (run >= config->warmup) {
+                samples[run - config->warmup].seconds =
+                    fpp_bench_now() - start;
+            }
+        }
+
+        median = fpp_bench_median(samples, config->repeat);
+        total = (double) size * nthreads;
+
+        result.kind = "file";
+        result.algo_name = cipher->name;
+        result.op = enc ? "encrypt" : "decrypt";
+        result.size = size;
+        result.threads = nthreads;
+        result.seconds = median.seconds;
+        result.gbps = total / median.seconds / 1e9;
+        result.cpb = 0;
+        result.has_stats = true;
+        fpp_ctx_get_stats(ctx, &result.stats);
+
+        if (fpp_bench_add_result(bench, &result) != FPP_OK) {
+            err = FPP_FAILURE;
+            goto failed;
+        }
+    }
+
+    err = FPP_OK;
+
+failed:
+    if (params) {
+        for (i = 0; i < nthreads; ++i) {
+            enc_fname = names + 2 * i * FPP_BENCH_NAME_SIZE;
+            remove(enc_fname);
+            remove(enc_fname + FPP_BENCH_NAME_SIZE);
+        }
+    }
+    fpp_ctx_destroy(ctx);
+    free(params);
+    free(names);
+    free(samples);
+    return err;
+}
+
+static double
+fpp_bench_ratio(uint64_t a, uint64_t b)
+{
+    return b ? (double) a / (double) b : 0;
+}
+
+/* Cycles per plaintext byte and IPC of every phase of the file runs */
+static void
+fpp_bench_print_phases(const fpp_bench_t *bench)
+{
+    const fpp_bench_result_t *r;
+    const fpp_phase_stats_t *ps;
+    unsigned int need = FPP_COUNTER_CYCLES | FPP_COUNTER_INSTRUCTIONS;
+    size_t i, phase;
+    bool header = false;
+
+    for (i = 0; i < bench->nresults; ++i) {
+        r = &bench->results[i];
+        if (!r->has_stats || (r->stats.counters & need) != need) {
+            continue;
+        }
+
+        if (!header) {
+            fprintf(stdout, "\n%-12s %-8s %12s %8s", "cycles/B:IPC", "op",
+                "size", "threads");
+            for (phase = 0; phase < FPP_PHASE_MAX; ++phase) {
+                fprintf(stdout, " %13s", fpp_phase_name(phase));
+            }
+            fprintf(stdout, "\n");
+            header = true;
+        }
+
+        fprintf(stdout, "%-12s %-8s %12zu %8zu", r->algo_name, r->op,
+            r->size, r->threads);
+        for (phase = 0; phase < FPP_PHASE_MAX; ++phase) {
+            ps = &r->stats.phases[phase];
+            fprintf(stdout, " %8.2f:%4.2f",
+                fpp_bench_ratio(ps->cycles, r->stats.bytes),
+                fpp_bench_ratio(ps->instructions, ps->cycles));
+        }
+        fprintf(stdout, "\n");
+    }
+
+    if (!header) {
+        fprintf(stdout, "\nHardware counters are not available, per-phase "
+            "cycles and IPC are skipped\n");
+    }
+}
+
+static void
+fpp_bench_print_table(const fpp_bench_t *bench)
+{
+    const fpp_bench_result_t *r;
+    size_t i;
+
+    fprintf(stdout, "%-12s %-8s %12s %8s %10s %10s\n",
+        "cipher", "op", "size", "", "GB/s", "cycles/B");
+    for (i = 0; i < bench->nresults; ++i) {
+        r = &bench->results[i];
+        if (strcmp(r->kind, "cipher") != 0) {
+            continue;
+        }
+        if (r->cpb > 0) {
+            fprintf(stdout, "%-12s %-8s %12zu %8s %10.3f %10.2f\n",
+                r->algo_name, r->op, r->size, "", r->gbps, r->cpb);
+        }
+        else {
+            fprintf(stdout, "%-12s %-8s %12zu %8s %10.3f %10s\n",
+                r->algo_name, r->op, r->size, "", r->gbps, "-");
+        }
+    }
+
+    fprintf(stdout, "\nPBKDF2-HMAC-SHA512, %u iterations: %.2f ms, "
+        "%.2f ms per key in batches of %d\n\n",
+        (unsigned int) bench->config.iter, bench->kdf_ms,
+        bench->kdf_batch_ms, FPP_PBKDF2_LANES);
+
+    fprintf(stdout, "%-12s %-8s %12s %8s %10s\n",
+        "file", "op", "size", "threads", "GB/s");
+    for (i = 0; i < bench->nresults; ++i) {
+        r = &bench->results[i];
+        if (strcmp(r->kind, "file") != 0) {
+            continue;
+        }
+        fprintf(stdout, "%-12s %-8s %12zu %8zu %10.3f\n",
+            r->algo_name, r->op, r->size, r->threads, r->gbps);
+    }
+
+    fpp_bench_print_phases(bench);
+}
+
+static void
+fpp_bench_write_phases(FILE *fd, const fpp_stats_t *stats)
+{
+    const fpp_phase_stats_t *ps;
+    size_t phase;
+
+    fprintf(fd, ", \"counters\": %u, \"phases\": {", stats->counters);
+    for (phase = 0; phase < FPP_PHASE_MAX; ++phase) {
+        ps = &stats->phases[phase];
+        fprintf(fd, "%s\"%s\": {\"cycles_per_byte\": %.3f, \"ipc\": %.3f, "
+            "\"cache_misses\": %llu, \"context_switches\": %llu}",
+            phase ? ", " : "", fpp_phase_name(phase),
+            fpp_bench_ratio(ps->cycles, stats->bytes),
+            fpp_bench_ratio(ps->instructions, ps->cycles),
+            (unsigned long long) ps->cache_misses,
+            (unsigned long long) ps->context_switches);
+    }
+    fprintf(fd, "}");
+}
+
+static fpp_err_t
+fpp_bench_write_json(const fpp_bench_t *bench, const char *fname)
+{
+    const fpp_bench_config_t *config = &bench->config;
+    const fpp_bench_result_t *r;
+    char host[256];
+    FILE *fd;
+    size_t i;
+    int rc;
+
+    if (strcmp(fname, "-") == 0) {
+        fd = stdout;
+    }
+    else {
+        fd = fopen(fname, "w");
+        if (!fd) {
+            fpp_log_error(fpp_get_os_errno(), "Failed to open \"%s\"", fname);
+            return FPP_FAILURE;
+        }
+    }
+
+    if (gethostname(host, sizeof(host)) != 0) {
+        strcpy(host, "unknown");
+    }
+    host[sizeof(host) - 1] = '\0';
+
+    fprintf(fd, "{\n");
+    fprintf(fd, "  \"version\": \"%s\",\n", FPP_VERSION_STR);
+    fprintf(fd, "  \"host\": \"%s\",\n", host);
+    fprintf(fd, "  \"ncpu\": %zu,\n", fpp_get_ncpu());
+    fprintf(fd, "  \"openssl\": \"%s\",\n", OpenSSL_version(OPENSSL_VERSION));
+    fprintf(fd, "  \"repeat\": %zu,\n", config->repeat);
+    fprintf(fd, "  \"warmup\": %zu,\n", config->warmup);
+    fprintf(fd, "  \"kdf\": {\"algorithm\": \"pbkdf2-hmac-sha512\", "
+        "\"iter\": %u, \"ms\": %.3f, \"batch_lanes\": %d, "
+        "\"batch_ms_per_key\": %.3f},\n", (unsigned int) config->iter,
+        bench->kdf_ms, FPP_PBKDF2_LANES, bench->kdf_batch_ms);
+    fprintf(fd, "  \"results\": [\n");
+
+    for (i = 0; i < bench->nresults; ++i) {
+        r = &bench->results[i];
+        fprintf(fd, "    {\"kind\": \"%s\", \"algorithm\": \"%s\", "
+            "\"op\": \"%s\", \"size\": %zu, \"threads\": %zu, "
+            "\"seconds\": %.9f, \"gbps\": %.4f, \"cycles_per_byte\": %.3f",
+            r->kind, r->algo_name, r->op, r->size, r->threads, r->seconds,
+            r->gbps, r->cpb);
+        if (r->has_stats) {
+            fpp_bench_write_phases(fd, &r->stats);
+        }
+        fprintf(fd, "}%s\n", i + 1 < bench->nresults ? "," : "");
+    }
+
+    fprintf(fd, "  ]\n}\n");
+
+    if (fd == stdout) {
+        return fflush(fd) == 0 ? FPP_OK : FPP_FAILURE;
+    }
+    rc = fclose(fd);
+    return rc == 0 ? FPP_OK : FPP_FAILURE;
+}
+
+int
+fpp_bench_main(int argc, const char *const *argv)
+{
+    static char in_fname[FPP_BENCH_MAX_PATHLEN];
+    fpp_bench_t bench;
+    fpp_bench_config_t *config = &bench.config;
+    const fpp_cipher_t *cipher;
+    fpp_ctx_t *ctx = NULL;
+    size_t i, j, k;
+    bool have_file = false;
+    fpp_err_t err = FPP_FAILURE;
+
+    memset(&bench, 0, sizeof(fpp_bench_t));
+    config->iter = FPP_DEFAULT_ITER;
+    config->sizes[0] = 4 * 1024;
+    config->sizes[1] = 1024 * 1024;
+    config->sizes[2] = 64 * 1024 * 1024;
+    config->nsizes = 3;
+    config->threads[0] = 1;
+    config->threads[1] = fpp_get_ncpu();
+    config->nthreads = config->threads[1] > 1 ? 2 : 1;
+    config->repeat = 5;
+    config->warmup = 1;
+    config->dir = getenv("TMPDIR");
+    if (!config->dir) {
+        config->dir = "/tmp";
+    }
+
+    if (fpp_bench_parse_argv(config, argc, argv) != FPP_OK) {
+        fpp_bench_show_help();
+        return 1;
+    }
+
+    ctx = fpp_ctx_create(NULL);
+    if (!ctx) {
+        fpp_log_error(FPP_FAILURE, "Failed to create context");
+        goto failed;
+    }
+
+    for (i = 0; i < fpp_cipher_count(); ++i) {
+        cipher = fpp_cipher_at(i);
+        if (config->algo_name && strcmp(config->algo_name, cipher->name)) {
+            continue;
+        }
+        for (j = 0; j < config->nsizes; ++j) {
+            if (fpp_bench_cipher(&bench, ctx, cipher, config->sizes[j])
+                != FPP_OK)
+            {
+                goto failed;
+            }
+        }
+    }
+
+    if (fpp_bench_kdf(&bench) != FPP_OK) {
+        goto failed;
+    }
+
+    for (j = 0; j < config->nsizes; ++j) {
+        snprintf(in_fname, sizeof(in_fname), "%s/fpp-bench-%ld-%zu.bin",
+            config->dir, (long) getpid(), config->sizes[j]);
+        if (fpp_bench_write_file(in_fname, config->sizes[j]) != FPP_OK) {
+            fpp_log_error(fpp_get_os_errno(), "Failed to create \"%s\"",
+                in_fname);
+            goto failed;
+        }
+        have_file = true;
+
+        for (i = 0; i < fpp_cipher_count(); ++i) {
+            cipher = fpp_cipher_at(i);
+            if (config->algo_name &&
+                strcmp(config->algo_name, cipher->name))
+            {
+                continue;
+            }
+            if (!fpp_ctx_get_evp_cipher(ctx, cipher)) {
+                continue;
+            }
+            for (k = 0; k < config->nthreads; ++k) {
+                if (fpp_bench_file(&bench, cipher, config->sizes[j],
+                    config->threads[k], in_fname) != FPP_OK)
+                {
+                    goto failed;
+                }
+            }
+        }
+
+        remove(in_fname);
+        have_file = false;
+    }
+
+    fpp_bench_print_table(&bench);
+
+    if (config->json_fname) {
+        if (strcmp(config->json_fname, "-") == 0) {
+            fprintf(stdout, "\n");
+        }
+        if (fpp_bench_write_json(&bench, config->json_fname) != FPP_OK) {
+            goto failed;
+        }
+    }
+
+    err = FPP_OK;
+
+failed:
+    if (have_file) {
+        remove(in_fname);
+    }
+    fpp_ctx_destroy(ctx);
+    free(bench.results);
+    return err == FPP_OK ? 0 : 1;
+}
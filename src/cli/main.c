@@ -11,28 +11,63 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
 #include <openssl/crypto.h>
 
 #include "encrypt_file.h"
+#include "context.h"
+#include "cipher.h"
+#include "cpu.h"
 #include "getpass.h"
 #include "memory.h"
 #include "errcodes.h"
 #include "log.h"
 #include "version.h"
+#include "bench.h"
+#include "tune.h"
+#include "profile.h"
+#include "merkle.h"
+#include "throttle.h"
+#include "args.h"
 
 #define FPP_MAX_PATHLEN  4096
+#define FPP_INDEX_PATHLEN  (FPP_MAX_PATHLEN + sizeof(FPP_MERKLE_INDEX_SUFFIX))
 
 static bool encrypt_mode;
 static bool decrypt_mode;
 static bool show_version;
 static bool show_help;
 static bool quiet_mode;
+static bool merkle_mode;
 
-static size_t iter = 50180;
+static size_t iter = FPP_DEFAULT_ITER;
+static bool iter_set;
+static int kdf_time;
+static const char *kdf_name;
+static const char *kdf_memory_str;
+static const char *kdf_max_memory_str;
+static int kdf_lanes;
 static const char *in_fname;
 static const char *out_fname;
 static const char *header_fname;
-static const char *algo_name = "aes256";
+static const char *algo_name = FPP_DEFAULT_ALGO;
+static const char *stats_fname;
+static const char *log_fname;
+static const char *check_fname;
+static const char *range_str;
+static const char *manifest_fname;
+/* Everything after --verify */
+static const char *const *verify_fnames;
+static size_t nverify;
+static const char *log_level_name = "info";
+static const char *rate_str;
+static const char *memory_str;
+static const char *ionice_str;
+static const char *profile_fname;
+static size_t nthreads;
+static const char *cpus_str;
+static int nice_incr;
 
 
 static fpp_err_t
@@ -41,6 +76,7 @@ fpp_parse_argv(size_t argc, const char *const *argv)
     size_t i, saved_index;
     const char *p;
     bool long_option;
+    long long n;
 
     for (i = 1; i < argc; ++i) {
 
@@ -68,8 +104,33 @@ fpp_parse_argv(size_t argc, const char *const *argv)
                 quiet_mode = true;
                 break;
 
+            case 'm':
+                merkle_mode = true;
+                break;
+
+            case 't':
+                goto verify;
+
+            case 'c':
+                if (argv[++i]) {
+                    check_fname = argv[i];
+                }
+                else {
+                    goto missing_argment;
+                }
+                break;
+
             case 'i':
-                iter = atoi(argv[i]);
+                if (argv[++i]) {
+                    if (fpp_parse_int(argv[i], 1, UINT32_MAX, &n) != FPP_OK) {
+                        goto invalid_argument;
+                    }
+                    iter = (size_t) n;
+                    iter_set = true;
+                }
+                else {
+                    goto missing_argment;
+                }
                 break;
 
             case 'e':
@@ -119,6 +180,15 @@ fpp_parse_argv(size_t argc, const char *const *argv)
                 }
                 break;
 
+            case 's':
+                if (argv[++i]) {
+                    stats_fname = argv[i];
+                }
+                else {
+                    goto missing_argment;
+                }
+                break;
+
             case '-':
                 long_option = true;
                 break;
@@ -149,6 +219,38 @@ fpp_parse_argv(size_t argc, const char *const *argv)
                 continue;
             }
 
+            if (strcmp(p, "merkle") == 0) {
+                merkle_mode = true;
+                p += sizeof("merkle") - 1;
+                continue;
+            }
+
+            if (strcmp(p, "verify") == 0) {
+                goto verify;
+            }
+
+            if (strcmp(p, "check") == 0) {
+                if (argv[++i]) {
+                    check_fname = argv[i];
+                    p += sizeof("check") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
+            if (strcmp(p, "range") == 0) {
+                if (argv[++i]) {
+                    range_str = argv[i];
+                    p += sizeof("range") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
             if (strcmp(p, "encrypt") == 0) {
                 if (argv[++i]) {
                     encrypt_mode = true;
@@ -206,9 +308,203 @@ fpp_parse_argv(size_t argc, const char *const *argv)
                 }
             }
 
+            if (strcmp(p, "stats") == 0) {
+                if (argv[++i]) {
+                    stats_fname = argv[i];
+                    p += sizeof("stats") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
+            if (strcmp(p, "manifest") == 0) {
+                if (argv[++i]) {
+                    manifest_fname = argv[i];
+                    p += sizeof("manifest") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
+            if (strcmp(p, "limit-rate") == 0) {
+                if (argv[++i]) {
+                    rate_str = argv[i];
+                    p += sizeof("limit-rate") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
+            if (strcmp(p, "memory-limit") == 0) {
+                if (argv[++i]) {
+                    memory_str = argv[i];
+                    p += sizeof("memory-limit") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
+            if (strcmp(p, "profile") == 0) {
+                if (argv[++i]) {
+                    profile_fname = argv[i];
+                    p += sizeof("profile") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
+            if (strcmp(p, "threads") == 0) {
+                if (argv[++i]) {
+                    if (fpp_parse_int(argv[i], 1, FPP_CPU_MAX, &n) != FPP_OK) {
+                        goto invalid_argument;
+                    }
+                    nthreads = (size_t) n;
+                    p += sizeof("threads") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
+            if (strcmp(p, "cpus") == 0) {
+                if (argv[++i]) {
+                    cpus_str = argv[i];
+                    p += sizeof("cpus") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
+            if (strcmp(p, "nice") == 0) {
+                if (argv[++i]) {
+                    if (fpp_parse_int(argv[i], -20, 19, &n) != FPP_OK) {
+                        goto invalid_argument;
+                    }
+                    nice_incr = (int) n;
+                    p += sizeof("nice") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
+            if (strcmp(p, "ionice") == 0) {
+                if (argv[++i]) {
+                    ionice_str = argv[i];
+                    p += sizeof("ionice") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
+            if (strcmp(p, "log-level") == 0) {
+                if (argv[++i]) {
+                    log_level_name = argv[i];
+                    p += sizeof("log-level") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
+            if (strcmp(p, "log") == 0) {
+                if (argv[++i]) {
+                    log_fname = argv[i];
+                    p += sizeof("log") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
+            if (strcmp(p, "kdf") == 0) {
+                if (argv[++i]) {
+                    kdf_name = argv[i];
+                    p += sizeof("kdf") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
+            if (strcmp(p, "kdf-memory") == 0) {
+                if (argv[++i]) {
+                    kdf_memory_str = argv[i];
+                    p += sizeof("kdf-memory") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
+            if (strcmp(p, "kdf-max-memory") == 0) {
+                if (argv[++i]) {
+                    kdf_max_memory_str = argv[i];
+                    p += sizeof("kdf-max-memory") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
+            if (strcmp(p, "kdf-lanes") == 0) {
+                if (argv[++i]) {
+                    if (fpp_parse_int(argv[i], 1, FPP_KDF_MAX_LANES, &n)
+                        != FPP_OK)
+                    {
+                        goto invalid_argument;
+                    }
+                    kdf_lanes = (int) n;
+                    p += sizeof("kdf-lanes") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
+            if (strcmp(p, "kdf-time") == 0) {
+                if (argv[++i]) {
+                    if (fpp_parse_int(argv[i], 1, INT_MAX, &n) != FPP_OK) {
+                        goto invalid_argument;
+                    }
+                    kdf_time = (int) n;
+                    p += sizeof("kdf-time") - 1;
+                    continue;
+                }
+                else {
+                    goto missing_argment;
+                }
+            }
+
             if (strcmp(p, "iter") == 0) {
                 if (argv[++i]) {
-                    iter = atoi(argv[i]);
+                    if (fpp_parse_int(argv[i], 1, UINT32_MAX, &n) != FPP_OK) {
+                        goto invalid_argument;
+                    }
+                    iter = (size_t) n;
+                    iter_set = true;
                     p += sizeof("iter") - 1;
                     continue;
                 }
@@ -223,24 +519,368 @@ fpp_parse_argv(size_t argc, const char *const *argv)
 
     return EXIT_SUCCESS;
 
+verify:
+    if (i + 1 == argc) {
+        goto missing_argment;
+    }
+    verify_fnames = &argv[i + 1];
+    nverify = argc - i - 1;
+    return EXIT_SUCCESS;
+
 invalid_option:
     fprintf(stderr, "fpp: invalid option -- \"%s\"\n", argv[saved_index]);
     return EXIT_FAILURE;
 
+invalid_argument:
+    fpp_log_error(FPP_ERR_IO_ARGV, "Invalid argument \"%s\" for option "
+        "\"%s\"", argv[i], argv[saved_index]);
+    return EXIT_FAILURE;
+
 missing_argment:
     fprintf(stderr, "fpp: missing argment for option -- \"%s\"\n",
         argv[saved_index]);
     return EXIT_FAILURE;
 }
 
+static fpp_err_t
+fpp_restrict_cpus(const char *cpus)
+{
+    fpp_cpu_topology_t *topo;
+    fpp_err_t err = FPP_FAILURE;
+
+    topo = malloc(sizeof(fpp_cpu_topology_t));
+    if (!topo) {
+        fpp_log_error(fpp_get_os_errno(), "Failed to allocate memory");
+        return FPP_FAILURE;
+    }
+
+    if (fpp_cpu_topology_init(topo, cpus) != FPP_OK) {
+        fpp_log_error(FPP_ERR_IO_ARGV,
+            "Invalid CPU list \"%s\", or none of them is available", cpus);
+    }
+    else if (fpp_cpu_restrict(topo) != FPP_OK) {
+        fpp_log_error(fpp_get_os_errno(), "Failed to restrict to CPUs \"%s\"",
+            cpus);
+    }
+    else {
+        err = FPP_OK;
+    }
+
+    free(topo);
+    return err;
+}
+
 static void
 show_version_info(void)
 {
+    fpp_cpu_topology_t *topo;
+    char features[128];
+
     fprintf(stdout, "fpp, version %s\n", FPP_VERSION_STR);
 #ifdef FPP_COMPILER
     fprintf(stdout, "   compiled %s on %s\n", FPP_BUILD_DATE, FPP_COMPILER);
 #endif
     fprintf(stdout, "   using %s\n", SSLeay_version(SSLEAY_VERSION));
+    fprintf(stdout, "   cpu features: %s\n",
+        fpp_cpu_features_str(fpp_cpu_features(), features, sizeof(features)));
+    fprintf(stdout, "   -a auto selects %s\n", fpp_cipher_select()->name);
+
+    topo = malloc(sizeof(fpp_cpu_topology_t));
+    if (topo && fpp_cpu_topology_init(topo, NULL) == FPP_OK) {
+        fprintf(stdout, "   %zu CPU(s) on %zu NUMA node(s)\n", topo->ncpus,
+            topo->nnodes);
+    }
+    free(topo);
+}
+
+static fpp_err_t
+fpp_start_log(const char *fname, const char *level_name)
+{
+    static const char *names[] = { "debug", "info", "warn", "error" };
+    fpp_log_config_t config;
+    size_t i;
+
+    fpp_log_config_init(&config);
+    config.fname = fname;
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (strcmp(level_name, names[i]) == 0) {
+            config.level = (fpp_log_level_t) i;
+            break;
+        }
+    }
+    if (i == sizeof(names) / sizeof(names[0])) {
+        fpp_log_error(FPP_ERR_IO_ARGV, "Unknown log level \"%s\"",
+            level_name);
+        return FPP_FAILURE;
+    }
+
+    if (fpp_log_start(&config) != FPP_OK) {
+        fpp_log_error(fpp_get_os_errno(), "Failed to open log \"%s\"",
+            fname);
+        return FPP_FAILURE;
+    }
+    return FPP_OK;
+}
+
+/* An unsigned decimal number, *end is what follows it */
+static fpp_err_t
+fpp_parse_uint64(const char *str, uint64_t *value, char **end)
+{
+    unsigned long long n;
+
+    /* strtoull() would take "-1" as 2^64 - 1 */
+    if (*str < '0' || *str > '9') {
+        return FPP_ERR_IO_ARGV;
+    }
+    errno = 0;
+    n = strtoull(str, end, 10);
+    if (errno == ERANGE) {
+        return FPP_ERR_IO_ARGV;
+    }
+
+    *value = (uint64_t) n;
+    return FPP_OK;
+}
+
+/* "offset:length" or "offset", the length 0 meaning up to the end */
+static fpp_err_t
+fpp_parse_range(const char *str, uint64_t *offset, uint64_t *length)
+{
+    char *end;
+
+    *length = 0;
+    if (fpp_parse_uint64(str, offset, &end) != FPP_OK) {
+        return FPP_ERR_IO_ARGV;
+    }
+    if (*end == ':' && fpp_parse_uint64(end + 1, length, &end) != FPP_OK) {
+        return FPP_ERR_IO_ARGV;
+    }
+    return *end == '\0' ? FPP_OK : FPP_ERR_IO_ARGV;
+}
+
+static fpp_err_t
+fpp_check_file(fpp_ctx_t *ctx, const char *fname)
+{
+    static char index_fname[FPP_INDEX_PATHLEN];
+    fpp_merkle_report_t report;
+    const fpp_merkle_chunk_t *chunk;
+    uint64_t offset = 0, length = 0;
+    fpp_err_t err;
+    size_t i;
+
+    if (range_str && fpp_parse_range(range_str, &offset, &length)
+        != FPP_OK)
+    {
+        fpp_log_error(FPP_ERR_IO_ARGV, "Invalid range \"%s\"", range_str);
+        return FPP_FAILURE;
+    }
+
+    snprintf(index_fname, sizeof(index_fname), "%s%s", fname,
+        FPP_MERKLE_INDEX_SUFFIX);
+
+    err = fpp_ctx_merkle_verify(ctx, fname, header_fname, index_fname,
+        offset, length, &report);
+    if (err != FPP_OK && err != FPP_ERR_IO_DIGEST) {
+        return err;
+    }
+
+    for (i = 0; i < report.nbad; ++i) {
+        chunk = &report.bad[i];
+        fpp_log_error(FPP_ERR_IO_DIGEST,
+            "Chunk %llu at bytes %llu-%llu of \"%s\" is corrupt",
+            (unsigned long long) chunk->index,
+            (unsigned long long) chunk->offset,
+            (unsigned long long) (chunk->offset + chunk->length - 1), fname);
+    }
+    if (report.size_mismatch) {
+        fpp_log_error(FPP_ERR_IO_DIGEST,
+            "Size of \"%s\" changed since its index was built", fname);
+    }
+    fpp_log_message("Chunks checked: %llu, corrupt: %zu",
+        (unsigned long long) report.nchecked, report.nbad);
+
+    fpp_merkle_report_free(&report);
+    return err;
+}
+
+/* "idle" or a best-effort level 0-7 */
+static fpp_err_t
+fpp_parse_ionice(const char *str, fpp_ctx_config_t *config)
+{
+    if (strcmp(str, "idle") == 0) {
+        config->io_class = FPP_IO_CLASS_IDLE;
+        return FPP_OK;
+    }
+    if (str[0] >= '0' && str[0] <= '7' && str[1] == '\0') {
+        config->io_class = FPP_IO_CLASS_BEST_EFFORT;
+        config->io_level = str[0] - '0';
+        return FPP_OK;
+    }
+    return FPP_FAILURE;
+}
+
+/* All files on every CPU, the bad ones are listed at the end */
+static fpp_err_t
+fpp_verify_files(fpp_ctx_t *ctx, const char *passwd)
+{
+    fpp_crypto_params_t *params;
+    fpp_err_t *results;
+    size_t i, nbad;
+    fpp_err_t err;
+
+    if (header_fname && nverify > 1) {
+        fpp_log_error(FPP_ERR_IO_ARGV,
+            "A header file can be given for a single file only");
+        return FPP_FAILURE;
+    }
+
+    params = calloc(nverify, sizeof(fpp_crypto_params_t));
+    results = calloc(nverify, sizeof(fpp_err_t));
+    if (!params || !results) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to allocate memory");
+        free(params);
+        free(results);
+        return FPP_FAILURE;
+    }
+
+    for (i = 0; i < nverify; ++i) {
+        params[i].in_fname = verify_fnames[i];
+        params[i].header_fname = header_fname;
+        params[i].text_passwd = passwd;
+    }
+
+    err = fpp_ctx_verify_files(ctx, params, nverify, results);
+
+    nbad = 0;
+    for (i = 0; i < nverify; ++i) {
+        if (results[i] != FPP_OK) {
+            fpp_log_error(results[i], "Bad file: \"%s\"", verify_fnames[i]);
+            nbad++;
+        }
+    }
+    fpp_log_message("Files verified: %zu, bad: %zu", nverify, nbad);
+
+    free(params);
+    free(results);
+    return err;
+}
+
+static fpp_err_t
+fpp_write_stats(fpp_ctx_t *ctx, const char *fname)
+{
+    fpp_stats_t stats;
+    FILE *fd;
+    int rc;
+
+    fpp_ctx_get_stats(ctx, &stats);
+
+    if (strcmp(fname, "-") == 0) {
+        fd = stderr;
+    }
+    else {
+        fd = fopen(fname, "w");
+        if (!fd) {
+            fpp_log_error(fpp_get_os_errno(), "Failed to open \"%s\"", fname);
+            return FPP_FAILURE;
+        }
+    }
+
+    fpp_stats_write_json(fd, &stats);
+    fprintf(fd, "\n");
+
+    if (fd == stderr) {
+        return fflush(fd) == 0 ? FPP_OK : FPP_FAILURE;
+    }
+    rc = fclose(fd);
+    return rc == 0 ? FPP_OK : FPP_FAILURE;
+}
+
+/* Only new files use it, decryption takes the KDF from the header */
+static fpp_err_t
+fpp_parse_kdf(fpp_ctx_config_t *config)
+{
+    uint64_t memory;
+
+    if (fpp_kdf_by_name(kdf_name, &config->kdf) != FPP_OK) {
+        fpp_log_error(FPP_ERR_IO_ARGV, "Unknown KDF \"%s\"", kdf_name);
+        return FPP_FAILURE;
+    }
+
+    if (kdf_memory_str) {
+        if (fpp_parse_size(kdf_memory_str, &memory) != FPP_OK
+            || memory / 1024 > UINT32_MAX)
+        {
+            fpp_log_error(FPP_ERR_IO_ARGV, "Invalid KDF memory \"%s\"",
+                kdf_memory_str);
+            return FPP_FAILURE;
+        }
+        config->kdf_memory = (uint32_t) (memory / 1024);
+
+        /* N of scrypt is a power of two */
+        while (config->kdf == FPP_KDF_SCRYPT
+            && (config->kdf_memory & (config->kdf_memory - 1)))
+        {
+            config->kdf_memory &= config->kdf_memory - 1;
+        }
+    }
+
+    config->kdf_lanes = (uint32_t) kdf_lanes;
+
+    /* Passes rather than PBKDF2 iterations */
+    if (config->kdf == FPP_KDF_ARGON2ID && !iter_set) {
+        iter = FPP_ARGON2_DEFAULT_PASSES;
+    }
+
+    return FPP_OK;
+}
+
+static fpp_err_t
+fpp_set_kdf_time(void)
+{
+    uint32_t n;
+
+    if (fpp_kdf_calibrate_iter((uint32_t) kdf_time, &n) != FPP_OK) {
+        fpp_log_error(fpp_get_openssl_errno(), "Failed to measure PBKDF2");
+        return FPP_FAILURE;
+    }
+
+    iter = n;
+    fpp_log_message("PBKDF2 iterations: %zu (%d ms)", iter, kdf_time);
+    return FPP_OK;
+}
+
+/*
+ * A profile named with --profile must load, the default one is used
+ * only if it is there and valid.
+ */
+static fpp_err_t
+fpp_load_profile(fpp_ctx_config_t *config)
+{
+    static char default_fname[FPP_MAX_PATHLEN];
+    fpp_profile_t profile;
+    const char *fname;
+    fpp_err_t err;
+
+    fname = profile_fname;
+    if (!fname) {
+        fname = fpp_profile_default_path(default_fname,
+            sizeof(default_fname));
+        if (!fname || access(fname, F_OK) != 0) {
+            return FPP_OK;
+        }
+    }
+
+    err = fpp_profile_load(&profile, fname);
+    if (err != FPP_OK) {
+        fpp_log_error(err, "Failed to load profile \"%s\"%s", fname,
+            profile_fname ? "" : ", ignored");
+        return profile_fname ? FPP_FAILURE : FPP_OK;
+    }
+
+    fpp_profile_apply(&profile, config);
+    return FPP_OK;
 }
 
 static void
@@ -248,6 +888,8 @@ fpp_show_help_info(void)
 {
     fprintf(stdout,
         "Usage: fpp [options...] [argments...]\n"
+        "       fpp bench [options...]\n"
+        "       fpp tune [options...]\n"
         "FPP (Files Protect Program) version %s %s\n\n"
         "Options:\n"
         "  -h, --help                     Displays this message.\n"
@@ -255,10 +897,48 @@ fpp_show_help_info(void)
         "  -q, --quiet                    Suppress non-error messages.\n"
         "  -e, --encrypt <file>           Specify file to encrypt.\n"
         "  -d, --decrypt <file>           Specify file to decrypt.\n"
-        "  -a, --algorithm                Specify algorithm.\n"
+        "  -a, --algorithm                Specify algorithm, auto for\n"
+        "                                 the fastest on this host.\n"
         "  -o, --output-file <file>       Specify output file.\n"
         "  -y, --header <file>            Specify header file.\n"
-        "  -i, --iter <n>                 Specify number of iteration.\n",
+        "      --manifest <file>          Append sha256sum lines of the\n"
+        "                                 written files, - for stdout.\n"
+        "  -s, --stats <file>             Write per-phase statistics as\n"
+        "                                 JSON, - for stderr.\n"
+        "      --log <file>               Write messages as JSON lines,\n"
+        "                                 - for stderr.\n"
+        "      --log-level <level>        debug, info, warn or error.\n"
+        "  -i, --iter <n>                 Specify number of iteration.\n"
+        "      --kdf-time <ms>            Pick the number of iterations\n"
+        "                                 that takes ms on this host.\n"
+        "      --kdf <name>               pbkdf2, scrypt or argon2id.\n"
+        "      --kdf-memory <n[K|M|G]>    Memory of every scrypt or\n"
+        "                                 Argon2id lane (64M).\n"
+        "      --kdf-lanes <n>            Lanes, one thread each, default\n"
+        "                                 one per CPU.\n"
+        "      --kdf-max-memory <n[K|M|G]>\n"
+        "                                 Memory of all lanes a file may\n"
+        "                                 ask for (1G).\n"
+        "      --limit-rate <n[K|M|G]>    Read and write at most n bytes\n"
+        "                                 per second.\n"
+        "      --memory-limit <n[K|M|G]>  Run only as many files at once as\n"
+        "                                 fit, the others wait.\n"
+        "      --threads <n>              Worker threads for --verify and\n"
+        "                                 --merkle, default from the\n"
+        "                                 profile or one per CPU.\n"
+        "      --cpus <list>              Run on these CPUs only, as in\n"
+        "                                 0-3,8.\n"
+        "      --profile <file>           Host profile from fpp tune.\n"
+        "      --nice <n>                 Add n to the niceness of workers.\n"
+        "      --ionice <idle|0-7>        I/O class or best-effort level.\n"
+        "  -m, --merkle                   Write an integrity index of the\n"
+        "                                 encrypted file.\n"
+        "  -t, --verify <file>...         Decrypt files without writing\n"
+        "                                 them to check that they are\n"
+        "                                 intact, must come last.\n"
+        "  -c, --check <file>             Check an encrypted file against\n"
+        "                                 its integrity index.\n"
+        "      --range <offset[:length]>  Check only this part.\n",
         FPP_VERSION_STR, FPP_BUILD_DATE);
 }
 
@@ -266,10 +946,22 @@ int
 main(int argc, const char *const *argv)
 {
     static char temp_fname[FPP_MAX_PATHLEN];
+    static char index_fname[FPP_INDEX_PATHLEN];
     char *passwd1 = NULL, *passwd2 = NULL;
+    fpp_ctx_config_t config;
     fpp_crypto_params_t params; 
+    fpp_ctx_t *ctx = NULL;
+    uint64_t memory_limit, kdf_max_memory;
     fpp_err_t err;
 
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return fpp_bench_main(argc - 1, argv + 1);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "tune") == 0) {
+        return fpp_tune_main(argc - 1, argv + 1);
+    }
+
     if ((err = fpp_parse_argv(argc, argv)) != EXIT_SUCCESS) {
         fpp_show_help_info();
         goto failed;
@@ -289,12 +981,119 @@ main(int argc, const char *const *argv)
         fpp_enable_quite_mode();
     }
 
-    if (!in_fname) {
+    if (log_fname && fpp_start_log(log_fname, log_level_name) != FPP_OK) {
+        goto failed;
+    }
+
+    if (!in_fname && !check_fname && !nverify) {
         fpp_log_error(FPP_FAILURE, "Empty input file name");
         goto failed;
     }
 
-    if (encrypt_mode) {
+    /* The index completes the header after the checksum is taken */
+    if (manifest_fname && merkle_mode) {
+        fpp_log_error(FPP_ERR_IO_ARGV,
+            "--manifest can't be combined with --merkle");
+        goto failed;
+    }
+
+    if (kdf_time && (iter_set || !encrypt_mode
+        || (kdf_name && strcmp(kdf_name, "pbkdf2") != 0)))
+    {
+        fpp_log_error(FPP_ERR_IO_ARGV,
+            "--kdf-time only applies to PBKDF2 encryption without --iter");
+        goto failed;
+    }
+    if (kdf_time && fpp_set_kdf_time() != FPP_OK) {
+        goto failed;
+    }
+
+    /* Before any thread is started, they inherit the CPU set */
+    if (cpus_str && fpp_restrict_cpus(cpus_str) != FPP_OK) {
+        goto failed;
+    }
+
+    fpp_ctx_config_init(&config);
+    if (fpp_load_profile(&config) != FPP_OK) {
+        goto failed;
+    }
+    if (kdf_max_memory_str) {
+        if (fpp_parse_size(kdf_max_memory_str, &kdf_max_memory) != FPP_OK
+            || kdf_max_memory / 1024 == 0
+            || kdf_max_memory / 1024 > FPP_KDF_MAX_MEMORY)
+        {
+            fpp_log_error(FPP_ERR_IO_ARGV, "Invalid KDF memory limit \"%s\"",
+                kdf_max_memory_str);
+            goto failed;
+        }
+        config.kdf_max_memory = (uint32_t) (kdf_max_memory / 1024);
+    }
+    if (kdf_name && encrypt_mode && fpp_parse_kdf(&config) != FPP_OK) {
+        goto failed;
+    }
+    config.algo_name = algo_name;
+    config.iter = iter;
+    /* One file at a time, the index and a scrub use every CPU */
+    if (!merkle_mode && !check_fname && !nverify) {
+        config.nthreads = 1;
+    }
+    else if (nthreads) {
+        config.nthreads = nthreads;
+    }
+    config.cpus = cpus_str;
+    config.nice = nice_incr;
+
+    if (rate_str && fpp_parse_size(rate_str, &config.io_rate) != FPP_OK) {
+        fpp_log_error(FPP_ERR_IO_ARGV, "Invalid rate \"%s\"", rate_str);
+        goto failed;
+    }
+    if (ionice_str && fpp_parse_ionice(ionice_str, &config) != FPP_OK) {
+        fpp_log_error(FPP_ERR_IO_ARGV, "Invalid I/O priority \"%s\"",
+            ionice_str);
+        goto failed;
+    }
+    if (memory_str) {
+        if (fpp_parse_size(memory_str, &memory_limit) != FPP_OK) {
+            fpp_log_error(FPP_ERR_IO_ARGV, "Invalid memory limit \"%s\"",
+                memory_str);
+            goto failed;
+        }
+        fpp_memory_set_budget((size_t) memory_limit);
+    }
+    /* Keep the plaintext out of swap */
+    config.secure_memory = true;
+    config.stats = (stats_fname != NULL);
+    config.manifest_fname = encrypt_mode ? manifest_fname : NULL;
+
+    ctx = fpp_ctx_create(&config);
+    if (!ctx) {
+        fpp_log_error(FPP_FAILURE, "Failed to create context");
+        goto failed;
+    }
+    /* Single files are processed on this thread, not by the workers */
+    if ((config.nice || config.io_class != FPP_IO_CLASS_DEFAULT)
+        && fpp_throttle_thread(&config, fpp_throttle_get_nice()) != FPP_OK)
+    {
+        fpp_log_error(fpp_get_os_errno(), "Failed to lower thread priority");
+    }
+
+    if (check_fname) {
+        if (fpp_check_file(ctx, check_fname) != FPP_OK) {
+            goto failed;
+        }
+    }
+    else if (nverify) {
+        passwd1 = fpp_getpass("Enter pass phrase: ");
+        if (!passwd1) {
+            fpp_log_error(FPP_FAILURE, "Invalid input passwords");
+            goto failed;
+        }
+
+        if (fpp_verify_files(ctx, passwd1) != FPP_OK) {
+            goto failed;
+        }
+    }
+    else if (encrypt_mode) {
         passwd1 = fpp_getpass("Enter pass phrase: ");
         passwd2 = fpp_getpass("Verifying - Enter pass phrase: ");
         if (!passwd1 || !passwd2) {
@@ -319,7 +1118,7 @@ main(int argc, const char *const *argv)
         params.iter = iter;
         params.algo_name = algo_name;
 
-        err = fpp_encrypt_file(&params);
+        err = fpp_ctx_encrypt_file(ctx, &params);
         if (err != EXIT_SUCCESS) {
             fpp_log_message("Failed to encrypt file");
             goto failed;
@@ -333,6 +1132,18 @@ main(int argc, const char *const *argv)
         else {
             fpp_log_message("File successfully saved: \"%s\"", out_fname);
         }
+
+        if (merkle_mode) {
+            snprintf(index_fname, sizeof(index_fname), "%s%s", out_fname,
+                FPP_MERKLE_INDEX_SUFFIX);
+            err = fpp_ctx_merkle_build(ctx, out_fname, header_fname,
+                index_fname, 0);
+            if (err != FPP_OK) {
+                fpp_log_message("Failed to write integrity index");
+                goto failed;
+            }
+            fpp_log_message("Integrity index saved: \"%s\"", index_fname);
+        }
     }
     else if (decrypt_mode) {
         passwd1 = fpp_getpass("Enter pass phrase: ");
@@ -351,8 +1162,9 @@ main(int argc, const char *const *argv)
         params.header_fname = header_fname;
         params.text_passwd = passwd1;
         params.iter = iter;
+        params.algo_name = NULL;
 
-        err = fpp_decrypt_file(&params);
+        err = fpp_ctx_decrypt_file(ctx, &params);
         if (err != EXIT_SUCCESS) {
             fpp_log_message("Failed to decrypt file");
             goto failed;
@@ -370,6 +1182,15 @@ main(int argc, const char *const *argv)
         free(passwd2);
     }
 
+    if (stats_fname && fpp_write_stats(ctx, stats_fname) != FPP_OK) {
+        fpp_log_error(FPP_FAILURE, "Failed to write statistics");
+        fpp_ctx_destroy(ctx);
+        fpp_log_stop();
+        return 1;
+    }
+
+    fpp_ctx_destroy(ctx);
+    fpp_log_stop();
     return 0;
 
 failed:
@@ -382,6 +1203,9 @@ failed:
         free(passwd1);
     }
 
+    fpp_ctx_destroy(ctx);
+    fpp_log_stop();
+
 #if (_WIN32)
     system("pause");
 #endif
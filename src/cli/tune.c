@@ -0,0 +1,502 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+
+#include "tune.h"
+#include "profile.h"
+#include "context.h"
+#include "cipher.h"
+#include "thread_pool.h"
+#include "random.h"
+#include "errcodes.h"
+#include "log.h"
+#include "args.h"
+
+#define FPP_TUNE_MAX_PATHLEN    4096
+#define FPP_TUNE_NAME_SIZE      (FPP_TUNE_MAX_PATHLEN + 32)
+#define FPP_TUNE_DEFAULT_SIZE   (64 * 1024 * 1024)
+#define FPP_TUNE_CIPHER_BYTES   (32 * 1024 * 1024)
+/* Fewer threads or smaller chunks win unless the other is this faster */
+#define FPP_TUNE_MARGIN         1.05
+
+typedef struct {
+    const char *dir;
+    const char *profile_fname;
+    size_t size;
+} fpp_tune_config_t;
+
+/*
+ * The test data is split into one file per CPU, so that every worker
+ * count processes the same bytes and only the parallelism changes.
+ */
+typedef struct {
+    fpp_tune_config_t config;
+    char *names;
+    size_t nfiles;
+    size_t file_size;
+    fpp_profile_t profile;
+} fpp_tune_t;
+
+static const size_t fpp_tune_chunk_sizes[] = {
+    64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024
+};
+
+
+static double
+fpp_tune_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static char *
+fpp_tune_in_fname(fpp_tune_t *tune, size_t i)
+{
+    return tune->names + 2 * i * FPP_TUNE_NAME_SIZE;
+}
+
+static char *
+fpp_tune_out_fname(fpp_tune_t *tune, size_t i)
+{
+    return fpp_tune_in_fname(tune, i) + FPP_TUNE_NAME_SIZE;
+}
+
+/* Write back and evict a file, so that the next pass reads the disk */
+static void
+fpp_tune_flush(const char *fname)
+{
+#if !(_WIN32)
+    int fd;
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    fsync(fd);
+#if (__linux__)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+#else
+    (void) fname;
+#endif
+}
+
+static void
+fpp_tune_show_help(void)
+{
+    fprintf(stdout,
+        "Usage: fpp tune [options...]\n\n"
+        "Options:\n"
+        "  -h, --help                     Displays this message.\n"
+        "      --dir <dir>                Filesystem to calibrate on.\n"
+        "      --size <n[K|M|G]>          Test data size (64M).\n"
+        "      --profile <file>           Where to save the profile.\n");
+}
+
+static fpp_err_t
+fpp_tune_parse_argv(fpp_tune_config_t *config, int argc,
+    const char *const *argv)
+{
+    const char *opt, *arg;
+    uint64_t size;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        opt = argv[i];
+
+        if (strcmp(opt, "-h") == 0 || strcmp(opt, "--help") == 0) {
+            fpp_tune_show_help();
+            exit(0);
+        }
+
+        if (strcmp(opt, "--dir") && strcmp(opt, "--size")
+            && strcmp(opt, "--profile"))
+        {
+            fprintf(stderr, "fpp: invalid option -- \"%s\"\n", opt);
+            return FPP_FAILURE;
+        }
+
+        arg = argv[++i];
+        if (!arg) {
+            fprintf(stderr, "fpp: missing argment for option -- \"%s\"\n",
+                opt);
+            return FPP_FAILURE;
+        }
+
+        if (strcmp(opt, "--dir") == 0) {
+            config->dir = arg;
+        }
+        else if (strcmp(opt, "--profile") == 0) {
+            config->profile_fname = arg;
+        }
+        else if (fpp_parse_size(arg, &size) != FPP_OK || size == 0
+            || size > SIZE_MAX)
+        {
+            fprintf(stderr, "fpp: invalid argment for option -- \"%s\"\n",
+                opt);
+            return FPP_FAILURE;
+        }
+        else {
+            config->size = (size_t) size;
+        }
+    }
+
+    return FPP_OK;
+}
+
+/* Creates the test files, the time includes writing them back */
+static fpp_err_t
+fpp_tune_write(fpp_tune_t *tune)
+{
+    uint8_t *data;
+    size_t i, pos, n;
+    double start;
+    FILE *fd;
+
+    data = malloc(FPP_DEFAULT_CHUNK_SIZE);
+    if (!data || fpp_random_bytes(data, FPP_DEFAULT_CHUNK_SIZE) != FPP_OK) {
+        free(data);
+        return FPP_FAILURE;
+    }
+
+    start = fpp_tune_now();
+    for (i = 0; i < tune->nfiles; ++i) {
+        fd = fopen(fpp_tune_in_fname(tune, i), "wb");
+        if (!fd) {
+            free(data);
+            return FPP_FAILURE;
+        }
+        for (pos = 0; pos < tune->file_size; pos += n) {
+            n = tune->file_size - pos;
+            if (n > FPP_DEFAULT_CHUNK_SIZE) {
+                n = FPP_DEFAULT_CHUNK_SIZE;
+            }
+            if (fwrite(data, 1, n, fd) != n) {
+                fclose(fd);
+                free(data);
+                return FPP_FAILURE;
+            }
+        }
+        if (fclose(fd) != 0) {
+            free(data);
+            return FPP_FAILURE;
+        }
+        fpp_tune_flush(fpp_tune_in_fname(tune, i));
+    }
+
+    tune->profile.write_rate = (uint64_t) ((double) tune->file_size
+        * tune->nfiles / (fpp_tune_now() - start));
+
+    free(data);
+    return FPP_OK;
+}
+
+static fpp_err_t
+fpp_tune_read(fpp_tune_t *tune)
+{
+    uint8_t *data;
+    size_t i;
+    double start;
+    FILE *fd;
+
+    data = malloc(FPP_DEFAULT_CHUNK_SIZE);
+    if (!data) {
+        return FPP_FAILURE;
+    }
+
+    start = fpp_tune_now();
+    for (i = 0; i < tune->nfiles; ++i) {
+        fd = fopen(fpp_tune_in_fname(tune, i), "rb");
+        if (!fd) {
+            free(data);
+            return FPP_FAILURE;
+        }
+        while (fread(data, 1, FPP_DEFAULT_CHUNK_SIZE, fd) != 0) {
+            /* Only the time counts */
+        }
+        fclose(fd);
+    }
+
+    tune->profile.read_rate = (uint64_t) ((double) tune->file_size
+        * tune->nfiles / (fpp_tune_now() - start));
+
+    free(data);
+    return FPP_OK;
+}
+
+/* In memory, one thread, the chunk size of the file pipeline */
+static fpp_err_t
+fpp_tune_ciphers(fpp_tune_t *tune, fpp_ctx_t *ctx)
+{
+    const fpp_cipher_t *cipher;
+    const EVP_CIPHER *evp_cipher;
+    EVP_CIPHER_CTX *cipher_ctx;
+    uint8_t key[EVP_MAX_KEY_LENGTH];
+    uint8_t iv[EVP_MAX_IV_LENGTH];
+    uint8_t *in, *out;
+    size_t i, pos;
+    double start;
+    int len;
+    fpp_err_t err = FPP_FAILURE;
+
+    cipher_ctx = EVP_CIPHER_CTX_new();
+    in = malloc(FPP_DEFAULT_CHUNK_SIZE);
+    out = malloc(FPP_DEFAULT_CHUNK_SIZE + EVP_MAX_BLOCK_LENGTH);
+    if (!cipher_ctx || !in || !out
+        || fpp_random_bytes(in, FPP_DEFAULT_CHUNK_SIZE) != FPP_OK
+        || fpp_random_bytes(key, sizeof(key)) != FPP_OK
+        || fpp_random_bytes(iv, sizeof(iv)) != FPP_OK)
+    {
+        goto failed;
+    }
+
+    for (i = 0; i < fpp_cipher_count(); ++i) {
+        cipher = fpp_cipher_at(i);
+        evp_cipher = fpp_ctx_get_evp_cipher(ctx, cipher);
+        if (!evp_cipher || cipher->algo >= FPP_PROFILE_NALGOS) {
+            continue;
+        }
+
+        if (EVP_EncryptInit_ex(cipher_ctx, evp_cipher, NULL, key, iv) != 1) {
+            goto failed;
+        }
+        start = fpp_tune_now();
+        for (pos = 0; pos < FPP_TUNE_CIPHER_BYTES;
+            pos += FPP_DEFAULT_CHUNK_SIZE)
+        {
+            if (EVP_EncryptUpdate(cipher_ctx, out, &len, in,
+                FPP_DEFAULT_CHUNK_SIZE) != 1)
+            {
+                goto failed;
+            }
+        }
+        tune->profile.cipher_rate[cipher->algo] = (uint64_t)
+            (FPP_TUNE_CIPHER_BYTES / (fpp_tune_now() - start));
+    }
+
+    err = FPP_OK;
+
+failed:
+    EVP_CIPHER_CTX_free(cipher_ctx);
+    free(in);
+    free(out);
+    return err;
+}
+
+/*
+ * Encrypt all test files from a cold cache and write them back, the
+ * way a real run ends up on disk. Returns bytes/s, 0 on failure.
+ */
+static double
+fpp_tune_run(fpp_tune_t *tune, size_t chunk_size, size_t nthreads)
+{
+    fpp_ctx_config_t config;
+    fpp_crypto_params_t *params;
+    fpp_ctx_t *ctx;
+    double start, seconds;
+    fpp_err_t err;
+    size_t i;
+
+    fpp_ctx_config_init(&config);
+    config.iter = 1;
+    config.chunk_size = chunk_size;
+    config.nthreads = nthreads;
+
+    ctx = fpp_ctx_create(&config);
+    params = calloc(tune->nfiles, sizeof(fpp_crypto_params_t));
+    if (!ctx || !params) {
+        fpp_ctx_destroy(ctx);
+        free(params);
+        return 0;
+    }
+
+    for (i = 0; i < tune->nfiles; ++i) {
+        params[i].in_fname = fpp_tune_in_fname(tune, i);
+        params[i].out_fname = fpp_tune_out_fname(tune, i);
+        params[i].text_passwd = "fpp tune pass phrase";
+        fpp_tune_flush(params[i].in_fname);
+    }
+
+    start = fpp_tune_now();
+    err = fpp_ctx_encrypt_files(ctx, params, tune->nfiles, NULL);
+    for (i = 0; i < tune->nfiles; ++i) {
+        fpp_tune_flush(params[i].out_fname);
+    }
+    seconds = fpp_tune_now() - start;
+
+    for (i = 0; i < tune->nfiles; ++i) {
+        remove(params[i].out_fname);
+    }
+    fpp_ctx_destroy(ctx);
+    free(params);
+
+    if (err != FPP_OK || seconds <= 0) {
+        return 0;
+    }
+    return (double) tune->file_size * tune->nfiles / seconds;
+}
+
+static fpp_err_t
+fpp_tune_pipeline(fpp_tune_t *tune)
+{
+    size_t i, ncpu, nthreads, best_chunk, best_threads;
+    double rate, best;
+
+    best = 0;
+    best_chunk = FPP_DEFAULT_CHUNK_SIZE;
+    for (i = 0; i < sizeof(fpp_tune_chunk_sizes) / sizeof(size_t); ++i) {
+        rate = fpp_tune_run(tune, fpp_tune_chunk_sizes[i], 1);
+        if (rate == 0) {
+            return FPP_FAILURE;
+        }
+        fpp_log_message("  chunk %8zu KiB:  %10.1f MB/s",
+            fpp_tune_chunk_sizes[i] / 1024, rate / 1e6);
+        if (rate > best * FPP_TUNE_MARGIN) {
+            best = rate;
+            best_chunk = fpp_tune_chunk_sizes[i];
+        }
+    }
+    tune->profile.chunk_size = best_chunk;
+
+    /* Powers of two up to the CPU count, and the CPU count itself */
+    ncpu = fpp_get_ncpu();
+    best = 0;
+    best_threads = 1;
+    for (nthreads = 1; ; nthreads *= 2) {
+        if (nthreads > ncpu) {
+            nthreads = ncpu;
+        }
+        rate = fpp_tune_run(tune, best_chunk, nthreads);
+        if (rate == 0) {
+            return FPP_FAILURE;
+        }
+        fpp_log_message("  threads %6zu:      %10.1f MB/s", nthreads,
+            rate / 1e6);
+        if (rate > best * FPP_TUNE_MARGIN) {
+            best = rate;
+            best_threads = nthreads;
+        }
+        if (nthreads == ncpu) {
+            break;
+        }
+    }
+    tune->profile.nthreads = best_threads;
+
+    return FPP_OK;
+}
+
+int
+fpp_tune_main(int argc, const char *const *argv)
+{
+    static char default_fname[FPP_TUNE_MAX_PATHLEN];
+    fpp_tune_t tune;
+    fpp_tune_config_t *config = &tune.config;
+    const fpp_cipher_t *cipher;
+    fpp_ctx_t *ctx = NULL;
+    size_t i;
+    fpp_err_t err = FPP_FAILURE;
+
+    memset(&tune, 0, sizeof(fpp_tune_t));
+    fpp_profile_init(&tune.profile);
+    config->size = FPP_TUNE_DEFAULT_SIZE;
+    config->dir = ".";
+
+    if (fpp_tune_parse_argv(config, argc, argv) != FPP_OK) {
+        fpp_tune_show_help();
+        return 1;
+    }
+
+    if (!config->profile_fname) {
+        config->profile_fname = fpp_profile_default_path(default_fname,
+            sizeof(default_fname));
+        if (!config->profile_fname) {
+            fpp_log_error(FPP_ERR_IO_ARGV,
+                "No home directory, specify --profile");
+            return 1;
+        }
+    }
+
+    tune.nfiles = fpp_get_ncpu();
+    tune.file_size = (config->size + tune.nfiles - 1) / tune.nfiles;
+    tune.names = calloc(tune.nfiles, 2 * FPP_TUNE_NAME_SIZE);
+    ctx = fpp_ctx_create(NULL);
+    if (!tune.names || !ctx) {
+        fpp_log_error(FPP_FAILURE, "Failed to set up calibration");
+        goto failed;
+    }
+
+    for (i = 0; i < tune.nfiles; ++i) {
+        snprintf(fpp_tune_in_fname(&tune, i), FPP_TUNE_NAME_SIZE,
+            "%s/fpp-tune-%ld-%zu.bin", config->dir, (long) getpid(), i);
+        snprintf(fpp_tune_out_fname(&tune, i), FPP_TUNE_NAME_SIZE,
+            "%s/fpp-tune-%ld-%zu.fpp", config->dir, (long) getpid(), i);
+    }
+
+    fpp_log_message("Calibrating on \"%s\" with %zu file(s) of %zu KiB",
+        config->dir, tune.nfiles, tune.file_size / 1024);
+
+    if (fpp_tune_write(&tune) != FPP_OK || fpp_tune_read(&tune) != FPP_OK) {
+        fpp_log_error(fpp_get_os_errno(), "Failed to measure \"%s\"",
+            config->dir);
+        goto failed;
+    }
+    fpp_log_message("  write:               %10.1f MB/s",
+        tune.profile.write_rate / 1e6);
+    fpp_log_message("  read:                %10.1f MB/s",
+        tune.profile.read_rate / 1e6);
+
+    if (fpp_tune_ciphers(&tune, ctx) != FPP_OK) {
+        fpp_log_error(fpp_get_openssl_errno(), "Failed to measure ciphers");
+        goto failed;
+    }
+    for (i = 0; i < fpp_cipher_count(); ++i) {
+        cipher = fpp_cipher_at(i);
+        if (tune.profile.cipher_rate[cipher->algo]) {
+            fpp_log_message("  %-20s %10.1f MB/s", cipher->name,
+                tune.profile.cipher_rate[cipher->algo] / 1e6);
+        }
+    }
+
+    if (fpp_tune_pipeline(&tune) != FPP_OK) {
+        fpp_log_error(FPP_FAILURE, "Failed to measure the file pipeline");
+        goto failed;
+    }
+
+    if (fpp_profile_save(&tune.profile, config->profile_fname) != FPP_OK) {
+        fpp_log_error(fpp_get_os_errno(), "Failed to save profile \"%s\"",
+            config->profile_fname);
+        goto failed;
+    }
+    fpp_log_message("Profile saved: \"%s\" (chunk %zu KiB, %zu thread(s))",
+        config->profile_fname, tune.profile.chunk_size / 1024,
+        tune.profile.nthreads);
+
+    err = FPP_OK;
+
+failed:
+    if (tune.names) {
+        for (i = 0; i < tune.nfiles; ++i) {
+            remove(fpp_tune_in_fname(&tune, i));
+            remove(fpp_tune_out_fname(&tune, i));
+        }
+    }
+    fpp_ctx_destroy(ctx);
+    free(tune.names);
+    return err == FPP_OK ? 0 : 1;
+}
@@ -13,6 +13,7 @@
 #include <openssl/aes.h>
 
 #include "aes256.h"
+#include "probes.h"
 
 
 fpp_err_t
@@ -24,6 +25,8 @@ fpp_encrypt_aes256_cbc(const uint8_t *in_data, uint32_t in_len,
     int32_t current_len;
     uint32_t result_len;
 
+    FPP_PROBE3(cipher__start, "aes256", 0, in_len);
+
     /* Create and initialise the context. */
     ctx = EVP_CIPHER_CTX_new();
     if (!ctx) {
@@ -65,6 +68,8 @@ fpp_encrypt_aes256_cbc(const uint8_t *in_data, uint32_t in_len,
 
     *out_len = result_len;
 
+    FPP_PROBE3(cipher__done, "aes256", 0, result_len);
+
     return FPP_OK;
 
 failed:
@@ -83,6 +88,8 @@ fpp_decrypt_aes256_cbc(const uint8_t *in_data, uint32_t in_len,
     int32_t current_len;
     uint32_t result_len;
 
+    FPP_PROBE3(cipher__start, "aes256", 1, in_len);
+
     /* Create and initialise the context. */
     ctx = EVP_CIPHER_CTX_new();
     if (!ctx) {
@@ -125,6 +132,8 @@ fpp_decrypt_aes256_cbc(const uint8_t *in_data, uint32_t in_len,
 
     *out_len = result_len;
 
+    FPP_PROBE3(cipher__done, "aes256", 1, result_len);
+
     return FPP_OK;
 
 failed:
@@ -0,0 +1,277 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+
+#include "aes_mb.h"
+#include "cpu.h"
+
+#if (__x86_64__ || __i386__) && (__GNUC__)
+#define FPP_HAVE_AESNI  1
+#include <wmmintrin.h>
+#endif
+
+#define FPP_AES_MAX_ROUNDS  14
+
+#if (FPP_HAVE_AESNI)
+
+#define FPP_AESNI  __attribute__((target("aes,sse2")))
+
+/* The eight lanes as separate variables, so that they stay in registers */
+#define FPP_AES_MB_EACH(op)                                                \
+    op(0) op(1) op(2) op(3) op(4) op(5) op(6) op(7)
+
+FPP_AESNI static inline __m128i
+fpp_aes128_expand_step(__m128i key, __m128i assist)
+{
+    __m128i t;
+
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    t = _mm_slli_si128(key, 4);
+    key = _mm_xor_si128(key, t);
+    t = _mm_slli_si128(t, 4);
+    key = _mm_xor_si128(key, t);
+    t = _mm_slli_si128(t, 4);
+    key = _mm_xor_si128(key, t);
+    return _mm_xor_si128(key, assist);
+}
+
+FPP_AESNI static void
+fpp_aes128_expand(const uint8_t *key, __m128i *rk)
+{
+    rk[0] = _mm_loadu_si128((const __m128i *) key);
+
+#define FPP_AES128_ROUND_KEY(i, rcon)                                      \
+    rk[i] = fpp_aes128_expand_step(rk[i - 1],                              \
+        _mm_aeskeygenassist_si128(rk[i - 1], rcon))
+
+    FPP_AES128_ROUND_KEY(1, 0x01);
+    FPP_AES128_ROUND_KEY(2, 0x02);
+    FPP_AES128_ROUND_KEY(3, 0x04);
+    FPP_AES128_ROUND_KEY(4, 0x08);
+    FPP_AES128_ROUND_KEY(5, 0x10);
+    FPP_AES128_ROUND_KEY(6, 0x20);
+    FPP_AES128_ROUND_KEY(7, 0x40);
+    FPP_AES128_ROUND_KEY(8, 0x80);
+    FPP_AES128_ROUND_KEY(9, 0x1b);
+    FPP_AES128_ROUND_KEY(10, 0x36);
+
+#undef FPP_AES128_ROUND_KEY
+}
+
+/* Odd round keys of AES-256 use SubWord without RotWord and no rcon */
+FPP_AESNI static inline __m128i
+fpp_aes256_expand_odd(__m128i even, __m128i odd)
+{
+    __m128i t, assist;
+
+    assist = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(even, 0x00), 0xaa);
+    t = _mm_slli_si128(odd, 4);
+    odd = _mm_xor_si128(odd, t);
+    t = _mm_slli_si128(t, 4);
+    odd = _mm_xor_si128(odd, t);
+    t = _mm_slli_si128(t, 4);
+    odd = _mm_xor_si128(odd, t);
+    return _mm_xor_si128(odd, assist);
+}
+
+FPP_AESNI static void
+fpp_aes256_expand(const uint8_t *key, __m128i *rk)
+{
+    rk[0] = _mm_loadu_si128((const __m128i *) key);
+    rk[1] = _mm_loadu_si128((const __m128i *) (key + 16));
+
+#define FPP_AES256_ROUND_KEYS(i, rcon)                                     \
+    rk[i] = fpp_aes128_expand_step(rk[i - 2],                              \
+        _mm_aeskeygenassist_si128(rk[i - 1], rcon));                       \
+    if (i + 1 <= FPP_AES_MAX_ROUNDS) {                                     \
+        rk[i + 1] = fpp_aes256_expand_odd(rk[i], rk[i - 1]);               \
+    }
+
+    FPP_AES256_ROUND_KEYS(2, 0x01);
+    FPP_AES256_ROUND_KEYS(4, 0x02);
+    FPP_AES256_ROUND_KEYS(6, 0x04);
+    FPP_AES256_ROUND_KEYS(8, 0x08);
+    FPP_AES256_ROUND_KEYS(10, 0x10);
+    FPP_AES256_ROUND_KEYS(12, 0x20);
+    FPP_AES256_ROUND_KEYS(14, 0x40);
+
+#undef FPP_AES256_ROUND_KEYS
+}
+
+/*
+ * Up to eight streams, lane[i] NULL for unused lanes. Lanes that end
+ * early keep running on their last block, their results are dropped.
+ */
+FPP_AESNI static void
+fpp_aes_cbc_encrypt_lanes(fpp_aes_cbc_stream_t **lane,
+    __m128i rk[FPP_AES_MB_LANES][FPP_AES_MAX_ROUNDS + 1], int nr)
+{
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7;
+    size_t pos, len;
+    int r;
+
+    len = 0;
+
+#define FPP_AES_MB_LOAD_IV(i)                                              \
+    x##i = _mm_setzero_si128();                                            \
+    if (lane[i]) {                                                         \
+        x##i = _mm_loadu_si128((const __m128i *) lane[i]->iv);             \
+        if (lane[i]->len > len) {                                          \
+            len = lane[i]->len;                                            \
+        }                                                                  \
+    }
+
+#define FPP_AES_MB_XOR_IN(i)                                               \
+    if (lane[i] && pos < lane[i]->len) {                                   \
+        x##i = _mm_xor_si128(x##i,                                         \
+            _mm_loadu_si128((const __m128i *) (lane[i]->in + pos)));       \
+    }                                                                      \
+    x##i = _mm_xor_si128(x##i, rk[i][0]);
+
+#define FPP_AES_MB_ROUND(i)                                                \
+    x##i = _mm_aesenc_si128(x##i, rk[i][r]);
+
+#define FPP_AES_MB_LAST(i)                                                 \
+    x##i = _mm_aesenclast_si128(x##i, rk[i][nr]);                          \
+    if (lane[i] && pos < lane[i]->len) {                                   \
+        _mm_storeu_si128((__m128i *) (lane[i]->out + pos), x##i);          \
+    }
+
+    FPP_AES_MB_EACH(FPP_AES_MB_LOAD_IV)
+
+    for (pos = 0; pos < len; pos += 16) {
+        FPP_AES_MB_EACH(FPP_AES_MB_XOR_IN)
+        for (r = 1; r < nr; ++r) {
+            FPP_AES_MB_EACH(FPP_AES_MB_ROUND)
+        }
+        FPP_AES_MB_EACH(FPP_AES_MB_LAST)
+    }
+
+#undef FPP_AES_MB_LOAD_IV
+#undef FPP_AES_MB_XOR_IN
+#undef FPP_AES_MB_ROUND
+#undef FPP_AES_MB_LAST
+}
+
+static fpp_err_t
+fpp_aes_cbc_encrypt_aesni(fpp_aes_cbc_stream_t *streams, size_t n,
+    int key_bits)
+{
+    __m128i rk[FPP_AES_MB_LANES][FPP_AES_MAX_ROUNDS + 1];
+    fpp_aes_cbc_stream_t *lane[FPP_AES_MB_LANES];
+    size_t base, i;
+    int nr;
+
+    nr = (key_bits == 128) ? 10 : 14;
+    /* Unused lanes still go through the rounds */
+    memset(rk, 0, sizeof(rk));
+
+    for (base = 0; base < n; base += FPP_AES_MB_LANES) {
+        for (i = 0; i < FPP_AES_MB_LANES; ++i) {
+            lane[i] = (base + i < n) ? &streams[base + i] : NULL;
+            if (!lane[i]) {
+                continue;
+            }
+            if (key_bits == 128) {
+                fpp_aes128_expand(lane[i]->key, rk[i]);
+            }
+            else {
+                fpp_aes256_expand(lane[i]->key, rk[i]);
+            }
+        }
+
+        fpp_aes_cbc_encrypt_lanes(lane, rk, nr);
+
+        for (i = 0; i < FPP_AES_MB_LANES && lane[i]; ++i) {
+            if (lane[i]->len) {
+                memcpy(lane[i]->iv, lane[i]->out + lane[i]->len - 16, 16);
+            }
+        }
+    }
+
+    OPENSSL_cleanse(rk, sizeof(rk));
+    return FPP_OK;
+}
+
+#endif
+
+bool
+fpp_aes_mb_is_accelerated(void)
+{
+#if (FPP_HAVE_AESNI)
+    return (fpp_cpu_features() & FPP_CPU_AESNI) != 0;
+#else
+    return false;
+#endif
+}
+
+/* One stream after another through OpenSSL */
+static fpp_err_t
+fpp_aes_cbc_encrypt_evp(fpp_aes_cbc_stream_t *streams, size_t n,
+    int key_bits)
+{
+    EVP_CIPHER_CTX *cipher_ctx;
+    fpp_aes_cbc_stream_t *s;
+    fpp_err_t err = FPP_FAILURE;
+    size_t i;
+    int len;
+
+    cipher_ctx = EVP_CIPHER_CTX_new();
+    if (!cipher_ctx) {
+        return FPP_FAILURE;
+    }
+
+    for (i = 0; i < n; ++i) {
+        s = &streams[i];
+        if (EVP_EncryptInit_ex(cipher_ctx, key_bits == 128
+                ? EVP_aes_128_cbc() : EVP_aes_256_cbc(), NULL, s->key,
+                s->iv) != 1
+            || EVP_CIPHER_CTX_set_padding(cipher_ctx, 0) != 1
+            || EVP_EncryptUpdate(cipher_ctx, s->out, &len, s->in,
+                (int) s->len) != 1)
+        {
+            goto failed;
+        }
+        if (s->len) {
+            memcpy(s->iv, s->out + s->len - 16, 16);
+        }
+    }
+
+    err = FPP_OK;
+
+failed:
+    EVP_CIPHER_CTX_free(cipher_ctx);
+    return err;
+}
+
+fpp_err_t
+fpp_aes_cbc_encrypt_mb(fpp_aes_cbc_stream_t *streams, size_t n,
+    int key_bits)
+{
+    size_t i;
+
+    if (key_bits != 128 && key_bits != 256) {
+        return FPP_FAILURE;
+    }
+    for (i = 0; i < n; ++i) {
+        if (streams[i].len % 16) {
+            return FPP_FAILURE;
+        }
+    }
+
+#if (FPP_HAVE_AESNI)
+    if (fpp_aes_mb_is_accelerated()) {
+        return fpp_aes_cbc_encrypt_aesni(streams, n, key_bits);
+    }
+#endif
+    return fpp_aes_cbc_encrypt_evp(streams, n, key_bits);
+}
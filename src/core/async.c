@@ -0,0 +1,433 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if (__linux__)
+#include <sys/eventfd.h>
+#endif
+
+#include "async.h"
+#include "context_internal.h"
+#include "memory.h"
+#include "log.h"
+
+struct fpp_async_job_s {
+    fpp_async_t *async;
+    fpp_job_t job;
+    fpp_crypto_params_t params;
+    /* Private copies of the params strings */
+    char *strings;
+    size_t strings_size;
+
+    fpp_async_handler_pt handler;
+    void *data;
+    fpp_err_t status;
+
+    /* Outstanding jobs, so that destroy can cancel them */
+    fpp_async_job_t *prev;
+    fpp_async_job_t *next;
+    /* Completion queue */
+    fpp_async_job_t *done_next;
+};
+
+struct fpp_async_s {
+    fpp_ctx_t *ctx;
+    fpp_thread_pool_t *pool;
+    pthread_mutex_t lock;
+    fpp_async_config_t config;
+
+    fpp_async_job_t *jobs;
+    size_t njobs;
+
+    fpp_async_job_t *done_head;
+    fpp_async_job_t *done_tail;
+
+    /* eventfd, or the read end of a pipe on systems without it */
+    int notify_fd;
+    int notify_wfd;
+};
+
+
+void
+fpp_async_config_init(fpp_async_config_t *config)
+{
+    memset(config, 0, sizeof(fpp_async_config_t));
+    config->nworkers = 0;
+    config->max_jobs = 0;
+    config->notify = FPP_ASYNC_NOTIFY_FD;
+}
+
+static fpp_err_t
+fpp_async_open_notify_fd(fpp_async_t *async)
+{
+#if (__linux__)
+    async->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (async->notify_fd == -1) {
+        return FPP_FAILURE;
+    }
+    async->notify_wfd = async->notify_fd;
+    return FPP_OK;
+#else
+    int fds[2];
+
+    if (pipe(fds) != 0) {
+        return FPP_FAILURE;
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    async->notify_fd = fds[0];
+    async->notify_wfd = fds[1];
+    return FPP_OK;
+#endif
+}
+
+static void
+fpp_async_signal(fpp_async_t *async)
+{
+    uint64_t one = 1;
+    ssize_t n;
+
+    /* A full pipe or counter already means "readable" */
+#if (__linux__)
+    n = write(async->notify_wfd, &one, sizeof(one));
+#else
+    n = write(async->notify_wfd, &one, 1);
+#endif
+    (void) n;
+}
+
+static void
+fpp_async_drain(fpp_async_t *async)
+{
+    uint8_t buf[64];
+
+    while (read(async->notify_fd, buf, sizeof(buf)) > 0) {
+        /* void */
+    }
+}
+
+static void
+fpp_async_worker_init(void *arg, size_t index)
+{
+    fpp_async_t *async = arg;
+
+    (void) index;
+    fpp_ctx_lower_priority(async->ctx);
+}
+
+fpp_async_t *
+fpp_async_create(fpp_ctx_t *ctx, const fpp_async_config_t *config)
+{
+    fpp_async_t *async;
+
+    async = calloc(1, sizeof(fpp_async_t));
+    if (!async) {
+        return NULL;
+    }
+
+    async->ctx = ctx;
+    async->notify_fd = -1;
+    async->notify_wfd = -1;
+    if (config) {
+        async->config = *config;
+    }
+    else {
+        fpp_async_config_init(&async->config);
+    }
+
+    if (pthread_mutex_init(&async->lock, NULL) != 0) {
+        free(async);
+        return NULL;
+    }
+
+    if (async->config.notify == FPP_ASYNC_NOTIFY_FD) {
+        if (fpp_async_open_notify_fd(async) != FPP_OK) {
+            fpp_log_error(fpp_get_os_errno(),
+                "Failed to create completion descriptor");
+            goto failed;
+        }
+    }
+
+    async->pool = fpp_thread_pool_create_ex(async->config.nworkers,
+        fpp_async_worker_init, async);
+    if (!async->pool) {
+        fpp_log_error(FPP_FAILURE, "Failed to start worker threads");
+        goto failed;
+    }
+
+    return async;
+
+failed:
+    if (async->notify_fd != -1) {
+        close(async->notify_fd);
+    }
+    if (async->notify_wfd != -1 && async->notify_wfd != async->notify_fd) {
+        close(async->notify_wfd);
+    }
+    pthread_mutex_destroy(&async->lock);
+    free(async);
+    return NULL;
+}
+
+static void
+fpp_async_job_free(fpp_async_job_t *ajob)
+{
+    /* The strings include the pass phrase */
+    fpp_explicit_memzero((uint8_t *) ajob->strings, ajob->strings_size);
+    free(ajob->strings);
+    free(ajob);
+}
+
+static void
+fpp_async_deliver(fpp_async_job_t *ajob)
+{
+    ajob->handler(ajob, ajob->status, ajob->data);
+    fpp_async_job_free(ajob);
+}
+
+void
+fpp_async_destroy(fpp_async_t *async)
+{
+    fpp_async_job_t *ajob;
+
+    pthread_mutex_lock(&async->lock);
+    for (ajob = async->jobs; ajob; ajob = ajob->next) {
+        __atomic_store_n(&ajob->job.canceled, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&async->lock);
+
+    /* Workers finish the queue quickly as every job is canceled */
+    fpp_thread_pool_destroy(async->pool);
+
+    fpp_async_process_completions(async);
+
+    if (async->notify_fd != -1) {
+        close(async->notify_fd);
+    }
+    if (async->notify_wfd != async->notify_fd) {
+        close(async->notify_wfd);
+    }
+    pthread_mutex_destroy(&async->lock);
+    free(async);
+}
+
+int
+fpp_async_get_fd(const fpp_async_t *async)
+{
+    return async->notify_fd;
+}
+
+size_t
+fpp_async_process_completions(fpp_async_t *async)
+{
+    fpp_async_job_t *ajob, *next;
+    size_t n;
+
+    if (async->notify_fd != -1) {
+        fpp_async_drain(async);
+    }
+
+    pthread_mutex_lock(&async->lock);
+    ajob = async->done_head;
+    async->done_head = NULL;
+    async->done_tail = NULL;
+    pthread_mutex_unlock(&async->lock);
+
+    for (n = 0; ajob; ajob = next, ++n) {
+        next = ajob->done_next;
+        fpp_async_deliver(ajob);
+    }
+
+    return n;
+}
+
+static void
+fpp_async_worker_handler(void *arg)
+{
+    fpp_async_job_t *ajob = arg;
+    fpp_async_t *async = ajob->async;
+    bool notify;
+
+    if (__atomic_load_n(&ajob->job.canceled, __ATOMIC_RELAXED)) {
+        ajob->status = FPP_ERR_JOB_CANCELED;
+    }
+    else {
+        ajob->status = fpp_ctx_run_job(async->ctx, &ajob->job);
+        if (ajob->status != FPP_OK &&
+            __atomic_load_n(&ajob->job.canceled, __ATOMIC_RELAXED))
+        {
+            ajob->status = FPP_ERR_JOB_CANCELED;
+        }
+    }
+
+    pthread_mutex_lock(&async->lock);
+
+    if (ajob->prev) {
+        ajob->prev->next = ajob->next;
+    }
+    else {
+        async->jobs = ajob->next;
+    }
+    if (ajob->next) {
+        ajob->next->prev = ajob->prev;
+    }
+    async->njobs--;
+
+    notify = (async->config.notify == FPP_ASYNC_NOTIFY_FD);
+    if (notify) {
+        ajob->done_next = NULL;
+        if (async->done_tail) {
+            async->done_tail->done_next = ajob;
+        }
+        else {
+            async->done_head = ajob;
+        }
+        async->done_tail = ajob;
+    }
+
+    pthread_mutex_unlock(&async->lock);
+
+    if (notify) {
+        fpp_async_signal(async);
+    }
+    else {
+        fpp_async_deliver(ajob);
+    }
+}
+
+static char *
+fpp_async_copy_string(char **p, const char *str)
+{
+    char *copy;
+    size_t len;
+
+    if (!str) {
+        return NULL;
+    }
+    len = strlen(str) + 1;
+    copy = memcpy(*p, str, len);
+    *p += len;
+    return copy;
+}
+
+static fpp_err_t
+fpp_async_submit(fpp_async_t *async, const fpp_crypto_params_t *params,
+    fpp_mode_t mode, fpp_async_handler_pt handler, void *data,
+    fpp_async_job_t **job)
+{
+    fpp_async_job_t *ajob;
+    const char *strings[5];
+    size_t i, size;
+    char *p;
+
+    ajob = calloc(1, sizeof(fpp_async_job_t));
+    if (!ajob) {
+        return FPP_FAILURE;
+    }
+
+    strings[0] = params->in_fname;
+    strings[1] = params->out_fname;
+    strings[2] = params->header_fname;
+    strings[3] = params->text_passwd;
+    strings[4] = params->algo_name;
+
+    for (size = 0, i = 0; i < 5; ++i) {
+        if (strings[i]) {
+            size += strlen(strings[i]) + 1;
+        }
+    }
+
+    ajob->strings = malloc(size);
+    if (!ajob->strings) {
+        free(ajob);
+        return FPP_FAILURE;
+    }
+    ajob->strings_size = size;
+
+    p = ajob->strings;
+    ajob->params.in_fname = fpp_async_copy_string(&p, params->in_fname);
+    ajob->params.out_fname = fpp_async_copy_string(&p, params->out_fname);
+    ajob->params.header_fname = fpp_async_copy_string(&p,
+        params->header_fname);
+    ajob->params.text_passwd = fpp_async_copy_string(&p,
+        params->text_passwd);
+    ajob->params.algo_name = fpp_async_copy_string(&p, params->algo_name);
+    ajob->params.iter = params->iter;
+
+    fpp_job_init(&ajob->job, &ajob->params, mode);
+    ajob->async = async;
+    ajob->handler = handler;
+    ajob->data = data;
+
+    pthread_mutex_lock(&async->lock);
+
+    if (async->config.max_jobs && async->njobs >= async->config.max_jobs) {
+        pthread_mutex_unlock(&async->lock);
+        fpp_async_job_free(ajob);
+        return FPP_ERR_JOB_BUSY;
+    }
+
+    ajob->next = async->jobs;
+    if (async->jobs) {
+        async->jobs->prev = ajob;
+    }
+    async->jobs = ajob;
+    async->njobs++;
+
+    /* The handle must be valid before a worker can complete the job */
+    if (job) {
+        *job = ajob;
+    }
+
+    if (fpp_thread_pool_post(async->pool, fpp_async_worker_handler,
+        ajob) != FPP_OK)
+    {
+        async->jobs = ajob->next;
+        if (ajob->next) {
+            ajob->next->prev = NULL;
+        }
+        async->njobs--;
+        pthread_mutex_unlock(&async->lock);
+        fpp_async_job_free(ajob);
+        if (job) {
+            *job = NULL;
+        }
+        return FPP_FAILURE;
+    }
+
+    pthread_mutex_unlock(&async->lock);
+
+    return FPP_OK;
+}
+
+fpp_err_t
+fpp_async_encrypt_file(fpp_async_t *async, const fpp_crypto_params_t *params,
+    fpp_async_handler_pt handler, void *data, fpp_async_job_t **job)
+{
+    return fpp_async_submit(async, params, FPP_MODE_ENCRYPT, handler, data,
+        job);
+}
+
+fpp_err_t
+fpp_async_decrypt_file(fpp_async_t *async, const fpp_crypto_params_t *params,
+    fpp_async_handler_pt handler, void *data, fpp_async_job_t **job)
+{
+    return fpp_async_submit(async, params, FPP_MODE_DECRYPT, handler, data,
+        job);
+}
+
+void
+fpp_async_cancel(fpp_async_job_t *job)
+{
+    __atomic_store_n(&job->job.canceled, 1, __ATOMIC_RELAXED);
+}
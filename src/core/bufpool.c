@@ -0,0 +1,314 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#if !(_WIN32)
+#include <sys/mman.h>
+#endif
+
+#include "bufpool.h"
+#include "secmem.h"
+#include "memory.h"
+#include "cpu.h"
+
+#define FPP_BUFPOOL_HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+
+struct fpp_bufpool_s {
+    pthread_mutex_t lock;
+    size_t stride;
+    size_t nbufs;
+    /* Region buffers handed out so far, the ones above are untouched */
+    size_t nfresh;
+
+    uint8_t *region;
+    uint8_t *map_base;
+    size_t map_size;
+    /* Replaces the region with FPP_BUFPOOL_LOCKED */
+    fpp_secmem_t *arena;
+
+    /* Released buffers, linked through their first word */
+    void *free_list;
+
+    fpp_buffer_stats_t stats;
+};
+
+
+#if (_WIN32)
+
+static fpp_err_t
+fpp_bufpool_map(fpp_bufpool_t *pool, bool huge_pages, int node)
+{
+    (void) huge_pages;
+    (void) node;
+
+    pool->map_size = pool->stride * pool->nbufs;
+    pool->map_base = _aligned_malloc(pool->map_size, FPP_BUFPOOL_ALIGNMENT);
+    if (!pool->map_base) {
+        return FPP_FAILURE;
+    }
+    pool->region = pool->map_base;
+    return FPP_OK;
+}
+
+static void
+fpp_bufpool_unmap(fpp_bufpool_t *pool)
+{
+    _aligned_free(pool->map_base);
+}
+
+static void *
+fpp_bufpool_heap_alloc(size_t size)
+{
+    return _aligned_malloc(size, FPP_BUFPOOL_ALIGNMENT);
+}
+
+static void
+fpp_bufpool_heap_free(void *buf)
+{
+    _aligned_free(buf);
+}
+
+#else
+
+static fpp_err_t
+fpp_bufpool_map(fpp_bufpool_t *pool, bool huge_pages, int node)
+{
+    size_t size;
+    void *base;
+
+    size = pool->stride * pool->nbufs;
+
+#if defined(MAP_HUGETLB)
+    /* Succeeds only if the administrator reserved enough huge pages */
+    if (huge_pages) {
+        pool->map_size = fpp_align_up(size, FPP_BUFPOOL_HUGE_PAGE_SIZE);
+        base = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED) {
+            pool->map_base = base;
+            pool->region = base;
+            pool->stats.huge_pages = true;
+            fpp_cpu_bind_memory(base, pool->map_size, node);
+            return FPP_OK;
+        }
+    }
+#endif
+
+    /* Transparent huge pages need a huge page aligned range */
+    pool->map_size = size + (huge_pages ? FPP_BUFPOOL_HUGE_PAGE_SIZE : 0);
+    base = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return FPP_FAILURE;
+    }
+    pool->map_base = base;
+    pool->region = base;
+    fpp_cpu_bind_memory(base, pool->map_size, node);
+
+#if defined(MADV_HUGEPAGE)
+    if (huge_pages) {
+        pool->region = (uint8_t *) fpp_align_up((uintptr_t) base,
+            FPP_BUFPOOL_HUGE_PAGE_SIZE);
+        if (madvise(pool->region, fpp_align_up(size,
+            FPP_BUFPOOL_HUGE_PAGE_SIZE), MADV_HUGEPAGE) == 0)
+        {
+            pool->stats.huge_pages = true;
+        }
+    }
+#endif
+
+    return FPP_OK;
+}
+
+static void
+fpp_bufpool_unmap(fpp_bufpool_t *pool)
+{
+    munmap(pool->map_base, pool->map_size);
+}
+
+static void *
+fpp_bufpool_heap_alloc(size_t size)
+{
+    void *buf;
+
+    if (posix_memalign(&buf, FPP_BUFPOOL_ALIGNMENT, size) != 0) {
+        return NULL;
+    }
+    return buf;
+}
+
+static void
+fpp_bufpool_heap_free(void *buf)
+{
+    free(buf);
+}
+
+#endif
+
+fpp_bufpool_t *
+fpp_bufpool_create(size_t buf_size, size_t nbufs, int flags, int node)
+{
+    fpp_bufpool_t *pool;
+
+    if (buf_size == 0 || nbufs == 0) {
+        return NULL;
+    }
+
+    pool = calloc(1, sizeof(fpp_bufpool_t));
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->stride = fpp_align_up(buf_size, FPP_BUFPOOL_ALIGNMENT);
+    pool->nbufs = nbufs;
+    pool->stats.buffer_size = buf_size;
+    pool->stats.reserved = nbufs;
+
+    if (flags & FPP_BUFPOOL_LOCKED) {
+        /* Slots of a page or more are page aligned and guarded */
+        pool->arena = fpp_secmem_create(pool->stride, nbufs, node);
+        if (!pool->arena) {
+            free(pool);
+            return NULL;
+        }
+        pool->stats.locked = fpp_secmem_is_locked(pool->arena);
+    }
+    else if (fpp_bufpool_map(pool, flags & FPP_BUFPOOL_HUGE_PAGES, node)
+        != FPP_OK)
+    {
+        free(pool);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        if (pool->arena) {
+            fpp_secmem_destroy(pool->arena);
+        }
+        else {
+            fpp_bufpool_unmap(pool);
+        }
+        free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+bool
+fpp_bufpool_owns(const fpp_bufpool_t *pool, const void *buf)
+{
+    const uint8_t *p = buf;
+
+    if (pool->arena) {
+        return fpp_secmem_owns(pool->arena, buf);
+    }
+    return p >= pool->region && p < pool->region + pool->nbufs * pool->stride;
+}
+
+void
+fpp_bufpool_destroy(fpp_bufpool_t *pool)
+{
+    void *buf;
+
+    if (!pool) {
+        return;
+    }
+
+    /* Only heap buffers need to be released one by one */
+    while (pool->free_list) {
+        buf = pool->free_list;
+        pool->free_list = *(void **) buf;
+        if (!fpp_bufpool_owns(pool, buf)) {
+            fpp_bufpool_heap_free(buf);
+        }
+    }
+
+    if (pool->arena) {
+        fpp_secmem_destroy(pool->arena);
+    }
+    else {
+        fpp_bufpool_unmap(pool);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+void *
+fpp_bufpool_alloc(fpp_bufpool_t *pool)
+{
+    void *buf = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->free_list) {
+        buf = pool->free_list;
+        pool->free_list = *(void **) buf;
+        pool->stats.reuses++;
+    }
+    else if (pool->nfresh < pool->nbufs) {
+        if (pool->arena) {
+            buf = fpp_secmem_alloc(pool->arena);
+        }
+        else {
+            buf = pool->region + pool->nfresh * pool->stride;
+        }
+        pool->nfresh++;
+        pool->stats.fresh++;
+    }
+
+    if (buf) {
+        pool->stats.allocs++;
+        if (++pool->stats.in_use > pool->stats.peak_in_use) {
+            pool->stats.peak_in_use = pool->stats.in_use;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (buf) {
+        return buf;
+    }
+
+    /* More buffers in flight than reserved */
+    buf = fpp_bufpool_heap_alloc(pool->stride);
+    if (!buf) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.allocs++;
+    pool->stats.heap_allocs++;
+    if (++pool->stats.in_use > pool->stats.peak_in_use) {
+        pool->stats.peak_in_use = pool->stats.in_use;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return buf;
+}
+
+void
+fpp_bufpool_free(fpp_bufpool_t *pool, void *buf)
+{
+    pthread_mutex_lock(&pool->lock);
+    *(void **) buf = pool->free_list;
+    pool->free_list = buf;
+    pool->stats.in_use--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+fpp_bufpool_get_stats(fpp_bufpool_t *pool, fpp_buffer_stats_t *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -13,6 +13,7 @@
 #include <openssl/camellia.h>
 
 #include "camellia128.h"
+#include "probes.h"
 
 
 fpp_err_t
@@ -24,6 +25,8 @@ fpp_encrypt_camellia128_cbc(const uint8_t *in_data, uint32_t in_len,
     int32_t current_len;
     uint32_t result_len;
 
+    FPP_PROBE3(cipher__start, "camellia128", 0, in_len);
+
     /* Create and initialise the context. */
     ctx = EVP_CIPHER_CTX_new();
     if (!ctx) {
@@ -58,6 +61,8 @@ fpp_encrypt_camellia128_cbc(const uint8_t *in_data, uint32_t in_len,
 
     *out_len = result_len;
 
+    FPP_PROBE3(cipher__done, "camellia128", 0, result_len);
+
     return FPP_OK;
 
 failed:
@@ -76,6 +81,8 @@ fpp_decrypt_camellia128_cbc(const uint8_t *in_data, uint32_t in_len,
     int32_t current_len;
     uint32_t result_len;
 
+    FPP_PROBE3(cipher__start, "camellia128", 1, in_len);
+
     /* Create and initialise the context. */
     ctx = EVP_CIPHER_CTX_new();
     if (!ctx) {
@@ -110,6 +117,8 @@ fpp_decrypt_camellia128_cbc(const uint8_t *in_data, uint32_t in_len,
 
     *out_len = result_len;
 
+    FPP_PROBE3(cipher__done, "camellia128", 1, result_len);
+
     return FPP_OK;
 
 failed:
@@ -0,0 +1,219 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+
+#include "cipher.h"
+#include "cpu.h"
+#include "stats.h"
+#include "encrypt_file.h"
+#include "aes128.h"
+#include "aes256.h"
+#include "blowfish.h"
+#include "cast5.h"
+#include "camellia128.h"
+#include "camellia256.h"
+
+#define fpp_array_size(a)  (sizeof(a) / sizeof(a[0]))
+
+/* Every candidate encrypts this many bytes, after one untimed round */
+#define FPP_CIPHER_PROBE_SIZE    (64 * 1024)
+#define FPP_CIPHER_PROBE_ROUNDS  8
+/* Probes per candidate, the fastest one counts */
+#define FPP_CIPHER_PROBE_REPEAT  5
+/* Percent a candidate must beat the fallback by to replace it */
+#define FPP_CIPHER_PROBE_MARGIN  20
+
+
+static const fpp_cipher_t fpp_ciphers[] = {
+    {
+        "aes128", FPP_ALGO_AES128, "AES-128-CBC", EVP_aes_128_cbc,
+        FPP_KEYSIZE_AES128, FPP_IVSIZE_AES128, FPP_AES_BLOCK_SIZE,
+        fpp_encrypt_aes128_cbc, fpp_decrypt_aes128_cbc
+    },
+    {
+        "aes256", FPP_ALGO_AES256, "AES-256-CBC", EVP_aes_256_cbc,
+        FPP_KEYSIZE_AES256, FPP_IVSIZE_AES256, FPP_AES_BLOCK_SIZE,
+        fpp_encrypt_aes256_cbc, fpp_decrypt_aes256_cbc
+    },
+    {
+        "blowfish", FPP_ALGO_BLOWFISH, "BF-CBC", EVP_bf_cbc,
+        FPP_KEYSIZE_BLOWFISH, FPP_IVSIZE_BLOWFISH, FPP_BLOWFISH_BLOCK_SIZE,
+        fpp_encrypt_blowfish_cbc, fpp_decrypt_blowfish_cbc
+    },
+    {
+        "cast5", FPP_ALGO_CAST5, "CAST5-CBC", EVP_cast5_cbc,
+        FPP_KEYSIZE_CAST5, FPP_IVSIZE_CAST5, FPP_CAST5_BLOCK_SIZE,
+        fpp_encrypt_cast5_cbc, fpp_decrypt_cast5_cbc
+    },
+    {
+        "camellia128", FPP_ALGO_CAMELLIA128, "CAMELLIA-128-CBC",
+        EVP_camellia_128_cbc,
+        FPP_KEYSIZE_CAMELLIA128, FPP_IVSIZE_CAMELLIA128,
+        FPP_CAMELLIA128_BLOCK_SIZE,
+        fpp_encrypt_camellia128_cbc, fpp_decrypt_camellia128_cbc
+    },
+    {
+        "camellia256", FPP_ALGO_CAMELLIA256, "CAMELLIA-256-CBC",
+        EVP_camellia_256_cbc,
+        FPP_KEYSIZE_CAMELLIA256, FPP_IVSIZE_CAMELLIA256,
+        FPP_CAMELLIA256_BLOCK_SIZE,
+        fpp_encrypt_camellia256_cbc, fpp_decrypt_camellia256_cbc
+    }
+};
+
+
+/*
+ * Candidates of fpp_cipher_select(), the first one is the default and
+ * the fallback. All have its key size, auto never trades key size for
+ * speed.
+ */
+static const uint32_t fpp_cipher_auto_algos[] = {
+    FPP_ALGO_AES256,
+    FPP_ALGO_CAMELLIA256
+};
+
+static pthread_once_t fpp_cipher_auto_once = PTHREAD_ONCE_INIT;
+static const fpp_cipher_t *fpp_cipher_auto;
+
+/* Nanoseconds to encrypt the probe, 0 if the cipher can't be used */
+static uint64_t
+fpp_cipher_probe(const fpp_cipher_t *cipher, EVP_CIPHER_CTX *cipher_ctx,
+    const uint8_t *in, uint8_t *out)
+{
+    static const uint8_t key[EVP_MAX_KEY_LENGTH];
+    static const uint8_t iv[EVP_MAX_IV_LENGTH];
+    uint64_t start = 0;
+    int i, len;
+
+    if (EVP_EncryptInit_ex(cipher_ctx, cipher->evp_cipher(), NULL, key,
+        iv) != 1)
+    {
+        return 0;
+    }
+
+    for (i = 0; i <= FPP_CIPHER_PROBE_ROUNDS; ++i) {
+        if (i == 1) {
+            start = fpp_time_ns();
+        }
+        if (EVP_EncryptUpdate(cipher_ctx, out, &len, in,
+            FPP_CIPHER_PROBE_SIZE) != 1)
+        {
+            return 0;
+        }
+    }
+    return fpp_time_ns() - start + 1;
+}
+
+/*
+ * AES instructions make AES the fastest, and constant-time, so the
+ * default stays. Elsewhere the candidates are probed in turn a few
+ * times, and another one replaces the default only if its best probe
+ * is faster by a clear margin, so that noise doesn't flip the choice.
+ */
+static void
+fpp_cipher_select_once(void)
+{
+    static uint8_t in[FPP_CIPHER_PROBE_SIZE];
+    static uint8_t out[FPP_CIPHER_PROBE_SIZE + EVP_MAX_BLOCK_LENGTH];
+    uint64_t best[fpp_array_size(fpp_cipher_auto_algos)];
+    const fpp_cipher_t *cipher;
+    EVP_CIPHER_CTX *cipher_ctx;
+    uint64_t ns;
+    size_t i, r;
+
+    fpp_cipher_auto = fpp_cipher_by_algo(fpp_cipher_auto_algos[0]);
+
+    if (fpp_cpu_features() & (FPP_CPU_AESNI | FPP_CPU_ARMV8_AES)) {
+        return;
+    }
+
+    cipher_ctx = EVP_CIPHER_CTX_new();
+    if (!cipher_ctx) {
+        return;
+    }
+
+    memset(best, 0, sizeof(best));
+    for (r = 0; r < FPP_CIPHER_PROBE_REPEAT; ++r) {
+        for (i = 0; i < fpp_array_size(fpp_cipher_auto_algos); ++i) {
+            cipher = fpp_cipher_by_algo(fpp_cipher_auto_algos[i]);
+            ns = fpp_cipher_probe(cipher, cipher_ctx, in, out);
+            if (ns && (!best[i] || ns < best[i])) {
+                best[i] = ns;
+            }
+        }
+    }
+
+    EVP_CIPHER_CTX_free(cipher_ctx);
+
+    if (!best[0]) {
+        return;
+    }
+    for (i = 1; i < fpp_array_size(fpp_cipher_auto_algos); ++i) {
+        if (best[i] && best[i] * 100
+            < best[0] * (100 - FPP_CIPHER_PROBE_MARGIN))
+        {
+            fpp_cipher_auto = fpp_cipher_by_algo(fpp_cipher_auto_algos[i]);
+            best[0] = best[i];
+        }
+    }
+}
+
+const fpp_cipher_t *
+fpp_cipher_select(void)
+{
+    pthread_once(&fpp_cipher_auto_once, fpp_cipher_select_once);
+    return fpp_cipher_auto;
+}
+
+const fpp_cipher_t *
+fpp_cipher_by_name(const char *name)
+{
+    size_t i;
+
+    if (strcmp(name, FPP_CIPHER_AUTO) == 0) {
+        return fpp_cipher_select();
+    }
+
+    for (i = 0; i < fpp_array_size(fpp_ciphers); ++i) {
+        if (strcmp(name, fpp_ciphers[i].name) == 0) {
+            return &fpp_ciphers[i];
+        }
+    }
+    return NULL;
+}
+
+const fpp_cipher_t *
+fpp_cipher_by_algo(uint32_t algo)
+{
+    size_t i;
+
+    for (i = 0; i < fpp_array_size(fpp_ciphers); ++i) {
+        if (fpp_ciphers[i].algo == algo) {
+            return &fpp_ciphers[i];
+        }
+    }
+    return NULL;
+}
+
+const fpp_cipher_t *
+fpp_cipher_at(size_t index)
+{
+    if (index >= fpp_array_size(fpp_ciphers)) {
+        return NULL;
+    }
+    return &fpp_ciphers[index];
+}
+
+size_t
+fpp_cipher_count(void)
+{
+    return fpp_array_size(fpp_ciphers);
+}
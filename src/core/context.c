@@ -0,0 +1,910 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#if (OPENSSL_VERSION_NUMBER >= 0x30200000L)
+#include <openssl/thread.h>
+#endif
+
+#include "context_internal.h"
+#include "aes_mb.h"
+#include "memory.h"
+#include "sha256.h"
+#include "log.h"
+
+typedef fpp_err_t (*fpp_file_handler_pt)(fpp_ctx_t *ctx,
+    const fpp_crypto_params_t *params);
+
+typedef struct {
+    fpp_ctx_t *ctx;
+    const fpp_crypto_params_t *params;
+    fpp_file_handler_pt handler;
+    fpp_err_t *result;
+    fpp_wait_group_t *wg;
+    /* Small AES files encrypted together, see fpp_ctx_encrypt_group() */
+    const fpp_crypto_params_t *group[FPP_AES_MB_LANES];
+    fpp_err_t *group_results[FPP_AES_MB_LANES];
+    size_t ngroup;
+} fpp_batch_task_t;
+
+typedef struct {
+    const fpp_crypto_params_t *params;
+    fpp_err_t *result;
+    uint32_t algo;
+    uint64_t size;
+} fpp_group_candidate_t;
+
+/* Set in pinned workers, see fpp_ctx_worker_init() */
+static __thread fpp_ctx_t *fpp_worker_ctx;
+static __thread size_t fpp_worker_node;
+
+
+void
+fpp_ctx_config_init(fpp_ctx_config_t *config)
+{
+    memset(config, 0, sizeof(fpp_ctx_config_t));
+    config->algo_name = FPP_DEFAULT_ALGO;
+    config->iter = FPP_DEFAULT_ITER;
+    config->kdf = FPP_KDF_PBKDF2;
+    config->kdf_memory = FPP_KDF_DEFAULT_MEMORY;
+    config->kdf_lanes = 0;
+    config->kdf_max_memory = FPP_KDF_DEFAULT_MAX_MEMORY;
+    config->nthreads = 0;
+    config->cpus = NULL;
+    config->numa_pinning = true;
+    config->chunk_size = FPP_DEFAULT_CHUNK_SIZE;
+    config->secure_memory = false;
+    config->huge_pages = false;
+    config->perf_counters = false;
+    config->stats = false;
+    config->plaintext_digest = true;
+    config->manifest_fname = NULL;
+    config->io_rate = 0;
+    config->io_burst = 0;
+    config->nice = 0;
+    config->io_class = FPP_IO_CLASS_DEFAULT;
+    config->io_level = 0;
+}
+
+static fpp_err_t
+fpp_ctx_resolve_ciphers(fpp_ctx_t *ctx)
+{
+    const fpp_cipher_t *cipher;
+    size_t i;
+
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+    /*
+     * Blowfish and CAST5 live in the legacy provider. Use a private
+     * library context so that loading it doesn't change the provider
+     * set of the application we are linked into.
+     */
+    ctx->libctx = OSSL_LIB_CTX_new();
+    if (!ctx->libctx) {
+        return FPP_FAILURE;
+    }
+    ctx->default_provider = OSSL_PROVIDER_load(ctx->libctx, "default");
+    if (!ctx->default_provider) {
+        return FPP_FAILURE;
+    }
+    ctx->legacy_provider = OSSL_PROVIDER_load(ctx->libctx, "legacy");
+#endif
+#if (OPENSSL_VERSION_NUMBER >= 0x30200000L)
+    /* Argon2id runs a lane per thread of this pool, empty by default */
+    OSSL_set_max_threads(ctx->libctx, FPP_KDF_MAX_LANES);
+#endif
+
+    for (i = 0; i < fpp_cipher_count(); ++i) {
+        cipher = fpp_cipher_at(i);
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+        ctx->evp_ciphers[cipher->algo] = EVP_CIPHER_fetch(ctx->libctx,
+            cipher->evp_name, NULL);
+#else
+        ctx->evp_ciphers[cipher->algo] = cipher->evp_cipher();
+#endif
+    }
+
+    /* Unavailable ciphers are reported when a file asks for them */
+    ERR_clear_error();
+    return FPP_OK;
+}
+
+static fpp_err_t
+fpp_ctx_check_kdf(fpp_ctx_t *ctx)
+{
+    const fpp_ctx_config_t *config = &ctx->config;
+    fpp_kdf_params_t kdf;
+
+    kdf.id = config->kdf;
+    kdf.iter = config->iter;
+    kdf.memory = config->kdf_memory;
+    kdf.lanes = config->kdf_lanes;
+
+    if (!fpp_kdf_is_available(fpp_ctx_get_libctx(ctx), kdf.id)) {
+        fpp_log_error(FPP_ERR_IO_ARGV, "KDF \"%s\" is not available",
+            fpp_kdf_name(kdf.id));
+        return FPP_FAILURE;
+    }
+    if (fpp_kdf_check(&kdf) != FPP_OK) {
+        fpp_log_error(FPP_ERR_IO_ARGV,
+            "Invalid %s parameters: %u KiB in %u lane(s)",
+            fpp_kdf_name(kdf.id), kdf.memory, kdf.lanes);
+        return FPP_FAILURE;
+    }
+    if (kdf.id != FPP_KDF_PBKDF2
+        && (uint64_t) kdf.memory * kdf.lanes > config->kdf_max_memory)
+    {
+        fpp_log_error(FPP_ERR_IO_ARGV,
+            "%s needs %u KiB in each of %u lanes, the limit is %u KiB",
+            fpp_kdf_name(kdf.id), kdf.memory, kdf.lanes,
+            config->kdf_max_memory);
+        return FPP_FAILURE;
+    }
+    return FPP_OK;
+}
+
+/*
+ * A pool per node for pinned workers, each with group_size buffers per
+ * worker on the node plus one. Their regions prefer the node's memory,
+ * so pages of locked pools, which are faulted in right here, land on it
+ * as well as those of the others, which a worker touches first.
+ */
+static fpp_err_t
+fpp_ctx_create_buffer_pools(fpp_ctx_t *ctx, int flags)
+{
+    size_t nbufs[FPP_NODE_MAX];
+    fpp_bufpool_t *pool;
+    size_t i, node;
+    int numa_node;
+
+    ctx->nbuffer_pools = ctx->pin_threads ? ctx->topology.nnodes : 1;
+
+    for (i = 0; i < ctx->nbuffer_pools; ++i) {
+        nbufs[i] = 1;
+    }
+    for (i = 0; i < ctx->config.nthreads; ++i) {
+        node = ctx->pin_threads
+            ? fpp_cpu_topology_worker_node(&ctx->topology, i) : 0;
+        nbufs[node] += ctx->group_size;
+    }
+
+    for (i = 0; i < ctx->nbuffer_pools; ++i) {
+        numa_node = (ctx->pin_threads && ctx->topology.nnodes > 1)
+            ? (int) ctx->topology.nodes[i] : FPP_NODE_ANY;
+
+        pool = fpp_bufpool_create(ctx->buffer_size, nbufs[i], flags,
+            numa_node);
+        if (!pool && flags) {
+            /* Out of lockable memory or address space, try plain pages */
+            pool = fpp_bufpool_create(ctx->buffer_size, nbufs[i], 0,
+                numa_node);
+        }
+
+        if (!pool) {
+            return FPP_FAILURE;
+        }
+        ctx->buffer_pools[i] = pool;
+    }
+
+    return FPP_OK;
+}
+
+/*
+ * mlock() can fail on a low RLIMIT_MEMLOCK without failing the arena,
+ * and a pool may have fallen back to plain pages.
+ */
+static bool
+fpp_ctx_is_locked(const fpp_ctx_t *ctx)
+{
+    fpp_buffer_stats_t stats;
+    size_t i;
+
+    if (!ctx->key_arena || !fpp_secmem_is_locked(ctx->key_arena)) {
+        return false;
+    }
+    for (i = 0; i < ctx->nbuffer_pools; ++i) {
+        fpp_bufpool_get_stats(ctx->buffer_pools[i], &stats);
+        if (!stats.locked) {
+            return false;
+        }
+    }
+    return true;
+}
+
+fpp_ctx_t *
+fpp_ctx_create(const fpp_ctx_config_t *config)
+{
+    fpp_ctx_t *ctx;
+    int flags;
+
+    ctx = calloc(1, sizeof(fpp_ctx_t));
+    if (!ctx) {
+        return NULL;
+    }
+
+    if (config) {
+        ctx->config = *config;
+    }
+    else {
+        fpp_ctx_config_init(&ctx->config);
+    }
+
+    if (!ctx->config.algo_name) {
+        ctx->config.algo_name = FPP_DEFAULT_ALGO;
+    }
+    if (ctx->config.iter == 0) {
+        ctx->config.iter = FPP_DEFAULT_ITER;
+    }
+    if (ctx->config.chunk_size == 0) {
+        ctx->config.chunk_size = FPP_DEFAULT_CHUNK_SIZE;
+    }
+    if (ctx->config.kdf_memory == 0) {
+        ctx->config.kdf_memory = FPP_KDF_DEFAULT_MEMORY;
+    }
+    if (ctx->config.kdf_max_memory == 0) {
+        ctx->config.kdf_max_memory = FPP_KDF_DEFAULT_MAX_MEMORY;
+    }
+    if (ctx->config.kdf_lanes == 0) {
+        ctx->config.kdf_lanes = fpp_get_ncpu();
+        if (ctx->config.kdf_lanes > FPP_KDF_MAX_LANES) {
+            ctx->config.kdf_lanes = FPP_KDF_MAX_LANES;
+        }
+        if (ctx->config.kdf_lanes
+            > ctx->config.kdf_max_memory / ctx->config.kdf_memory)
+        {
+            ctx->config.kdf_lanes =
+                ctx->config.kdf_max_memory / ctx->config.kdf_memory;
+        }
+        if (ctx->config.kdf_lanes == 0) {
+            ctx->config.kdf_lanes = 1;
+        }
+    }
+
+    if (fpp_cpu_topology_init(&ctx->topology, ctx->config.cpus) != FPP_OK) {
+        fpp_log_error(FPP_ERR_IO_ARGV, "Invalid CPU list \"%s\"",
+            ctx->config.cpus ? ctx->config.cpus : "");
+        free(ctx);
+        return NULL;
+    }
+    ctx->pin_threads = ctx->config.cpus
+        || (ctx->config.numa_pinning && ctx->topology.nnodes > 1);
+
+    if (ctx->config.nthreads == 0) {
+        ctx->config.nthreads = ctx->topology.ncpus;
+    }
+
+    /* Input chunk followed by output chunk with room for padding */
+    ctx->buffer_out_offset = fpp_align_up(ctx->config.chunk_size,
+        FPP_BUFPOOL_ALIGNMENT);
+    ctx->buffer_size = ctx->buffer_out_offset + ctx->config.chunk_size
+        + EVP_MAX_BLOCK_LENGTH;
+    ctx->job_memory = ctx->buffer_size + FPP_JOB_MEMORY_OVERHEAD;
+
+    fpp_throttle_init(&ctx->throttle, ctx->config.io_rate,
+        ctx->config.io_burst ? ctx->config.io_burst
+            : ctx->config.chunk_size);
+    ctx->base_nice = fpp_throttle_get_nice();
+
+    if (pthread_mutex_init(&ctx->lock, NULL) != 0) {
+        free(ctx);
+        return NULL;
+    }
+    if (pthread_mutex_init(&ctx->kdf_lock, NULL) != 0) {
+        pthread_mutex_destroy(&ctx->lock);
+        free(ctx);
+        return NULL;
+    }
+
+    if (fpp_ctx_resolve_ciphers(ctx) != FPP_OK) {
+        fpp_ctx_destroy(ctx);
+        return NULL;
+    }
+
+    if (fpp_ctx_check_kdf(ctx) != FPP_OK) {
+        fpp_ctx_destroy(ctx);
+        return NULL;
+    }
+
+    if (ctx->config.manifest_fname) {
+        if (strcmp(ctx->config.manifest_fname, "-") == 0) {
+            ctx->manifest = stdout;
+        }
+        else {
+            ctx->manifest = fopen(ctx->config.manifest_fname, "ab");
+        }
+        if (!ctx->manifest) {
+            fpp_log_error(fpp_get_os_errno(),
+                "Failed to open manifest file \"%s\"",
+                ctx->config.manifest_fname);
+            fpp_ctx_destroy(ctx);
+            return NULL;
+        }
+    }
+
+    /*
+     * Locked memory is reserved up front, keys fall back to the heap
+     * if the arena runs out of slots.
+     */
+    ctx->key_arena = fpp_secmem_create(FPP_CTX_KEY_SLOT_SIZE,
+        FPP_CTX_KEY_SLOTS, FPP_NODE_ANY);
+
+    if (ctx->config.secure_memory) {
+        flags = FPP_BUFPOOL_LOCKED;
+    }
+    else if (ctx->config.huge_pages) {
+        flags = FPP_BUFPOOL_HUGE_PAGES;
+    }
+    else {
+        flags = 0;
+    }
+
+    /*
+     * A group takes a buffer per file. Plain pools only map them, but
+     * locked ones would pin eight times the memory, their files are
+     * encrypted one by one so that plaintext never spills to the heap.
+     */
+    ctx->group_size = (fpp_aes_mb_is_accelerated()
+        && !(flags & FPP_BUFPOOL_LOCKED)) ? FPP_AES_MB_LANES : 1;
+
+    if (fpp_ctx_create_buffer_pools(ctx, flags) != FPP_OK) {
+        fpp_ctx_destroy(ctx);
+        return NULL;
+    }
+
+    if (ctx->config.secure_memory && !fpp_ctx_is_locked(ctx)) {
+        fpp_log_error(FPP_FAILURE, "Failed to lock buffers in memory, "
+            "keys and plaintext may be written to swap (raise \"ulimit -l\" "
+            "or lower --threads)");
+    }
+
+    return ctx;
+}
+
+void
+fpp_ctx_destroy(fpp_ctx_t *ctx)
+{
+    size_t i;
+
+    if (!ctx) {
+        return;
+    }
+
+    if (ctx->pool) {
+        fpp_thread_pool_destroy(ctx->pool);
+    }
+
+    for (i = 0; i < ctx->nbuffer_pools; ++i) {
+        fpp_bufpool_destroy(ctx->buffer_pools[i]);
+    }
+    fpp_secmem_destroy(ctx->key_arena);
+
+    if (ctx->manifest && ctx->manifest != stdout) {
+        fclose(ctx->manifest);
+    }
+
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+    for (i = 0; i <= FPP_ALGO_MAX; ++i) {
+        if (ctx->evp_ciphers[i]) {
+            EVP_CIPHER_free((EVP_CIPHER *) ctx->evp_ciphers[i]);
+        }
+    }
+    if (ctx->legacy_provider) {
+        OSSL_PROVIDER_unload(ctx->legacy_provider);
+    }
+    if (ctx->default_provider) {
+        OSSL_PROVIDER_unload(ctx->default_provider);
+    }
+    if (ctx->libctx) {
+        OSSL_LIB_CTX_free(ctx->libctx);
+    }
+#else
+    (void) i;
+#endif
+
+    pthread_mutex_destroy(&ctx->kdf_lock);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+}
+
+const fpp_ctx_config_t *
+fpp_ctx_get_config(const fpp_ctx_t *ctx)
+{
+    return &ctx->config;
+}
+
+void
+fpp_ctx_get_buffer_stats(fpp_ctx_t *ctx, fpp_buffer_stats_t *stats)
+{
+    fpp_buffer_stats_t node;
+    size_t i;
+
+    fpp_bufpool_get_stats(ctx->buffer_pools[0], stats);
+
+    /* Totals of the per-node pools */
+    for (i = 1; i < ctx->nbuffer_pools; ++i) {
+        fpp_bufpool_get_stats(ctx->buffer_pools[i], &node);
+        stats->reserved += node.reserved;
+        stats->allocs += node.allocs;
+        stats->reuses += node.reuses;
+        stats->fresh += node.fresh;
+        stats->heap_allocs += node.heap_allocs;
+        stats->in_use += node.in_use;
+        stats->peak_in_use += node.peak_in_use;
+        stats->huge_pages = stats->huge_pages && node.huge_pages;
+        stats->locked = stats->locked && node.locked;
+    }
+}
+
+void
+fpp_ctx_get_stats(fpp_ctx_t *ctx, fpp_stats_t *stats)
+{
+    pthread_mutex_lock(&ctx->lock);
+    *stats = ctx->stats;
+    pthread_mutex_unlock(&ctx->lock);
+
+    stats->peak_rss = fpp_peak_rss();
+}
+
+void
+fpp_ctx_reset_stats(fpp_ctx_t *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    memset(&ctx->stats, 0, sizeof(fpp_stats_t));
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void
+fpp_ctx_add_stats(fpp_ctx_t *ctx, const fpp_stats_t *stats,
+    uint64_t latency)
+{
+    fpp_phase_stats_t *dst;
+    const fpp_phase_stats_t *src;
+    size_t i;
+
+    pthread_mutex_lock(&ctx->lock);
+
+    ctx->stats.files += stats->files;
+    ctx->stats.bytes += stats->bytes;
+    /* Workers may differ, report only what every one of them had */
+    if (ctx->stats.files == stats->files) {
+        ctx->stats.counters = stats->counters;
+    }
+    else {
+        ctx->stats.counters &= stats->counters;
+    }
+
+    for (i = 0; i < FPP_PHASE_MAX; ++i) {
+        dst = &ctx->stats.phases[i];
+        src = &stats->phases[i];
+        dst->ns += src->ns;
+        dst->bytes += src->bytes;
+        dst->cycles += src->cycles;
+        dst->instructions += src->instructions;
+        dst->cache_misses += src->cache_misses;
+        dst->context_switches += src->context_switches;
+    }
+
+    fpp_histogram_record(&ctx->stats.latency, latency);
+
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Same format as "sha256sum --binary": names with a backslash or a
+ * newline are escaped and the line is marked with a leading backslash.
+ * A line is written and flushed under the lock, so batch workers don't
+ * interleave and a crash loses no finished file.
+ */
+fpp_err_t
+fpp_ctx_add_manifest(fpp_ctx_t *ctx, const char *fname,
+    const uint8_t *checksum)
+{
+    FILE *fd = ctx->manifest;
+    const char *p;
+    size_t i;
+    int rc;
+
+    pthread_mutex_lock(&ctx->lock);
+
+    if (strpbrk(fname, "\\\n")) {
+        fputc('\\', fd);
+    }
+    for (i = 0; i < FPP_SHA256_BUFSIZE; ++i) {
+        fprintf(fd, "%02x", checksum[i]);
+    }
+    fputs(" *", fd);
+    for (p = fname; *p; ++p) {
+        if (*p == '\\') {
+            fputs("\\\\", fd);
+        }
+        else if (*p == '\n') {
+            fputs("\\n", fd);
+        }
+        else {
+            fputc(*p, fd);
+        }
+    }
+    fputc('\n', fd);
+    rc = fflush(fd);
+    if (ferror(fd)) {
+        rc = EOF;
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (rc != 0) {
+        fpp_log_error(fpp_get_os_errno(),
+            "Failed to write manifest file \"%s\"",
+            ctx->config.manifest_fname);
+        return FPP_FAILURE;
+    }
+    return FPP_OK;
+}
+
+const EVP_CIPHER *
+fpp_ctx_get_evp_cipher(fpp_ctx_t *ctx, const fpp_cipher_t *cipher)
+{
+    return ctx->evp_ciphers[cipher->algo];
+}
+
+OSSL_LIB_CTX *
+fpp_ctx_get_libctx(fpp_ctx_t *ctx)
+{
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+    return ctx->libctx;
+#else
+    (void) ctx;
+    return NULL;
+#endif
+}
+
+void
+fpp_ctx_lower_priority(fpp_ctx_t *ctx)
+{
+    if ((ctx->config.nice || ctx->config.io_class != FPP_IO_CLASS_DEFAULT)
+        && fpp_throttle_thread(&ctx->config, ctx->base_nice) != FPP_OK)
+    {
+        /* Not fatal, the worker runs at the priority it has */
+        fpp_log_error(fpp_get_os_errno(), "Failed to lower thread priority");
+    }
+}
+
+static void
+fpp_ctx_worker_init(void *arg, size_t index)
+{
+    fpp_ctx_t *ctx = arg;
+
+    fpp_ctx_lower_priority(ctx);
+
+    if (!ctx->pin_threads) {
+        return;
+    }
+
+    fpp_worker_ctx = ctx;
+    fpp_worker_node = fpp_cpu_topology_worker_node(&ctx->topology, index);
+    if (fpp_cpu_pin_thread(&ctx->topology, fpp_worker_node) != FPP_OK) {
+        /* Not fatal, the worker runs wherever the scheduler puts it */
+        fpp_log_error(fpp_get_os_errno(), "Failed to pin worker thread");
+    }
+}
+
+/* The node whose memory the calling thread should use */
+static size_t
+fpp_ctx_thread_node(fpp_ctx_t *ctx)
+{
+    if (ctx->nbuffer_pools == 1) {
+        return 0;
+    }
+    if (fpp_worker_ctx == ctx) {
+        return fpp_worker_node;
+    }
+    return fpp_cpu_topology_current_node(&ctx->topology);
+}
+
+fpp_thread_pool_t *
+fpp_ctx_get_thread_pool(fpp_ctx_t *ctx)
+{
+    fpp_thread_pool_t *pool;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (!ctx->pool) {
+        ctx->pool = fpp_thread_pool_create_ex(ctx->config.nthreads,
+            fpp_ctx_worker_init, ctx);
+    }
+    pool = ctx->pool;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return pool;
+}
+
+uint8_t *
+fpp_ctx_alloc_key(fpp_ctx_t *ctx)
+{
+    uint8_t *key = NULL;
+
+    if (ctx->key_arena) {
+        key = fpp_secmem_alloc(ctx->key_arena);
+    }
+    if (!key) {
+        key = malloc(FPP_CTX_KEY_SLOT_SIZE);
+    }
+    return key;
+}
+
+void
+fpp_ctx_free_key(fpp_ctx_t *ctx, uint8_t *key)
+{
+    if (ctx->key_arena && fpp_secmem_owns(ctx->key_arena, key)) {
+        fpp_secmem_free(ctx->key_arena, key, FPP_CTX_KEY_SLOT_SIZE);
+        return;
+    }
+    fpp_explicit_memzero(key, FPP_CTX_KEY_SLOT_SIZE);
+    free(key);
+}
+
+/*
+ * A job reads, encrypts and writes a chunk on one worker, so with
+ * a buffer from the worker's node the chunk stays on that node.
+ */
+uint8_t *
+fpp_ctx_alloc_buffer(fpp_ctx_t *ctx)
+{
+    return fpp_bufpool_alloc(ctx->buffer_pools[fpp_ctx_thread_node(ctx)]);
+}
+
+void
+fpp_ctx_free_buffer(fpp_ctx_t *ctx, uint8_t *buf, size_t used)
+{
+    size_t chunk_size = ctx->config.chunk_size;
+    size_t i;
+
+    /* Wipe what the last file left in the input and output halves */
+    if (used > chunk_size) {
+        used = chunk_size;
+    }
+    fpp_explicit_memzero(buf, used);
+    fpp_explicit_memzero(buf + ctx->buffer_out_offset,
+        used + EVP_MAX_BLOCK_LENGTH);
+
+    /* Heap buffers, owned by no pool, go to the one of this node */
+    for (i = 0; i < ctx->nbuffer_pools; ++i) {
+        if (fpp_bufpool_owns(ctx->buffer_pools[i], buf)) {
+            fpp_bufpool_free(ctx->buffer_pools[i], buf);
+            return;
+        }
+    }
+    fpp_bufpool_free(ctx->buffer_pools[fpp_ctx_thread_node(ctx)], buf);
+}
+
+static void
+fpp_ctx_batch_handler(void *arg)
+{
+    fpp_batch_task_t *task = arg;
+    fpp_err_t results[FPP_AES_MB_LANES];
+    size_t i;
+
+    if (task->ngroup) {
+        fpp_ctx_encrypt_group(task->ctx, task->group, task->ngroup, results);
+        for (i = 0; i < task->ngroup; ++i) {
+            *task->group_results[i] = results[i];
+        }
+    }
+    else {
+        *task->result = task->handler(task->ctx, task->params);
+    }
+    fpp_wait_group_done(task->wg);
+}
+
+static int
+fpp_group_candidate_cmp(const void *a, const void *b)
+{
+    const fpp_group_candidate_t *x = a;
+    const fpp_group_candidate_t *y = b;
+
+    if (x->algo != y->algo) {
+        return (x->algo < y->algo) ? -1 : 1;
+    }
+    if (x->size != y->size) {
+        return (x->size < y->size) ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Files that fit in one chunk and use AES go to the multi-buffer
+ * kernel in groups, see fpp_ctx_encrypt_group(). Files of a group are
+ * of about the same size, so that its lanes finish together, and
+ * groups are no larger than it takes to keep every thread busy. Fills
+ * tasks with the groups and marks their files in grouped.
+ */
+static size_t
+fpp_ctx_plan_groups(fpp_ctx_t *ctx, const fpp_crypto_params_t *params,
+    size_t n, fpp_err_t *statuses, size_t nthreads, fpp_batch_task_t *tasks,
+    bool *grouped)
+{
+    fpp_group_candidate_t *cand;
+    const fpp_cipher_t *cipher;
+    const char *algo_name;
+    struct stat st;
+    size_t i, j, k, m, size, ntasks;
+
+    if (n < 2 || ctx->group_size < 2) {
+        return 0;
+    }
+
+    cand = calloc(n, sizeof(fpp_group_candidate_t));
+    if (!cand) {
+        /* Every file is processed on its own then */
+        return 0;
+    }
+
+    m = 0;
+    for (i = 0; i < n; ++i) {
+        algo_name = params[i].algo_name ? params[i].algo_name
+            : ctx->config.algo_name;
+        cipher = fpp_cipher_by_name(algo_name);
+        if (!cipher || (cipher->algo != FPP_ALGO_AES128
+                && cipher->algo != FPP_ALGO_AES256)
+            || stat(params[i].in_fname, &st) != 0 || !S_ISREG(st.st_mode)
+            || (uint64_t) st.st_size > ctx->config.chunk_size)
+        {
+            continue;
+        }
+        cand[m].params = &params[i];
+        cand[m].result = &statuses[i];
+        cand[m].algo = cipher->algo;
+        cand[m].size = (uint64_t) st.st_size;
+        grouped[i] = true;
+        m++;
+    }
+
+    size = (m + nthreads - 1) / nthreads;
+    if (size > ctx->group_size) {
+        size = ctx->group_size;
+    }
+
+    qsort(cand, m, sizeof(fpp_group_candidate_t), fpp_group_candidate_cmp);
+
+    ntasks = 0;
+    for (i = 0; i < m; i = j) {
+        j = i + 1;
+        while (j < m && j - i < size && cand[j].algo == cand[i].algo) {
+            j++;
+        }
+
+        if (j - i < 2) {
+            /* Nothing to interleave with, a task of its own */
+            grouped[cand[i].params - params] = false;
+            continue;
+        }
+        for (k = i; k < j; ++k) {
+            tasks[ntasks].group[k - i] = cand[k].params;
+            tasks[ntasks].group_results[k - i] = cand[k].result;
+        }
+        tasks[ntasks].ngroup = j - i;
+        ntasks++;
+    }
+
+    free(cand);
+    return ntasks;
+}
+
+static fpp_err_t
+fpp_ctx_process_files(fpp_ctx_t *ctx, const fpp_crypto_params_t *params,
+    size_t n, fpp_err_t *results, fpp_file_handler_pt handler)
+{
+    fpp_thread_pool_t *pool;
+    fpp_batch_task_t *tasks = NULL;
+    fpp_err_t *statuses = NULL;
+    bool *grouped = NULL;
+    fpp_wait_group_t wg;
+    fpp_err_t err;
+    size_t i, ntasks;
+
+    if (n == 0) {
+        return FPP_OK;
+    }
+
+    pool = fpp_ctx_get_thread_pool(ctx);
+    if (!pool) {
+        fpp_log_error(FPP_FAILURE, "Failed to start worker threads");
+        return FPP_FAILURE;
+    }
+
+    tasks = calloc(n, sizeof(fpp_batch_task_t));
+    statuses = calloc(n, sizeof(fpp_err_t));
+    grouped = calloc(n, sizeof(bool));
+    if (!tasks || !statuses || !grouped) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to allocate memory");
+        free(tasks);
+        free(statuses);
+        free(grouped);
+        return FPP_FAILURE;
+    }
+
+    if (fpp_wait_group_init(&wg) != FPP_OK) {
+        free(tasks);
+        free(statuses);
+        free(grouped);
+        return FPP_FAILURE;
+    }
+
+    ntasks = 0;
+    if (handler == fpp_ctx_encrypt_file) {
+        ntasks = fpp_ctx_plan_groups(ctx, params, n, statuses,
+            fpp_thread_pool_size(pool), tasks, grouped);
+    }
+    for (i = 0; i < n; ++i) {
+        if (!grouped[i]) {
+            tasks[ntasks].params = &params[i];
+            tasks[ntasks].result = &statuses[i];
+            ntasks++;
+        }
+    }
+
+    for (i = 0; i < ntasks; ++i) {
+        tasks[i].ctx = ctx;
+        tasks[i].handler = handler;
+        tasks[i].wg = &wg;
+
+        fpp_wait_group_add(&wg, 1);
+        if (fpp_thread_pool_post(pool, fpp_ctx_batch_handler,
+            &tasks[i]) != FPP_OK)
+        {
+            /* Out of memory for the queue, run it on our own thread */
+            fpp_ctx_batch_handler(&tasks[i]);
+        }
+    }
+
+    fpp_wait_group_wait(&wg);
+    fpp_wait_group_destroy(&wg);
+
+    err = FPP_OK;
+    for (i = 0; i < n; ++i) {
+        if (statuses[i] != FPP_OK) {
+            err = FPP_FAILURE;
+        }
+        if (results) {
+            results[i] = statuses[i];
+        }
+    }
+
+    free(tasks);
+    free(statuses);
+    free(grouped);
+    return err;
+}
+
+fpp_err_t
+fpp_ctx_encrypt_files(fpp_ctx_t *ctx, const fpp_crypto_params_t *params,
+    size_t n, fpp_err_t *results)
+{
+    return fpp_ctx_process_files(ctx, params, n, results,
+        fpp_ctx_encrypt_file);
+}
+
+fpp_err_t
+fpp_ctx_decrypt_files(fpp_ctx_t *ctx, const fpp_crypto_params_t *params,
+    size_t n, fpp_err_t *results)
+{
+    return fpp_ctx_process_files(ctx, params, n, results,
+        fpp_ctx_decrypt_file);
+}
+
+fpp_err_t
+fpp_ctx_verify_files(fpp_ctx_t *ctx, const fpp_crypto_params_t *params,
+    size_t n, fpp_err_t *results)
+{
+    return fpp_ctx_process_files(ctx, params, n, results,
+        fpp_ctx_verify_file);
+}
@@ -0,0 +1,460 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#if (__linux__)
+/* sched_getaffinity(), sched_getcpu() and the CPU_* macros */
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#if (__linux__)
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+#if (__aarch64__ && __linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "cpu.h"
+#include "thread_pool.h"
+
+/* Node sysfs files and mbind(2), without libnuma */
+#define FPP_NODE_SYSFS_DIR   "/sys/devices/system/node"
+#define FPP_MPOL_PREFERRED   1
+
+/* One bit per CPU number */
+typedef struct {
+    uint64_t bits[FPP_CPU_MAX / 64];
+} fpp_cpu_mask_t;
+
+#define fpp_array_size(a)  (sizeof(a) / sizeof(a[0]))
+
+static const struct {
+    uint32_t bit;
+    const char *name;
+} fpp_cpu_feature_names[] = {
+    { FPP_CPU_AESNI, "aes-ni" },
+    { FPP_CPU_VAES, "vaes" },
+    { FPP_CPU_PCLMUL, "pclmul" },
+    { FPP_CPU_AVX2, "avx2" },
+    { FPP_CPU_AVX512F, "avx512f" },
+    { FPP_CPU_SHANI, "sha-ni" },
+    { FPP_CPU_ARMV8_AES, "armv8-aes" },
+    { FPP_CPU_ARMV8_PMULL, "armv8-pmull" },
+    { FPP_CPU_ARMV8_SHA2, "armv8-sha2" }
+};
+
+static pthread_once_t fpp_cpu_once = PTHREAD_ONCE_INIT;
+static uint32_t fpp_cpu_detected;
+
+static void
+fpp_cpu_detect(void)
+{
+    uint32_t features = 0;
+
+#if ((__x86_64__ || __i386__) && __GNUC__)
+    /* Checks XGETBV too, AVX needs the OS to save the wide registers */
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("aes")) {
+        features |= FPP_CPU_AESNI;
+    }
+    if (__builtin_cpu_supports("vaes")) {
+        features |= FPP_CPU_VAES;
+    }
+    if (__builtin_cpu_supports("pclmul")) {
+        features |= FPP_CPU_PCLMUL;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        features |= FPP_CPU_AVX2;
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        features |= FPP_CPU_AVX512F;
+    }
+    if (__builtin_cpu_supports("sha")) {
+        features |= FPP_CPU_SHANI;
+    }
+#elif (__aarch64__ && __linux__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+
+    if (hwcap & HWCAP_AES) {
+        features |= FPP_CPU_ARMV8_AES;
+    }
+    if (hwcap & HWCAP_PMULL) {
+        features |= FPP_CPU_ARMV8_PMULL;
+    }
+    if (hwcap & HWCAP_SHA2) {
+        features |= FPP_CPU_ARMV8_SHA2;
+    }
+#endif
+
+    fpp_cpu_detected = features;
+}
+
+uint32_t
+fpp_cpu_features(void)
+{
+    pthread_once(&fpp_cpu_once, fpp_cpu_detect);
+    return fpp_cpu_detected;
+}
+
+const char *
+fpp_cpu_features_str(uint32_t features, char *buf, size_t size)
+{
+    size_t i, len;
+    int n;
+
+    if (size == 0) {
+        return buf;
+    }
+    buf[0] = '\0';
+
+    len = 0;
+    for (i = 0; i < fpp_array_size(fpp_cpu_feature_names); ++i) {
+        if (!(features & fpp_cpu_feature_names[i].bit)) {
+            continue;
+        }
+        n = snprintf(buf + len, size - len, "%s%s", len ? " " : "",
+            fpp_cpu_feature_names[i].name);
+        if (n < 0 || (size_t) n >= size - len) {
+            break;
+        }
+        len += (size_t) n;
+    }
+
+    if (len == 0) {
+        snprintf(buf, size, "none");
+    }
+    return buf;
+}
+
+static inline void
+fpp_cpu_mask_set(fpp_cpu_mask_t *mask, size_t cpu)
+{
+    mask->bits[cpu / 64] |= (uint64_t) 1 << (cpu % 64);
+}
+
+static inline bool
+fpp_cpu_mask_isset(const fpp_cpu_mask_t *mask, size_t cpu)
+{
+    return (mask->bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+/* A list as in cpuset(7), "0-3,8,10-11" */
+static fpp_err_t
+fpp_cpu_parse_list(const char *list, fpp_cpu_mask_t *mask)
+{
+    unsigned long first, last, cpu;
+    char *end;
+
+    memset(mask, 0, sizeof(fpp_cpu_mask_t));
+
+    for ( ;; ) {
+        if (*list < '0' || *list > '9') {
+            return FPP_FAILURE;
+        }
+        first = strtoul(list, &end, 10);
+        last = first;
+        if (*end == '-') {
+            list = end + 1;
+            if (*list < '0' || *list > '9') {
+                return FPP_FAILURE;
+            }
+            last = strtoul(list, &end, 10);
+        }
+        if (last < first || last >= FPP_CPU_MAX) {
+            return FPP_FAILURE;
+        }
+        for (cpu = first; cpu <= last; ++cpu) {
+            fpp_cpu_mask_set(mask, cpu);
+        }
+
+        if (*end == '\n') {
+            end++;
+        }
+        if (*end == '\0') {
+            return FPP_OK;
+        }
+        if (*end != ',') {
+            return FPP_FAILURE;
+        }
+        list = end + 1;
+    }
+}
+
+static void
+fpp_cpu_get_allowed(fpp_cpu_mask_t *mask)
+{
+    size_t cpu, ncpu;
+#if (__linux__)
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        memset(mask, 0, sizeof(fpp_cpu_mask_t));
+        for (cpu = 0; cpu < FPP_CPU_MAX && cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                fpp_cpu_mask_set(mask, cpu);
+            }
+        }
+        return;
+    }
+#endif
+
+    memset(mask, 0, sizeof(fpp_cpu_mask_t));
+    ncpu = fpp_get_ncpu();
+    for (cpu = 0; cpu < ncpu && cpu < FPP_CPU_MAX; ++cpu) {
+        fpp_cpu_mask_set(mask, cpu);
+    }
+}
+
+/* System node number of every CPU, -1 for CPUs of no known node */
+static void
+fpp_cpu_get_nodes(int *node_of)
+{
+    size_t cpu;
+#if (__linux__)
+    char path[300], list[4096];
+    fpp_cpu_mask_t mask;
+    struct dirent *entry;
+    unsigned long node;
+    char *end;
+    FILE *fd;
+    DIR *dir;
+    size_t n;
+#endif
+
+    for (cpu = 0; cpu < FPP_CPU_MAX; ++cpu) {
+        node_of[cpu] = -1;
+    }
+
+#if (__linux__)
+    dir = opendir(FPP_NODE_SYSFS_DIR);
+    if (!dir) {
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) != 0
+            || entry->d_name[4] < '0' || entry->d_name[4] > '9')
+        {
+            continue;
+        }
+        node = strtoul(entry->d_name + 4, &end, 10);
+        if (*end != '\0' || node > UINT16_MAX) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), FPP_NODE_SYSFS_DIR "/%s/cpulist",
+            entry->d_name);
+        fd = fopen(path, "r");
+        if (!fd) {
+            continue;
+        }
+        n = fread(list, 1, sizeof(list) - 1, fd);
+        fclose(fd);
+        list[n] = '\0';
+
+        /* Nodes of memory only have an empty list */
+        if (fpp_cpu_parse_list(list, &mask) != FPP_OK) {
+            continue;
+        }
+        for (cpu = 0; cpu < FPP_CPU_MAX; ++cpu) {
+            if (fpp_cpu_mask_isset(&mask, cpu)) {
+                node_of[cpu] = (int) node;
+            }
+        }
+    }
+
+    closedir(dir);
+#endif
+}
+
+fpp_err_t
+fpp_cpu_topology_init(fpp_cpu_topology_t *topo, const char *cpus)
+{
+    int node_of[FPP_CPU_MAX];
+    fpp_cpu_mask_t allowed, wanted;
+    size_t next[FPP_NODE_MAX];
+    size_t cpu, i, j, k;
+    int node;
+
+    memset(topo, 0, sizeof(fpp_cpu_topology_t));
+
+    fpp_cpu_get_allowed(&allowed);
+    if (cpus) {
+        if (fpp_cpu_parse_list(cpus, &wanted) != FPP_OK) {
+            return FPP_ERR_IO_ARGV;
+        }
+        for (i = 0; i < FPP_CPU_MAX / 64; ++i) {
+            allowed.bits[i] &= wanted.bits[i];
+        }
+    }
+
+    fpp_cpu_get_nodes(node_of);
+
+    /* Nodes in the order of their first CPU, CPUs grouped by node */
+    for (cpu = 0; cpu < FPP_CPU_MAX; ++cpu) {
+        if (!fpp_cpu_mask_isset(&allowed, cpu)) {
+            continue;
+        }
+        node = node_of[cpu] < 0 ? 0 : node_of[cpu];
+        j = 0;
+        while (j < topo->nnodes && topo->nodes[j] != node) {
+            j++;
+        }
+        if (j == topo->nnodes) {
+            if (topo->nnodes == FPP_NODE_MAX) {
+                continue;
+            }
+            topo->nodes[topo->nnodes++] = (uint16_t) node;
+        }
+        topo->node_ncpus[j]++;
+    }
+
+    for (j = 0; j < topo->nnodes; ++j) {
+        for (cpu = 0; cpu < FPP_CPU_MAX; ++cpu) {
+            node = node_of[cpu] < 0 ? 0 : node_of[cpu];
+            if (fpp_cpu_mask_isset(&allowed, cpu) && node == topo->nodes[j]) {
+                topo->cpus[topo->ncpus] = (uint16_t) cpu;
+                topo->cpu_node[topo->ncpus] = (uint8_t) j;
+                topo->ncpus++;
+            }
+        }
+    }
+
+    if (topo->ncpus == 0) {
+        return FPP_ERR_IO_ARGV;
+    }
+
+    /* Round robin over the nodes, each until its CPUs are used up */
+    memset(next, 0, sizeof(next));
+    for (k = 0; k < topo->ncpus; ) {
+        for (j = 0; j < topo->nnodes && k < topo->ncpus; ++j) {
+            if (next[j] < topo->node_ncpus[j]) {
+                next[j]++;
+                topo->worker_node[k++] = (uint8_t) j;
+            }
+        }
+    }
+
+    return FPP_OK;
+}
+
+size_t
+fpp_cpu_topology_worker_node(const fpp_cpu_topology_t *topo, size_t index)
+{
+    return topo->worker_node[index % topo->ncpus];
+}
+
+size_t
+fpp_cpu_topology_current_node(const fpp_cpu_topology_t *topo)
+{
+#if (__linux__)
+    size_t i;
+    int cpu;
+
+    if (topo->nnodes < 2) {
+        return 0;
+    }
+    cpu = sched_getcpu();
+    for (i = 0; cpu >= 0 && i < topo->ncpus; ++i) {
+        if (topo->cpus[i] == cpu) {
+            return topo->cpu_node[i];
+        }
+    }
+#else
+    (void) topo;
+#endif
+    return 0;
+}
+
+#if (__linux__)
+
+static fpp_err_t
+fpp_cpu_set_affinity(const fpp_cpu_topology_t *topo, size_t node)
+{
+    cpu_set_t set;
+    size_t i;
+
+    CPU_ZERO(&set);
+    for (i = 0; i < topo->ncpus; ++i) {
+        if (node == SIZE_MAX || topo->cpu_node[i] == node) {
+            CPU_SET(topo->cpus[i], &set);
+        }
+    }
+    /* The calling thread only, not the whole process */
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        return FPP_FAILURE;
+    }
+    return FPP_OK;
+}
+
+fpp_err_t
+fpp_cpu_pin_thread(const fpp_cpu_topology_t *topo, size_t node)
+{
+    return fpp_cpu_set_affinity(topo, node);
+}
+
+fpp_err_t
+fpp_cpu_restrict(const fpp_cpu_topology_t *topo)
+{
+    return fpp_cpu_set_affinity(topo, SIZE_MAX);
+}
+
+void
+fpp_cpu_bind_memory(void *addr, size_t len, int node)
+{
+    unsigned long mask[FPP_NODE_MAX / (8 * sizeof(unsigned long))];
+
+    if (node < 0 || node >= FPP_NODE_MAX) {
+        return;
+    }
+
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] |=
+        1UL << (node % (8 * sizeof(unsigned long)));
+
+    /* Not fatal if it fails, memory comes from wherever it is free */
+    syscall(SYS_mbind, addr, (unsigned long) len, FPP_MPOL_PREFERRED, mask,
+        (unsigned long) FPP_NODE_MAX + 1, 0);
+}
+
+#else
+
+fpp_err_t
+fpp_cpu_pin_thread(const fpp_cpu_topology_t *topo, size_t node)
+{
+    (void) topo;
+    (void) node;
+    return FPP_FAILURE;
+}
+
+fpp_err_t
+fpp_cpu_restrict(const fpp_cpu_topology_t *topo)
+{
+    (void) topo;
+    return FPP_FAILURE;
+}
+
+void
+fpp_cpu_bind_memory(void *addr, size_t len, int node)
+{
+    (void) addr;
+    (void) len;
+    (void) node;
+}
+
+#endif
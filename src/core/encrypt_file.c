@@ -1,4 +1,4 @@
-/* 
+/*
  * This file is part of FPP (File Protection Program).
  *
  * See LICENSE for licensing information.
@@ -10,23 +10,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
 
 #include "encrypt_file.h"
+#include "context_internal.h"
+#include "cipher.h"
 #include "pbkdf2.h"
-#include "aes128.h"
+#include "kdf.h"
 #include "aes256.h"
-#include "blowfish.h"
-#include "cast5.h"
-#include "camellia128.h"
-#include "camellia256.h"
+#include "aes_mb.h"
+#include "sha3_256.h"
+#include "sha256.h"
 #include "random.h"
 #include "memory.h"
 #include "log.h"
+#include "probes.h"
 
-static const char magic_word[8] = "FPPv1";
-
-#define fpp_padding_size(size, block_size) \
-    ((size/block_size + 1) * block_size)
+static const char magic_word[8] = FPP_MAGIC_WORD;
+static const char magic_word_v1[8] = FPP_MAGIC_WORD_V1;
 
 static bool
 fpp_is_file_exist(const char *fname)
@@ -39,67 +41,351 @@ fpp_is_file_exist(const char *fname)
     return true;
 }
 
-static uint32_t
-fpp_get_algo_magic_word(const char *name)
+/*
+ * Runs the input through the cipher one chunk at a time, so memory use
+ * doesn't depend on the file size. The chunk buffer holds the input
+ * chunk followed by the output chunk. Without out_fd the output is
+ * only checked and dropped.
+ */
+static fpp_err_t
+fpp_cipher_stream(fpp_ctx_t *ctx, fpp_job_t *job, EVP_CIPHER_CTX *cipher_ctx,
+    FILE *in_fd, FILE *out_fd, uint8_t *buf)
 {
-    if (strcmp(name, "aes128") == 0) {
-        return FPP_ALGO_AES128;
+    const fpp_crypto_params_t *params = job->params;
+    size_t chunk_size;
+    size_t bytes_read;
+    size_t bytes_written;
+    uint8_t *in_chunk;
+    uint8_t *out_chunk;
+    int out_len;
+    fpp_err_t err;
+
+    chunk_size = ctx->config.chunk_size;
+    in_chunk = buf;
+    out_chunk = buf + ctx->buffer_out_offset;
+
+    for ( ;; ) {
+        if (__atomic_load_n(&job->canceled, __ATOMIC_RELAXED)) {
+            fpp_log_error(FPP_ERR_JOB_CANCELED, "Processing of \"%s\" canceled",
+                params->in_fname);
+            return FPP_ERR_JOB_CANCELED;
+        }
+
+        fpp_job_enter_phase(job, FPP_PHASE_READ);
+        bytes_read = fread(in_chunk, sizeof(uint8_t), chunk_size, in_fd);
+        if (bytes_read == 0) {
+            break;
+        }
+        if (bytes_read > job->buf_used) {
+            job->buf_used = bytes_read;
+        }
+        fpp_job_add_bytes(job, FPP_PHASE_READ, bytes_read);
+        fpp_job_throttle(ctx, job, bytes_read);
+
+        fpp_job_enter_phase(job, FPP_PHASE_CIPHER);
+        fpp_job_add_bytes(job, FPP_PHASE_CIPHER, bytes_read);
+        FPP_PROBE2(chunk__start, job, bytes_read);
+        /* Hash the plaintext while the chunk is still in cache */
+        if (job->digest && job->mode == FPP_MODE_ENCRYPT
+            && fpp_sha3_256_update(job->digest, in_chunk,
+                bytes_read) != FPP_OK)
+        {
+            goto digest_failed;
+        }
+        if (EVP_CipherUpdate(cipher_ctx, out_chunk, &out_len,
+            in_chunk, bytes_read) != 1)
+        {
+            err = fpp_get_openssl_errno();
+            fpp_log_error(err, "Failed to process data");
+            return FPP_FAILURE;
+        }
+        if (job->digest && job->mode == FPP_MODE_DECRYPT
+            && fpp_sha3_256_update(job->digest, out_chunk,
+                out_len) != FPP_OK)
+        {
+            goto digest_failed;
+        }
+        FPP_PROBE3(chunk__done, job, bytes_read, out_len);
+
+        fpp_job_enter_phase(job, FPP_PHASE_WRITE);
+        fpp_job_add_bytes(job, FPP_PHASE_WRITE, out_len);
+        bytes_written = out_fd
+            ? fwrite(out_chunk, sizeof(uint8_t), out_len, out_fd)
+            : (size_t) out_len;
+        if (bytes_written != (size_t) out_len) {
+            err = fpp_get_os_errno();
+            fpp_log_error(err, "Failed to write data to output file \"%s\"",
+                params->out_fname);
+            return FPP_FAILURE;
+        }
+        if (job->checksum
+            && fpp_sha256_update(job->checksum, out_chunk, out_len) != FPP_OK)
+        {
+            goto digest_failed;
+        }
+        FPP_PROBE2(write__done, job, bytes_written);
+        if (out_fd) {
+            fpp_job_throttle(ctx, job, bytes_written);
+        }
+    }
+
+    if (ferror(in_fd)) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to read data from input file \"%s\"",
+            params->in_fname);
+        return FPP_FAILURE;
+    }
+
+    /* Padding is added or checked and stripped here */
+    fpp_job_enter_phase(job, FPP_PHASE_CIPHER);
+    if (EVP_CipherFinal_ex(cipher_ctx, out_chunk, &out_len) != 1) {
+        err = fpp_get_openssl_errno();
+        fpp_log_error(err, "Failed to finalize data");
+        return (job->mode == FPP_MODE_DECRYPT)
+            ? FPP_ERR_IO_PADDING : FPP_FAILURE;
+    }
+    if (job->digest && job->mode == FPP_MODE_DECRYPT
+        && fpp_sha3_256_update(job->digest, out_chunk, out_len) != FPP_OK)
+    {
+        goto digest_failed;
+    }
+
+    fpp_job_enter_phase(job, FPP_PHASE_WRITE);
+    fpp_job_add_bytes(job, FPP_PHASE_WRITE, out_len);
+    bytes_written = out_fd
+        ? fwrite(out_chunk, sizeof(uint8_t), out_len, out_fd)
+        : (size_t) out_len;
+    if (bytes_written != (size_t) out_len) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to write data to output file \"%s\"",
+            params->out_fname);
+        return FPP_FAILURE;
     }
-    else if (strcmp(name, "aes256") == 0) {
-        return FPP_ALGO_AES256;
+    if (job->checksum
+        && fpp_sha256_update(job->checksum, out_chunk, out_len) != FPP_OK)
+    {
+        goto digest_failed;
     }
-    else if (strcmp(name, "blowfish") == 0) {
-        return FPP_ALGO_BLOWFISH;
+    FPP_PROBE2(write__done, job, bytes_written);
+    if (out_fd) {
+        fpp_job_throttle(ctx, job, bytes_written);
     }
-    else if (strcmp(name, "cast5") == 0) {
-        return FPP_ALGO_CAST5;
+
+    return FPP_OK;
+
+digest_failed:
+    err = fpp_get_openssl_errno();
+    fpp_log_error(err, "Failed to hash data");
+    return FPP_FAILURE;
+}
+
+/* SHA-256 of a file being written through fd, read from its start */
+static fpp_err_t
+fpp_checksum_file(FILE *fd, uint8_t *buf, size_t size, uint8_t *checksum)
+{
+    EVP_MD_CTX *mdctx;
+    size_t n;
+
+    if (fflush(fd) != 0 || fseek(fd, 0, SEEK_SET) != 0) {
+        return FPP_FAILURE;
     }
-    else if (strcmp(name, "camellia128") == 0) {
-        return FPP_ALGO_CAMELLIA128;
+
+    mdctx = fpp_sha256_init();
+    if (!mdctx) {
+        return FPP_FAILURE;
+    }
+    while ((n = fread(buf, sizeof(uint8_t), size, fd)) != 0) {
+        if (fpp_sha256_update(mdctx, buf, n) != FPP_OK) {
+            fpp_sha256_free(mdctx);
+            return FPP_FAILURE;
+        }
     }
-    else if (strcmp(name, "camellia256") == 0) {
-        return FPP_ALGO_CAMELLIA256;
+    if (ferror(fd)) {
+        fpp_sha256_free(mdctx);
+        return FPP_FAILURE;
     }
-    else {
-        return FPP_UNKNOWN_ALGO;
+    return fpp_sha256_final(mdctx, checksum);
+}
+
+static fpp_err_t
+fpp_checksum_header(const fpp_crypto_header_t *header, uint8_t *checksum)
+{
+    EVP_MD_CTX *mdctx;
+
+    mdctx = fpp_sha256_init();
+    if (!mdctx) {
+        return FPP_FAILURE;
     }
+    if (fpp_sha256_update(mdctx, (const uint8_t *) header,
+        sizeof(*header)) != FPP_OK)
+    {
+        fpp_sha256_free(mdctx);
+        return FPP_FAILURE;
+    }
+    return fpp_sha256_final(mdctx, checksum);
 }
 
 fpp_err_t
-fpp_encrypt_file(fpp_crypto_params_t *params)
+fpp_write_header(const fpp_crypto_header_t *header, FILE *fd)
 {
-    static uint8_t key[FPP_KEYSIZE_AES256];
+    if (fseek(fd, 0, SEEK_SET) != 0) {
+        return FPP_FAILURE;
+    }
+    if (fwrite(header, sizeof(uint8_t), sizeof(*header), fd)
+        != sizeof(*header))
+    {
+        return FPP_FAILURE;
+    }
+    return FPP_OK;
+}
 
-    FILE *in_fd = NULL;
-    FILE *out_fd = NULL;
-    FILE *head_fd = NULL;
-    uint8_t *data = NULL;
-    uint8_t *edata = NULL;
-    size_t data_size;
-    size_t edata_size;
-    size_t bytes_read;
-    size_t bytes_written;
-    uint32_t algo_magic_word;
+fpp_err_t
+fpp_read_header(fpp_crypto_header_t *header, FILE *fd)
+{
+    fpp_kdf_params_t kdf;
+    size_t rest;
 
-    /*
-     * We already know encrypted data size by padding size function
-     */
-    uint32_t dummy_len;
+    memset(header, 0, sizeof(*header));
+
+    if (fread(header, sizeof(uint8_t), FPP_HEADER_V1_SIZE, fd)
+        != FPP_HEADER_V1_SIZE)
+    {
+        return FPP_FAILURE;
+    }
+
+    if (memcmp(header->magic_word, magic_word_v1,
+        sizeof(header->magic_word)) == 0)
+    {
+        return FPP_OK;
+    }
+    if (memcmp(header->magic_word, magic_word,
+        sizeof(header->magic_word)) != 0)
+    {
+        return FPP_ERR_IO_FORMAT;
+    }
+
+    rest = sizeof(*header) - FPP_HEADER_V1_SIZE;
+    if (fread((uint8_t *) header + FPP_HEADER_V1_SIZE, sizeof(uint8_t),
+        rest, fd) != rest)
+    {
+        return FPP_FAILURE;
+    }
+
+    /* Written by a later version with features we don't know */
+    if (header->flags & ~(FPP_HEADER_DIGEST | FPP_HEADER_MERKLE)) {
+        return FPP_ERR_IO_FORMAT;
+    }
+
+    kdf.id = header->kdf;
+    kdf.iter = header->iter;
+    kdf.memory = header->kdf_memory;
+    kdf.lanes = header->kdf_lanes;
+    if (kdf.id != FPP_KDF_PBKDF2 && fpp_kdf_check(&kdf) != FPP_OK) {
+        return FPP_ERR_IO_FORMAT;
+    }
+
+    return FPP_OK;
+}
+
+static fpp_err_t
+fpp_derive_key(fpp_ctx_t *ctx, const fpp_crypto_header_t *header,
+    const char *passwd, uint8_t *key)
+{
+    fpp_kdf_params_t kdf;
+
+    kdf.id = header->kdf;
+    kdf.iter = header->iter;
+    kdf.memory = header->kdf_memory;
+    kdf.lanes = header->kdf_lanes;
+
+    return fpp_kdf_derive(fpp_ctx_get_libctx(ctx), &kdf, passwd,
+        strlen(passwd), header->salt, sizeof(header->salt), key,
+        FPP_CTX_KEY_SLOT_SIZE);
+}
+
+/*
+ * scrypt and Argon2id run one at a time per context, with their lanes
+ * and their memory reserved from the budget. A job gives back the held
+ * share of the budget while it waits, so that waiting jobs never hold
+ * what the running one needs.
+ */
+static fpp_err_t
+fpp_ctx_derive_key(fpp_ctx_t *ctx, size_t held,
+    const fpp_crypto_header_t *header, const char *passwd, uint8_t *key)
+{
+    size_t size;
+    fpp_err_t err;
 
+    if (header->kdf == FPP_KDF_PBKDF2) {
+        return fpp_derive_key(ctx, header, passwd, key);
+    }
+
+    /* Checked against kdf_max_memory when the header was read */
+    size = (size_t) header->kdf_memory * 1024 * header->kdf_lanes;
+
+    fpp_memory_release(held);
+    pthread_mutex_lock(&ctx->kdf_lock);
+    fpp_memory_reserve(held + size);
+
+    err = fpp_derive_key(ctx, header, passwd, key);
+
+    fpp_memory_release(size);
+    pthread_mutex_unlock(&ctx->kdf_lock);
+
+    return err;
+}
+
+/* An encryption between its stages, see fpp_ctx_encrypt_group() */
+typedef struct {
+    fpp_job_t *job;
     fpp_crypto_header_t header;
+    const EVP_CIPHER *evp_cipher;
+    FILE *in_fd;
+    FILE *out_fd;
+    FILE *head_fd;
+    EVP_CIPHER_CTX *cipher_ctx;
+    uint8_t *key;
+    uint8_t *buf;
+    bool read_back;
+} fpp_encrypt_t;
+
+static void
+fpp_encrypt_init(fpp_encrypt_t *enc, fpp_job_t *job)
+{
+    memset(enc, 0, sizeof(fpp_encrypt_t));
+    enc->job = job;
+}
+
+/* Check the names, fill in the header and allocate the key slot */
+static fpp_err_t
+fpp_encrypt_open(fpp_ctx_t *ctx, fpp_encrypt_t *enc)
+{
+    fpp_job_t *job = enc->job;
+    const fpp_crypto_params_t *params = job->params;
+    fpp_crypto_header_t *header = &enc->header;
+    const fpp_cipher_t *cipher;
+    const char *algo_name;
     fpp_err_t err;
 
+    algo_name = params->algo_name ? params->algo_name : ctx->config.algo_name;
 
-    memset(&header, 0, sizeof(header));
-    memmove(header.magic_word, magic_word, sizeof(header.magic_word));
-    header.iter = params->iter;
+    memset(header, 0, sizeof(fpp_crypto_header_t));
+    memmove(header->magic_word, magic_word, sizeof(header->magic_word));
+    header->iter = params->iter ? params->iter : ctx->config.iter;
+    if (ctx->config.kdf != FPP_KDF_PBKDF2) {
+        header->kdf = ctx->config.kdf;
+        header->kdf_memory = ctx->config.kdf_memory;
+        header->kdf_lanes = ctx->config.kdf_lanes;
+    }
 
-    in_fd = fopen(params->in_fname, "rb");
-    if (!in_fd) {
+    fpp_job_enter_phase(job, FPP_PHASE_OPEN);
+
+    enc->in_fd = fopen(params->in_fname, "rb");
+    if (!enc->in_fd) {
         err = fpp_get_os_errno();
         fpp_log_error(err, "Failed to open input file \"%s\"",
             params->in_fname);
-        goto failed;
+        return FPP_FAILURE;
     }
 
     /*
@@ -111,403 +397,1043 @@ fpp_encrypt_file(fpp_crypto_params_t *params)
     if (fpp_is_file_exist(params->out_fname)) {
         fpp_log_error(FPP_ERR_IO_EXIST, "Output file \"%s\" already exists",
             params->out_fname);
-        goto failed;
+        return FPP_FAILURE;
     }
 
     if (params->header_fname) {
         if (fpp_is_file_exist(params->header_fname)) {
             fpp_log_error(FPP_ERR_IO_EXIST,
                 "Header file \"%s\" already exists", params->header_fname);
-            goto failed;
+            return FPP_FAILURE;
         }
     }
 
-    algo_magic_word = fpp_get_algo_magic_word(params->algo_name);
-    if (algo_magic_word == FPP_UNKNOWN_ALGO) {
+    cipher = fpp_cipher_by_name(algo_name);
+    if (!cipher) {
         fpp_log_error(FPP_ERR_IO_ARGV, "Unknown algorithm \"%s\"",
-            params->algo_name);
-        goto failed;
-    }
-    header.algo = algo_magic_word;
-
-    fseek(in_fd, 0, SEEK_END);
-    data_size = ftell(in_fd);
-    fseek(in_fd, 0, SEEK_SET);
-
-    /* Stack size may not be enough */
-    data = malloc(data_size * sizeof(uint8_t));
-    if (!data) {
-        err = fpp_get_os_errno();
-        fpp_log_error(err, "Failed to allocate memory");
-        goto failed;
+            algo_name);
+        return FPP_FAILURE;
     }
-
-    bytes_read = fread(data, sizeof(uint8_t), data_size, in_fd);
-    if (bytes_read != data_size) {
-        err = fpp_get_os_errno();
-        fpp_log_error(err, "Failed to read data from input file \"%s\"",
-            params->in_fname);
-        goto failed;
+    enc->evp_cipher = fpp_ctx_get_evp_cipher(ctx, cipher);
+    if (!enc->evp_cipher) {
+        fpp_log_error(FPP_ERR_IO_ARGV, "Algorithm \"%s\" is not available",
+            algo_name);
+        return FPP_FAILURE;
     }
+    header->algo = cipher->algo;
 
     /* Generate random IV */
-    if (fpp_random_bytes(header.iv, sizeof(header.iv)) != FPP_OK) {
+    if (fpp_random_bytes(header->iv, sizeof(header->iv)) != FPP_OK) {
         err = fpp_get_openssl_errno();
         fpp_log_error(err, "Failed to generate random IV");
-        goto failed;
+        return FPP_FAILURE;
     }
 
     /* Genereate salt */
-    if (fpp_random_bytes(header.salt,
-        sizeof(header.salt)) != FPP_OK)
+    if (fpp_random_bytes(header->salt,
+        sizeof(header->salt)) != FPP_OK)
     {
         err = fpp_get_openssl_errno();
         fpp_log_error(err, "Failed to generate random salt");
-        goto failed;
+        return FPP_FAILURE;
+    }
+
+    /* Key slots come from locked memory owned by the context */
+    enc->key = fpp_ctx_alloc_key(ctx);
+    if (!enc->key) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to allocate memory");
+        return FPP_FAILURE;
     }
 
+    return FPP_OK;
+}
+
+static fpp_err_t
+fpp_encrypt_derive(fpp_ctx_t *ctx, fpp_encrypt_t *enc, size_t held)
+{
+    fpp_job_t *job = enc->job;
+    fpp_err_t err;
+
     /* Genereate key */
-    if (fpp_pkcs5_pbkdf2_hmac_sha512(params->text_passwd,
-        strlen(params->text_passwd), header.salt, sizeof(header.salt),
-        params->iter, key, sizeof(key)) != FPP_OK)
+    fpp_job_enter_phase(job, FPP_PHASE_KDF);
+    FPP_PROBE2(kdf__start, job, enc->header.iter);
+    if (fpp_ctx_derive_key(ctx, held, &enc->header,
+        job->params->text_passwd, enc->key) != FPP_OK)
     {
         err = fpp_get_openssl_errno();
-        fpp_log_error(err, "fpp_pkcs5_pbkdf2_hmac_sha256() failed");
-        goto failed;
+        fpp_log_error(err, "Key derivation (%s) failed",
+            fpp_kdf_name(enc->header.kdf));
+        return FPP_FAILURE;
     }
+    FPP_PROBE2(kdf__done, job, enc->header.iter);
 
-    if (algo_magic_word == FPP_ALGO_AES128) {
-        edata_size = fpp_padding_size(data_size, FPP_AES_BLOCK_SIZE);
-        edata = malloc(edata_size * sizeof(uint8_t));
-        if (!edata) {
-            err = fpp_get_os_errno();
-            fpp_log_error(err, "Failed to allocate memory");
-            goto failed;
-        }
-        err = fpp_encrypt_aes128_cbc(data, data_size,
-            edata, &dummy_len, key, header.iv);
-    }
-    else if (algo_magic_word == FPP_ALGO_AES256) {
-        edata_size = fpp_padding_size(data_size, FPP_AES_BLOCK_SIZE);
-        edata = malloc(edata_size * sizeof(uint8_t));
-        if (!edata) {
-            err = fpp_get_os_errno();
-            fpp_log_error(err, "Failed to allocate memory");
-            goto failed;
-        }
-        err = fpp_encrypt_aes256_cbc(data, data_size,
-            edata, &dummy_len, key, header.iv);
-    }
-    else if (algo_magic_word == FPP_ALGO_BLOWFISH) {
-        edata_size = fpp_padding_size(data_size, FPP_BLOWFISH_BLOCK_SIZE);
-        edata = malloc(edata_size * sizeof(uint8_t));
-        if (!edata) {
-            err = fpp_get_os_errno();
-            fpp_log_error(err, "Failed to allocate memory");
-            goto failed;
+    return FPP_OK;
+}
+
+/*
+ * Set up the cipher and the digest, create the output and write the
+ * header. The key slot is freed unless keep_key, see
+ * fpp_ctx_encrypt_group().
+ */
+static fpp_err_t
+fpp_encrypt_setup(fpp_ctx_t *ctx, fpp_encrypt_t *enc, bool keep_key)
+{
+    fpp_job_t *job = enc->job;
+    const fpp_crypto_params_t *params = job->params;
+    fpp_crypto_header_t *header = &enc->header;
+    size_t bytes_written;
+    fpp_err_t err;
+
+    if (ctx->config.plaintext_digest) {
+        job->digest = fpp_sha3_256_init(enc->key + FPP_DIGEST_KEY_OFFSET,
+            FPP_DIGEST_KEY_SIZE);
+        if (!job->digest) {
+            err = fpp_get_openssl_errno();
+            fpp_log_error(err, "Failed to initialize digest");
+            return FPP_FAILURE;
         }
-        err = fpp_encrypt_blowfish_cbc(data, data_size,
-            edata, &dummy_len, key, header.iv);
+        header->flags |= FPP_HEADER_DIGEST;
     }
-    else if (algo_magic_word == FPP_ALGO_CAST5) {
-        edata_size = fpp_padding_size(data_size, FPP_CAST5_BLOCK_SIZE);
-        edata = malloc(edata_size * sizeof(uint8_t));
-        if (!edata) {
-            err = fpp_get_os_errno();
-            fpp_log_error(err, "Failed to allocate memory");
-            goto failed;
-        }
-        err = fpp_encrypt_cast5_cbc(data, data_size,
-            edata, &dummy_len, key, header.iv);
+
+    enc->cipher_ctx = EVP_CIPHER_CTX_new();
+    if (!enc->cipher_ctx) {
+        err = fpp_get_openssl_errno();
+        fpp_log_error(err, "Failed to allocate cipher context");
+        return FPP_FAILURE;
     }
-    else if (algo_magic_word == FPP_ALGO_CAMELLIA128) {
-        edata_size = fpp_padding_size(data_size, FPP_CAMELLIA128_BLOCK_SIZE);
-        edata = malloc(edata_size * sizeof(uint8_t));
-        if (!edata) {
-            err = fpp_get_os_errno();
-            fpp_log_error(err, "Failed to allocate memory");
-            goto failed;
-        }
-        err = fpp_encrypt_camellia128_cbc(data, data_size,
-            edata, &dummy_len, key, header.iv);
+
+    if (EVP_EncryptInit_ex(enc->cipher_ctx, enc->evp_cipher, NULL, enc->key,
+        header->iv) != 1)
+    {
+        err = fpp_get_openssl_errno();
+        fpp_log_error(err, "Failed to initialize cipher");
+        return FPP_FAILURE;
     }
-    else if (algo_magic_word == FPP_ALGO_CAMELLIA256) {
-        edata_size = fpp_padding_size(data_size, FPP_CAMELLIA256_BLOCK_SIZE);
-        edata = malloc(edata_size * sizeof(uint8_t));
-        if (!edata) {
-            err = fpp_get_os_errno();
-            fpp_log_error(err, "Failed to allocate memory");
-            goto failed;
-        }
-        err = fpp_encrypt_camellia256_cbc(data, data_size,
-            edata, &dummy_len, key, header.iv);
+
+    /* The cipher context holds its own key schedule from now on */
+    if (!keep_key) {
+        fpp_ctx_free_key(ctx, enc->key);
+        enc->key = NULL;
     }
 
-    if (err != FPP_OK) {
-        err = fpp_get_openssl_errno();
-        fpp_log_error(err, "Failed to encrypt data");
-        goto failed;
+    fpp_job_enter_phase(job, FPP_PHASE_OPEN);
+
+    enc->buf = fpp_ctx_alloc_buffer(ctx);
+    if (!enc->buf) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to allocate memory");
+        return FPP_FAILURE;
     }
 
-    out_fd = fopen(params->out_fname, "wb");
-    if (!out_fd) {
+    /*
+     * The manifest checksum is taken as the data is written. A header
+     * in the file that the digest completes after the data is the
+     * exception: the file is read back then, while it is still cached.
+     */
+    enc->read_back = ctx->manifest && job->digest && !params->header_fname;
+
+    enc->out_fd = fopen(params->out_fname, enc->read_back ? "w+b" : "wb");
+    if (!enc->out_fd) {
         err = fpp_get_os_errno();
         fpp_log_error(err, "Failed to open output file \"%s\"",
             params->out_fname);
-        goto failed;
+        return FPP_FAILURE;
     }
 
     if (params->header_fname) {
-        head_fd = fopen(params->header_fname, "wb");
-        if (!head_fd) {
+        enc->head_fd = fopen(params->header_fname, "wb");
+        if (!enc->head_fd) {
             err = fpp_get_os_errno();
             fpp_log_error(err, "Failed to open header file \"%s\"",
                 params->header_fname);
-            goto failed;
+            return FPP_FAILURE;
         }
     }
 
-    if (params->header_fname) {
-        bytes_written = fwrite(&header, sizeof(uint8_t),
-            sizeof(header), head_fd);
-    }
-    else {
-        bytes_written = fwrite(&header, sizeof(uint8_t),
-            sizeof(header), out_fd);
-    }
-    if (bytes_written != sizeof(header)) {
+    fpp_job_enter_phase(job, FPP_PHASE_WRITE);
+    bytes_written = fwrite(header, sizeof(uint8_t), sizeof(*header),
+        enc->head_fd ? enc->head_fd : enc->out_fd);
+    if (bytes_written != sizeof(*header)) {
         err = fpp_get_os_errno();
         fpp_log_error(err, "Failed to write header to output file \"%s\"",
             params->out_fname);
-        goto failed;
+        return FPP_FAILURE;
     }
 
-    bytes_written = fwrite(edata, sizeof(uint8_t), edata_size, out_fd);
-    if (bytes_written != edata_size) {
-        err = fpp_get_os_errno();
-        fpp_log_error(err, "Failed to write data to output file \"%s\"",
-            params->out_fname);
-        goto failed;
+    if (ctx->manifest && !enc->read_back) {
+        job->checksum = fpp_sha256_init();
+        if (!job->checksum
+            || (!enc->head_fd && fpp_sha256_update(job->checksum,
+                (const uint8_t *) header, sizeof(*header)) != FPP_OK))
+        {
+            err = fpp_get_openssl_errno();
+            fpp_log_error(err, "Failed to initialize checksum");
+            return FPP_FAILURE;
+        }
     }
 
-    fpp_explicit_memzero(key, sizeof(key));
+    return FPP_OK;
+}
 
-    fclose(in_fd);
-    fclose(out_fd);
-    if (head_fd) {
-        fclose(head_fd);
-    }
+/* Release everything and don't leave truncated files behind */
+static void
+fpp_encrypt_abort(fpp_ctx_t *ctx, fpp_encrypt_t *enc)
+{
+    fpp_job_t *job = enc->job;
+    const fpp_crypto_params_t *params = job->params;
 
-    free(data);
-    free(edata);
-    return FPP_OK;
+    if (enc->key) {
+        fpp_ctx_free_key(ctx, enc->key);
+    }
 
-failed:
-    if (in_fd) {
-        fclose(in_fd);
+    if (job->digest) {
+        fpp_sha3_256_free(job->digest);
+        job->digest = NULL;
     }
-    if (out_fd) {
-        fclose(out_fd);
+    if (job->checksum) {
+        fpp_sha256_free(job->checksum);
+        job->checksum = NULL;
     }
-    if (head_fd) {
-        fclose(head_fd);
+    if (enc->cipher_ctx) {
+        EVP_CIPHER_CTX_free(enc->cipher_ctx);
     }
-    if (data) {
-        free(data);
+    if (enc->buf) {
+        fpp_ctx_free_buffer(ctx, enc->buf, job->buf_used);
     }
-    if (edata) {
-        free(edata);
+    if (enc->in_fd) {
+        fclose(enc->in_fd);
     }
-    return FPP_FAILURE;
+    if (enc->head_fd) {
+        fclose(enc->head_fd);
+        remove(params->header_fname);
+    }
+    if (enc->out_fd) {
+        fclose(enc->out_fd);
+        remove(params->out_fname);
+    }
+    fpp_encrypt_init(enc, job);
 }
 
-
-fpp_err_t
-fpp_decrypt_file(fpp_crypto_params_t *params)
+/* The data is written, complete the header and close the files */
+static fpp_err_t
+fpp_encrypt_finish(fpp_ctx_t *ctx, fpp_encrypt_t *enc)
 {
-    static uint8_t key[FPP_KEYSIZE_AES256];
-
-    FILE *in_fd = NULL;
-    FILE *out_fd = NULL;
-    FILE *head_fd = NULL;
-    uint8_t *data = NULL;
-    uint8_t *ddata = NULL;
-    uint32_t ddata_size;
-
-    size_t bytes_read;
-    size_t bytes_written;
-    size_t data_size;
-
-    fpp_crypto_header_t header;
+    fpp_job_t *job = enc->job;
+    const fpp_crypto_params_t *params = job->params;
+    fpp_crypto_header_t *header = &enc->header;
+    FILE *out_fd = enc->out_fd;
+    FILE *head_fd = enc->head_fd;
+    uint8_t checksum[FPP_SHA256_BUFSIZE];
+    uint8_t head_checksum[FPP_SHA256_BUFSIZE];
     fpp_err_t err;
 
+    /* The digest is known now, complete the header written before */
+    if (job->digest) {
+        err = fpp_sha3_256_final(job->digest, header->digest);
+        job->digest = NULL;
+        if (err != FPP_OK) {
+            err = fpp_get_openssl_errno();
+            fpp_log_error(err, "Failed to finalize digest");
+            goto failed;
+        }
 
-    memset(&header, 0, sizeof(header));
-
-    in_fd = fopen(params->in_fname, "rb");
-    if (!in_fd) {
-        err = fpp_get_os_errno();
-        fpp_log_error(err, "Failed to open input file \"%s\"",
-            params->in_fname);
-        goto failed;
-    }
-
-    if (fpp_is_file_exist(params->out_fname)) {
-        fpp_log_error(FPP_ERR_IO_EXIST, "Output file \"%s\" already exists",
-            params->out_fname);
-        goto failed;
+        if (fpp_write_header(header, head_fd ? head_fd : out_fd) != FPP_OK) {
+            err = fpp_get_os_errno();
+            fpp_log_error(err, "Failed to write header \"%s\"",
+                head_fd ? params->header_fname : params->out_fname);
+            goto failed;
+        }
     }
 
-    if (params->header_fname) {
-        head_fd = fopen(params->header_fname, "rb");
-        if (!head_fd) {
+    if (ctx->manifest) {
+        if (enc->read_back) {
+            fpp_job_enter_phase(job, FPP_PHASE_READ);
+            err = fpp_checksum_file(out_fd, enc->buf, ctx->config.chunk_size,
+                checksum);
+        }
+        else {
+            err = fpp_sha256_final(job->checksum, checksum);
+            job->checksum = NULL;
+        }
+        if (err == FPP_OK && head_fd) {
+            err = fpp_checksum_header(header, head_checksum);
+        }
+        if (err != FPP_OK) {
             err = fpp_get_os_errno();
-            fpp_log_error(err, "Failed to open header file \"%s\"",
-                params->header_fname);
+            fpp_log_error(err, "Failed to compute checksum of \"%s\"",
+                params->out_fname);
             goto failed;
         }
     }
 
-    fseek(in_fd, 0, SEEK_END);
-    if (params->header_fname) {
-        data_size = ftell(in_fd);
+    if (enc->key) {
+        fpp_ctx_free_key(ctx, enc->key);
     }
-    else {
-        data_size = ftell(in_fd) - sizeof(header);
-    }
-    fseek(in_fd, 0, SEEK_SET);
+    EVP_CIPHER_CTX_free(enc->cipher_ctx);
+    fpp_ctx_free_buffer(ctx, enc->buf, job->buf_used);
+    fclose(enc->in_fd);
+    fpp_encrypt_init(enc, job);
 
-    if (params->header_fname) {
-        bytes_read = fread(&header, sizeof(uint8_t), sizeof(header), head_fd);
-    }
-    else {
-        bytes_read = fread(&header, sizeof(uint8_t), sizeof(header), in_fd);
-    }
-    if (bytes_read != sizeof(header)) {
+    if (head_fd && fclose(head_fd) != 0) {
         err = fpp_get_os_errno();
-        fpp_log_error(err, "Failed to read header \"%s\"",
+        fpp_log_error(err, "Failed to write header file \"%s\"",
             params->header_fname);
-        goto failed;
+        fclose(out_fd);
+        remove(params->header_fname);
+        remove(params->out_fname);
+        return FPP_FAILURE;
     }
 
-    if (strncmp(header.magic_word, magic_word, sizeof(header.magic_word)) ||
-        bytes_read != sizeof(header))
+    if (fclose(out_fd) != 0) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to write output file \"%s\"",
+            params->out_fname);
+        if (head_fd) {
+            remove(params->header_fname);
+        }
+        remove(params->out_fname);
+        return FPP_FAILURE;
+    }
+
+    if (ctx->manifest
+        && (fpp_ctx_add_manifest(ctx, params->out_fname, checksum) != FPP_OK
+            || (head_fd && fpp_ctx_add_manifest(ctx, params->header_fname,
+                head_checksum) != FPP_OK)))
+    {
+        if (head_fd) {
+            remove(params->header_fname);
+        }
+        remove(params->out_fname);
+        return FPP_FAILURE;
+    }
+
+    return FPP_OK;
+
+failed:
+    fpp_encrypt_abort(ctx, enc);
+    return FPP_FAILURE;
+}
+
+static fpp_err_t
+fpp_encrypt_job(fpp_ctx_t *ctx, fpp_job_t *job)
+{
+    fpp_encrypt_t enc;
+    fpp_err_t err;
+
+    fpp_encrypt_init(&enc, job);
+
+    if (fpp_encrypt_open(ctx, &enc) != FPP_OK
+        || fpp_encrypt_derive(ctx, &enc, ctx->job_memory) != FPP_OK
+        || fpp_encrypt_setup(ctx, &enc, false) != FPP_OK)
     {
-        fpp_log_error(FPP_ERR_IO_FORMAT, "Failed to recognize file format");
         goto failed;
     }
 
-    /* Stack size may not be enough */
-    data = malloc(data_size * sizeof(uint8_t));
-    if (!data) {
-        err = fpp_get_os_errno();
-        fpp_log_error(err, "Failed to allocate memory");
+    err = fpp_cipher_stream(ctx, job, enc.cipher_ctx, enc.in_fd, enc.out_fd,
+        enc.buf);
+    if (err != FPP_OK) {
+        fpp_log_error(err, "Failed to encrypt data");
         goto failed;
     }
 
-    bytes_read = fread(data, sizeof(uint8_t), data_size, in_fd);
-    if (bytes_read != data_size) {
+    return fpp_encrypt_finish(ctx, &enc);
+
+failed:
+    fpp_encrypt_abort(ctx, &enc);
+    return FPP_FAILURE;
+}
+
+static fpp_err_t
+fpp_decrypt_job(fpp_ctx_t *ctx, fpp_job_t *job)
+{
+    const fpp_crypto_params_t *params = job->params;
+    uint8_t *key = NULL;
+
+    FILE *in_fd = NULL;
+    FILE *out_fd = NULL;
+    FILE *head_fd = NULL;
+    EVP_CIPHER_CTX *cipher_ctx = NULL;
+    const fpp_cipher_t *cipher;
+    const EVP_CIPHER *evp_cipher;
+    uint8_t *buf = NULL;
+    uint8_t digest[FPP_SHA3_256_BUFSIZE];
+
+    fpp_crypto_header_t header;
+    fpp_err_t result = FPP_FAILURE;
+    fpp_err_t err;
+
+
+    fpp_job_enter_phase(job, FPP_PHASE_OPEN);
+
+    in_fd = fopen(params->in_fname, "rb");
+    if (!in_fd) {
         err = fpp_get_os_errno();
-        fpp_log_error(err, "Failed to read data from input file \"%s\"",
+        fpp_log_error(err, "Failed to open input file \"%s\"",
             params->in_fname);
         goto failed;
     }
 
-    /* Genereate key */
-    if (fpp_pkcs5_pbkdf2_hmac_sha512(params->text_passwd,
-        strlen(params->text_passwd), header.salt, sizeof(header.salt),
-        header.iter, key, sizeof(key)) != FPP_OK)
-    {
-        err = fpp_get_openssl_errno();
-        fpp_log_error(err, "fpp_pkcs5_pbkdf2_hmac_sha256() failed");
+    if (!job->discard && fpp_is_file_exist(params->out_fname)) {
+        fpp_log_error(FPP_ERR_IO_EXIST, "Output file \"%s\" already exists",
+            params->out_fname);
         goto failed;
     }
 
-    ddata = malloc(data_size * sizeof(uint8_t));
-    if (!ddata) {
-        err = fpp_get_os_errno();
-        fpp_log_error(err, "Failed to allocate memory");
+    if (params->header_fname) {
+        head_fd = fopen(params->header_fname, "rb");
+        if (!head_fd) {
+            err = fpp_get_os_errno();
+            fpp_log_error(err, "Failed to open header file \"%s\"",
+                params->header_fname);
+            goto failed;
+        }
+    }
+
+    fpp_job_enter_phase(job, FPP_PHASE_READ);
+    err = fpp_read_header(&header, head_fd ? head_fd : in_fd);
+    if (err != FPP_OK) {
+        if (err == FPP_ERR_IO_FORMAT) {
+            fpp_log_error(err, "Failed to recognize file format");
+            result = err;
+        }
+        else {
+            err = fpp_get_os_errno();
+            fpp_log_error(err, "Failed to read header \"%s\"",
+                head_fd ? params->header_fname : params->in_fname);
+        }
         goto failed;
     }
 
-    if (header.algo == FPP_ALGO_AES128) {
-        err = fpp_decrypt_aes128_cbc(data, data_size,
-            ddata, &ddata_size, key, header.iv);
+    fpp_job_enter_phase(job, FPP_PHASE_OPEN);
+
+    cipher = fpp_cipher_by_algo(header.algo);
+    if (!cipher) {
+        fpp_log_error(FPP_FAILURE, "Unrecognized magic word of algorithm");
+        goto failed;
+    }
+    evp_cipher = fpp_ctx_get_evp_cipher(ctx, cipher);
+    if (!evp_cipher) {
+        fpp_log_error(FPP_ERR_IO_ARGV, "Algorithm \"%s\" is not available",
+            cipher->name);
+        goto failed;
     }
-    else if (header.algo == FPP_ALGO_AES256) {
-        err = fpp_decrypt_aes256_cbc(data, data_size,
-            ddata, &ddata_size, key, header.iv);
+    if (!fpp_kdf_is_available(fpp_ctx_get_libctx(ctx), header.kdf)) {
+        fpp_log_error(FPP_ERR_IO_ARGV, "KDF \"%s\" is not available",
+            fpp_kdf_name(header.kdf));
+        goto failed;
     }
-    else if (header.algo == FPP_ALGO_BLOWFISH) {
-        err = fpp_decrypt_blowfish_cbc(data, data_size,
-            ddata, &ddata_size, key, header.iv);
+    /* The header asks for it, keep a hostile file from taking it all */
+    if (header.kdf != FPP_KDF_PBKDF2
+        && (uint64_t) header.kdf_memory * header.kdf_lanes
+            > ctx->config.kdf_max_memory)
+    {
+        fpp_log_error(FPP_ERR_IO_ARGV,
+            "Key derivation (%s) needs %llu MiB, the limit is %u MiB",
+            fpp_kdf_name(header.kdf),
+            (unsigned long long) header.kdf_memory * header.kdf_lanes / 1024,
+            ctx->config.kdf_max_memory / 1024);
+        goto failed;
     }
-    else if (header.algo == FPP_ALGO_CAST5) {
-        err = fpp_decrypt_cast5_cbc(data, data_size,
-            ddata, &ddata_size, key, header.iv);
+
+    /* Key slots come from locked memory owned by the context */
+    key = fpp_ctx_alloc_key(ctx);
+    if (!key) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to allocate memory");
+        goto failed;
     }
-    else if (header.algo == FPP_ALGO_CAMELLIA128) {
-        err = fpp_decrypt_camellia128_cbc(data, data_size,
-            ddata, &ddata_size, key, header.iv);
+
+    /* Genereate key */
+    fpp_job_enter_phase(job, FPP_PHASE_KDF);
+    FPP_PROBE2(kdf__start, job, header.iter);
+    if (fpp_ctx_derive_key(ctx, ctx->job_memory, &header,
+        params->text_passwd, key) != FPP_OK)
+    {
+        err = fpp_get_openssl_errno();
+        fpp_log_error(err, "Key derivation (%s) failed",
+            fpp_kdf_name(header.kdf));
+        goto failed;
     }
-    else if (header.algo == FPP_ALGO_CAMELLIA256) {
-        err = fpp_decrypt_camellia256_cbc(data, data_size,
-            ddata, &ddata_size, key, header.iv);
+    FPP_PROBE2(kdf__done, job, header.iter);
+
+    if (header.flags & FPP_HEADER_DIGEST) {
+        job->digest = fpp_sha3_256_init(key + FPP_DIGEST_KEY_OFFSET,
+            FPP_DIGEST_KEY_SIZE);
+        if (!job->digest) {
+            err = fpp_get_openssl_errno();
+            fpp_log_error(err, "Failed to initialize digest");
+            goto failed;
+        }
     }
-    else {
-        fpp_log_error(FPP_FAILURE, "Unrecognized magic word of algorithm");
+
+    cipher_ctx = EVP_CIPHER_CTX_new();
+    if (!cipher_ctx) {
+        err = fpp_get_openssl_errno();
+        fpp_log_error(err, "Failed to allocate cipher context");
         goto failed;
     }
 
-    if (err != FPP_OK) {
+    if (EVP_DecryptInit_ex(cipher_ctx, evp_cipher, NULL, key,
+        header.iv) != 1)
+    {
         err = fpp_get_openssl_errno();
-        fpp_log_error(err, "Failed to decrypt data");
+        fpp_log_error(err, "Failed to initialize cipher");
         goto failed;
     }
 
-    out_fd = fopen(params->out_fname, "wb");
-    if (!out_fd) {
+    fpp_ctx_free_key(ctx, key);
+    key = NULL;
+
+    fpp_job_enter_phase(job, FPP_PHASE_OPEN);
+
+    buf = fpp_ctx_alloc_buffer(ctx);
+    if (!buf) {
         err = fpp_get_os_errno();
-        fpp_log_error(err, "Failed to open output file \"%s\"",
-            params->out_fname);
+        fpp_log_error(err, "Failed to allocate memory");
         goto failed;
     }
 
-    bytes_written = fwrite(ddata, sizeof(uint8_t), ddata_size, out_fd);
-    if (bytes_written != ddata_size) {
-        err = fpp_get_os_errno();
-        fpp_log_error(err, "Failed to write data to output file \"%s\"",
-            params->out_fname);
+    if (!job->discard) {
+        out_fd = fopen(params->out_fname, "wb");
+        if (!out_fd) {
+            err = fpp_get_os_errno();
+            fpp_log_error(err, "Failed to open output file \"%s\"",
+                params->out_fname);
+            goto failed;
+        }
+    }
+
+    err = fpp_cipher_stream(ctx, job, cipher_ctx, in_fd, out_fd, buf);
+    if (err != FPP_OK) {
+        fpp_log_error(err, "Failed to decrypt data");
+        if (err == FPP_ERR_IO_PADDING || err == FPP_ERR_JOB_CANCELED) {
+            result = err;
+        }
         goto failed;
     }
 
-    fpp_explicit_memzero(key, sizeof(key));
+    if (job->digest) {
+        err = fpp_sha3_256_final(job->digest, digest);
+        job->digest = NULL;
+        if (err != FPP_OK) {
+            err = fpp_get_openssl_errno();
+            fpp_log_error(err, "Failed to finalize digest");
+            goto failed;
+        }
+        if (CRYPTO_memcmp(digest, header.digest, sizeof(digest)) != 0) {
+            fpp_log_error(FPP_ERR_IO_DIGEST,
+                "Digest of \"%s\" doesn't match, wrong password or "
+                "damaged file", params->in_fname);
+            result = FPP_ERR_IO_DIGEST;
+            goto failed;
+        }
+    }
 
+    EVP_CIPHER_CTX_free(cipher_ctx);
+    fpp_ctx_free_buffer(ctx, buf, job->buf_used);
     fclose(in_fd);
-    fclose(out_fd);
     if (head_fd) {
         fclose(head_fd);
     }
 
-    free(data);
-    free(ddata);
+    if (out_fd && fclose(out_fd) != 0) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to write output file \"%s\"",
+            params->out_fname);
+        remove(params->out_fname);
+        return FPP_FAILURE;
+    }
+
     return FPP_OK;
 
 failed:
+    if (key) {
+        fpp_ctx_free_key(ctx, key);
+    }
+
+    if (job->digest) {
+        fpp_sha3_256_free(job->digest);
+        job->digest = NULL;
+    }
+    if (cipher_ctx) {
+        EVP_CIPHER_CTX_free(cipher_ctx);
+    }
+    if (buf) {
+        fpp_ctx_free_buffer(ctx, buf, job->buf_used);
+    }
     if (in_fd) {
         fclose(in_fd);
     }
+    if (head_fd) {
+        fclose(head_fd);
+    }
     if (out_fd) {
+        /* Don't leave partially decrypted data behind */
         fclose(out_fd);
+        remove(params->out_fname);
     }
-    if (head_fd) {
-        fclose(head_fd);
+    return result;
+}
+
+void
+fpp_job_init(fpp_job_t *job, const fpp_crypto_params_t *params,
+    fpp_mode_t mode)
+{
+    memset(job, 0, sizeof(fpp_job_t));
+    job->params = params;
+    job->mode = mode;
+}
+
+/* Everything but the admission, a group is admitted as a whole */
+static void
+fpp_job_begin(fpp_ctx_t *ctx, fpp_job_t *job, fpp_job_stats_t *js)
+{
+    if (ctx->config.stats || ctx->config.perf_counters) {
+        fpp_job_stats_init(js, ctx->config.perf_counters);
+        job->stats = js;
     }
-    if (data) {
-        free(data);
+}
+
+static void
+fpp_job_end(fpp_ctx_t *ctx, fpp_job_t *job, fpp_job_stats_t *js,
+    fpp_err_t err)
+{
+    fpp_stats_t *stats;
+
+    if (job->stats) {
+        fpp_job_enter_phase(job, FPP_PHASE_NONE);
+        job->stats = NULL;
+
+        if (err == FPP_OK) {
+            stats = &js->stats;
+            stats->files = 1;
+            stats->bytes = (job->mode == FPP_MODE_ENCRYPT)
+                ? stats->phases[FPP_PHASE_READ].bytes
+                : stats->phases[FPP_PHASE_WRITE].bytes;
+            fpp_ctx_add_stats(ctx, stats, js->mark_ns - js->start);
+        }
     }
-    if (ddata) {
-        free(ddata);
+
+    FPP_PROBE4(file__done, job, job->params->in_fname, job->mode, err);
+
+    if (fpp_log_enabled(FPP_LOG_DEBUG)) {
+        fpp_log_field_t fields[] = {
+            FPP_LOG_STR("file", job->params->in_fname),
+            FPP_LOG_STR("mode", job->mode == FPP_MODE_ENCRYPT ? "encrypt"
+                : job->discard ? "verify" : "decrypt"),
+            FPP_LOG_INT("code", err)
+        };
+        fpp_log_write(FPP_LOG_DEBUG, "File processed", fields,
+            sizeof(fields) / sizeof(fields[0]));
     }
-    return FPP_FAILURE;
+}
+
+fpp_err_t
+fpp_ctx_run_job(fpp_ctx_t *ctx, fpp_job_t *job)
+{
+    fpp_job_stats_t js;
+    fpp_err_t err;
+
+    FPP_PROBE3(file__start, job, job->params->in_fname, job->mode);
+
+    /* Admission, the job waits here while the budget is exhausted */
+    fpp_memory_reserve(ctx->job_memory);
+
+    fpp_job_begin(ctx, job, &js);
+
+    if (job->mode == FPP_MODE_ENCRYPT) {
+        err = fpp_encrypt_job(ctx, job);
+    }
+    else {
+        err = fpp_decrypt_job(ctx, job);
+    }
+
+    fpp_memory_release(ctx->job_memory);
+
+    fpp_job_end(ctx, job, &js, err);
+
+    return err;
+}
+
+/*
+ * Keys of a group. One batch PBKDF2 run if they all use it with the
+ * same iterations, one derivation per file otherwise.
+ */
+static void
+fpp_encrypt_group_derive(fpp_ctx_t *ctx, fpp_encrypt_t *enc,
+    fpp_err_t *results, size_t n)
+{
+    fpp_pbkdf2_params_t batch[FPP_AES_MB_LANES];
+    const char *passwd;
+    uint32_t iter = 0;
+    bool same = true;
+    size_t i, k;
+    fpp_err_t err;
+
+    for (i = 0; i < n; ++i) {
+        if (results[i] != FPP_OK) {
+            continue;
+        }
+        if (enc[i].header.kdf != FPP_KDF_PBKDF2
+            || (iter && enc[i].header.iter != iter))
+        {
+            same = false;
+        }
+        iter = enc[i].header.iter;
+    }
+
+    if (!same) {
+        for (i = 0; i < n; ++i) {
+            if (results[i] == FPP_OK
+                && (results[i] = fpp_encrypt_derive(ctx, &enc[i],
+                    n * ctx->job_memory)) != FPP_OK)
+            {
+                fpp_encrypt_abort(ctx, &enc[i]);
+            }
+        }
+        return;
+    }
+
+    for (i = 0, k = 0; i < n; ++i) {
+        if (results[i] != FPP_OK) {
+            continue;
+        }
+        fpp_job_enter_phase(enc[i].job, FPP_PHASE_KDF);
+        FPP_PROBE2(kdf__start, enc[i].job, iter);
+
+        passwd = enc[i].job->params->text_passwd;
+        batch[k].pass = passwd;
+        batch[k].passlen = strlen(passwd);
+        batch[k].salt = enc[i].header.salt;
+        batch[k].saltlen = sizeof(enc[i].header.salt);
+        batch[k].out = enc[i].key;
+        k++;
+    }
+
+    if (k && fpp_pkcs5_pbkdf2_hmac_sha512_batch(batch, k, iter,
+        FPP_CTX_KEY_SLOT_SIZE) != FPP_OK)
+    {
+        err = fpp_get_openssl_errno();
+        fpp_log_error(err, "Key derivation (%s) failed",
+            fpp_kdf_name(FPP_KDF_PBKDF2));
+        for (i = 0; i < n; ++i) {
+            if (results[i] == FPP_OK) {
+                fpp_encrypt_abort(ctx, &enc[i]);
+                results[i] = FPP_FAILURE;
+            }
+        }
+        return;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (results[i] == FPP_OK) {
+            FPP_PROBE2(kdf__done, enc[i].job, iter);
+        }
+    }
+}
+
+/*
+ * Read a whole file of len bytes into the input half of its buffer and
+ * prepare a stream over its full blocks, the last padded block goes to
+ * tail.
+ * *whole is false if the file is larger than a chunk after all, the
+ * input is rewound then.
+ */
+static fpp_err_t
+fpp_encrypt_group_read(fpp_ctx_t *ctx, fpp_encrypt_t *enc,
+    fpp_aes_cbc_stream_t *stream, uint8_t *tail, size_t *len, bool *whole)
+{
+    fpp_job_t *job = enc->job;
+    size_t chunk_size;
+    size_t bytes_read;
+    size_t full, pad;
+    fpp_err_t err;
+
+    chunk_size = ctx->config.chunk_size;
+
+    fpp_job_enter_phase(job, FPP_PHASE_READ);
+    bytes_read = fread(enc->buf, sizeof(uint8_t), chunk_size, enc->in_fd);
+    if (ferror(enc->in_fd)) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to read data from input file \"%s\"",
+            job->params->in_fname);
+        return FPP_FAILURE;
+    }
+    if (bytes_read > job->buf_used) {
+        job->buf_used = bytes_read;
+    }
+
+    /* Grown since the files were grouped */
+    if (bytes_read == chunk_size && fgetc(enc->in_fd) != EOF) {
+        *whole = false;
+        if (fseek(enc->in_fd, 0, SEEK_SET) != 0) {
+            err = fpp_get_os_errno();
+            fpp_log_error(err, "Failed to read data from input file \"%s\"",
+                job->params->in_fname);
+            return FPP_FAILURE;
+        }
+        return FPP_OK;
+    }
+    *whole = true;
+    *len = bytes_read;
+
+    fpp_job_add_bytes(job, FPP_PHASE_READ, bytes_read);
+    fpp_job_throttle(ctx, job, bytes_read);
+
+    fpp_job_enter_phase(job, FPP_PHASE_CIPHER);
+    fpp_job_add_bytes(job, FPP_PHASE_CIPHER, bytes_read);
+    FPP_PROBE2(chunk__start, job, bytes_read);
+    if (job->digest
+        && fpp_sha3_256_update(job->digest, enc->buf, bytes_read) != FPP_OK)
+    {
+        err = fpp_get_openssl_errno();
+        fpp_log_error(err, "Failed to hash data");
+        return FPP_FAILURE;
+    }
+
+    /* PKCS#7, as EVP_EncryptFinal_ex() would add it */
+    full = bytes_read & ~(size_t) 15;
+    pad = 16 - (bytes_read - full);
+    memcpy(tail, enc->buf + full, bytes_read - full);
+    memset(tail + bytes_read - full, (int) pad, pad);
+
+    stream->key = enc->key;
+    memcpy(stream->iv, enc->header.iv, sizeof(stream->iv));
+    stream->in = enc->buf;
+    stream->out = enc->buf + ctx->buffer_out_offset;
+    stream->len = full;
+
+    return FPP_OK;
+}
+
+static fpp_err_t
+fpp_encrypt_group_write(fpp_ctx_t *ctx, fpp_encrypt_t *enc,
+    const uint8_t *out, size_t out_len)
+{
+    fpp_job_t *job = enc->job;
+    size_t bytes_written;
+    fpp_err_t err;
+
+    fpp_job_enter_phase(job, FPP_PHASE_WRITE);
+    fpp_job_add_bytes(job, FPP_PHASE_WRITE, out_len);
+    bytes_written = fwrite(out, sizeof(uint8_t), out_len, enc->out_fd);
+    if (bytes_written != out_len) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to write data to output file \"%s\"",
+            job->params->out_fname);
+        return FPP_FAILURE;
+    }
+    if (job->checksum
+        && fpp_sha256_update(job->checksum, out, out_len) != FPP_OK)
+    {
+        err = fpp_get_openssl_errno();
+        fpp_log_error(err, "Failed to hash data");
+        return FPP_FAILURE;
+    }
+    FPP_PROBE2(write__done, job, bytes_written);
+    fpp_job_throttle(ctx, job, bytes_written);
+
+    return FPP_OK;
+}
+
+/*
+ * Encrypt up to FPP_AES_MB_LANES small AES files together. Each file
+ * goes through the stages of fpp_encrypt_job(), but the keys come
+ * from one batch PBKDF2 run and the data, read whole, from one run of
+ * the multi-buffer kernel. A file that turns out to be larger than a
+ * chunk is streamed on its own.
+ */
+void
+fpp_ctx_encrypt_group(fpp_ctx_t *ctx, const fpp_crypto_params_t **params,
+    size_t n, fpp_err_t *results)
+{
+    fpp_job_t jobs[FPP_AES_MB_LANES];
+    fpp_job_stats_t js[FPP_AES_MB_LANES];
+    fpp_encrypt_t enc[FPP_AES_MB_LANES];
+    fpp_aes_cbc_stream_t streams[FPP_AES_MB_LANES];
+    uint8_t tails[FPP_AES_MB_LANES][16];
+    size_t lens[FPP_AES_MB_LANES];
+    /* The job of every stream */
+    size_t lane[FPP_AES_MB_LANES];
+    size_t i, k, nstreams, out_len;
+    uint32_t algo;
+    int key_bits;
+    bool whole;
+    fpp_err_t err;
+
+    for (i = 0; i < n; ++i) {
+        fpp_job_init(&jobs[i], params[i], FPP_MODE_ENCRYPT);
+        FPP_PROBE3(file__start, &jobs[i], params[i]->in_fname,
+            FPP_MODE_ENCRYPT);
+    }
+
+    fpp_memory_reserve(n * ctx->job_memory);
+
+    for (i = 0; i < n; ++i) {
+        fpp_job_begin(ctx, &jobs[i], &js[i]);
+        fpp_encrypt_init(&enc[i], &jobs[i]);
+        results[i] = fpp_encrypt_open(ctx, &enc[i]);
+        if (results[i] != FPP_OK) {
+            fpp_encrypt_abort(ctx, &enc[i]);
+        }
+    }
+
+    fpp_encrypt_group_derive(ctx, enc, results, n);
+
+    /* The kernel schedules the keys itself, they are kept until then */
+    for (i = 0; i < n; ++i) {
+        if (results[i] == FPP_OK
+            && (results[i] = fpp_encrypt_setup(ctx, &enc[i], true))
+                != FPP_OK)
+        {
+            fpp_encrypt_abort(ctx, &enc[i]);
+        }
+    }
+
+    algo = 0;
+    nstreams = 0;
+    for (i = 0; i < n; ++i) {
+        if (results[i] != FPP_OK) {
+            continue;
+        }
+        if (!algo) {
+            algo = enc[i].header.algo;
+        }
+
+        whole = false;
+        if (enc[i].header.algo == algo) {
+            k = nstreams;
+            results[i] = fpp_encrypt_group_read(ctx, &enc[i], &streams[k],
+                tails[k], &lens[k], &whole);
+            if (whole) {
+                lane[nstreams++] = i;
+            }
+        }
+        if (results[i] == FPP_OK && !whole) {
+            err = fpp_cipher_stream(ctx, &jobs[i], enc[i].cipher_ctx,
+                enc[i].in_fd, enc[i].out_fd, enc[i].buf);
+            if (err != FPP_OK) {
+                fpp_log_error(err, "Failed to encrypt data");
+                results[i] = FPP_FAILURE;
+            }
+        }
+        if (results[i] != FPP_OK) {
+            fpp_encrypt_abort(ctx, &enc[i]);
+        }
+    }
+
+    if (nstreams) {
+        key_bits = (algo == FPP_ALGO_AES128) ? 128 : 256;
+
+        /* The full blocks, then the padded ones that follow them */
+        err = fpp_aes_cbc_encrypt_mb(streams, nstreams, key_bits);
+        for (k = 0; err == FPP_OK && k < nstreams; ++k) {
+            streams[k].out += streams[k].len;
+            streams[k].in = tails[k];
+            streams[k].len = 16;
+        }
+        if (err == FPP_OK) {
+            err = fpp_aes_cbc_encrypt_mb(streams, nstreams, key_bits);
+        }
+
+        for (k = 0; k < nstreams; ++k) {
+            i = lane[k];
+            if (err != FPP_OK) {
+                fpp_log_error(err, "Failed to encrypt data");
+                results[i] = FPP_FAILURE;
+            }
+            else {
+                out_len = (lens[k] & ~(size_t) 15) + 16;
+                FPP_PROBE3(chunk__done, &jobs[i], lens[k], out_len);
+                results[i] = fpp_encrypt_group_write(ctx, &enc[i],
+                    enc[i].buf + ctx->buffer_out_offset, out_len);
+            }
+            if (results[i] != FPP_OK) {
+                fpp_encrypt_abort(ctx, &enc[i]);
+            }
+        }
+        fpp_explicit_memzero(tails[0], sizeof(tails));
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (results[i] == FPP_OK) {
+            results[i] = fpp_encrypt_finish(ctx, &enc[i]);
+        }
+    }
+
+    fpp_memory_release(n * ctx->job_memory);
+
+    for (i = 0; i < n; ++i) {
+        fpp_job_end(ctx, &jobs[i], &js[i], results[i]);
+    }
+}
+
+fpp_err_t
+fpp_ctx_encrypt_file(fpp_ctx_t *ctx, const fpp_crypto_params_t *params)
+{
+    fpp_job_t job;
+
+    fpp_job_init(&job, params, FPP_MODE_ENCRYPT);
+    return fpp_ctx_run_job(ctx, &job);
+}
+
+fpp_err_t
+fpp_ctx_decrypt_file(fpp_ctx_t *ctx, const fpp_crypto_params_t *params)
+{
+    fpp_job_t job;
+
+    fpp_job_init(&job, params, FPP_MODE_DECRYPT);
+    return fpp_ctx_run_job(ctx, &job);
+}
+
+fpp_err_t
+fpp_ctx_verify_file(fpp_ctx_t *ctx, const fpp_crypto_params_t *params)
+{
+    fpp_job_t job;
+
+    fpp_job_init(&job, params, FPP_MODE_DECRYPT);
+    job.discard = true;
+    return fpp_ctx_run_job(ctx, &job);
+}
+
+fpp_err_t
+fpp_encrypt_file(fpp_crypto_params_t *params)
+{
+    fpp_ctx_t *ctx;
+    fpp_err_t err;
+
+    ctx = fpp_ctx_create(NULL);
+    if (!ctx) {
+        fpp_log_error(FPP_FAILURE, "Failed to create context");
+        return FPP_FAILURE;
+    }
+
+    err = fpp_ctx_encrypt_file(ctx, params);
+    fpp_ctx_destroy(ctx);
+    return err;
+}
+
+fpp_err_t
+fpp_decrypt_file(fpp_crypto_params_t *params)
+{
+    fpp_ctx_t *ctx;
+    fpp_err_t err;
+
+    ctx = fpp_ctx_create(NULL);
+    if (!ctx) {
+        fpp_log_error(FPP_FAILURE, "Failed to create context");
+        return FPP_FAILURE;
+    }
+
+    err = fpp_ctx_decrypt_file(ctx, params);
+    fpp_ctx_destroy(ctx);
+    return err;
+}
+
+fpp_err_t
+fpp_kdf_calibrate_iter(uint32_t msec, uint32_t *iter)
+{
+    return fpp_pkcs5_pbkdf2_hmac_sha512_calibrate(msec,
+        FPP_CTX_KEY_SLOT_SIZE, iter);
 }
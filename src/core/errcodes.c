@@ -17,6 +17,14 @@ fpp_strerror(fpp_err_t errcode)
         return "File already exist.";
     case FPP_ERR_IO_FORMAT:
         return "Failed to determine file format.";
+    case FPP_ERR_IO_DIGEST:
+        return "Decrypted data doesn't match its digest.";
+    case FPP_ERR_IO_PADDING:
+        return "Decrypted data has invalid padding.";
+    case FPP_ERR_JOB_CANCELED:
+        return "Job was canceled.";
+    case FPP_ERR_JOB_BUSY:
+        return "Too many jobs in flight.";
     default:
         return "Unknow error code.";
     }
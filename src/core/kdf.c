@@ -0,0 +1,400 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#if (OPENSSL_VERSION_NUMBER >= 0x30200000L)
+#include <openssl/kdf.h>
+#include <openssl/thread.h>
+#include <openssl/core_names.h>
+#endif
+
+#include "kdf.h"
+#include "pbkdf2.h"
+
+#define FPP_ROTL32(x, n)  (((x) << (n)) | ((x) >> (32 - (n))))
+
+/* One ROMix of scrypt, the lanes only share the input and output */
+typedef struct {
+    uint32_t *b;
+    uint32_t n;
+    uint32_t r;
+    fpp_err_t err;
+} fpp_scrypt_lane_t;
+
+static const char *fpp_kdf_names[] = {
+    "pbkdf2",
+    "scrypt",
+    "argon2id"
+};
+
+
+const char *
+fpp_kdf_name(uint32_t id)
+{
+    if (id >= sizeof(fpp_kdf_names) / sizeof(fpp_kdf_names[0])) {
+        return "unknown";
+    }
+    return fpp_kdf_names[id];
+}
+
+fpp_err_t
+fpp_kdf_by_name(const char *name, uint32_t *id)
+{
+    uint32_t i;
+
+    for (i = 0; i < sizeof(fpp_kdf_names) / sizeof(fpp_kdf_names[0]); ++i) {
+        if (strcmp(name, fpp_kdf_names[i]) == 0) {
+            *id = i;
+            return FPP_OK;
+        }
+    }
+    return FPP_ERR_IO_ARGV;
+}
+
+bool
+fpp_kdf_is_available(OSSL_LIB_CTX *libctx, uint32_t id)
+{
+#if (OPENSSL_VERSION_NUMBER >= 0x30200000L)
+    EVP_KDF *algo;
+#endif
+
+    switch (id) {
+    case FPP_KDF_PBKDF2:
+    case FPP_KDF_SCRYPT:
+        return true;
+
+    case FPP_KDF_ARGON2ID:
+#if (OPENSSL_VERSION_NUMBER >= 0x30200000L)
+        algo = EVP_KDF_fetch(libctx, "ARGON2ID", NULL);
+        EVP_KDF_free(algo);
+        return algo != NULL;
+#else
+        (void) libctx;
+        return false;
+#endif
+
+    default:
+        return false;
+    }
+}
+
+fpp_err_t
+fpp_kdf_check(const fpp_kdf_params_t *kdf)
+{
+    switch (kdf->id) {
+    case FPP_KDF_PBKDF2:
+        return kdf->iter ? FPP_OK : FPP_ERR_IO_FORMAT;
+
+    case FPP_KDF_SCRYPT:
+        if (kdf->memory < 2 || (kdf->memory & (kdf->memory - 1))) {
+            return FPP_ERR_IO_FORMAT;
+        }
+        break;
+
+    case FPP_KDF_ARGON2ID:
+        if (kdf->iter == 0 || kdf->memory < 8) {
+            return FPP_ERR_IO_FORMAT;
+        }
+        break;
+
+    default:
+        return FPP_ERR_IO_FORMAT;
+    }
+
+    if (kdf->lanes == 0 || kdf->lanes > FPP_KDF_MAX_LANES
+        || (uint64_t) kdf->memory * kdf->lanes > FPP_KDF_MAX_MEMORY)
+    {
+        return FPP_ERR_IO_FORMAT;
+    }
+
+    return FPP_OK;
+}
+
+static void
+fpp_salsa20_8(uint32_t *b)
+{
+    uint32_t x[16];
+    int i;
+
+    memcpy(x, b, sizeof(x));
+
+    for (i = 0; i < 8; i += 2) {
+        /* Columns */
+        x[4] ^= FPP_ROTL32(x[0] + x[12], 7);
+        x[8] ^= FPP_ROTL32(x[4] + x[0], 9);
+        x[12] ^= FPP_ROTL32(x[8] + x[4], 13);
+        x[0] ^= FPP_ROTL32(x[12] + x[8], 18);
+        x[9] ^= FPP_ROTL32(x[5] + x[1], 7);
+        x[13] ^= FPP_ROTL32(x[9] + x[5], 9);
+        x[1] ^= FPP_ROTL32(x[13] + x[9], 13);
+        x[5] ^= FPP_ROTL32(x[1] + x[13], 18);
+        x[14] ^= FPP_ROTL32(x[10] + x[6], 7);
+        x[2] ^= FPP_ROTL32(x[14] + x[10], 9);
+        x[6] ^= FPP_ROTL32(x[2] + x[14], 13);
+        x[10] ^= FPP_ROTL32(x[6] + x[2], 18);
+        x[3] ^= FPP_ROTL32(x[15] + x[11], 7);
+        x[7] ^= FPP_ROTL32(x[3] + x[15], 9);
+        x[11] ^= FPP_ROTL32(x[7] + x[3], 13);
+        x[15] ^= FPP_ROTL32(x[11] + x[7], 18);
+
+        /* Rows */
+        x[1] ^= FPP_ROTL32(x[0] + x[3], 7);
+        x[2] ^= FPP_ROTL32(x[1] + x[0], 9);
+        x[3] ^= FPP_ROTL32(x[2] + x[1], 13);
+        x[0] ^= FPP_ROTL32(x[3] + x[2], 18);
+        x[6] ^= FPP_ROTL32(x[5] + x[4], 7);
+        x[7] ^= FPP_ROTL32(x[6] + x[5], 9);
+        x[4] ^= FPP_ROTL32(x[7] + x[6], 13);
+        x[5] ^= FPP_ROTL32(x[4] + x[7], 18);
+        x[11] ^= FPP_ROTL32(x[10] + x[9], 7);
+        x[8] ^= FPP_ROTL32(x[11] + x[10], 9);
+        x[9] ^= FPP_ROTL32(x[8] + x[11], 13);
+        x[10] ^= FPP_ROTL32(x[9] + x[8], 18);
+        x[12] ^= FPP_ROTL32(x[15] + x[14], 7);
+        x[13] ^= FPP_ROTL32(x[12] + x[15], 9);
+        x[14] ^= FPP_ROTL32(x[13] + x[12], 13);
+        x[15] ^= FPP_ROTL32(x[14] + x[13], 18);
+    }
+
+    for (i = 0; i < 16; ++i) {
+        b[i] += x[i];
+    }
+}
+
+/* 2r blocks of 16 words from in to out, even ones first */
+static void
+fpp_scrypt_blockmix(const uint32_t *in, uint32_t *out, uint32_t r)
+{
+    uint32_t x[16];
+    size_t i, k;
+
+    memcpy(x, in + (2 * r - 1) * 16, sizeof(x));
+
+    for (i = 0; i < 2 * r; ++i) {
+        for (k = 0; k < 16; ++k) {
+            x[k] ^= in[i * 16 + k];
+        }
+        fpp_salsa20_8(x);
+        memcpy(out + ((i & 1) * r + i / 2) * 16, x, sizeof(x));
+    }
+}
+
+static void *
+fpp_scrypt_romix(void *arg)
+{
+    fpp_scrypt_lane_t *lane = arg;
+    size_t words, i, k, j;
+    uint32_t *v, *y;
+
+    words = 32 * (size_t) lane->r;
+    v = malloc(words * sizeof(uint32_t) * (lane->n + 1));
+    if (!v) {
+        lane->err = FPP_FAILURE;
+        return NULL;
+    }
+    y = v + words * lane->n;
+
+    for (i = 0; i < lane->n; ++i) {
+        memcpy(v + i * words, lane->b, words * sizeof(uint32_t));
+        fpp_scrypt_blockmix(lane->b, y, lane->r);
+        memcpy(lane->b, y, words * sizeof(uint32_t));
+    }
+
+    for (i = 0; i < lane->n; ++i) {
+        j = lane->b[words - 16] & (lane->n - 1);
+        for (k = 0; k < words; ++k) {
+            lane->b[k] ^= v[j * words + k];
+        }
+        fpp_scrypt_blockmix(lane->b, y, lane->r);
+        memcpy(lane->b, y, words * sizeof(uint32_t));
+    }
+
+    OPENSSL_cleanse(v, words * sizeof(uint32_t) * (lane->n + 1));
+    free(v);
+    lane->err = FPP_OK;
+    return NULL;
+}
+
+/*
+ * scrypt as in RFC 7914, with every one of the p ROMix lanes on a
+ * thread of its own. The result is the same as a serial scrypt.
+ */
+static fpp_err_t
+fpp_scrypt(const char *pass, size_t passlen, const uint8_t *salt,
+    size_t saltlen, uint32_t n, uint32_t r, uint32_t p, uint8_t *out,
+    size_t outlen)
+{
+    fpp_scrypt_lane_t lanes[FPP_KDF_MAX_LANES];
+    pthread_t threads[FPP_KDF_MAX_LANES];
+    bool started[FPP_KDF_MAX_LANES];
+    uint8_t *b = NULL;
+    uint32_t *w = NULL;
+    size_t size, i;
+    fpp_err_t err = FPP_FAILURE;
+
+    size = (size_t) p * 128 * r;
+    b = malloc(size);
+    w = malloc(size);
+    if (!b || !w) {
+        goto failed;
+    }
+
+    if (!PKCS5_PBKDF2_HMAC(pass, passlen, salt, saltlen, 1, EVP_sha256(),
+        size, b))
+    {
+        goto failed;
+    }
+
+    for (i = 0; i < size / 4; ++i) {
+        w[i] = (uint32_t) b[4 * i] | ((uint32_t) b[4 * i + 1] << 8)
+            | ((uint32_t) b[4 * i + 2] << 16)
+            | ((uint32_t) b[4 * i + 3] << 24);
+    }
+
+    /* The caller's thread takes the first lane */
+    for (i = 0; i < p; ++i) {
+        lanes[i].b = w + i * 32 * r;
+        lanes[i].n = n;
+        lanes[i].r = r;
+        lanes[i].err = FPP_FAILURE;
+        started[i] = (i > 0) && pthread_create(&threads[i], NULL,
+            fpp_scrypt_romix, &lanes[i]) == 0;
+    }
+
+    fpp_scrypt_romix(&lanes[0]);
+    for (i = 1; i < p; ++i) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        else {
+            fpp_scrypt_romix(&lanes[i]);
+        }
+    }
+
+    for (i = 0; i < p; ++i) {
+        if (lanes[i].err != FPP_OK) {
+            goto failed;
+        }
+    }
+
+    for (i = 0; i < size / 4; ++i) {
+        b[4 * i] = (uint8_t) w[i];
+        b[4 * i + 1] = (uint8_t) (w[i] >> 8);
+        b[4 * i + 2] = (uint8_t) (w[i] >> 16);
+        b[4 * i + 3] = (uint8_t) (w[i] >> 24);
+    }
+
+    if (!PKCS5_PBKDF2_HMAC(pass, passlen, b, size, 1, EVP_sha256(),
+        outlen, out))
+    {
+        goto failed;
+    }
+
+    err = FPP_OK;
+
+failed:
+    if (b) {
+        OPENSSL_cleanse(b, size);
+    }
+    if (w) {
+        OPENSSL_cleanse(w, size);
+    }
+    free(b);
+    free(w);
+    return err;
+}
+
+#if (OPENSSL_VERSION_NUMBER >= 0x30200000L)
+
+static fpp_err_t
+fpp_argon2id(OSSL_LIB_CTX *libctx, const fpp_kdf_params_t *kdf,
+    const char *pass, size_t passlen, const uint8_t *salt, size_t saltlen,
+    uint8_t *out, size_t outlen)
+{
+    OSSL_PARAM params[7], *p = params;
+    EVP_KDF *algo;
+    EVP_KDF_CTX *kctx;
+    uint32_t iter, lanes, threads, memcost;
+    int rc;
+
+    algo = EVP_KDF_fetch(libctx, "ARGON2ID", NULL);
+    if (!algo) {
+        return FPP_FAILURE;
+    }
+    kctx = EVP_KDF_CTX_new(algo);
+    EVP_KDF_free(algo);
+    if (!kctx) {
+        return FPP_FAILURE;
+    }
+
+    /* Threads come from the pool of libctx, sized by its owner */
+    iter = kdf->iter;
+    lanes = kdf->lanes;
+    threads = (OSSL_get_max_threads(libctx) < lanes)
+        ? (uint32_t) OSSL_get_max_threads(libctx) : lanes;
+    if (threads == 0) {
+        threads = 1;
+    }
+    memcost = kdf->memory * kdf->lanes;
+
+    *p++ = OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_PASSWORD,
+        (void *) pass, passlen);
+    *p++ = OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SALT,
+        (void *) salt, saltlen);
+    *p++ = OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ITER, &iter);
+    *p++ = OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ARGON2_LANES, &lanes);
+    *p++ = OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_THREADS, &threads);
+    *p++ = OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ARGON2_MEMCOST,
+        &memcost);
+    *p = OSSL_PARAM_construct_end();
+
+    rc = EVP_KDF_derive(kctx, out, outlen, params);
+    EVP_KDF_CTX_free(kctx);
+
+    return rc == 1 ? FPP_OK : FPP_FAILURE;
+}
+
+#endif
+
+fpp_err_t
+fpp_kdf_derive(OSSL_LIB_CTX *libctx, const fpp_kdf_params_t *kdf,
+    const char *pass, size_t passlen, const uint8_t *salt, size_t saltlen,
+    uint8_t *out, size_t outlen)
+{
+#if (OPENSSL_VERSION_NUMBER < 0x30200000L)
+    (void) libctx;
+#endif
+
+    if (fpp_kdf_check(kdf) != FPP_OK) {
+        return FPP_ERR_IO_FORMAT;
+    }
+
+    switch (kdf->id) {
+    case FPP_KDF_PBKDF2:
+        return fpp_pkcs5_pbkdf2_hmac_sha512(pass, passlen, salt, saltlen,
+            kdf->iter, out, outlen);
+
+    case FPP_KDF_SCRYPT:
+        return fpp_scrypt(pass, passlen, salt, saltlen, kdf->memory,
+            FPP_SCRYPT_R, kdf->lanes, out, outlen);
+
+#if (OPENSSL_VERSION_NUMBER >= 0x30200000L)
+    case FPP_KDF_ARGON2ID:
+        return fpp_argon2id(libctx, kdf, pass, passlen, salt, saltlen, out,
+            outlen);
+#endif
+
+    default:
+        return FPP_FAILURE;
+    }
+}
@@ -1,18 +1,80 @@
-/* 
+/*
  * This file is part of FPP (File Protection Program).
  *
  * See LICENSE for licensing information.
  */
 
+#include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
 #include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "log.h"
+#include "probes.h"
 
+/* Room kept for the "truncated" marker and the closing "}\n" */
+#define FPP_LOG_RECORD_RESERVE  24
+
+/* Longest the writer sleeps on an empty ring if a wakeup gets lost */
+#define FPP_LOG_IDLE_NS  10000000
+
+/*
+ * Bounded multi-producer single-consumer queue after Dmitry Vyukov.
+ * A slot whose seq equals the enqueue position is free, a producer
+ * claims it by moving enqueue_pos with a CAS, fills it in place and
+ * publishes it by setting seq to pos + 1. The writer thread returns
+ * it by setting seq to pos + nslots.
+ */
+typedef struct {
+    uint64_t seq;
+    size_t len;
+    char data[FPP_LOG_RECORD_SIZE];
+} fpp_log_slot_t;
+
+typedef struct {
+    char *data;
+    size_t len;
+    /* Without FPP_LOG_RECORD_RESERVE */
+    size_t size;
+    bool truncated;
+} fpp_log_buf_t;
+
+typedef struct {
+    fpp_log_slot_t *slots;
+    size_t mask;
+    uint64_t enqueue_pos;
+    uint64_t dequeue_pos;
+
+    FILE *fd;
+    fpp_log_level_t level;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int sleeping;
+    int shutdown;
+
+    uint64_t written;
+    uint64_t dropped;
+} fpp_log_t;
+
+static const char *fpp_log_level_names[] = {
+    "debug",
+    "info",
+    "warn",
+    "error"
+};
 
 static bool fpp_quite_mode;
 
+/* Set while the writer thread runs */
+static fpp_log_t *fpp_log;
+
+
 void
 fpp_enable_quite_mode(void)
 {
@@ -31,6 +93,420 @@ fpp_is_quite_mode(void)
     return fpp_quite_mode;
 }
 
+static void
+fpp_log_append(fpp_log_buf_t *b, const char *s, size_t n)
+{
+    if (b->truncated || b->len + n > b->size) {
+        b->truncated = true;
+        return;
+    }
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+/* Quoted and escaped, cut short rather than dropped if it doesn't fit */
+static void
+fpp_log_append_string(fpp_log_buf_t *b, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    char esc[6];
+    size_t n;
+
+    if (b->truncated || b->len + 2 > b->size) {
+        b->truncated = true;
+        return;
+    }
+    b->data[b->len++] = '"';
+
+    for ( ; *s; ++s) {
+        n = 0;
+        switch (*s) {
+        case '"':
+        case '\\':
+            esc[n++] = '\\';
+            esc[n++] = *s;
+            break;
+        case '\n':
+            esc[n++] = '\\';
+            esc[n++] = 'n';
+            break;
+        case '\t':
+            esc[n++] = '\\';
+            esc[n++] = 't';
+            break;
+        default:
+            if ((unsigned char) *s < 0x20) {
+                esc[n++] = '\\';
+                esc[n++] = 'u';
+                esc[n++] = '0';
+                esc[n++] = '0';
+                esc[n++] = hex[(*s >> 4) & 0x0f];
+                esc[n++] = hex[*s & 0x0f];
+            }
+            else {
+                esc[n++] = *s;
+            }
+        }
+
+        /* Keep one byte for the closing quote */
+        if (b->len + n + 1 > b->size) {
+            b->truncated = true;
+            break;
+        }
+        memcpy(b->data + b->len, esc, n);
+        b->len += n;
+    }
+
+    b->data[b->len++] = '"';
+}
+
+static void
+fpp_log_append_field(fpp_log_buf_t *b, const fpp_log_field_t *field)
+{
+    char num[32];
+    size_t saved;
+    int n = 0;
+
+    if (b->truncated) {
+        return;
+    }
+    saved = b->len;
+
+    fpp_log_append(b, ",", 1);
+    fpp_log_append_string(b, field->key);
+    fpp_log_append(b, ":", 1);
+    if (b->truncated) {
+        b->len = saved;
+        return;
+    }
+
+    switch (field->type) {
+    case FPP_LOG_FIELD_STR:
+        if (field->value.s) {
+            fpp_log_append_string(b, field->value.s);
+        }
+        else {
+            fpp_log_append(b, "null", 4);
+        }
+        /* A cut value is still a complete string */
+        return;
+    case FPP_LOG_FIELD_INT:
+        n = snprintf(num, sizeof(num), "%lld", (long long) field->value.i);
+        break;
+    case FPP_LOG_FIELD_UINT:
+        n = snprintf(num, sizeof(num), "%llu",
+            (unsigned long long) field->value.u);
+        break;
+    }
+    fpp_log_append(b, num, (size_t) n);
+
+    /* Don't leave a key without its value */
+    if (b->truncated) {
+        b->len = saved;
+    }
+}
+
+static size_t
+fpp_log_format(char *data, fpp_log_level_t level, const char *msg,
+    const fpp_log_field_t *fields, size_t nfields)
+{
+    fpp_log_buf_t b;
+    struct timespec ts;
+    struct tm tm;
+    time_t sec;
+    char stamp[64];
+    size_t i;
+    int n;
+
+    b.data = data;
+    b.len = 0;
+    b.size = FPP_LOG_RECORD_SIZE - FPP_LOG_RECORD_RESERVE;
+    b.truncated = false;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    sec = ts.tv_sec;
+#if (_WIN32)
+    gmtime_s(&tm, &sec);
+#else
+    gmtime_r(&sec, &tm);
+#endif
+    n = snprintf(stamp, sizeof(stamp),
+        "{\"ts\":\"%04d-%02d-%02dT%02d:%02d:%02d.%06ldZ\",\"level\":\"%s\"",
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+        tm.tm_min, tm.tm_sec, (long) ts.tv_nsec / 1000,
+        fpp_log_level_names[level]);
+    fpp_log_append(&b, stamp, (size_t) n);
+
+    fpp_log_append(&b, ",\"msg\":", sizeof(",\"msg\":") - 1);
+    fpp_log_append_string(&b, msg);
+
+    for (i = 0; i < nfields; ++i) {
+        fpp_log_append_field(&b, &fields[i]);
+    }
+
+    /* The reserve is always there for the tail */
+    b.size = FPP_LOG_RECORD_SIZE;
+    if (b.truncated) {
+        b.truncated = false;
+        fpp_log_append(&b, ",\"truncated\":true",
+            sizeof(",\"truncated\":true") - 1);
+    }
+    fpp_log_append(&b, "}\n", 2);
+
+    return b.len;
+}
+
+static bool
+fpp_log_push(fpp_log_t *log, fpp_log_level_t level, const char *msg,
+    const fpp_log_field_t *fields, size_t nfields)
+{
+    fpp_log_slot_t *slot;
+    uint64_t pos, seq;
+    int64_t diff;
+
+    pos = __atomic_load_n(&log->enqueue_pos, __ATOMIC_RELAXED);
+    for ( ;; ) {
+        slot = &log->slots[pos & log->mask];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (int64_t) (seq - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log->enqueue_pos, &pos,
+                pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            /* Full, the writer is behind */
+            __atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        else {
+            pos = __atomic_load_n(&log->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->len = fpp_log_format(slot->data, level, msg, fields, nfields);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    /* A lost wakeup only costs FPP_LOG_IDLE_NS */
+    if (__atomic_load_n(&log->sleeping, __ATOMIC_ACQUIRE)) {
+        pthread_cond_signal(&log->cond);
+    }
+    return true;
+}
+
+/* Writes what is published so far, returns the number of records */
+static size_t
+fpp_log_drain(fpp_log_t *log)
+{
+    fpp_log_slot_t *slot;
+    uint64_t pos;
+    size_t n = 0;
+
+    pos = log->dequeue_pos;
+    for ( ;; ) {
+        slot = &log->slots[pos & log->mask];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+            break;
+        }
+        fwrite(slot->data, 1, slot->len, log->fd);
+        __atomic_store_n(&slot->seq, pos + log->mask + 1, __ATOMIC_RELEASE);
+        ++pos;
+        ++n;
+    }
+    log->dequeue_pos = pos;
+
+    if (n) {
+        __atomic_add_fetch(&log->written, n, __ATOMIC_RELAXED);
+        fflush(log->fd);
+    }
+    return n;
+}
+
+static void *
+fpp_log_worker(void *arg)
+{
+    fpp_log_t *log = arg;
+    struct timespec ts;
+
+    for ( ;; ) {
+        if (fpp_log_drain(log)) {
+            continue;
+        }
+        if (__atomic_load_n(&log->shutdown, __ATOMIC_ACQUIRE)) {
+            /* Producers are gone, pick up the last ones */
+            fpp_log_drain(log);
+            break;
+        }
+
+        pthread_mutex_lock(&log->lock);
+        __atomic_store_n(&log->sleeping, 1, __ATOMIC_RELEASE);
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += FPP_LOG_IDLE_NS;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&log->cond, &log->lock, &ts);
+
+        __atomic_store_n(&log->sleeping, 0, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&log->lock);
+    }
+
+    return NULL;
+}
+
+void
+fpp_log_config_init(fpp_log_config_t *config)
+{
+    memset(config, 0, sizeof(fpp_log_config_t));
+    config->level = FPP_LOG_INFO;
+    config->fname = NULL;
+    config->nrecords = FPP_LOG_DEFAULT_RECORDS;
+}
+
+fpp_err_t
+fpp_log_start(const fpp_log_config_t *config)
+{
+    fpp_log_t *log;
+    size_t nslots, i;
+
+    if (fpp_log) {
+        return FPP_FAILURE;
+    }
+
+    log = calloc(1, sizeof(fpp_log_t));
+    if (!log) {
+        return FPP_FAILURE;
+    }
+
+    nslots = 2;
+    while (nslots < config->nrecords) {
+        nslots <<= 1;
+    }
+
+    log->slots = calloc(nslots, sizeof(fpp_log_slot_t));
+    if (!log->slots) {
+        goto failed;
+    }
+    for (i = 0; i < nslots; ++i) {
+        log->slots[i].seq = i;
+    }
+    log->mask = nslots - 1;
+    log->level = config->level;
+
+    if (!config->fname || strcmp(config->fname, "-") == 0) {
+        log->fd = stderr;
+    }
+    else {
+        log->fd = fopen(config->fname, "a");
+        if (!log->fd) {
+            goto failed;
+        }
+    }
+
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->cond, NULL);
+
+    if (pthread_create(&log->thread, NULL, fpp_log_worker, log) != 0) {
+        pthread_cond_destroy(&log->cond);
+        pthread_mutex_destroy(&log->lock);
+        goto failed;
+    }
+
+    __atomic_store_n(&fpp_log, log, __ATOMIC_RELEASE);
+    return FPP_OK;
+
+failed:
+    if (log->fd && log->fd != stderr) {
+        fclose(log->fd);
+    }
+    free(log->slots);
+    free(log);
+    return FPP_FAILURE;
+}
+
+void
+fpp_log_stop(void)
+{
+    fpp_log_t *log = fpp_log;
+    fpp_log_field_t field[] = {
+        FPP_LOG_UINT("dropped", 0)
+    };
+    char data[FPP_LOG_RECORD_SIZE];
+    size_t len;
+
+    if (!log) {
+        return;
+    }
+
+    __atomic_store_n(&fpp_log, NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&log->shutdown, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&log->cond);
+    pthread_join(log->thread, NULL);
+
+    if (log->dropped) {
+        field[0].value.u = log->dropped;
+        len = fpp_log_format(data, FPP_LOG_WARN, "Log records dropped",
+            field, 1);
+        fwrite(data, 1, len, log->fd);
+    }
+
+    if (log->fd == stderr) {
+        fflush(log->fd);
+    }
+    else {
+        fclose(log->fd);
+    }
+
+    pthread_cond_destroy(&log->cond);
+    pthread_mutex_destroy(&log->lock);
+    free(log->slots);
+    free(log);
+}
+
+static bool
+fpp_log_is_started(void)
+{
+    return __atomic_load_n(&fpp_log, __ATOMIC_ACQUIRE) != NULL;
+}
+
+bool
+fpp_log_enabled(fpp_log_level_t level)
+{
+    fpp_log_t *log = __atomic_load_n(&fpp_log, __ATOMIC_ACQUIRE);
+
+    return log && level >= log->level;
+}
+
+void
+fpp_log_write(fpp_log_level_t level, const char *msg,
+    const fpp_log_field_t *fields, size_t nfields)
+{
+    fpp_log_t *log = __atomic_load_n(&fpp_log, __ATOMIC_ACQUIRE);
+
+    if (!log || level < log->level) {
+        return;
+    }
+    fpp_log_push(log, level, msg, fields, nfields);
+}
+
+void
+fpp_log_get_stats(fpp_log_stats_t *stats)
+{
+    fpp_log_t *log = __atomic_load_n(&fpp_log, __ATOMIC_ACQUIRE);
+
+    memset(stats, 0, sizeof(fpp_log_stats_t));
+    if (!log) {
+        return;
+    }
+    stats->written = __atomic_load_n(&log->written, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+}
+
 void
 fpp_log_message(const char *fmt, ...)
 {
@@ -45,6 +521,11 @@ fpp_log_message(const char *fmt, ...)
     vsnprintf(errstr, FPP_MAX_ERRSTRLEN, fmt, args);
     va_end(args);
 
+    if (fpp_log_is_started()) {
+        fpp_log_write(FPP_LOG_INFO, errstr, NULL, 0);
+        return;
+    }
+
     fprintf(stdout, "%s\n", errstr);
 }
 
@@ -53,10 +534,20 @@ fpp_log_error(fpp_err_t errcode, const char *fmt, ...)
 {
     char errstr[FPP_MAX_ERRSTRLEN];
     va_list args;
+    fpp_log_field_t field[] = {
+        FPP_LOG_INT("code", errcode)
+    };
 
     va_start(args, fmt);
     vsnprintf(errstr, FPP_MAX_ERRSTRLEN, fmt, args);
     va_end(args);
 
+    FPP_PROBE2(error, errcode, errstr);
+
+    if (fpp_log_is_started()) {
+        fpp_log_write(FPP_LOG_ERROR, errstr, field, 1);
+        return;
+    }
+
     fprintf(stdout, "Error %d: %s\n", errcode, errstr);
 }
@@ -6,14 +6,118 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "memory.h"
 
+/*
+ * Waiters take a ticket and are admitted in ticket order, so a large
+ * reservation isn't starved by a stream of small ones.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t limit;
+    size_t in_use;
+    size_t peak_in_use;
+    uint64_t waits;
+    uint64_t next_ticket;
+    uint64_t serving;
+} fpp_memory_budget_t;
+
+static fpp_memory_budget_t fpp_memory_budget = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    0, 0, 0, 0, 0, 0
+};
 
+
+/*
+ * memset() from libc is already vectorized for the host CPU. The empty
+ * asm statement tells the compiler the zeroed memory is read, so the
+ * store can't be dropped as dead, without paying for a hardware fence.
+ */
 void
 fpp_explicit_memzero(uint8_t *buf, size_t n)
 {
     memset(buf, 0, n);
+#if defined(__GNUC__)
+    __asm__ __volatile__("" : : "r"(buf) : "memory");
+#else
     fpp_memory_barrier();
+#endif
+}
+
+void
+fpp_memory_set_budget(size_t limit)
+{
+    fpp_memory_budget_t *mb = &fpp_memory_budget;
+
+    pthread_mutex_lock(&mb->lock);
+    mb->limit = limit;
+    pthread_cond_broadcast(&mb->cond);
+    pthread_mutex_unlock(&mb->lock);
+}
+
+void
+fpp_memory_get_budget_stats(fpp_memory_budget_stats_t *stats)
+{
+    fpp_memory_budget_t *mb = &fpp_memory_budget;
+
+    pthread_mutex_lock(&mb->lock);
+    stats->limit = mb->limit;
+    stats->in_use = mb->in_use;
+    stats->peak_in_use = mb->peak_in_use;
+    stats->waits = mb->waits;
+    pthread_mutex_unlock(&mb->lock);
+}
+
+static bool
+fpp_memory_fits(const fpp_memory_budget_t *mb, size_t n)
+{
+    if (mb->limit == 0 || mb->in_use == 0) {
+        return true;
+    }
+    /* The limit may have been lowered below what is in use */
+    return mb->in_use <= mb->limit && n <= mb->limit - mb->in_use;
+}
+
+void
+fpp_memory_reserve(size_t n)
+{
+    fpp_memory_budget_t *mb = &fpp_memory_budget;
+    uint64_t ticket;
+
+    pthread_mutex_lock(&mb->lock);
+
+    ticket = mb->next_ticket++;
+    if (ticket != mb->serving || !fpp_memory_fits(mb, n)) {
+        mb->waits++;
+        do {
+            pthread_cond_wait(&mb->cond, &mb->lock);
+        } while (ticket != mb->serving || !fpp_memory_fits(mb, n));
+    }
+
+    mb->serving++;
+    mb->in_use += n;
+    if (mb->in_use > mb->peak_in_use) {
+        mb->peak_in_use = mb->in_use;
+    }
+
+    /* The next ticket may fit as well */
+    pthread_cond_broadcast(&mb->cond);
+    pthread_mutex_unlock(&mb->lock);
+}
+
+void
+fpp_memory_release(size_t n)
+{
+    fpp_memory_budget_t *mb = &fpp_memory_budget;
+
+    pthread_mutex_lock(&mb->lock);
+    mb->in_use -= n;
+    pthread_cond_broadcast(&mb->cond);
+    pthread_mutex_unlock(&mb->lock);
 }
@@ -0,0 +1,623 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/crypto.h>
+
+#include "merkle.h"
+#include "context_internal.h"
+#include "thread_pool.h"
+#include "sha3_256.h"
+#include "log.h"
+#include "memory.h"
+
+#define FPP_MERKLE_MAX_LEAF_SIZE  (1024 * 1024 * 1024)
+
+/* Leaves and inner nodes never hash to the same value */
+#define FPP_MERKLE_LEAF_PREFIX    0x00
+#define FPP_MERKLE_NODE_PREFIX    0x01
+
+/* More tasks than workers so that a slow region doesn't idle the rest */
+#define FPP_MERKLE_TASKS_PER_THREAD  4
+
+typedef struct {
+    int fd;
+    uint64_t data_offset;
+    uint64_t data_size;
+    size_t leaf_size;
+    /* Leaves [first, last), hashes[0] belongs to leaf base */
+    uint64_t first;
+    uint64_t last;
+    uint64_t base;
+    uint8_t *hashes;
+    fpp_throttle_t *throttle;
+    fpp_err_t err;
+    fpp_wait_group_t *wg;
+} fpp_merkle_task_t;
+
+static const char merkle_magic_word[8] = "FPPMv1";
+
+
+static fpp_err_t
+fpp_merkle_hash(uint8_t prefix, const uint8_t *a, size_t a_len,
+    const uint8_t *b, size_t b_len, uint8_t *out)
+{
+    EVP_MD_CTX *mdctx;
+
+    mdctx = fpp_sha3_256_init(&prefix, 1);
+    if (!mdctx) {
+        return FPP_FAILURE;
+    }
+    if (fpp_sha3_256_update(mdctx, a, a_len) != FPP_OK
+        || (b && fpp_sha3_256_update(mdctx, b, b_len) != FPP_OK))
+    {
+        fpp_sha3_256_free(mdctx);
+        return FPP_FAILURE;
+    }
+    return fpp_sha3_256_final(mdctx, out);
+}
+
+static uint64_t
+fpp_merkle_nleaves(uint64_t data_size, size_t leaf_size)
+{
+    return (data_size + leaf_size - 1) / leaf_size;
+}
+
+/* Short reads of a truncated file hash what is there, i.e. mismatch */
+static fpp_err_t
+fpp_merkle_hash_leaves(fpp_merkle_task_t *task, uint8_t *buf)
+{
+    uint64_t leaf, pos, end;
+    size_t want, got;
+    ssize_t n;
+
+    for (leaf = task->first; leaf < task->last; ++leaf) {
+        pos = leaf * task->leaf_size;
+        end = pos + task->leaf_size;
+        if (end > task->data_size) {
+            end = task->data_size;
+        }
+        want = (size_t) (end - pos);
+
+        for (got = 0; got < want; got += (size_t) n) {
+            n = pread(task->fd, buf + got, want - got,
+                (off_t) (task->data_offset + pos + got));
+            if (n == -1) {
+                return fpp_get_os_errno();
+            }
+            if (n == 0) {
+                break;
+            }
+        }
+        fpp_throttle_acquire(task->throttle, got);
+
+        if (fpp_merkle_hash(FPP_MERKLE_LEAF_PREFIX, buf, got, NULL, 0,
+            task->hashes + (leaf - task->base) * FPP_MERKLE_HASH_SIZE)
+            != FPP_OK)
+        {
+            return fpp_get_openssl_errno();
+        }
+    }
+
+    return FPP_OK;
+}
+
+static void
+fpp_merkle_task_handler(void *arg)
+{
+    fpp_merkle_task_t *task = arg;
+    uint8_t *buf;
+
+    fpp_memory_reserve(task->leaf_size);
+
+    buf = malloc(task->leaf_size);
+    if (!buf) {
+        task->err = fpp_get_os_errno();
+    }
+    else {
+        task->err = fpp_merkle_hash_leaves(task, buf);
+        free(buf);
+    }
+
+    fpp_memory_release(task->leaf_size);
+
+    fpp_wait_group_done(task->wg);
+}
+
+/* Leaves [first, last) into hashes, spread over the thread pool */
+static fpp_err_t
+fpp_merkle_hash_range(fpp_ctx_t *ctx, int fd, uint64_t data_offset,
+    uint64_t data_size, size_t leaf_size, uint64_t first, uint64_t last,
+    uint8_t *hashes)
+{
+    fpp_thread_pool_t *pool;
+    fpp_merkle_task_t *tasks;
+    fpp_wait_group_t wg;
+    uint64_t n, per_task;
+    size_t ntasks, i;
+    fpp_err_t err;
+
+    n = last - first;
+    if (n == 0) {
+        return FPP_OK;
+    }
+
+    pool = fpp_ctx_get_thread_pool(ctx);
+    if (!pool) {
+        fpp_log_error(FPP_FAILURE, "Failed to start worker threads");
+        return FPP_FAILURE;
+    }
+
+    ntasks = fpp_thread_pool_size(pool) * FPP_MERKLE_TASKS_PER_THREAD;
+    if (ntasks > n) {
+        ntasks = (size_t) n;
+    }
+    per_task = (n + ntasks - 1) / ntasks;
+    ntasks = (size_t) ((n + per_task - 1) / per_task);
+
+    tasks = calloc(ntasks, sizeof(fpp_merkle_task_t));
+    if (!tasks) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to allocate memory");
+        return FPP_FAILURE;
+    }
+
+    if (fpp_wait_group_init(&wg) != FPP_OK) {
+        free(tasks);
+        return FPP_FAILURE;
+    }
+
+    for (i = 0; i < ntasks; ++i) {
+        tasks[i].fd = fd;
+        tasks[i].data_offset = data_offset;
+        tasks[i].data_size = data_size;
+        tasks[i].leaf_size = leaf_size;
+        tasks[i].first = first + i * per_task;
+        tasks[i].last = tasks[i].first + per_task;
+        if (tasks[i].last > last) {
+            tasks[i].last = last;
+        }
+        tasks[i].base = first;
+        tasks[i].hashes = hashes;
+        tasks[i].throttle = &ctx->throttle;
+        tasks[i].wg = &wg;
+
+        fpp_wait_group_add(&wg, 1);
+        if (fpp_thread_pool_post(pool, fpp_merkle_task_handler,
+            &tasks[i]) != FPP_OK)
+        {
+            fpp_merkle_task_handler(&tasks[i]);
+        }
+    }
+
+    fpp_wait_group_wait(&wg);
+    fpp_wait_group_destroy(&wg);
+
+    err = FPP_OK;
+    for (i = 0; i < ntasks; ++i) {
+        if (tasks[i].err != FPP_OK) {
+            err = tasks[i].err;
+        }
+    }
+    free(tasks);
+
+    if (err != FPP_OK) {
+        fpp_log_error(err, "Failed to hash chunks");
+        return FPP_FAILURE;
+    }
+    return FPP_OK;
+}
+
+/* An odd node at the end of a level moves up unchanged */
+static fpp_err_t
+fpp_merkle_root(const uint8_t *leaves, uint64_t n, uint8_t *root)
+{
+    uint8_t *level;
+    uint64_t i;
+
+    if (n == 0) {
+        return fpp_merkle_hash(FPP_MERKLE_NODE_PREFIX, NULL, 0, NULL, 0,
+            root);
+    }
+
+    level = malloc(n * FPP_MERKLE_HASH_SIZE);
+    if (!level) {
+        return FPP_FAILURE;
+    }
+    memcpy(level, leaves, n * FPP_MERKLE_HASH_SIZE);
+
+    while (n > 1) {
+        for (i = 0; i < n / 2; ++i) {
+            if (fpp_merkle_hash(FPP_MERKLE_NODE_PREFIX,
+                level + 2 * i * FPP_MERKLE_HASH_SIZE, FPP_MERKLE_HASH_SIZE,
+                level + (2 * i + 1) * FPP_MERKLE_HASH_SIZE,
+                FPP_MERKLE_HASH_SIZE, level + i * FPP_MERKLE_HASH_SIZE)
+                != FPP_OK)
+            {
+                free(level);
+                return FPP_FAILURE;
+            }
+        }
+        if (n % 2) {
+            memmove(level + i * FPP_MERKLE_HASH_SIZE,
+                level + (n - 1) * FPP_MERKLE_HASH_SIZE,
+                FPP_MERKLE_HASH_SIZE);
+        }
+        n = (n + 1) / 2;
+    }
+
+    memcpy(root, level, FPP_MERKLE_HASH_SIZE);
+    free(level);
+    return FPP_OK;
+}
+
+static FILE *
+fpp_merkle_open_header(const char *fname, const char *header_fname,
+    const char *mode, fpp_crypto_header_t *header)
+{
+    const char *name = header_fname ? header_fname : fname;
+    FILE *fd;
+    fpp_err_t err;
+
+    fd = fopen(name, mode);
+    if (!fd) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to open header file \"%s\"", name);
+        return NULL;
+    }
+
+    err = fpp_read_header(header, fd);
+    if (err != FPP_OK) {
+        fpp_log_error(err == FPP_ERR_IO_FORMAT ? err : fpp_get_os_errno(),
+            "Failed to read header \"%s\"", name);
+        fclose(fd);
+        return NULL;
+    }
+
+    if (memcmp(header->magic_word, FPP_MAGIC_WORD_V1,
+        sizeof(FPP_MAGIC_WORD_V1)) == 0)
+    {
+        fpp_log_error(FPP_ERR_IO_FORMAT,
+            "\"%s\" is in the FPPv1 format, which has no integrity index",
+            name);
+        fclose(fd);
+        return NULL;
+    }
+
+    return fd;
+}
+
+fpp_err_t
+fpp_ctx_merkle_build(fpp_ctx_t *ctx, const char *fname,
+    const char *header_fname, const char *index_fname, size_t leaf_size)
+{
+    fpp_crypto_header_t header;
+    fpp_merkle_index_t index;
+    struct stat st;
+    uint8_t *hashes = NULL;
+    FILE *head_fd = NULL;
+    FILE *index_fd = NULL;
+    int fd = -1;
+    int rc;
+    fpp_err_t err;
+
+    if (leaf_size == 0) {
+        leaf_size = FPP_MERKLE_DEFAULT_LEAF_SIZE;
+    }
+    if (leaf_size > FPP_MERKLE_MAX_LEAF_SIZE) {
+        fpp_log_error(FPP_ERR_IO_ARGV, "Chunk size %zu is too large",
+            leaf_size);
+        return FPP_FAILURE;
+    }
+
+    head_fd = fpp_merkle_open_header(fname, header_fname, "r+b", &header);
+    if (!head_fd) {
+        return FPP_FAILURE;
+    }
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to open \"%s\"", fname);
+        goto failed;
+    }
+
+    memset(&index, 0, sizeof(index));
+    memcpy(index.magic_word, merkle_magic_word, sizeof(index.magic_word));
+    index.leaf_size = (uint32_t) leaf_size;
+    index.data_offset = header_fname ? 0 : sizeof(fpp_crypto_header_t);
+    if ((uint64_t) st.st_size < index.data_offset) {
+        fpp_log_error(FPP_ERR_IO_FORMAT, "\"%s\" is truncated", fname);
+        goto failed;
+    }
+    index.data_size = (uint64_t) st.st_size - index.data_offset;
+    index.nleaves = fpp_merkle_nleaves(index.data_size, leaf_size);
+
+    hashes = malloc(index.nleaves * FPP_MERKLE_HASH_SIZE + 1);
+    if (!hashes) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to allocate memory");
+        goto failed;
+    }
+
+    if (fpp_merkle_hash_range(ctx, fd, index.data_offset, index.data_size,
+        leaf_size, 0, index.nleaves, hashes) != FPP_OK)
+    {
+        goto failed;
+    }
+
+    if (fpp_merkle_root(hashes, index.nleaves, header.merkle_root)
+        != FPP_OK)
+    {
+        err = fpp_get_openssl_errno();
+        fpp_log_error(err, "Failed to hash chunks");
+        goto failed;
+    }
+
+    index_fd = fopen(index_fname, "wb");
+    if (!index_fd) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to open index file \"%s\"", index_fname);
+        goto failed;
+    }
+    if (fwrite(&index, sizeof(index), 1, index_fd) != 1
+        || fwrite(hashes, FPP_MERKLE_HASH_SIZE, index.nleaves, index_fd)
+            != index.nleaves)
+    {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to write index file \"%s\"", index_fname);
+        goto failed;
+    }
+    rc = fclose(index_fd);
+    index_fd = NULL;
+    if (rc != 0) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to write index file \"%s\"", index_fname);
+        remove(index_fname);
+        goto failed;
+    }
+
+    header.flags |= FPP_HEADER_MERKLE;
+    rc = fpp_write_header(&header, head_fd) == FPP_OK ? 0 : -1;
+    if (fclose(head_fd) != 0) {
+        rc = -1;
+    }
+    head_fd = NULL;
+    if (rc != 0) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to write header \"%s\"",
+            header_fname ? header_fname : fname);
+        remove(index_fname);
+        goto failed;
+    }
+
+    close(fd);
+    free(hashes);
+    return FPP_OK;
+
+failed:
+    if (index_fd) {
+        fclose(index_fd);
+        remove(index_fname);
+    }
+    if (head_fd) {
+        fclose(head_fd);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    free(hashes);
+    return FPP_FAILURE;
+}
+
+static fpp_err_t
+fpp_merkle_read_index(const char *index_fname, fpp_merkle_index_t *index,
+    uint8_t **hashes)
+{
+    FILE *fd;
+    struct stat st;
+    fpp_err_t err;
+
+    *hashes = NULL;
+
+    fd = fopen(index_fname, "rb");
+    if (!fd) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to open index file \"%s\"", index_fname);
+        return FPP_FAILURE;
+    }
+    if (fstat(fileno(fd), &st) == -1) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to open index file \"%s\"", index_fname);
+        goto failed;
+    }
+
+    if (fread(index, sizeof(*index), 1, fd) != 1
+        || memcmp(index->magic_word, merkle_magic_word,
+            sizeof(index->magic_word)) != 0
+        || index->leaf_size == 0
+        || index->leaf_size > FPP_MERKLE_MAX_LEAF_SIZE
+        || index->nleaves != fpp_merkle_nleaves(index->data_size,
+            index->leaf_size)
+        || index->nleaves > (SIZE_MAX - 1) / FPP_MERKLE_HASH_SIZE)
+    {
+        fpp_log_error(FPP_ERR_IO_FORMAT, "Invalid index file \"%s\"",
+            index_fname);
+        goto failed;
+    }
+    /* nleaves is untrusted, don't allocate for hashes the file lacks */
+    if (index->nleaves > ((uint64_t) st.st_size - sizeof(*index))
+        / FPP_MERKLE_HASH_SIZE)
+    {
+        fpp_log_error(FPP_ERR_IO_FORMAT, "Index file \"%s\" is truncated",
+            index_fname);
+        goto failed;
+    }
+
+    *hashes = malloc(index->nleaves * FPP_MERKLE_HASH_SIZE + 1);
+    if (!*hashes) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to allocate memory");
+        goto failed;
+    }
+
+    if (fread(*hashes, FPP_MERKLE_HASH_SIZE, index->nleaves, fd)
+        != index->nleaves)
+    {
+        fpp_log_error(FPP_ERR_IO_FORMAT, "Index file \"%s\" is truncated",
+            index_fname);
+        goto failed;
+    }
+
+    fclose(fd);
+    return FPP_OK;
+
+failed:
+    free(*hashes);
+    *hashes = NULL;
+    fclose(fd);
+    return FPP_FAILURE;
+}
+
+fpp_err_t
+fpp_ctx_merkle_verify(fpp_ctx_t *ctx, const char *fname,
+    const char *header_fname, const char *index_fname, uint64_t offset,
+    uint64_t length, fpp_merkle_report_t *report)
+{
+    fpp_crypto_header_t header;
+    fpp_merkle_index_t index;
+    uint8_t root[FPP_MERKLE_HASH_SIZE];
+    uint8_t *stored = NULL;
+    uint8_t *hashes = NULL;
+    fpp_merkle_chunk_t *chunk;
+    uint64_t first, last, end, i;
+    struct stat st;
+    FILE *head_fd;
+    int fd = -1;
+    fpp_err_t err;
+
+    memset(report, 0, sizeof(fpp_merkle_report_t));
+
+    head_fd = fpp_merkle_open_header(fname, header_fname, "rb", &header);
+    if (!head_fd) {
+        return FPP_FAILURE;
+    }
+    fclose(head_fd);
+
+    if (!(header.flags & FPP_HEADER_MERKLE)) {
+        fpp_log_error(FPP_ERR_IO_FORMAT, "\"%s\" has no integrity index",
+            header_fname ? header_fname : fname);
+        return FPP_ERR_IO_FORMAT;
+    }
+
+    if (fpp_merkle_read_index(index_fname, &index, &stored) != FPP_OK) {
+        return FPP_ERR_IO_FORMAT;
+    }
+
+    /* The header vouches for the index, the index for the chunks */
+    if (fpp_merkle_root(stored, index.nleaves, root) != FPP_OK) {
+        err = fpp_get_openssl_errno();
+        fpp_log_error(err, "Failed to hash chunks");
+        goto failed;
+    }
+    if (CRYPTO_memcmp(root, header.merkle_root, sizeof(root)) != 0) {
+        fpp_log_error(FPP_ERR_IO_FORMAT,
+            "Index file \"%s\" doesn't match the header", index_fname);
+        free(stored);
+        return FPP_ERR_IO_FORMAT;
+    }
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to open \"%s\"", fname);
+        goto failed;
+    }
+    report->size_mismatch =
+        (uint64_t) st.st_size != index.data_offset + index.data_size;
+
+    if (offset >= index.data_size && index.data_size) {
+        fpp_log_error(FPP_ERR_IO_ARGV,
+            "Offset %llu is past the end of the data",
+            (unsigned long long) offset);
+        goto failed;
+    }
+    end = index.data_size;
+    if (length && length < index.data_size - offset) {
+        end = offset + length;
+    }
+    first = offset / index.leaf_size;
+    last = end ? (end - 1) / index.leaf_size + 1 : 0;
+    if (last > index.nleaves
+        || last - first > (SIZE_MAX - 1) / FPP_MERKLE_HASH_SIZE)
+    {
+        fpp_log_error(FPP_ERR_IO_FORMAT, "Invalid index file \"%s\"",
+            index_fname);
+        goto failed;
+    }
+
+    hashes = malloc((last - first) * FPP_MERKLE_HASH_SIZE + 1);
+    report->bad = calloc(last - first + 1, sizeof(fpp_merkle_chunk_t));
+    if (!hashes || !report->bad) {
+        err = fpp_get_os_errno();
+        fpp_log_error(err, "Failed to allocate memory");
+        goto failed;
+    }
+
+    if (fpp_merkle_hash_range(ctx, fd, index.data_offset, index.data_size,
+        index.leaf_size, first, last, hashes) != FPP_OK)
+    {
+        goto failed;
+    }
+
+    for (i = first; i < last; ++i) {
+        if (CRYPTO_memcmp(hashes + (i - first) * FPP_MERKLE_HASH_SIZE,
+            stored + i * FPP_MERKLE_HASH_SIZE, FPP_MERKLE_HASH_SIZE) == 0)
+        {
+            continue;
+        }
+        chunk = &report->bad[report->nbad++];
+        chunk->index = i;
+        chunk->offset = index.data_offset + i * index.leaf_size;
+        chunk->length = index.leaf_size;
+        if (i * index.leaf_size + chunk->length > index.data_size) {
+            chunk->length = index.data_size - i * index.leaf_size;
+        }
+    }
+    report->nchecked = last - first;
+
+    close(fd);
+    free(hashes);
+    free(stored);
+
+    return (report->nbad || report->size_mismatch)
+        ? FPP_ERR_IO_DIGEST : FPP_OK;
+
+failed:
+    if (fd != -1) {
+        close(fd);
+    }
+    free(hashes);
+    free(stored);
+    fpp_merkle_report_free(report);
+    return FPP_FAILURE;
+}
+
+void
+fpp_merkle_report_free(fpp_merkle_report_t *report)
+{
+    free(report->bad);
+    report->bad = NULL;
+    report->nbad = 0;
+}
@@ -9,8 +9,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
 
 #include "pbkdf2.h"
+#include "stats.h"
+
+/* Iterations are doubled until one run takes this long */
+#define FPP_PBKDF2_SAMPLE_NS  (50 * 1000 * 1000)
 
 fpp_err_t
 fpp_pkcs5_pbkdf2_hmac_sha256(const char *pass, size_t passlen,
@@ -47,3 +53,364 @@ fpp_pkcs5_pbkdf2_hmac_sha512(const char *pass, size_t passlen,
     }
     return EXIT_SUCCESS;
 }
+
+#define FPP_SHA512_BLOCK_SIZE   128
+#define FPP_SHA512_DIGEST_SIZE  64
+
+/*
+ * Lanes are GCC vector extensions, which GCC and clang lower to what
+ * the target has, down to plain 64-bit operations. On x86-64 Linux the
+ * iteration loop is also built for AVX2 and AVX-512 and the loader
+ * picks the variant the CPU supports. FPP_PBKDF2_GENERIC builds only
+ * the portable loop, the tests use it to cover both.
+ */
+typedef uint64_t fpp_u64v_t
+    __attribute__((vector_size(8 * FPP_PBKDF2_LANES)));
+
+#if (__x86_64__) && (__linux__) && !(__clang__)                           \
+    && !defined(FPP_PBKDF2_GENERIC)
+#define FPP_PBKDF2_CLONES                                                  \
+    __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define FPP_PBKDF2_CLONES
+#endif
+
+static const uint64_t fpp_sha512_k[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL,
+    0xe9b5dba58189dbbcULL, 0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+    0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL, 0xd807aa98a3030242ULL,
+    0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL,
+    0xc19bf174cf692694ULL, 0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+    0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL, 0x2de92c6f592b0275ULL,
+    0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL,
+    0xbf597fc7beef0ee4ULL, 0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+    0x06ca6351e003826fULL, 0x142929670a0e6e70ULL, 0x27b70a8546d22ffcULL,
+    0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL,
+    0x92722c851482353bULL, 0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+    0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL, 0xd192e819d6ef5218ULL,
+    0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL,
+    0x34b0bcb5e19b48a8ULL, 0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+    0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL, 0x748f82ee5defb2fcULL,
+    0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL,
+    0xc67178f2e372532bULL, 0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+    0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL, 0x06f067aa72176fbaULL,
+    0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL,
+    0x431d67c49c100d4cULL, 0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+    0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static const uint64_t fpp_sha512_iv[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL,
+    0xa54ff53a5f1d36f1ULL, 0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+#define FPP_ROTR64(x, n)  (((x) >> (n)) | ((x) << (64 - (n))))
+#define FPP_SHA512_S0(x)                                                   \
+    (FPP_ROTR64(x, 28) ^ FPP_ROTR64(x, 34) ^ FPP_ROTR64(x, 39))
+#define FPP_SHA512_S1(x)                                                   \
+    (FPP_ROTR64(x, 14) ^ FPP_ROTR64(x, 18) ^ FPP_ROTR64(x, 41))
+#define FPP_SHA512_G0(x)                                                   \
+    (FPP_ROTR64(x, 1) ^ FPP_ROTR64(x, 8) ^ ((x) >> 7))
+#define FPP_SHA512_G1(x)                                                   \
+    (FPP_ROTR64(x, 19) ^ FPP_ROTR64(x, 61) ^ ((x) >> 6))
+
+/*
+ * One SHA-512 compression of the 16 words in w into the 8 words in h,
+ * for uint64_t words or for vectors of them, one message per lane.
+ */
+#define FPP_SHA512_COMPRESS(type, h, w)                                    \
+    do {                                                                   \
+        type a_ = h[0], b_ = h[1], c_ = h[2], d_ = h[3];                   \
+        type e_ = h[4], f_ = h[5], g_ = h[6], h_ = h[7];                   \
+        type t1_, t2_;                                                     \
+        int i_;                                                            \
+                                                                           \
+        for (i_ = 0; i_ < 80; ++i_) {                                      \
+            if (i_ >= 16) {                                                \
+                w[i_ & 15] += FPP_SHA512_G1(w[(i_ - 2) & 15])              \
+                    + w[(i_ - 7) & 15] + FPP_SHA512_G0(w[(i_ - 15) & 15]); \
+            }                                                              \
+            t1_ = h_ + FPP_SHA512_S1(e_) + ((e_ & f_) ^ (~e_ & g_))        \
+                + fpp_sha512_k[i_] + w[i_ & 15];                           \
+            t2_ = FPP_SHA512_S0(a_) + ((a_ & b_) ^ (a_ & c_) ^ (b_ & c_)); \
+            h_ = g_; g_ = f_; f_ = e_; e_ = d_ + t1_;                      \
+            d_ = c_; c_ = b_; b_ = a_; a_ = t1_ + t2_;                     \
+        }                                                                  \
+                                                                           \
+        h[0] += a_; h[1] += b_; h[2] += c_; h[3] += d_;                    \
+        h[4] += e_; h[5] += f_; h[6] += g_; h[7] += h_;                    \
+    } while (0)
+
+static uint64_t
+fpp_load_be64(const uint8_t *p)
+{
+    return ((uint64_t) p[0] << 56) | ((uint64_t) p[1] << 48)
+        | ((uint64_t) p[2] << 40) | ((uint64_t) p[3] << 32)
+        | ((uint64_t) p[4] << 24) | ((uint64_t) p[5] << 16)
+        | ((uint64_t) p[6] << 8) | (uint64_t) p[7];
+}
+
+static void
+fpp_store_be64(uint8_t *p, uint64_t v)
+{
+    int i;
+
+    for (i = 7; i >= 0; --i) {
+        p[i] = (uint8_t) v;
+        v >>= 8;
+    }
+}
+
+/*
+ * HMAC-SHA512 of a 64 byte message, which is always one padded block,
+ * from the precomputed key states of every lane: h = H(init, data).
+ */
+static inline __attribute__((always_inline)) void
+fpp_sha512_lanes(fpp_u64v_t *h, const fpp_u64v_t *init,
+    const fpp_u64v_t *data)
+{
+    fpp_u64v_t w[16];
+    fpp_u64v_t zero = { 0 };
+    int i;
+
+    for (i = 0; i < 8; ++i) {
+        w[i] = data[i];
+        h[i] = init[i];
+    }
+    w[8] = zero + 0x8000000000000000ULL;
+    for (i = 9; i < 15; ++i) {
+        w[i] = zero;
+    }
+    w[15] = zero + (FPP_SHA512_BLOCK_SIZE + FPP_SHA512_DIGEST_SIZE) * 8;
+
+    FPP_SHA512_COMPRESS(fpp_u64v_t, h, w);
+}
+
+/* Iterations 2..iter of every lane, t holds U1 on entry */
+FPP_PBKDF2_CLONES static void
+fpp_pbkdf2_iterate(const fpp_u64v_t *istate, const fpp_u64v_t *ostate,
+    fpp_u64v_t *u, fpp_u64v_t *t, uint32_t iter)
+{
+    fpp_u64v_t inner[8];
+    uint32_t j;
+    int i;
+
+    for (j = 1; j < iter; ++j) {
+        fpp_sha512_lanes(inner, istate, u);
+        fpp_sha512_lanes(u, ostate, inner);
+        for (i = 0; i < 8; ++i) {
+            t[i] ^= u[i];
+        }
+    }
+
+    OPENSSL_cleanse(inner, sizeof(inner));
+}
+
+/* Key states of HMAC-SHA512 after the ipad and opad blocks */
+static fpp_err_t
+fpp_hmac_sha512_states(const char *pass, size_t passlen, uint64_t *ipad,
+    uint64_t *opad)
+{
+    uint8_t key[FPP_SHA512_BLOCK_SIZE];
+    uint64_t w[16];
+    unsigned int len;
+    int i;
+
+    memset(key, 0, sizeof(key));
+    if (passlen > sizeof(key)) {
+        if (EVP_Digest(pass, passlen, key, &len, EVP_sha512(), NULL) != 1) {
+            return FPP_FAILURE;
+        }
+    }
+    else if (passlen) {
+        memcpy(key, pass, passlen);
+    }
+
+    memcpy(ipad, fpp_sha512_iv, sizeof(fpp_sha512_iv));
+    for (i = 0; i < 16; ++i) {
+        w[i] = fpp_load_be64(key + 8 * i) ^ 0x3636363636363636ULL;
+    }
+    FPP_SHA512_COMPRESS(uint64_t, ipad, w);
+
+    memcpy(opad, fpp_sha512_iv, sizeof(fpp_sha512_iv));
+    for (i = 0; i < 16; ++i) {
+        w[i] = fpp_load_be64(key + 8 * i) ^ 0x5c5c5c5c5c5c5c5cULL;
+    }
+    FPP_SHA512_COMPRESS(uint64_t, opad, w);
+
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(w, sizeof(w));
+    return FPP_OK;
+}
+
+/* U1 of output block index, HMAC(pass, salt || INT(index + 1)) */
+static fpp_err_t
+fpp_pbkdf2_first(const fpp_pbkdf2_params_t *params, size_t index,
+    uint8_t *msg, uint8_t *u1)
+{
+    unsigned int len;
+
+    memcpy(msg, params->salt, params->saltlen);
+    msg[params->saltlen] = (uint8_t) ((index + 1) >> 24);
+    msg[params->saltlen + 1] = (uint8_t) ((index + 1) >> 16);
+    msg[params->saltlen + 2] = (uint8_t) ((index + 1) >> 8);
+    msg[params->saltlen + 3] = (uint8_t) (index + 1);
+
+    if (!HMAC(EVP_sha512(), params->pass, (int) params->passlen, msg,
+        params->saltlen + 4, u1, &len))
+    {
+        return FPP_FAILURE;
+    }
+    return FPP_OK;
+}
+
+fpp_err_t
+fpp_pkcs5_pbkdf2_hmac_sha512_batch(const fpp_pbkdf2_params_t *params,
+    size_t n, uint32_t iter, size_t outlen)
+{
+    fpp_u64v_t istate[8], ostate[8], u[8], t[8];
+    uint64_t ipad[8], opad[8];
+    uint8_t u1[FPP_SHA512_DIGEST_SIZE];
+    uint8_t block[FPP_SHA512_DIGEST_SIZE];
+    uint8_t *msg;
+    size_t i, lane, base, unit, nblocks, total, saltlen, len;
+    const fpp_pbkdf2_params_t *p;
+    fpp_err_t err = FPP_FAILURE;
+    int k;
+
+    if (iter == 0 || outlen == 0) {
+        return FPP_FAILURE;
+    }
+
+    /* A single block gains nothing from lanes, OpenSSL is faster */
+    if (n == 1 && outlen <= FPP_SHA512_DIGEST_SIZE) {
+        return fpp_pkcs5_pbkdf2_hmac_sha512(params->pass, params->passlen,
+            params->salt, params->saltlen, iter, params->out, outlen);
+    }
+
+    saltlen = 0;
+    for (i = 0; i < n; ++i) {
+        if (params[i].saltlen > saltlen) {
+            saltlen = params[i].saltlen;
+        }
+    }
+    msg = malloc(saltlen + 4);
+    if (!msg) {
+        return FPP_FAILURE;
+    }
+
+    nblocks = (outlen + FPP_SHA512_DIGEST_SIZE - 1) / FPP_SHA512_DIGEST_SIZE;
+    total = n * nblocks;
+
+    for (base = 0; base < total; base += FPP_PBKDF2_LANES) {
+
+        for (lane = 0; lane < FPP_PBKDF2_LANES; ++lane) {
+            unit = base + lane;
+            /* Spare lanes repeat the first one, their result is unused */
+            if (unit >= total) {
+                for (k = 0; k < 8; ++k) {
+                    istate[k][lane] = istate[k][0];
+                    ostate[k][lane] = ostate[k][0];
+                    u[k][lane] = u[k][0];
+                }
+                continue;
+            }
+
+            p = &params[unit / nblocks];
+            if (fpp_hmac_sha512_states(p->pass, p->passlen, ipad, opad)
+                    != FPP_OK
+                || fpp_pbkdf2_first(p, unit % nblocks, msg, u1) != FPP_OK)
+            {
+                goto failed;
+            }
+
+            for (k = 0; k < 8; ++k) {
+                istate[k][lane] = ipad[k];
+                ostate[k][lane] = opad[k];
+                u[k][lane] = fpp_load_be64(u1 + 8 * k);
+            }
+        }
+
+        for (k = 0; k < 8; ++k) {
+            t[k] = u[k];
+        }
+        fpp_pbkdf2_iterate(istate, ostate, u, t, iter);
+
+        for (lane = 0; lane < FPP_PBKDF2_LANES && base + lane < total;
+            ++lane)
+        {
+            unit = base + lane;
+            for (k = 0; k < 8; ++k) {
+                fpp_store_be64(block + 8 * k, t[k][lane]);
+            }
+
+            i = (unit % nblocks) * FPP_SHA512_DIGEST_SIZE;
+            len = outlen - i;
+            if (len > FPP_SHA512_DIGEST_SIZE) {
+                len = FPP_SHA512_DIGEST_SIZE;
+            }
+            memcpy(params[unit / nblocks].out + i, block, len);
+        }
+    }
+
+    err = FPP_OK;
+
+failed:
+    OPENSSL_cleanse(istate, sizeof(istate));
+    OPENSSL_cleanse(ostate, sizeof(ostate));
+    OPENSSL_cleanse(u, sizeof(u));
+    OPENSSL_cleanse(t, sizeof(t));
+    OPENSSL_cleanse(ipad, sizeof(ipad));
+    OPENSSL_cleanse(opad, sizeof(opad));
+    OPENSSL_cleanse(u1, sizeof(u1));
+    OPENSSL_cleanse(block, sizeof(block));
+    free(msg);
+    return err;
+}
+
+fpp_err_t
+fpp_pkcs5_pbkdf2_hmac_sha512_calibrate(uint32_t msec, size_t outlen,
+    uint32_t *iter)
+{
+    static const uint8_t salt[16];
+    uint8_t out[EVP_MAX_MD_SIZE * 4];
+    uint64_t start, elapsed;
+    uint32_t n;
+    double count;
+
+    if (outlen > sizeof(out)) {
+        outlen = sizeof(out);
+    }
+
+    for (n = FPP_PBKDF2_MIN_ITER; ; n *= 2) {
+        start = fpp_time_ns();
+        if (fpp_pkcs5_pbkdf2_hmac_sha512("fpp", 3, salt, sizeof(salt), n,
+            out, outlen) != FPP_OK)
+        {
+            return FPP_FAILURE;
+        }
+        elapsed = fpp_time_ns() - start;
+
+        if (elapsed >= FPP_PBKDF2_SAMPLE_NS || n > UINT32_MAX / 2) {
+            break;
+        }
+    }
+
+    count = (double) n * msec * 1e6 / (elapsed ? elapsed : 1);
+    if (count < FPP_PBKDF2_MIN_ITER) {
+        count = FPP_PBKDF2_MIN_ITER;
+    }
+    else if (count > UINT32_MAX) {
+        count = UINT32_MAX;
+    }
+
+    *iter = (uint32_t) count;
+    return FPP_OK;
+}
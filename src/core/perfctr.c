@@ -0,0 +1,198 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#if (__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "perfctr.h"
+
+struct fpp_perfctr_s {
+    int fds[FPP_PERFCTR_MAX];
+    /* Position of every open counter in the group read */
+    size_t slots[FPP_PERFCTR_MAX];
+    size_t nopen;
+    unsigned int available;
+};
+
+
+#if (__linux__)
+
+typedef struct {
+    uint32_t type;
+    uint64_t config;
+    unsigned int bit;
+} fpp_perfctr_event_t;
+
+static const fpp_perfctr_event_t fpp_perfctr_events[FPP_PERFCTR_MAX] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, FPP_COUNTER_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,
+        FPP_COUNTER_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,
+        FPP_COUNTER_CACHE_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES,
+        FPP_COUNTER_CONTEXT_SWITCHES }
+};
+
+static pthread_once_t fpp_perfctr_once = PTHREAD_ONCE_INIT;
+static pthread_key_t fpp_perfctr_key;
+
+static __thread fpp_perfctr_t *fpp_perfctr_state;
+static __thread bool fpp_perfctr_tried;
+
+
+static void
+fpp_perfctr_free(void *arg)
+{
+    fpp_perfctr_t *pc = arg;
+    size_t i;
+
+    for (i = 0; i < FPP_PERFCTR_MAX; ++i) {
+        if (pc->fds[i] != -1) {
+            close(pc->fds[i]);
+        }
+    }
+    free(pc);
+}
+
+static void
+fpp_perfctr_init_once(void)
+{
+    pthread_key_create(&fpp_perfctr_key, fpp_perfctr_free);
+}
+
+static int
+fpp_perfctr_open_event(const fpp_perfctr_event_t *event, int group_fd)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event->type;
+    attr.config = event->config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+        | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_hv = 1;
+
+    /* Kernel time is part of the I/O phases, but often not allowed */
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+    if (fd == -1) {
+        attr.exclude_kernel = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+    }
+    return fd;
+}
+
+fpp_perfctr_t *
+fpp_perfctr_get(void)
+{
+    fpp_perfctr_t *pc;
+    int leader = -1;
+    size_t i;
+
+    if (fpp_perfctr_tried) {
+        return fpp_perfctr_state;
+    }
+    fpp_perfctr_tried = true;
+
+    pthread_once(&fpp_perfctr_once, fpp_perfctr_init_once);
+
+    pc = calloc(1, sizeof(fpp_perfctr_t));
+    if (!pc) {
+        return NULL;
+    }
+
+    for (i = 0; i < FPP_PERFCTR_MAX; ++i) {
+        pc->fds[i] = fpp_perfctr_open_event(&fpp_perfctr_events[i], leader);
+        if (pc->fds[i] == -1) {
+            continue;
+        }
+        if (leader == -1) {
+            leader = pc->fds[i];
+        }
+        pc->slots[i] = pc->nopen++;
+        pc->available |= fpp_perfctr_events[i].bit;
+    }
+
+    if (!pc->nopen) {
+        free(pc);
+        return NULL;
+    }
+
+    /* Closed by the key destructor when the thread exits */
+    pthread_setspecific(fpp_perfctr_key, pc);
+    fpp_perfctr_state = pc;
+    return pc;
+}
+
+fpp_err_t
+fpp_perfctr_read(fpp_perfctr_t *pc, uint64_t values[FPP_PERFCTR_MAX])
+{
+    /* nr, time enabled, time running, one value per counter */
+    uint64_t buf[3 + FPP_PERFCTR_MAX];
+    uint64_t value;
+    ssize_t n;
+    size_t i;
+    int leader;
+
+    memset(values, 0, FPP_PERFCTR_MAX * sizeof(uint64_t));
+
+    for (leader = -1, i = 0; leader == -1; ++i) {
+        leader = pc->fds[i];
+    }
+
+    n = read(leader, buf, sizeof(buf));
+    if (n < (ssize_t) (3 * sizeof(uint64_t)) || buf[0] != pc->nopen) {
+        return FPP_FAILURE;
+    }
+
+    for (i = 0; i < FPP_PERFCTR_MAX; ++i) {
+        if (pc->fds[i] == -1) {
+            continue;
+        }
+        value = buf[3 + pc->slots[i]];
+        /* Scale up if the PMU was shared with other events */
+        if (buf[2] && buf[2] < buf[1]) {
+            value = (uint64_t) ((double) value * buf[1] / buf[2]);
+        }
+        values[i] = value;
+    }
+
+    return FPP_OK;
+}
+
+#else
+
+fpp_perfctr_t *
+fpp_perfctr_get(void)
+{
+    return NULL;
+}
+
+fpp_err_t
+fpp_perfctr_read(fpp_perfctr_t *pc, uint64_t values[FPP_PERFCTR_MAX])
+{
+    (void) pc;
+    memset(values, 0, FPP_PERFCTR_MAX * sizeof(uint64_t));
+    return FPP_FAILURE;
+}
+
+#endif
+
+unsigned int
+fpp_perfctr_available(const fpp_perfctr_t *pc)
+{
+    return pc ? pc->available : 0;
+}
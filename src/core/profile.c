@@ -0,0 +1,198 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "profile.h"
+#include "cipher.h"
+
+#define FPP_PROFILE_LINE_SIZE  256
+#define FPP_PROFILE_FNAME      ".fpp-profile"
+#define FPP_PROFILE_CIPHER     "cipher."
+
+
+void
+fpp_profile_init(fpp_profile_t *profile)
+{
+    memset(profile, 0, sizeof(fpp_profile_t));
+}
+
+static char *
+fpp_profile_trim(char *s)
+{
+    char *end;
+
+    while (isspace((unsigned char) *s)) {
+        s++;
+    }
+    end = s + strlen(s);
+    while (end > s && isspace((unsigned char) end[-1])) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+static fpp_err_t
+fpp_profile_set(fpp_profile_t *profile, const char *key,
+    unsigned long long value)
+{
+    const fpp_cipher_t *cipher;
+
+    if (strcmp(key, "version") == 0) {
+        return (value == FPP_PROFILE_VERSION) ? FPP_OK : FPP_ERR_IO_FORMAT;
+    }
+    if (strcmp(key, "chunk_size") == 0) {
+        profile->chunk_size = (size_t) value;
+    }
+    else if (strcmp(key, "threads") == 0) {
+        profile->nthreads = (size_t) value;
+    }
+    else if (strcmp(key, "read_rate") == 0) {
+        profile->read_rate = value;
+    }
+    else if (strcmp(key, "write_rate") == 0) {
+        profile->write_rate = value;
+    }
+    else if (strncmp(key, FPP_PROFILE_CIPHER,
+        sizeof(FPP_PROFILE_CIPHER) - 1) == 0)
+    {
+        cipher = fpp_cipher_by_name(key + sizeof(FPP_PROFILE_CIPHER) - 1);
+        if (cipher && cipher->algo < FPP_PROFILE_NALGOS) {
+            profile->cipher_rate[cipher->algo] = value;
+        }
+    }
+    return FPP_OK;
+}
+
+fpp_err_t
+fpp_profile_load(fpp_profile_t *profile, const char *fname)
+{
+    char line[FPP_PROFILE_LINE_SIZE];
+    char *key, *value, *end;
+    unsigned long long n;
+    fpp_err_t err = FPP_OK;
+    FILE *fd;
+
+    fpp_profile_init(profile);
+
+    fd = fopen(fname, "r");
+    if (!fd) {
+        return FPP_FAILURE;
+    }
+
+    while (err == FPP_OK && fgets(line, sizeof(line), fd)) {
+        key = fpp_profile_trim(line);
+        if (*key == '\0' || *key == '#') {
+            continue;
+        }
+
+        value = strchr(key, '=');
+        if (!value) {
+            err = FPP_ERR_IO_FORMAT;
+            break;
+        }
+        *value++ = '\0';
+        key = fpp_profile_trim(key);
+        value = fpp_profile_trim(value);
+
+        n = strtoull(value, &end, 10);
+        if (end == value || *end != '\0') {
+            err = FPP_ERR_IO_FORMAT;
+            break;
+        }
+        err = fpp_profile_set(profile, key, n);
+    }
+
+    if (err == FPP_OK && ferror(fd)) {
+        err = FPP_FAILURE;
+    }
+    fclose(fd);
+
+    if (err != FPP_OK) {
+        fpp_profile_init(profile);
+    }
+    return err;
+}
+
+fpp_err_t
+fpp_profile_save(const fpp_profile_t *profile, const char *fname)
+{
+    const fpp_cipher_t *cipher;
+    size_t i;
+    FILE *fd;
+
+    fd = fopen(fname, "w");
+    if (!fd) {
+        return FPP_FAILURE;
+    }
+
+    fprintf(fd, "# Host profile written by \"fpp tune\", rates in bytes/s\n");
+    fprintf(fd, "version = %d\n", FPP_PROFILE_VERSION);
+    fprintf(fd, "chunk_size = %zu\n", profile->chunk_size);
+    fprintf(fd, "threads = %zu\n", profile->nthreads);
+    fprintf(fd, "read_rate = %llu\n",
+        (unsigned long long) profile->read_rate);
+    fprintf(fd, "write_rate = %llu\n",
+        (unsigned long long) profile->write_rate);
+
+    for (i = 0; i < fpp_cipher_count(); ++i) {
+        cipher = fpp_cipher_at(i);
+        if (cipher->algo < FPP_PROFILE_NALGOS
+            && profile->cipher_rate[cipher->algo])
+        {
+            fprintf(fd, "%s%s = %llu\n", FPP_PROFILE_CIPHER, cipher->name,
+                (unsigned long long) profile->cipher_rate[cipher->algo]);
+        }
+    }
+
+    if (ferror(fd)) {
+        fclose(fd);
+        return FPP_FAILURE;
+    }
+    return fclose(fd) == 0 ? FPP_OK : FPP_FAILURE;
+}
+
+void
+fpp_profile_apply(const fpp_profile_t *profile, fpp_ctx_config_t *config)
+{
+    if (profile->chunk_size) {
+        config->chunk_size = profile->chunk_size;
+    }
+    if (profile->nthreads) {
+        config->nthreads = profile->nthreads;
+    }
+}
+
+const char *
+fpp_profile_default_path(char *buf, size_t size)
+{
+    const char *env, *home;
+    int n;
+
+    env = getenv("FPP_PROFILE");
+    if (env && *env) {
+        n = snprintf(buf, size, "%s", env);
+    }
+    else {
+        home = getenv("HOME");
+#if (_WIN32)
+        if (!home) {
+            home = getenv("USERPROFILE");
+        }
+#endif
+        if (!home) {
+            return NULL;
+        }
+        n = snprintf(buf, size, "%s/%s", home, FPP_PROFILE_FNAME);
+    }
+
+    return (n < 0 || (size_t) n >= size) ? NULL : buf;
+}
@@ -1,4 +1,4 @@
-/* 
+/*
  * This file is part of FPP (File Protection Program).
  *
  * See LICENSE for licensing information.
@@ -8,22 +8,190 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <openssl/evp.h>
 #include <openssl/rand.h>
 
 #include "random.h"
+#include "memory.h"
+
+/*
+ * Every thread owns an AES-256-CTR keystream generator seeded from
+ * the OpenSSL private DRBG, so that IVs and salts are handed out from
+ * a thread-local pool without locks or reseeding on every call.
+ *
+ * After each refill the generator is rekeyed from the head of the new
+ * keystream and the consumed bytes are wiped ("fast key erasure"), so
+ * a later compromise of the state doesn't reveal earlier output.
+ */
+
+#define FPP_RANDOM_KEY_SIZE   32
+#define FPP_RANDOM_IV_SIZE    16
+#define FPP_RANDOM_SEED_SIZE  (FPP_RANDOM_KEY_SIZE + FPP_RANDOM_IV_SIZE)
+
+typedef struct {
+    EVP_CIPHER_CTX *cipher_ctx;
+    uint8_t pool[FPP_RANDOM_POOL_SIZE];
+    size_t pos;
+    size_t generated;
+    unsigned int fork_generation;
+} fpp_random_state_t;
+
+static pthread_once_t fpp_random_once = PTHREAD_ONCE_INIT;
+static pthread_key_t fpp_random_key;
+static volatile unsigned int fpp_random_fork_generation;
+
+static __thread fpp_random_state_t *fpp_random_state;
+
+
+#if !(_WIN32)
+static void
+fpp_random_atfork_child(void)
+{
+    /* The child must not repeat the parent's stream */
+    fpp_random_fork_generation++;
+}
+#endif
+
+static void
+fpp_random_state_free(void *arg)
+{
+    fpp_random_state_t *state = arg;
+
+    EVP_CIPHER_CTX_free(state->cipher_ctx);
+    fpp_explicit_memzero((uint8_t *) state, sizeof(fpp_random_state_t));
+    free(state);
+}
+
+static void
+fpp_random_init_once(void)
+{
+    pthread_key_create(&fpp_random_key, fpp_random_state_free);
+#if !(_WIN32)
+    pthread_atfork(NULL, NULL, fpp_random_atfork_child);
+#endif
+}
+
+static fpp_err_t
+fpp_random_reseed(fpp_random_state_t *state)
+{
+    uint8_t seed[FPP_RANDOM_SEED_SIZE];
+    int rc;
+
+    if (RAND_priv_bytes(seed, sizeof(seed)) != 1) {
+        return FPP_FAILURE;
+    }
+
+    rc = EVP_EncryptInit_ex(state->cipher_ctx, EVP_aes_256_ctr(), NULL,
+        seed, seed + FPP_RANDOM_KEY_SIZE);
+    fpp_explicit_memzero(seed, sizeof(seed));
+    if (rc != 1) {
+        return FPP_FAILURE;
+    }
+
+    state->pos = FPP_RANDOM_POOL_SIZE;
+    state->generated = 0;
+    state->fork_generation = fpp_random_fork_generation;
+    return FPP_OK;
+}
+
+static fpp_err_t
+fpp_random_refill(fpp_random_state_t *state)
+{
+    int len;
+
+    /* CTR keystream is the encryption of zeros */
+    memset(state->pool, 0, sizeof(state->pool));
+    if (EVP_EncryptUpdate(state->cipher_ctx, state->pool, &len,
+        state->pool, sizeof(state->pool)) != 1)
+    {
+        return FPP_FAILURE;
+    }
+
+    if (EVP_EncryptInit_ex(state->cipher_ctx, NULL, NULL, state->pool,
+        state->pool + FPP_RANDOM_KEY_SIZE) != 1)
+    {
+        return FPP_FAILURE;
+    }
+    fpp_explicit_memzero(state->pool, FPP_RANDOM_SEED_SIZE);
+
+    state->pos = FPP_RANDOM_SEED_SIZE;
+    state->generated += sizeof(state->pool);
+    return FPP_OK;
+}
+
+static fpp_random_state_t *
+fpp_random_get_state(void)
+{
+    fpp_random_state_t *state;
+
+    if (fpp_random_state) {
+        return fpp_random_state;
+    }
+
+    pthread_once(&fpp_random_once, fpp_random_init_once);
+
+    state = calloc(1, sizeof(fpp_random_state_t));
+    if (!state) {
+        return NULL;
+    }
+
+    state->cipher_ctx = EVP_CIPHER_CTX_new();
+    if (!state->cipher_ctx) {
+        free(state);
+        return NULL;
+    }
+
+    if (fpp_random_reseed(state) != FPP_OK) {
+        fpp_random_state_free(state);
+        return NULL;
+    }
+
+    /* Released by the key destructor when the thread exits */
+    pthread_setspecific(fpp_random_key, state);
+    fpp_random_state = state;
+    return state;
+}
 
 fpp_err_t
 fpp_random_bytes(uint8_t *buf, size_t in_len)
 {
-    RAND_poll();
+    fpp_random_state_t *state;
+    size_t n;
 
-    if (RAND_status() != 1) {
-        return EXIT_FAILURE;
+    state = fpp_random_get_state();
+    if (!state) {
+        return FPP_FAILURE;
     }
-    if (RAND_bytes(buf, in_len) != 1) {
-        return EXIT_FAILURE;
+
+    if (state->fork_generation != fpp_random_fork_generation ||
+        state->generated >= FPP_RANDOM_RESEED_INTERVAL)
+    {
+        if (fpp_random_reseed(state) != FPP_OK) {
+            return FPP_FAILURE;
+        }
+    }
+
+    while (in_len) {
+        if (state->pos == FPP_RANDOM_POOL_SIZE) {
+            if (fpp_random_refill(state) != FPP_OK) {
+                return FPP_FAILURE;
+            }
+        }
+
+        n = FPP_RANDOM_POOL_SIZE - state->pos;
+        if (n > in_len) {
+            n = in_len;
+        }
+
+        memcpy(buf, state->pool + state->pos, n);
+        /* Handed out bytes must not stay in the pool */
+        memset(state->pool + state->pos, 0, n);
+
+        state->pos += n;
+        buf += n;
+        in_len -= n;
     }
 
-    RAND_cleanup();
-    return EXIT_SUCCESS;
+    return FPP_OK;
 }
@@ -0,0 +1,233 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#if !(_WIN32)
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "secmem.h"
+#include "memory.h"
+#include "cpu.h"
+
+#define FPP_SECMEM_ALIGNMENT  64
+
+struct fpp_secmem_s {
+    pthread_mutex_t lock;
+    uint8_t *base;
+    size_t map_size;
+    uint8_t *slots;
+    size_t slot_size;
+    size_t stride;
+    size_t nslots;
+    /* Stack of free slot indexes */
+    size_t *free_slots;
+    size_t nfree;
+    bool locked;
+};
+
+
+#if (_WIN32)
+
+static fpp_err_t
+fpp_secmem_map(fpp_secmem_t *arena, int node)
+{
+    (void) node;
+
+    arena->stride = fpp_align_up(arena->slot_size, FPP_SECMEM_ALIGNMENT);
+    arena->map_size = arena->stride * arena->nslots;
+    arena->base = _aligned_malloc(arena->map_size, FPP_SECMEM_ALIGNMENT);
+    if (!arena->base) {
+        return FPP_FAILURE;
+    }
+    arena->slots = arena->base;
+    arena->locked = false;
+    return FPP_OK;
+}
+
+static void
+fpp_secmem_unmap(fpp_secmem_t *arena)
+{
+    _aligned_free(arena->base);
+}
+
+#else
+
+static fpp_err_t
+fpp_secmem_map(fpp_secmem_t *arena, int node)
+{
+    size_t page_size, slot_pages, data_size, i;
+    bool guarded;
+
+    page_size = sysconf(_SC_PAGESIZE);
+
+    /* Page sized slots get a guard page each, small ones are packed */
+    guarded = arena->slot_size >= page_size;
+    if (guarded) {
+        slot_pages = fpp_align_up(arena->slot_size, page_size);
+        arena->stride = slot_pages + page_size;
+        data_size = arena->stride * arena->nslots;
+    }
+    else {
+        arena->stride = fpp_align_up(arena->slot_size, FPP_SECMEM_ALIGNMENT);
+        slot_pages = fpp_align_up(arena->stride * arena->nslots, page_size);
+        data_size = slot_pages + page_size;
+    }
+
+    /* Leading guard page, trailing one is included in data_size */
+    arena->map_size = page_size + data_size;
+
+    arena->base = mmap(NULL, arena->map_size, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena->base == MAP_FAILED) {
+        arena->base = NULL;
+        return FPP_FAILURE;
+    }
+    arena->slots = arena->base + page_size;
+    fpp_cpu_bind_memory(arena->base, arena->map_size, node);
+
+    arena->locked = true;
+
+    for (i = 0; i < (guarded ? arena->nslots : 1); ++i) {
+        if (mprotect(arena->slots + i * arena->stride, slot_pages,
+            PROT_READ | PROT_WRITE) != 0)
+        {
+            munmap(arena->base, arena->map_size);
+            arena->base = NULL;
+            return FPP_FAILURE;
+        }
+        if (mlock(arena->slots + i * arena->stride, slot_pages) != 0) {
+            arena->locked = false;
+        }
+#if defined(MADV_DONTDUMP)
+        madvise(arena->slots + i * arena->stride, slot_pages,
+            MADV_DONTDUMP);
+#endif
+    }
+
+    return FPP_OK;
+}
+
+static void
+fpp_secmem_unmap(fpp_secmem_t *arena)
+{
+    /* Slots are wiped on release, munmap() also unlocks the pages */
+    munmap(arena->base, arena->map_size);
+}
+
+#endif
+
+fpp_secmem_t *
+fpp_secmem_create(size_t slot_size, size_t nslots, int node)
+{
+    fpp_secmem_t *arena;
+    size_t i;
+
+    if (slot_size == 0 || nslots == 0) {
+        return NULL;
+    }
+
+    arena = calloc(1, sizeof(fpp_secmem_t));
+    if (!arena) {
+        return NULL;
+    }
+
+    arena->slot_size = slot_size;
+    arena->nslots = nslots;
+
+    arena->free_slots = malloc(nslots * sizeof(size_t));
+    if (!arena->free_slots) {
+        free(arena);
+        return NULL;
+    }
+
+    if (fpp_secmem_map(arena, node) != FPP_OK) {
+        free(arena->free_slots);
+        free(arena);
+        return NULL;
+    }
+
+    /* Hand out low addresses first */
+    for (i = 0; i < nslots; ++i) {
+        arena->free_slots[i] = nslots - 1 - i;
+    }
+    arena->nfree = nslots;
+
+    pthread_mutex_init(&arena->lock, NULL);
+    return arena;
+}
+
+void
+fpp_secmem_destroy(fpp_secmem_t *arena)
+{
+    if (!arena) {
+        return;
+    }
+    fpp_secmem_unmap(arena);
+    pthread_mutex_destroy(&arena->lock);
+    free(arena->free_slots);
+    free(arena);
+}
+
+void *
+fpp_secmem_alloc(fpp_secmem_t *arena)
+{
+    size_t index;
+
+    pthread_mutex_lock(&arena->lock);
+    if (arena->nfree == 0) {
+        pthread_mutex_unlock(&arena->lock);
+        return NULL;
+    }
+    index = arena->free_slots[--arena->nfree];
+    pthread_mutex_unlock(&arena->lock);
+
+    return arena->slots + index * arena->stride;
+}
+
+void
+fpp_secmem_free(fpp_secmem_t *arena, void *ptr, size_t used)
+{
+    size_t index;
+
+    if (used > arena->slot_size) {
+        used = arena->slot_size;
+    }
+    fpp_explicit_memzero(ptr, used);
+
+    index = ((uint8_t *) ptr - arena->slots) / arena->stride;
+
+    pthread_mutex_lock(&arena->lock);
+    arena->free_slots[arena->nfree++] = index;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+bool
+fpp_secmem_owns(const fpp_secmem_t *arena, const void *ptr)
+{
+    const uint8_t *p = ptr;
+
+    return p >= arena->slots && p < arena->slots
+        + arena->nslots * arena->stride;
+}
+
+bool
+fpp_secmem_is_locked(const fpp_secmem_t *arena)
+{
+    return arena->locked;
+}
+
+size_t
+fpp_secmem_slot_size(const fpp_secmem_t *arena)
+{
+    return arena->slot_size;
+}
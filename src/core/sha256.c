@@ -0,0 +1,54 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <openssl/evp.h>
+
+#include "sha256.h"
+
+EVP_MD_CTX *
+fpp_sha256_init(void)
+{
+    EVP_MD_CTX *mdctx;
+
+    mdctx = EVP_MD_CTX_create();
+    if (!mdctx) {
+        return NULL;
+    }
+    if (EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL) != 1) {
+        EVP_MD_CTX_destroy(mdctx);
+        return NULL;
+    }
+    return mdctx;
+}
+
+fpp_err_t
+fpp_sha256_update(EVP_MD_CTX *mdctx, const uint8_t *in_data,
+    size_t in_size)
+{
+    if (EVP_DigestUpdate(mdctx, in_data, in_size) != 1) {
+        return FPP_FAILURE;
+    }
+    return FPP_OK;
+}
+
+fpp_err_t
+fpp_sha256_final(EVP_MD_CTX *mdctx, uint8_t *buf)
+{
+    uint32_t hash_len = FPP_SHA256_BUFSIZE;
+    int rc;
+
+    rc = EVP_DigestFinal_ex(mdctx, buf, &hash_len);
+    EVP_MD_CTX_destroy(mdctx);
+    return rc == 1 ? FPP_OK : FPP_FAILURE;
+}
+
+void
+fpp_sha256_free(EVP_MD_CTX *mdctx)
+{
+    EVP_MD_CTX_destroy(mdctx);
+}
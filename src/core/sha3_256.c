@@ -9,6 +9,7 @@
 #include <string.h>
 #include <openssl/evp.h>
 
+#include "sha3_256.h"
 
 /* Return 256 bit (32 byte) */
 uint8_t *
@@ -48,3 +49,52 @@ failed:
     }
     return NULL;
 }
+
+EVP_MD_CTX *
+fpp_sha3_256_init(const uint8_t *key, size_t key_len)
+{
+    EVP_MD_CTX *mdctx;
+
+    mdctx = EVP_MD_CTX_create();
+    if (!mdctx) {
+        return NULL;
+    }
+    if (EVP_DigestInit_ex(mdctx, EVP_sha3_256(), NULL) != 1) {
+        goto failed;
+    }
+    if (key && EVP_DigestUpdate(mdctx, key, key_len) != 1) {
+        goto failed;
+    }
+    return mdctx;
+
+failed:
+    EVP_MD_CTX_destroy(mdctx);
+    return NULL;
+}
+
+fpp_err_t
+fpp_sha3_256_update(EVP_MD_CTX *mdctx, const uint8_t *in_data,
+    size_t in_size)
+{
+    if (EVP_DigestUpdate(mdctx, in_data, in_size) != 1) {
+        return FPP_FAILURE;
+    }
+    return FPP_OK;
+}
+
+fpp_err_t
+fpp_sha3_256_final(EVP_MD_CTX *mdctx, uint8_t *buf)
+{
+    uint32_t hash_len = FPP_SHA3_256_BUFSIZE;
+    int rc;
+
+    rc = EVP_DigestFinal_ex(mdctx, buf, &hash_len);
+    EVP_MD_CTX_destroy(mdctx);
+    return rc == 1 ? FPP_OK : FPP_FAILURE;
+}
+
+void
+fpp_sha3_256_free(EVP_MD_CTX *mdctx)
+{
+    EVP_MD_CTX_destroy(mdctx);
+}
@@ -0,0 +1,333 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#if !(_WIN32)
+#include <sys/resource.h>
+#endif
+
+#include "stats.h"
+#include "context_internal.h"
+
+static const char *fpp_phase_names[FPP_PHASE_MAX] = {
+    "open",
+    "kdf",
+    "read",
+    "cipher",
+    "write",
+    "throttle"
+};
+
+/* Names of the FPP_COUNTER_* bits, lowest first */
+static const char *fpp_counter_names[] = {
+    "cycles",
+    "instructions",
+    "cache_misses",
+    "context_switches"
+};
+
+
+const char *
+fpp_phase_name(fpp_phase_t phase)
+{
+    if (phase >= FPP_PHASE_MAX) {
+        return "none";
+    }
+    return fpp_phase_names[phase];
+}
+
+uint64_t
+fpp_time_ns(void)
+{
+#if (_WIN32)
+    LARGE_INTEGER freq, now;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t) ((double) now.QuadPart * 1e9 / freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+uint64_t
+fpp_peak_rss(void)
+{
+#if (_WIN32)
+    return 0;
+#else
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) != 0) {
+        return 0;
+    }
+#if (__APPLE__)
+    return (uint64_t) ru.ru_maxrss;
+#else
+    return (uint64_t) ru.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+static size_t
+fpp_histogram_index(uint64_t value)
+{
+    unsigned int bits = 0;
+
+    if (value < FPP_HISTOGRAM_SUB_BUCKETS) {
+        return (size_t) value;
+    }
+
+    while (bits < 63 && (value >> (bits + 1))) {
+        ++bits;
+    }
+    if (bits >= FPP_HISTOGRAM_MAX_BITS) {
+        return FPP_HISTOGRAM_BUCKETS - 1;
+    }
+
+    /* The leading bit picks the group, the next ones the bucket in it */
+    return (size_t) (bits - FPP_HISTOGRAM_SUB_BITS + 1)
+        * FPP_HISTOGRAM_SUB_BUCKETS
+        + (size_t) (value >> (bits - FPP_HISTOGRAM_SUB_BITS))
+        - FPP_HISTOGRAM_SUB_BUCKETS;
+}
+
+uint64_t
+fpp_histogram_bucket_lowest(size_t i)
+{
+    size_t group;
+
+    if (i < FPP_HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t) i;
+    }
+
+    group = i / FPP_HISTOGRAM_SUB_BUCKETS;
+    return (uint64_t) (FPP_HISTOGRAM_SUB_BUCKETS
+        + i % FPP_HISTOGRAM_SUB_BUCKETS) << (group - 1);
+}
+
+uint64_t
+fpp_histogram_bucket_highest(size_t i)
+{
+    if (i + 1 >= FPP_HISTOGRAM_BUCKETS) {
+        return UINT64_MAX;
+    }
+    return fpp_histogram_bucket_lowest(i + 1) - 1;
+}
+
+void
+fpp_histogram_record(fpp_histogram_t *h, uint64_t value)
+{
+    if (!h->count || value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+    h->count++;
+    h->sum += value;
+    h->buckets[fpp_histogram_index(value)]++;
+}
+
+uint64_t
+fpp_histogram_percentile(const fpp_histogram_t *h, double percentile)
+{
+    uint64_t rank, seen = 0, value;
+    size_t i;
+
+    if (!h->count) {
+        return 0;
+    }
+
+    rank = (uint64_t) ((percentile / 100.0) * h->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > h->count) {
+        rank = h->count;
+    }
+
+    for (i = 0; i < FPP_HISTOGRAM_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+
+    value = fpp_histogram_bucket_highest(i);
+    return value < h->max ? value : h->max;
+}
+
+void
+fpp_job_stats_init(fpp_job_stats_t *js, bool counters)
+{
+    memset(js, 0, sizeof(fpp_job_stats_t));
+    js->phase = FPP_PHASE_NONE;
+    js->start = fpp_time_ns();
+    js->mark_ns = js->start;
+    if (counters) {
+        js->counters = fpp_perfctr_get();
+        js->stats.counters = fpp_perfctr_available(js->counters);
+    }
+}
+
+/* Scaled counters of a multiplexed PMU may step back slightly */
+static uint64_t
+fpp_counter_delta(uint64_t now, uint64_t mark)
+{
+    return now > mark ? now - mark : 0;
+}
+
+void
+fpp_job_stats_enter(fpp_job_stats_t *js, fpp_phase_t phase)
+{
+    uint64_t now[FPP_PERFCTR_MAX];
+    uint64_t now_ns;
+    fpp_phase_stats_t *ps;
+
+    now_ns = fpp_time_ns();
+    if (js->phase != FPP_PHASE_NONE) {
+        js->stats.phases[js->phase].ns += now_ns - js->mark_ns;
+    }
+    js->mark_ns = now_ns;
+
+    if (!js->counters) {
+        js->phase = phase;
+        return;
+    }
+
+    if (fpp_perfctr_read(js->counters, now) != FPP_OK) {
+        js->phase = phase;
+        return;
+    }
+
+    if (js->phase != FPP_PHASE_NONE) {
+        ps = &js->stats.phases[js->phase];
+        ps->cycles += fpp_counter_delta(
+            now[FPP_PERFCTR_CYCLES], js->mark[FPP_PERFCTR_CYCLES]);
+        ps->instructions += fpp_counter_delta(
+            now[FPP_PERFCTR_INSTRUCTIONS],
+            js->mark[FPP_PERFCTR_INSTRUCTIONS]);
+        ps->cache_misses += fpp_counter_delta(
+            now[FPP_PERFCTR_CACHE_MISSES],
+            js->mark[FPP_PERFCTR_CACHE_MISSES]);
+        ps->context_switches += fpp_counter_delta(
+            now[FPP_PERFCTR_CONTEXT_SWITCHES],
+            js->mark[FPP_PERFCTR_CONTEXT_SWITCHES]);
+    }
+
+    memcpy(js->mark, now, sizeof(now));
+    js->phase = phase;
+}
+
+static double
+fpp_stats_seconds(uint64_t ns)
+{
+    return (double) ns / 1e9;
+}
+
+static void
+fpp_stats_write_counter(FILE *fd, const fpp_stats_t *stats,
+    unsigned int bit, uint64_t value)
+{
+    size_t i;
+
+    if (!(stats->counters & bit)) {
+        return;
+    }
+    for (i = 0; !(bit & (1u << i)); ++i) {
+        /* void */
+    }
+    fprintf(fd, ", \"%s\": %llu", fpp_counter_names[i],
+        (unsigned long long) value);
+}
+
+fpp_err_t
+fpp_stats_write_json(FILE *fd, const fpp_stats_t *stats)
+{
+    static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+    static const char *percentile_names[] = { "p50", "p90", "p99", "p999" };
+    const fpp_histogram_t *h = &stats->latency;
+    const fpp_phase_stats_t *ps;
+    uint64_t total_ns = 0;
+    bool first;
+    size_t i;
+
+    for (i = 0; i < FPP_PHASE_MAX; ++i) {
+        total_ns += stats->phases[i].ns;
+    }
+
+    fprintf(fd, "{\n");
+    fprintf(fd, "  \"files\": %zu,\n", stats->files);
+    fprintf(fd, "  \"bytes\": %llu,\n", (unsigned long long) stats->bytes);
+    fprintf(fd, "  \"seconds\": %.9f,\n", fpp_stats_seconds(total_ns));
+    fprintf(fd, "  \"peak_rss\": %llu,\n",
+        (unsigned long long) stats->peak_rss);
+
+    fprintf(fd, "  \"counters\": [");
+    for (i = 0, first = true; i < FPP_PERFCTR_MAX; ++i) {
+        if (stats->counters & (1u << i)) {
+            fprintf(fd, "%s\"%s\"", first ? "" : ", ", fpp_counter_names[i]);
+            first = false;
+        }
+    }
+    fprintf(fd, "],\n");
+
+    fprintf(fd, "  \"phases\": {\n");
+    for (i = 0; i < FPP_PHASE_MAX; ++i) {
+        ps = &stats->phases[i];
+        fprintf(fd, "    \"%s\": {\"seconds\": %.9f, \"bytes\": %llu, "
+            "\"mb_per_sec\": %.3f", fpp_phase_name(i),
+            fpp_stats_seconds(ps->ns), (unsigned long long) ps->bytes,
+            ps->ns ? (double) ps->bytes * 1e3 / ps->ns : 0.0);
+        fpp_stats_write_counter(fd, stats, FPP_COUNTER_CYCLES, ps->cycles);
+        fpp_stats_write_counter(fd, stats, FPP_COUNTER_INSTRUCTIONS,
+            ps->instructions);
+        fpp_stats_write_counter(fd, stats, FPP_COUNTER_CACHE_MISSES,
+            ps->cache_misses);
+        fpp_stats_write_counter(fd, stats, FPP_COUNTER_CONTEXT_SWITCHES,
+            ps->context_switches);
+        fprintf(fd, "}%s\n", i + 1 < FPP_PHASE_MAX ? "," : "");
+    }
+    fprintf(fd, "  },\n");
+
+    fprintf(fd, "  \"latency\": {\n");
+    fprintf(fd, "    \"count\": %llu,\n", (unsigned long long) h->count);
+    fprintf(fd, "    \"min\": %.9f,\n", fpp_stats_seconds(h->min));
+    fprintf(fd, "    \"mean\": %.9f,\n",
+        h->count ? fpp_stats_seconds(h->sum) / h->count : 0.0);
+    for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+        fprintf(fd, "    \"%s\": %.9f,\n", percentile_names[i],
+            fpp_stats_seconds(fpp_histogram_percentile(h, percentiles[i])));
+    }
+    fprintf(fd, "    \"max\": %.9f,\n", fpp_stats_seconds(h->max));
+
+    /* [lowest ns, highest ns, count] of the non-empty buckets */
+    fprintf(fd, "    \"buckets\": [");
+    for (i = 0, first = true; i < FPP_HISTOGRAM_BUCKETS; ++i) {
+        if (!h->buckets[i]) {
+            continue;
+        }
+        fprintf(fd, "%s[%llu, %llu, %llu]", first ? "" : ", ",
+            (unsigned long long) fpp_histogram_bucket_lowest(i),
+            (unsigned long long) fpp_histogram_bucket_highest(i),
+            (unsigned long long) h->buckets[i]);
+        first = false;
+    }
+    fprintf(fd, "]\n");
+    fprintf(fd, "  }\n");
+    fprintf(fd, "}");
+
+    return ferror(fd) ? FPP_FAILURE : FPP_OK;
+}
@@ -0,0 +1,267 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#if (__linux__)
+/* sched_getaffinity() and CPU_COUNT() */
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#if (_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#if (__linux__)
+#include <sched.h>
+#endif
+
+#include "thread_pool.h"
+
+typedef struct fpp_task_s fpp_task_t;
+
+struct fpp_task_s {
+    fpp_task_handler_pt handler;
+    void *arg;
+    fpp_task_t *next;
+};
+
+struct fpp_thread_pool_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    fpp_task_t *head;
+    fpp_task_t *tail;
+    pthread_t *threads;
+    size_t nthreads;
+    bool shutdown;
+    fpp_thread_init_pt init;
+    void *init_arg;
+    /* Index of the next worker to start */
+    size_t next_index;
+};
+
+
+static void *
+fpp_thread_pool_worker(void *arg)
+{
+    fpp_thread_pool_t *pool = arg;
+    fpp_task_t *task;
+
+    if (pool->init) {
+        pool->init(pool->init_arg,
+            __atomic_fetch_add(&pool->next_index, 1, __ATOMIC_RELAXED));
+    }
+
+    for ( ;; ) {
+        pthread_mutex_lock(&pool->lock);
+
+        while (!pool->head && !pool->shutdown) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+
+        if (!pool->head) {
+            /* Shutdown requested and the queue is drained */
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        task = pool->head;
+        pool->head = task->next;
+        if (!pool->head) {
+            pool->tail = NULL;
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+
+        task->handler(task->arg);
+        free(task);
+    }
+
+    return NULL;
+}
+
+fpp_thread_pool_t *
+fpp_thread_pool_create(size_t nthreads)
+{
+    return fpp_thread_pool_create_ex(nthreads, NULL, NULL);
+}
+
+fpp_thread_pool_t *
+fpp_thread_pool_create_ex(size_t nthreads, fpp_thread_init_pt init,
+    void *init_arg)
+{
+    fpp_thread_pool_t *pool;
+    size_t i;
+
+    if (nthreads == 0) {
+        nthreads = fpp_get_ncpu();
+    }
+
+    pool = calloc(1, sizeof(fpp_thread_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->init = init;
+    pool->init_arg = init_arg;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for (i = 0; i < nthreads; ++i) {
+        if (pthread_create(&pool->threads[i], NULL,
+            fpp_thread_pool_worker, pool) != 0)
+        {
+            break;
+        }
+        pool->nthreads++;
+    }
+
+    if (pool->nthreads == 0) {
+        fpp_thread_pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void
+fpp_thread_pool_destroy(fpp_thread_pool_t *pool)
+{
+    size_t i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nthreads; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+size_t
+fpp_thread_pool_size(const fpp_thread_pool_t *pool)
+{
+    return pool->nthreads;
+}
+
+fpp_err_t
+fpp_thread_pool_post(fpp_thread_pool_t *pool, fpp_task_handler_pt handler,
+    void *arg)
+{
+    fpp_task_t *task;
+
+    task = malloc(sizeof(fpp_task_t));
+    if (!task) {
+        return FPP_FAILURE;
+    }
+    task->handler = handler;
+    task->arg = arg;
+    task->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail) {
+        pool->tail->next = task;
+    }
+    else {
+        pool->head = task;
+    }
+    pool->tail = task;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return FPP_OK;
+}
+
+fpp_err_t
+fpp_wait_group_init(fpp_wait_group_t *wg)
+{
+    if (pthread_mutex_init(&wg->lock, NULL) != 0) {
+        return FPP_FAILURE;
+    }
+    if (pthread_cond_init(&wg->cond, NULL) != 0) {
+        pthread_mutex_destroy(&wg->lock);
+        return FPP_FAILURE;
+    }
+    wg->count = 0;
+    return FPP_OK;
+}
+
+void
+fpp_wait_group_destroy(fpp_wait_group_t *wg)
+{
+    pthread_cond_destroy(&wg->cond);
+    pthread_mutex_destroy(&wg->lock);
+}
+
+void
+fpp_wait_group_add(fpp_wait_group_t *wg, size_t n)
+{
+    pthread_mutex_lock(&wg->lock);
+    wg->count += n;
+    pthread_mutex_unlock(&wg->lock);
+}
+
+void
+fpp_wait_group_done(fpp_wait_group_t *wg)
+{
+    pthread_mutex_lock(&wg->lock);
+    if (--wg->count == 0) {
+        pthread_cond_broadcast(&wg->cond);
+    }
+    pthread_mutex_unlock(&wg->lock);
+}
+
+void
+fpp_wait_group_wait(fpp_wait_group_t *wg)
+{
+    pthread_mutex_lock(&wg->lock);
+    while (wg->count != 0) {
+        pthread_cond_wait(&wg->cond, &wg->lock);
+    }
+    pthread_mutex_unlock(&wg->lock);
+}
+
+size_t
+fpp_get_ncpu(void)
+{
+#if (_WIN32)
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long n;
+#if (__linux__)
+    cpu_set_t set;
+
+    /* A cpuset or taskset leaves fewer than the online CPUs */
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set)) {
+        return (size_t) CPU_COUNT(&set);
+    }
+#endif
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t) n : 1;
+#endif
+}
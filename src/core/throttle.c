@@ -0,0 +1,159 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#if (_WIN32)
+#include <windows.h>
+#elif (__linux__)
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#include "throttle.h"
+#include "stats.h"
+
+#define FPP_NSEC_PER_SEC  1000000000ULL
+
+#if (__linux__)
+/* From linux/ioprio.h, which isn't installed everywhere */
+#define FPP_IOPRIO_WHO_PROCESS  1
+#define FPP_IOPRIO_CLASS_SHIFT  13
+#define FPP_IOPRIO_CLASS_BE     2
+#define FPP_IOPRIO_CLASS_IDLE   3
+#endif
+
+
+static uint64_t
+fpp_throttle_ns(uint64_t n, uint64_t rate)
+{
+    /* Split so that large n don't overflow */
+    return n / rate * FPP_NSEC_PER_SEC
+        + n % rate * FPP_NSEC_PER_SEC / rate;
+}
+
+static void
+fpp_sleep_ns(uint64_t ns)
+{
+#if (_WIN32)
+    Sleep((DWORD) ((ns + 999999) / 1000000));
+#else
+    struct timespec ts;
+
+    ts.tv_sec = (time_t) (ns / FPP_NSEC_PER_SEC);
+    ts.tv_nsec = (long) (ns % FPP_NSEC_PER_SEC);
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+        /* Sleep the rest */
+    }
+#endif
+}
+
+void
+fpp_throttle_init(fpp_throttle_t *throttle, uint64_t rate, uint64_t burst)
+{
+    throttle->rate = rate;
+    throttle->burst_ns = rate ? fpp_throttle_ns(burst, rate) : 0;
+    throttle->tat = 0;
+}
+
+void
+fpp_throttle_acquire(fpp_throttle_t *throttle, uint64_t n)
+{
+    uint64_t cost, now, tat, new_tat;
+
+    if (throttle->rate == 0 || n == 0) {
+        return;
+    }
+
+    cost = fpp_throttle_ns(n, throttle->rate);
+    now = fpp_time_ns();
+
+    tat = __atomic_load_n(&throttle->tat, __ATOMIC_RELAXED);
+    do {
+        /* An idle bucket is full, unused credit doesn't pile up */
+        new_tat = (tat > now ? tat : now) + cost;
+    } while (!__atomic_compare_exchange_n(&throttle->tat, &tat, new_tat,
+        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (new_tat > now + throttle->burst_ns) {
+        fpp_sleep_ns(new_tat - now - throttle->burst_ns);
+    }
+}
+
+int
+fpp_throttle_get_nice(void)
+{
+#if (__linux__)
+    int prio;
+
+    errno = 0;
+    prio = getpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid));
+    return (errno == 0) ? prio : 0;
+#else
+    return 0;
+#endif
+}
+
+fpp_err_t
+fpp_throttle_thread(const fpp_ctx_config_t *config, int base_nice)
+{
+#if (__linux__)
+    pid_t tid;
+    int ioprio;
+#endif
+
+#if (_WIN32)
+    /* Thread priorities are absolute there */
+    (void) base_nice;
+
+    if (config->nice > 0) {
+        SetThreadPriority(GetCurrentThread(), (config->nice >= 10)
+            ? THREAD_PRIORITY_LOWEST : THREAD_PRIORITY_BELOW_NORMAL);
+    }
+    /* Background mode lowers the I/O priority of the thread as well */
+    if (config->io_class == FPP_IO_CLASS_IDLE
+        && !SetThreadPriority(GetCurrentThread(),
+            THREAD_MODE_BACKGROUND_BEGIN))
+    {
+        return FPP_FAILURE;
+    }
+#elif (__linux__)
+    /* Linux applies both per thread when given a thread id */
+    tid = (pid_t) syscall(SYS_gettid);
+
+    if (config->nice
+        && setpriority(PRIO_PROCESS, (id_t) tid, base_nice + config->nice)
+            != 0)
+    {
+        return FPP_FAILURE;
+    }
+
+    if (config->io_class != FPP_IO_CLASS_DEFAULT) {
+        if (config->io_class == FPP_IO_CLASS_IDLE) {
+            ioprio = FPP_IOPRIO_CLASS_IDLE << FPP_IOPRIO_CLASS_SHIFT;
+        }
+        else {
+            ioprio = (FPP_IOPRIO_CLASS_BE << FPP_IOPRIO_CLASS_SHIFT)
+                | (config->io_level & 0x7);
+        }
+        if (syscall(SYS_ioprio_set, FPP_IOPRIO_WHO_PROCESS, (int) tid,
+            ioprio) != 0)
+        {
+            return FPP_FAILURE;
+        }
+    }
+#else
+    /* No per-thread priorities, the whole process would change */
+    (void) config;
+    (void) base_nice;
+#endif
+
+    return FPP_OK;
+}
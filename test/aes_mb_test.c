@@ -0,0 +1,204 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+/*
+ * Comparison of fpp_aes_cbc_encrypt_mb() with EVP_aes_*_cbc() for both
+ * key sizes and every batch of 1 to two full groups of lanes, so that
+ * each lane count runs with the remaining lanes unused. The streams
+ * have different lengths, an empty one among them, and are padded as
+ * the file code pads its last chunk; a second call on the same
+ * streams has to continue them from the updated IVs.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <openssl/evp.h>
+
+#include "aes_mb.h"
+#include "errcodes.h"
+
+#define FPP_TEST_MAX_STREAMS  (2 * FPP_AES_MB_LANES + 1)
+/* Plaintext bytes of a stream, before padding */
+#define FPP_TEST_MAX_DATA     1000
+#define FPP_TEST_BUF_SIZE     (FPP_TEST_MAX_DATA + 16)
+/* Written after the end of every output, must stay there */
+#define FPP_TEST_GUARD        0xa5
+#define FPP_TEST_GUARD_SIZE   16
+
+typedef struct {
+    uint8_t key[32];
+    uint8_t iv[16];
+    uint8_t in[2][FPP_TEST_BUF_SIZE];
+    uint8_t out[2][FPP_TEST_BUF_SIZE + FPP_TEST_GUARD_SIZE];
+    uint8_t expected[2 * FPP_TEST_BUF_SIZE];
+    /* Plaintext of the second chunk, before and after padding */
+    size_t datalen;
+    size_t padlen;
+    /* Whole blocks of the first chunk */
+    size_t len;
+} fpp_test_stream_t;
+
+static fpp_test_stream_t fpp_test_streams[FPP_TEST_MAX_STREAMS];
+
+
+/* PKCS#7 up to the next block, a full block if len is aligned */
+static size_t
+fpp_test_pad(uint8_t *buf, size_t len)
+{
+    size_t pad = 16 - len % 16;
+
+    memset(buf + len, (int) pad, pad);
+    return len + pad;
+}
+
+/* Both chunks of the stream at once, padding only the second one */
+static int
+fpp_test_expected(fpp_test_stream_t *t, int key_bits)
+{
+    uint8_t plain[2 * FPP_TEST_BUF_SIZE];
+    EVP_CIPHER_CTX *cipher_ctx;
+    int len, total;
+    int ok;
+
+    memcpy(plain, t->in[0], t->len);
+    memcpy(plain + t->len, t->in[1], t->datalen);
+
+    cipher_ctx = EVP_CIPHER_CTX_new();
+    if (!cipher_ctx) {
+        return 0;
+    }
+    ok = EVP_EncryptInit_ex(cipher_ctx, key_bits == 128
+            ? EVP_aes_128_cbc() : EVP_aes_256_cbc(), NULL, t->key, t->iv) == 1
+        && EVP_EncryptUpdate(cipher_ctx, t->expected, &len, plain,
+            (int) (t->len + t->datalen)) == 1;
+    total = len;
+    ok = ok && EVP_EncryptFinal_ex(cipher_ctx, t->expected + total,
+        &len) == 1;
+    EVP_CIPHER_CTX_free(cipher_ctx);
+
+    return ok;
+}
+
+static void
+fpp_test_init(size_t n, int key_bits)
+{
+    fpp_test_stream_t *t;
+    size_t i, j;
+
+    for (i = 0; i < n; ++i) {
+        t = &fpp_test_streams[i];
+        for (j = 0; j < sizeof(t->key); ++j) {
+            t->key[j] = (uint8_t) (i * 29 + j * 5 + key_bits);
+        }
+        for (j = 0; j < sizeof(t->iv); ++j) {
+            t->iv[j] = (uint8_t) (i * 17 + j * 3);
+        }
+
+        /* Stream 1 is empty before padding, the others differ */
+        t->datalen = (i == 1) ? 0 : (i * 97 + 5) % FPP_TEST_MAX_DATA;
+        for (j = 0; j < FPP_TEST_MAX_DATA; ++j) {
+            t->in[0][j] = (uint8_t) (i * 7 + j);
+            t->in[1][j] = (uint8_t) (i * 11 + j * 13);
+        }
+        /* The first call gets whole blocks, as a chunk in the middle */
+        t->len = t->datalen - t->datalen % 16;
+        t->padlen = fpp_test_pad(t->in[1], t->datalen);
+
+        memset(t->out, FPP_TEST_GUARD, sizeof(t->out));
+    }
+}
+
+static int
+fpp_test_run(size_t n, int key_bits)
+{
+    fpp_aes_cbc_stream_t streams[FPP_TEST_MAX_STREAMS];
+    fpp_test_stream_t *t;
+    size_t i, j, len[2];
+    int chunk;
+
+    fpp_test_init(n, key_bits);
+
+    for (i = 0; i < n; ++i) {
+        t = &fpp_test_streams[i];
+        if (!fpp_test_expected(t, key_bits)) {
+            printf("aes%d %zu stream(s): OpenSSL failed\n", key_bits, n);
+            return 1;
+        }
+        streams[i].key = t->key;
+        memcpy(streams[i].iv, t->iv, sizeof(t->iv));
+    }
+
+    for (chunk = 0; chunk < 2; ++chunk) {
+        for (i = 0; i < n; ++i) {
+            t = &fpp_test_streams[i];
+            streams[i].in = t->in[chunk];
+            streams[i].out = t->out[chunk];
+            streams[i].len = chunk ? t->padlen : t->len;
+        }
+        if (fpp_aes_cbc_encrypt_mb(streams, n, key_bits) != FPP_OK) {
+            printf("aes%d %zu stream(s): encryption failed\n", key_bits,
+                n);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < n; ++i) {
+        t = &fpp_test_streams[i];
+        len[0] = t->len;
+        len[1] = t->padlen;
+
+        if (memcmp(t->out[0], t->expected, len[0]) != 0
+            || memcmp(t->out[1], t->expected + len[0], len[1]) != 0)
+        {
+            printf("aes%d %zu stream(s): stream %zu differs from "
+                "OpenSSL\n", key_bits, n, i);
+            return 1;
+        }
+        for (chunk = 0; chunk < 2; ++chunk) {
+            for (j = 0; j < FPP_TEST_GUARD_SIZE; ++j) {
+                if (t->out[chunk][len[chunk] + j] != FPP_TEST_GUARD) {
+                    printf("aes%d %zu stream(s): stream %zu wrote past "
+                        "its end\n", key_bits, n, i);
+                    return 1;
+                }
+            }
+        }
+        if (memcmp(streams[i].iv, t->expected + len[0] + len[1] - 16,
+            16) != 0)
+        {
+            printf("aes%d %zu stream(s): stream %zu has a wrong IV\n",
+                key_bits, n, i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int
+main(void)
+{
+    static const int key_bits[] = { 128, 256 };
+    size_t i, n;
+    int failed = 0, err;
+
+    printf("aes multi-buffer: %s\n",
+        fpp_aes_mb_is_accelerated() ? "AES-NI" : "OpenSSL");
+
+    for (i = 0; i < sizeof(key_bits) / sizeof(key_bits[0]); ++i) {
+        err = 0;
+        for (n = 1; n <= FPP_TEST_MAX_STREAMS; ++n) {
+            err |= fpp_test_run(n, key_bits[i]);
+        }
+        printf("aes%d 1-%d stream(s): %s\n", key_bits[i],
+            FPP_TEST_MAX_STREAMS, err ? "failed" : "ok");
+        failed |= err;
+    }
+
+    return failed;
+}
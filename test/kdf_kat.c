@@ -0,0 +1,101 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+/*
+ * Known-answer test of the scrypt in kdf.c with the vectors of RFC 7914,
+ * section 12. The first vector (r = 1) and the last one (1 GiB) don't
+ * fit FPP_SCRYPT_R and the test time, the others run with every lane
+ * on a thread as in a real derivation.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "kdf.h"
+#include "errcodes.h"
+
+#define FPP_KAT_OUT_SIZE  64
+
+typedef struct {
+    const char *pass;
+    const char *salt;
+    uint32_t n;
+    uint32_t p;
+    uint8_t out[FPP_KAT_OUT_SIZE];
+} fpp_scrypt_kat_t;
+
+static const fpp_scrypt_kat_t fpp_scrypt_kats[] = {
+    {
+        "password", "NaCl", 1024, 16,
+        {
+            0xfd, 0xba, 0xbe, 0x1c, 0x9d, 0x34, 0x72, 0x00,
+            0x78, 0x56, 0xe7, 0x19, 0x0d, 0x01, 0xe9, 0xfe,
+            0x7c, 0x6a, 0xd7, 0xcb, 0xc8, 0x23, 0x78, 0x30,
+            0xe7, 0x73, 0x76, 0x63, 0x4b, 0x37, 0x31, 0x62,
+            0x2e, 0xaf, 0x30, 0xd9, 0x2e, 0x22, 0xa3, 0x88,
+            0x6f, 0xf1, 0x09, 0x27, 0x9d, 0x98, 0x30, 0xda,
+            0xc7, 0x27, 0xaf, 0xb9, 0x4a, 0x83, 0xee, 0x6d,
+            0x83, 0x60, 0xcb, 0xdf, 0xa2, 0xcc, 0x06, 0x40
+        }
+    },
+    {
+        "pleaseletmein", "SodiumChloride", 16384, 1,
+        {
+            0x70, 0x23, 0xbd, 0xcb, 0x3a, 0xfd, 0x73, 0x48,
+            0x46, 0x1c, 0x06, 0xcd, 0x81, 0xfd, 0x38, 0xeb,
+            0xfd, 0xa8, 0xfb, 0xba, 0x90, 0x4f, 0x8e, 0x3e,
+            0xa9, 0xb5, 0x43, 0xf6, 0x54, 0x5d, 0xa1, 0xf2,
+            0xd5, 0x43, 0x29, 0x55, 0x61, 0x3f, 0x0f, 0xcf,
+            0x62, 0xd4, 0x97, 0x05, 0x24, 0x2a, 0x9a, 0xf9,
+            0xe6, 0x1e, 0x85, 0xdc, 0x0d, 0x65, 0x1e, 0x40,
+            0xdf, 0xcf, 0x01, 0x7b, 0x45, 0x57, 0x58, 0x87
+        }
+    }
+};
+
+
+int
+main(void)
+{
+    const fpp_scrypt_kat_t *kat;
+    fpp_kdf_params_t kdf;
+    uint8_t out[FPP_KAT_OUT_SIZE];
+    size_t i;
+    int failed = 0;
+
+    for (i = 0; i < sizeof(fpp_scrypt_kats) / sizeof(fpp_scrypt_kats[0]);
+        ++i)
+    {
+        kat = &fpp_scrypt_kats[i];
+
+        /* N blocks of 128 * r bytes, one KiB each with r = 8 */
+        kdf.id = FPP_KDF_SCRYPT;
+        kdf.iter = 0;
+        kdf.memory = kat->n;
+        kdf.lanes = kat->p;
+
+        if (fpp_kdf_derive(NULL, &kdf, kat->pass, strlen(kat->pass),
+            (const uint8_t *) kat->salt, strlen(kat->salt), out,
+            sizeof(out)) != FPP_OK)
+        {
+            printf("scrypt N=%u p=%u: derivation failed\n", kat->n, kat->p);
+            failed = 1;
+            continue;
+        }
+
+        if (memcmp(out, kat->out, sizeof(out)) != 0) {
+            printf("scrypt N=%u p=%u: wrong output\n", kat->n, kat->p);
+            failed = 1;
+            continue;
+        }
+
+        printf("scrypt N=%u p=%u: ok\n", kat->n, kat->p);
+    }
+
+    return failed;
+}
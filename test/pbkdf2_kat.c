@@ -0,0 +1,238 @@
+/*
+ * This file is part of FPP (File Protection Program).
+ *
+ * See LICENSE for licensing information.
+ */
+
+/*
+ * Test of fpp_pkcs5_pbkdf2_hmac_sha512_batch(). The RFC 6070 inputs
+ * with their PBKDF2-HMAC-SHA512 outputs run as partly filled batches,
+ * then batches of every size up to two full groups of lanes, with
+ * long passwords and multi-block outputs, are compared with OpenSSL.
+ * Built once as the library is and once with FPP_PBKDF2_GENERIC, so
+ * that both the target_clones variants and the portable loop run.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <openssl/evp.h>
+
+#include "pbkdf2.h"
+#include "errcodes.h"
+
+#define FPP_KAT_OUT_SIZE  64
+/* Entries of the KAT batches, fewer than FPP_PBKDF2_LANES */
+#define FPP_KAT_BATCH     3
+#define FPP_CMP_MAX_BATCH (2 * FPP_PBKDF2_LANES + 1)
+#define FPP_CMP_MAX_PASS  200
+#define FPP_CMP_MAX_SALT  64
+#define FPP_CMP_MAX_OUT   200
+#define FPP_CMP_ITER      3
+
+typedef struct {
+    const char *pass;
+    size_t passlen;
+    const char *salt;
+    size_t saltlen;
+    uint32_t iter;
+    size_t outlen;
+    uint8_t out[FPP_KAT_OUT_SIZE];
+} fpp_pbkdf2_kat_t;
+
+static const fpp_pbkdf2_kat_t fpp_pbkdf2_kats[] = {
+    {
+        "password", 8, "salt", 4, 1, 64,
+        {
+            0x86, 0x7f, 0x70, 0xcf, 0x1a, 0xde, 0x02, 0xcf,
+            0xf3, 0x75, 0x25, 0x99, 0xa3, 0xa5, 0x3d, 0xc4,
+            0xaf, 0x34, 0xc7, 0xa6, 0x69, 0x81, 0x5a, 0xe5,
+            0xd5, 0x13, 0x55, 0x4e, 0x1c, 0x8c, 0xf2, 0x52,
+            0xc0, 0x2d, 0x47, 0x0a, 0x28, 0x5a, 0x05, 0x01,
+            0xba, 0xd9, 0x99, 0xbf, 0xe9, 0x43, 0xc0, 0x8f,
+            0x05, 0x02, 0x35, 0xd7, 0xd6, 0x8b, 0x1d, 0xa5,
+            0x5e, 0x63, 0xf7, 0x3b, 0x60, 0xa5, 0x7f, 0xce
+        }
+    },
+    {
+        "password", 8, "salt", 4, 2, 64,
+        {
+            0xe1, 0xd9, 0xc1, 0x6a, 0xa6, 0x81, 0x70, 0x8a,
+            0x45, 0xf5, 0xc7, 0xc4, 0xe2, 0x15, 0xce, 0xb6,
+            0x6e, 0x01, 0x1a, 0x2e, 0x9f, 0x00, 0x40, 0x71,
+            0x3f, 0x18, 0xae, 0xfd, 0xb8, 0x66, 0xd5, 0x3c,
+            0xf7, 0x6c, 0xab, 0x28, 0x68, 0xa3, 0x9b, 0x9f,
+            0x78, 0x40, 0xed, 0xce, 0x4f, 0xef, 0x5a, 0x82,
+            0xbe, 0x67, 0x33, 0x5c, 0x77, 0xa6, 0x06, 0x8e,
+            0x04, 0x11, 0x27, 0x54, 0xf2, 0x7c, 0xcf, 0x4e
+        }
+    },
+    {
+        "password", 8, "salt", 4, 4096, 64,
+        {
+            0xd1, 0x97, 0xb1, 0xb3, 0x3d, 0xb0, 0x14, 0x3e,
+            0x01, 0x8b, 0x12, 0xf3, 0xd1, 0xd1, 0x47, 0x9e,
+            0x6c, 0xde, 0xbd, 0xcc, 0x97, 0xc5, 0xc0, 0xf8,
+            0x7f, 0x69, 0x02, 0xe0, 0x72, 0xf4, 0x57, 0xb5,
+            0x14, 0x3f, 0x30, 0x60, 0x26, 0x41, 0xb3, 0xd5,
+            0x5c, 0xd3, 0x35, 0x98, 0x8c, 0xb3, 0x6b, 0x84,
+            0x37, 0x60, 0x60, 0xec, 0xd5, 0x32, 0xe0, 0x39,
+            0xb7, 0x42, 0xa2, 0x39, 0x43, 0x4a, 0xf2, 0xd5
+        }
+    },
+    {
+        "passwordPASSWORDpassword", 24,
+        "saltSALTsaltSALTsaltSALTsaltSALTsalt", 36, 4096, 64,
+        {
+            0x8c, 0x05, 0x11, 0xf4, 0xc6, 0xe5, 0x97, 0xc6,
+            0xac, 0x63, 0x15, 0xd8, 0xf0, 0x36, 0x2e, 0x22,
+            0x5f, 0x3c, 0x50, 0x14, 0x95, 0xba, 0x23, 0xb8,
+            0x68, 0xc0, 0x05, 0x17, 0x4d, 0xc4, 0xee, 0x71,
+            0x11, 0x5b, 0x59, 0xf9, 0xe6, 0x0c, 0xd9, 0x53,
+            0x2f, 0xa3, 0x3e, 0x0f, 0x75, 0xae, 0xfe, 0x30,
+            0x22, 0x5c, 0x58, 0x3a, 0x18, 0x6c, 0xd8, 0x2b,
+            0xd4, 0xda, 0xea, 0x97, 0x24, 0xa3, 0xd3, 0xb8
+        }
+    },
+    {
+        "pass\0word", 9, "sa\0lt", 5, 4096, 16,
+        {
+            0x9d, 0x9e, 0x9c, 0x4c, 0xd2, 0x1f, 0xe4, 0xbe,
+            0x24, 0xd5, 0xb8, 0x24, 0x4c, 0x75, 0x96, 0x65
+        }
+    }
+};
+
+/* Output lengths below, at and above one SHA-512 block */
+static const size_t fpp_cmp_outlens[] = { 20, 64, 150 };
+
+
+static int
+fpp_run_kats(void)
+{
+    const fpp_pbkdf2_kat_t *kat;
+    fpp_pbkdf2_params_t params[FPP_KAT_BATCH];
+    uint8_t out[FPP_KAT_BATCH][FPP_KAT_OUT_SIZE];
+    size_t i, j;
+    int failed = 0;
+
+    for (i = 0; i < sizeof(fpp_pbkdf2_kats) / sizeof(fpp_pbkdf2_kats[0]);
+        ++i)
+    {
+        kat = &fpp_pbkdf2_kats[i];
+
+        memset(out, 0, sizeof(out));
+        for (j = 0; j < FPP_KAT_BATCH; ++j) {
+            params[j].pass = kat->pass;
+            params[j].passlen = kat->passlen;
+            params[j].salt = (const uint8_t *) kat->salt;
+            params[j].saltlen = kat->saltlen;
+            params[j].out = out[j];
+        }
+
+        if (fpp_pkcs5_pbkdf2_hmac_sha512_batch(params, FPP_KAT_BATCH,
+            kat->iter, kat->outlen) != FPP_OK)
+        {
+            printf("pbkdf2 vector %zu: derivation failed\n", i + 1);
+            failed = 1;
+            continue;
+        }
+
+        for (j = 0; j < FPP_KAT_BATCH; ++j) {
+            if (memcmp(out[j], kat->out, kat->outlen) != 0) {
+                break;
+            }
+        }
+        if (j < FPP_KAT_BATCH) {
+            printf("pbkdf2 vector %zu: wrong output in entry %zu\n", i + 1,
+                j);
+            failed = 1;
+            continue;
+        }
+
+        printf("pbkdf2 vector %zu c=%u: ok\n", i + 1, kat->iter);
+    }
+
+    return failed;
+}
+
+static int
+fpp_run_compare(void)
+{
+    static char pass[FPP_CMP_MAX_BATCH][FPP_CMP_MAX_PASS];
+    static uint8_t salt[FPP_CMP_MAX_BATCH][FPP_CMP_MAX_SALT];
+    static uint8_t out[FPP_CMP_MAX_BATCH][FPP_CMP_MAX_OUT];
+    static uint8_t expected[FPP_CMP_MAX_OUT];
+    fpp_pbkdf2_params_t params[FPP_CMP_MAX_BATCH];
+    size_t n, i, j, k, outlen;
+    int failed = 0;
+
+    /* Passwords longer than the 128-byte block are hashed first */
+    for (i = 0; i < FPP_CMP_MAX_BATCH; ++i) {
+        params[i].passlen = (i * 37 + 1) % FPP_CMP_MAX_PASS;
+        params[i].saltlen = (i * 11) % FPP_CMP_MAX_SALT;
+        for (j = 0; j < FPP_CMP_MAX_PASS; ++j) {
+            pass[i][j] = (char) (i * 31 + j * 7 + 1);
+        }
+        for (j = 0; j < FPP_CMP_MAX_SALT; ++j) {
+            salt[i][j] = (uint8_t) (i * 13 + j * 3);
+        }
+        params[i].pass = pass[i];
+        params[i].salt = salt[i];
+        params[i].out = out[i];
+    }
+
+    for (k = 0; k < sizeof(fpp_cmp_outlens) / sizeof(fpp_cmp_outlens[0]);
+        ++k)
+    {
+        outlen = fpp_cmp_outlens[k];
+
+        for (n = 1; n <= FPP_CMP_MAX_BATCH; ++n) {
+            memset(out, 0, sizeof(out));
+            if (fpp_pkcs5_pbkdf2_hmac_sha512_batch(params, n, FPP_CMP_ITER,
+                outlen) != FPP_OK)
+            {
+                printf("pbkdf2 batch %zu outlen %zu: derivation failed\n",
+                    n, outlen);
+                failed = 1;
+                continue;
+            }
+
+            for (i = 0; i < n; ++i) {
+                if (!PKCS5_PBKDF2_HMAC(params[i].pass,
+                    (int) params[i].passlen, params[i].salt,
+                    (int) params[i].saltlen, FPP_CMP_ITER, EVP_sha512(),
+                    (int) outlen, expected))
+                {
+                    printf("pbkdf2 batch %zu outlen %zu: OpenSSL failed\n",
+                        n, outlen);
+                    failed = 1;
+                    break;
+                }
+                if (memcmp(out[i], expected, outlen) != 0) {
+                    printf("pbkdf2 batch %zu outlen %zu: entry %zu differs "
+                        "from OpenSSL\n", n, outlen, i);
+                    failed = 1;
+                    break;
+                }
+            }
+        }
+
+        printf("pbkdf2 batches 1-%d outlen %zu: %s\n", FPP_CMP_MAX_BATCH,
+            outlen, failed ? "failed" : "ok");
+    }
+
+    return failed;
+}
+
+int
+main(void)
+{
+    int failed = 0;
+
+    failed |= fpp_run_kats();
+    failed |= fpp_run_compare();
+
+    return failed;
+}